@@ -0,0 +1,85 @@
+#include <cstring>
+
+#include "advertisement-ring.h"
+
+AdvertisementRecord::AdvertisementRecord()
+    : addr(0), rssi(0), nameSize(0), name {}, metadata {}
+{
+}
+
+AdvertisementRecord::AdvertisementRecord(
+    uint64_t aAddr,
+    int16_t aRssi,
+    const NEMR5053ManufacturerSpecificData &aMetadata,
+    const char *aName,
+    size_t aNameSize
+)
+    : addr(aAddr), dt(std::chrono::system_clock::now()), rssi(aRssi),
+    nameSize((uint8_t) (aNameSize < MAX_NAME ? aNameSize : MAX_NAME)), name {}, metadata(aMetadata.val)
+{
+    if (nameSize)
+        memcpy(name, aName, nameSize);
+}
+
+std::string AdvertisementRecord::nameString() const
+{
+    return std::string(name, nameSize);
+}
+
+/**
+ * @param capacity records, rounded up to the power of 2
+ */
+AdvertisementRing::AdvertisementRing(
+    size_t capacity
+)
+    : head(0), tail(0), dropped(0)
+{
+    size_t n = 2;
+    while (n < capacity)
+        n *= 2;
+    records.resize(n);
+    mask = n - 1;
+}
+
+/**
+ * Queue record, never blocks
+ * @param record advertisement
+ * @return false if the ring is full, record is dropped and counted
+ */
+bool AdvertisementRing::push(
+    const AdvertisementRecord &record
+) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    records[t & mask] = record;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+/**
+ * @param retRecord returns the oldest record
+ * @return false if the ring is empty
+ */
+bool AdvertisementRing::pop(
+    AdvertisementRecord &retRecord
+) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+        return false;
+    retRecord = records[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+bool AdvertisementRing::empty() const
+{
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+}
+
+size_t AdvertisementRing::capacity() const
+{
+    return records.size();
+}
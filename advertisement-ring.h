@@ -0,0 +1,55 @@
+#ifndef ADVERTISEMENT_RING_H
+#define ADVERTISEMENT_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nemr-5053-manufacturer-specific-data.h"
+
+/**
+ * Advertisement parsed on the radio thread, fixed size so it can be queued without allocation
+ */
+class AdvertisementRecord {
+public:
+    /// BLE legacy advertising payload is 31 bytes, so is the longest name
+    static const size_t MAX_NAME = 31;
+    uint64_t addr;
+    std::chrono::time_point<std::chrono::system_clock> dt;
+    int16_t rssi;
+    uint8_t nameSize;
+    char name[MAX_NAME];
+    NEMR5053_MANUFACTURER_SPECIFIC_DATA metadata;
+
+    AdvertisementRecord();
+    AdvertisementRecord(uint64_t addr, int16_t rssi, const NEMR5053ManufacturerSpecificData &metadata,
+        const char *name, size_t nameSize);
+    std::string nameString() const;
+};
+
+/**
+ * Single producer, single consumer lock-free ring of advertisements.
+ * push() is called by the radio callback thread only, pop() by the consumer thread only.
+ */
+class AdvertisementRing {
+private:
+    std::vector<AdvertisementRecord> records;
+    size_t mask;
+    /// next record to pop, written by the consumer
+    alignas(64) std::atomic<size_t> head;
+    /// next record to push, written by the producer
+    alignas(64) std::atomic<size_t> tail;
+public:
+    /// records lost because the ring was full
+    std::atomic<uint32_t> dropped;
+
+    explicit AdvertisementRing(size_t capacity = 8192);
+    bool push(const AdvertisementRecord &record);
+    bool pop(AdvertisementRecord &retRecord);
+    bool empty() const;
+    size_t capacity() const;
+};
+
+#endif
@@ -0,0 +1,657 @@
+#include <cerrno>
+#include <cstring>
+
+#include "ble-helper-bluez.h"
+
+static const char *IFACE_ADAPTER = "org.bluez.Adapter1";
+static const char *IFACE_DEVICE = "org.bluez.Device1";
+static const char *IFACE_CHARACTERISTIC = "org.bluez.GattCharacteristic1";
+static const char *IFACE_OBJECT_MANAGER = "org.freedesktop.DBus.ObjectManager";
+
+// BLE GATT service 0000fef0-0000-1000-8000-00805f9b34fb, see ble-helper-win.cpp
+const char *BLEHelperBluez::SERVICE_UUID = "0000fef0-0000-1000-8000-00805f9b34fb";
+
+const char *BLEHelperBluez::CHARACTERISTIC_UUID[2] {
+    // Command characteristic
+    "0000fef1-0000-1000-8000-00805f9b34fb",
+    // Image write characteristic
+    "0000fef2-0000-1000-8000-00805f9b34fb"
+};
+
+BluezDeviceState::BluezDeviceState()
+    : rssi(0), advertised(false), nameSize(0), name {}, connected(false), servicesResolved(false), sessionStep(BS_NONE),
+    replied(false), replyResult(0)
+{
+}
+
+/**
+ * @return GATT services discovered and both characteristics found
+ */
+bool BluezDeviceState::resolved() const
+{
+    return servicesResolved && !characteristic[0].empty() && !characteristic[1].empty();
+}
+
+/**
+ * @param bus bus to bluetoothd, kept by the caller until the helper is destroyed
+ */
+BLEHelperBluez::BLEHelperBluez(
+    BluezBus *aBus
+)
+    : BLEDiscoverer(), bus(aBus), adapterPath("/org/bluez/hci0"), connectTimeoutMs(10000)
+{
+    bus->setListener(this);
+}
+
+BLEHelperBluez::BLEHelperBluez(
+    BluezBus *aBus,
+    OnDiscover *onDiscover
+)
+    : BLEDiscoverer(onDiscover), bus(aBus), adapterPath("/org/bluez/hci0"), connectTimeoutMs(10000)
+{
+    bus->setListener(this);
+}
+
+BLEHelperBluez::BLEHelperBluez(
+    BluezBus *aBus,
+    OnDiscover *onDiscover,
+    void *discoverExtra
+)
+    : BLEDiscoverer(onDiscover, discoverExtra), bus(aBus), adapterPath("/org/bluez/hci0"), connectTimeoutMs(10000)
+{
+    bus->setListener(this);
+}
+
+BLEHelperBluez::~BLEHelperBluez()
+{
+    stopDiscovery(0);
+    // waits for the signal being delivered
+    bus->setListener(nullptr);
+}
+
+int BLEHelperBluez::devicePath(
+    char *retPath,
+    size_t size,
+    uint64_t addr
+) const {
+    int r = bluezDevicePath(retPath, size, adapterPath.c_str(), addr);
+    return r > 0 && (size_t) r < size ? 0 : -1;
+}
+
+int BLEHelperBluez::startDiscovery()
+{
+    if (discoveryOn)
+        return 0;
+    if (bus->start() < 0)
+        return -1;
+    std::unique_lock<std::mutex> lck(mutexDiscoveryState);
+    discoveryOn = true;
+    lck.unlock();
+
+    startAdvertisementConsumer();
+    // bluetoothd filters by the service and reports every advertisement, not only property changes
+    int r = bus->setDiscoveryFilter(adapterPath.c_str(), SERVICE_UUID);
+    if (r >= 0)
+        r = bus->call(adapterPath.c_str(), IFACE_ADAPTER, "StartDiscovery");
+    if (r < 0) {
+        stopAdvertisementConsumer();
+        lck.lock();
+        discoveryOn = false;
+        return -1;
+    }
+    return 0;
+}
+
+void BLEHelperBluez::stopDiscovery(
+    int seconds
+) {
+    if (!discoveryOn)
+        return;
+    bus->call(adapterPath.c_str(), IFACE_ADAPTER, "StopDiscovery", nullptr, seconds > 0 ? seconds * 1000 : 1000);
+    stopAdvertisementConsumer();
+    std::unique_lock<std::mutex> lck(mutexDiscoveryState);
+    discoveryOn = false;
+    lck.unlock();
+    cvDiscoveryState.notify_all();
+}
+
+/**
+ * Connect, wait for the characteristics and subscribe to the command characteristic notifications
+ * @return 0- success
+ */
+int BLEHelperBluez::open(
+    DiscoveredDevice *device
+) {
+    return waitAsync(device, startOpen(device), true);
+}
+
+int BLEHelperBluez::close(
+    DiscoveredDevice *device
+) {
+    return waitAsync(device, startClose(device), false);
+}
+
+/**
+ * Set the session step waiting for the reply, the state of the device removed by bluetoothd is added again
+ */
+void BLEHelperBluez::enterStep(
+    uint64_t addr,
+    BluezSessionStep step
+) {
+    std::unique_lock<std::mutex> lck(mutexBluez);
+    auto &state = states[addr];
+    state.sessionStep = step;
+    state.replied = false;
+    if (step == BS_CONNECT)
+        state.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(connectTimeoutMs);
+}
+
+/**
+ * Stop open() in progress and drop the link
+ * @return -1
+ */
+int BLEHelperBluez::abortOpen(
+    DiscoveredDevice *device
+) {
+    enterStep(device->addr, BS_NONE);
+    char path[128];
+    if (devicePath(path, sizeof(path), device->addr) == 0)
+        bus->callAsync(path, IFACE_DEVICE, "Disconnect");
+    return -1;
+}
+
+/**
+ * Send Device1.Connect, see pollOpen()
+ * @return PENDING, -1 if error
+ */
+int BLEHelperBluez::startOpen(
+    DiscoveredDevice *device
+) {
+    char path[128];
+    if (devicePath(path, sizeof(path), device->addr) || bus->start() < 0)
+        return -1;
+    // responses left from the previous session
+    notificationQueue(device->addr)->clear();
+    enterStep(device->addr, BS_CONNECT);
+    if (bus->callAsync(path, IFACE_DEVICE, "Connect", connectTimeoutMs) < 0) {
+        enterStep(device->addr, BS_NONE);
+        return -1;
+    }
+    return PENDING;
+}
+
+/**
+ * Connected: wait for the characteristics, then for StartNotify of the command characteristic.
+ * Connection and service discovery time out after connectTimeoutMs.
+ */
+int BLEHelperBluez::pollOpen(
+    DiscoveredDevice *device,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    std::unique_lock<std::mutex> lck(mutexBluez);
+    auto &state = states[device->addr];
+    // device removed by bluetoothd
+    bool failed = state.sessionStep == BS_NONE || (state.replied && state.replyResult < 0);
+    bool listObjects = false;
+    std::string notifyPath;
+    if (!failed && state.sessionStep == BS_CONNECT && state.replied) {
+        state.sessionStep = BS_RESOLVE;
+        state.replied = false;
+        // characteristics cached by bluetoothd are not announced again
+        listObjects = !state.resolved();
+    }
+    if (!failed && state.sessionStep == BS_RESOLVE && state.resolved()) {
+        state.sessionStep = BS_NOTIFY;
+        state.replied = false;
+        notifyPath = state.characteristic[CI_REQUEST];
+    }
+    if (!failed && state.sessionStep == BS_NOTIFY && state.replied) {
+        state.sessionStep = BS_NONE;
+        auto *bimpl = new BLEDeviceImplBluez();
+        bimpl->characteristic[0] = state.characteristic[0];
+        bimpl->characteristic[1] = state.characteristic[1];
+        lck.unlock();
+        delete device->impl;
+        device->impl = bimpl;
+        device->deviceState = DS_SESSION_ON;
+        return 0;
+    }
+    if (failed || std::chrono::steady_clock::now() >= state.deadline) {
+        lck.unlock();
+        return abortOpen(device);
+    }
+    if (state.deadline < wakeAt)
+        wakeAt = state.deadline;
+    lck.unlock();
+    int r = 0;
+    if (listObjects)
+        r = bus->callAsync("/", IFACE_OBJECT_MANAGER, "GetManagedObjects");
+    if (!notifyPath.empty())
+        r = bus->callAsync(notifyPath.c_str(), IFACE_CHARACTERISTIC, "StartNotify");
+    return r < 0 ? abortOpen(device) : PENDING;
+}
+
+/**
+ * Send StopNotify and Device1.Disconnect, pollClose() waits for the Disconnect reply.
+ * Open in progress is stopped.
+ * @return 0- closed, PENDING, -1 if error
+ */
+int BLEHelperBluez::startClose(
+    DiscoveredDevice *device
+) {
+    device->deviceState = DS_IDLE;
+    auto *bimpl = (BLEDeviceImplBluez *) device->impl;
+    if (!bimpl) {
+        bool opening;
+        {
+            std::unique_lock<std::mutex> lck(mutexBluez);
+            auto it = states.find(device->addr);
+            opening = it != states.end() && it->second.sessionStep != BS_NONE && it->second.sessionStep != BS_DISCONNECT;
+        }
+        // open() in progress is given up
+        if (opening)
+            abortOpen(device);
+        return 0;
+    }
+    // reply is not waited for, bluetoothd handles the calls in order
+    bus->callAsync(bimpl->characteristic[CI_REQUEST].c_str(), IFACE_CHARACTERISTIC, "StopNotify");
+    delete bimpl;
+    device->impl = nullptr;
+    char path[128];
+    if (devicePath(path, sizeof(path), device->addr))
+        return 0;
+    enterStep(device->addr, BS_DISCONNECT);
+    if (bus->callAsync(path, IFACE_DEVICE, "Disconnect") < 0) {
+        enterStep(device->addr, BS_NONE);
+        return -1;
+    }
+    return PENDING;
+}
+
+int BLEHelperBluez::pollClose(
+    DiscoveredDevice *device,
+    std::chrono::steady_clock::time_point &
+) {
+    std::unique_lock<std::mutex> lck(mutexBluez);
+    auto &state = states[device->addr];
+    // device removed by bluetoothd is disconnected
+    if (state.sessionStep != BS_DISCONNECT)
+        return 0;
+    if (!state.replied)
+        return PENDING;
+    state.sessionStep = BS_NONE;
+    return state.replyResult < 0 ? -1 : 0;
+}
+
+int BLEHelperBluez::read(
+    const DiscoveredDevice *device,
+    CharacteristicIndex,
+    void *buffer,
+    uint32_t size,
+    int milliseconds
+) {
+    if (device->deviceState == DS_IDLE || !device->impl)
+        return -1;
+    return notificationQueue(device->addr)->pop(buffer, size, milliseconds);
+}
+
+int BLEHelperBluez::writeValue(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size,
+    bool withResponse,
+    bool wait
+) {
+    if (device->deviceState == DS_IDLE)
+        return -1;
+    auto *bimpl = (BLEDeviceImplBluez *) device->impl;
+    if (!bimpl)
+        return -4;
+    if (bus->writeValue(bimpl->characteristic[(int) characteristic].c_str(), buffer, size, withResponse, wait) < 0)
+        return -5;
+    return (int) size;
+}
+
+int BLEHelperBluez::write(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size
+) {
+    return writeValue(device, characteristic, buffer, size, true, true);
+}
+
+int BLEHelperBluez::writeWithoutResponse(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size
+) {
+    return writeValue(device, characteristic, buffer, size, false, true);
+}
+
+/**
+ * Queue WriteValue and return, the reply is not waited for: the message keeps a copy of the buffer
+ * and bluetoothd sends the writes in order
+ */
+int BLEHelperBluez::startWrite(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size,
+    bool withResponse
+) {
+    return writeValue(device, characteristic, buffer, size, withResponse, false);
+}
+
+int BLEHelperBluez::pair(
+    const DiscoveredDevice *device
+) {
+    char path[128];
+    if (devicePath(path, sizeof(path), device->addr))
+        return -1;
+    int r = bus->call(path, IFACE_DEVICE, "Pair");
+    return r < 0 && r != -EALREADY ? -1 : 0;
+}
+
+int BLEHelperBluez::unpair(
+    const DiscoveredDevice *device
+) {
+    char path[128];
+    if (devicePath(path, sizeof(path), device->addr))
+        return -1;
+    return bus->call(adapterPath.c_str(), IFACE_ADAPTER, "RemoveDevice", path) < 0 ? -1 : 0;
+}
+
+/**
+ * Apply Device1 properties: advertisement (RSSI, manufacturer data, name) goes to the advertisement ring,
+ * connection state wakes pollOpen()
+ * @param addr device address
+ * @param properties a{sv}
+ */
+void BLEHelperBluez::deviceProperties(
+    uint64_t addr,
+    DBusReader &properties
+) {
+    int16_t rssi = 0;
+    bool hasRssi = false;
+    NEMR5053ManufacturerSpecificData metadata;
+    bool hasMetadata = false;
+    const char *name = nullptr;
+    int connected = 0;
+    bool hasConnected = false;
+    int servicesResolved = 0;
+    bool hasServicesResolved = false;
+
+    if (!properties.enter('a', "{sv}"))
+        return;
+    while (properties.enter('e', "sv")) {
+        const char *key = "";
+        properties.read('s', &key);
+        if (strcmp(key, "RSSI") == 0) {
+            if (properties.enterVariant("n")) {
+                hasRssi = properties.read('n', &rssi);
+                properties.exit();
+            }
+        } else if (strcmp(key, "ManufacturerData") == 0) {
+            if (properties.enterVariant("a{qv}")) {
+                properties.enter('a', "{qv}");
+                while (properties.enter('e', "qv")) {
+                    uint16_t company = 0;
+                    properties.read('q', &company);
+                    if (properties.enterVariant("ay")) {
+                        const void *data;
+                        size_t size;
+                        // advertising data section starts with the company identifier, little endian
+                        uint8_t section[2 + 29];
+                        if (properties.readBytes(data, size) && size + 2 <= sizeof(section)) {
+                            section[0] = (uint8_t) company;
+                            section[1] = (uint8_t) (company >> 8);
+                            memmove(section + 2, data, size);
+                            if (size + 2 >= sizeof(NEMR5053_MANUFACTURER_SPECIFIC_DATA) && metadata.set(section, size + 2))
+                                hasMetadata = true;
+                        }
+                        properties.exit();
+                    }
+                    properties.exit();
+                }
+                properties.exit();
+                properties.exit();
+            }
+        } else if (strcmp(key, "Name") == 0) {
+            if (properties.enterVariant("s")) {
+                properties.read('s', &name);
+                properties.exit();
+            }
+        } else if (strcmp(key, "Connected") == 0) {
+            if (properties.enterVariant("b")) {
+                hasConnected = properties.read('b', &connected);
+                properties.exit();
+            }
+        } else if (strcmp(key, "ServicesResolved") == 0) {
+            if (properties.enterVariant("b")) {
+                hasServicesResolved = properties.read('b', &servicesResolved);
+                properties.exit();
+            }
+        } else
+            properties.skip();
+        properties.exit();
+    }
+    properties.exit();
+
+    std::unique_lock<std::mutex> lck(mutexBluez);
+    auto &state = states[addr];
+    if (name) {
+        size_t sz = strlen(name);
+        state.nameSize = (uint8_t) (sz < sizeof(state.name) ? sz : sizeof(state.name));
+        memmove(state.name, name, state.nameSize);
+    }
+    if (hasMetadata)
+        state.metadata = metadata;
+    if (hasRssi) {
+        state.rssi = rssi;
+        state.advertised = true;
+    }
+    if (hasConnected) {
+        state.connected = connected != 0;
+        if (!state.connected)
+            state.servicesResolved = false;
+    }
+    if (hasServicesResolved)
+        state.servicesResolved = servicesResolved != 0;
+    // RSSI and manufacturer data change with each advertisement, the other properties are cached by bluetoothd
+    bool advertisement = (hasRssi || hasMetadata) && state.advertised && state.metadata.valid();
+    if (advertisement)
+        pushAdvertisement(addr, state.rssi, state.metadata, state.name, state.nameSize);
+    bool linkChanged = hasConnected || hasServicesResolved;
+    lck.unlock();
+    if (!linkChanged)
+        return;
+    anyNotification()->notify();
+    if (hasConnected && !connected) {
+        // link lost, session is kept until close() as the Windows backend does
+        std::unique_lock<std::mutex> lckState(mutexDiscoveryState);
+        DiscoveredDevice *device = devices.find(addr);
+        if (device && device->deviceState == DS_SESSION_ON)
+            device->deviceState = DS_RUNNING;
+    }
+}
+
+/**
+ * Remember the object path of the command and image characteristics
+ * @param path characteristic object path
+ * @param addr device address
+ * @param properties a{sv}
+ */
+void BLEHelperBluez::characteristicProperties(
+    const char *path,
+    uint64_t addr,
+    DBusReader &properties
+) {
+    int index = -1;
+    if (!properties.enter('a', "{sv}"))
+        return;
+    while (properties.enter('e', "sv")) {
+        const char *key = "";
+        properties.read('s', &key);
+        if (strcmp(key, "UUID") == 0 && properties.enterVariant("s")) {
+            const char *uuid = "";
+            properties.read('s', &uuid);
+            // bluetoothd reports UUIDs in lower case
+            for (int i = 0; i < 2; i++) {
+                if (strcmp(uuid, CHARACTERISTIC_UUID[i]) == 0)
+                    index = i;
+            }
+            properties.exit();
+        } else if (strcmp(key, "UUID") != 0)
+            properties.skip();
+        properties.exit();
+    }
+    properties.exit();
+    if (index < 0)
+        return;
+    {
+        std::unique_lock<std::mutex> lck(mutexBluez);
+        states[addr].characteristic[index] = path;
+    }
+    anyNotification()->notify();
+}
+
+void BLEHelperBluez::interfacesAdded(
+    const char *path,
+    DBusReader &interfaces
+) {
+    uint64_t addr;
+    bool ofDevice = bluezPathAddr(path, addr);
+    if (!interfaces.enter('a', "{sa{sv}}"))
+        return;
+    while (interfaces.enter('e', "sa{sv}")) {
+        const char *iface = "";
+        interfaces.read('s', &iface);
+        if (ofDevice && strcmp(iface, IFACE_DEVICE) == 0)
+            deviceProperties(addr, interfaces);
+        else if (ofDevice && strcmp(iface, IFACE_CHARACTERISTIC) == 0)
+            characteristicProperties(path, addr, interfaces);
+        else
+            interfaces.skip();
+        interfaces.exit();
+    }
+    interfaces.exit();
+}
+
+void BLEHelperBluez::interfacesRemoved(
+    const char *path,
+    DBusReader &interfaces
+) {
+    uint64_t addr;
+    if (!bluezPathAddr(path, addr))
+        return;
+    bool characteristic = false;
+    bool device = false;
+    if (interfaces.enter('a', "s")) {
+        const char *iface;
+        while (interfaces.read('s', &iface)) {
+            characteristic = characteristic || strcmp(iface, IFACE_CHARACTERISTIC) == 0;
+            device = device || strcmp(iface, IFACE_DEVICE) == 0;
+        }
+        interfaces.exit();
+    }
+    std::unique_lock<std::mutex> lck(mutexBluez);
+    auto s = states.find(addr);
+    if (s == states.end())
+        return;
+    if (device) {
+        // bluetoothd drops devices not seen for a while, the next advertisement adds them again
+        states.erase(s);
+        return;
+    }
+    for (auto &c : s->second.characteristic) {
+        if (characteristic && c == path)
+            c.clear();
+    }
+}
+
+/**
+ * Device1 changes are advertisements and the link state, GattCharacteristic1 Value changes are notifications
+ */
+void BLEHelperBluez::propertiesChanged(
+    const char *path,
+    const char *interface,
+    DBusReader &changed
+) {
+    uint64_t addr;
+    if (!bluezPathAddr(path, addr))
+        return;
+    if (strcmp(interface, IFACE_DEVICE) == 0) {
+        deviceProperties(addr, changed);
+        return;
+    }
+    if (strcmp(interface, IFACE_CHARACTERISTIC) != 0 || !changed.enter('a', "{sv}"))
+        return;
+    while (changed.enter('e', "sv")) {
+        const char *key = "";
+        changed.read('s', &key);
+        if (strcmp(key, "Value") == 0 && changed.enterVariant("ay")) {
+            const void *data;
+            size_t size;
+            // copied into the pooled buffer, wakes the reader of this device only
+            if (changed.readBytes(data, size) && size)
+                notificationQueue(addr)->push(data, size);
+            changed.exit();
+        } else if (strcmp(key, "Value") != 0)
+            changed.skip();
+        changed.exit();
+    }
+    changed.exit();
+}
+
+/**
+ * Reply to the call of the session step waiting for it advances pollOpen() or pollClose()
+ */
+void BLEHelperBluez::replied(
+    const char *path,
+    const char *method,
+    int result
+) {
+    BluezSessionStep step = BS_NONE;
+    if (strcmp(method, "Connect") == 0)
+        step = BS_CONNECT;
+    else if (strcmp(method, "StartNotify") == 0)
+        step = BS_NOTIFY;
+    else if (strcmp(method, "Disconnect") == 0)
+        step = BS_DISCONNECT;
+    uint64_t addr;
+    if (step != BS_NONE && bluezPathAddr(path, addr)) {
+        std::unique_lock<std::mutex> lck(mutexBluez);
+        auto s = states.find(addr);
+        if (s != states.end() && s->second.sessionStep == step) {
+            s->second.replied = true;
+            s->second.replyResult = result;
+        }
+    }
+    // objects of GetManagedObjects are applied already
+    anyNotification()->notify();
+}
+
+#ifdef ESL_BLE_SDBUS
+BLEHelper::BLEHelper()
+    : BLEHelperBluez(&systemBus)
+{
+}
+
+BLEHelper::BLEHelper(
+    OnDiscover *onDiscover
+)
+    : BLEHelperBluez(&systemBus, onDiscover)
+{
+}
+
+BLEHelper::BLEHelper(
+    OnDiscover *onDiscover,
+    void *discoverExtra
+)
+    : BLEHelperBluez(&systemBus, onDiscover, discoverExtra)
+{
+}
+#endif
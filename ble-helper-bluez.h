@@ -0,0 +1,142 @@
+#ifndef BLE_HELPER_BLUEZ_H
+#define BLE_HELPER_BLUEZ_H
+
+#include <chrono>
+#include <map>
+#include <string>
+
+#include "ble-helper.h"
+#include "bluez-bus.h"
+
+class BLEDeviceImplBluez : public BLEDeviceImpl {
+public:
+    /// object paths of CI_REQUEST and CI_IMAGE characteristics of the session
+    std::string characteristic[2];
+};
+
+/**
+ * Steps of startOpen() and startClose(), each waits for a reply or a signal handled on the bus thread
+ */
+enum BluezSessionStep {
+    BS_NONE = 0,
+    /// Device1.Connect sent
+    BS_CONNECT,
+    /// waiting for ServicesResolved and the characteristics
+    BS_RESOLVE,
+    /// GattCharacteristic1.StartNotify sent
+    BS_NOTIFY,
+    /// Device1.Disconnect sent
+    BS_DISCONNECT
+};
+
+/**
+ * Device as org.bluez signals report it
+ */
+class BluezDeviceState {
+public:
+    /// last advertised manufacturer specific data
+    NEMR5053ManufacturerSpecificData metadata;
+    int16_t rssi;
+    /// RSSI received, device is in range
+    bool advertised;
+    uint8_t nameSize;
+    char name[AdvertisementRecord::MAX_NAME];
+    bool connected;
+    /// GATT services discovered, characteristics are known
+    bool servicesResolved;
+    /// object paths of CI_REQUEST and CI_IMAGE characteristics, empty until found
+    std::string characteristic[2];
+    /// open() or close() in progress
+    BluezSessionStep sessionStep;
+    /// reply to the method of the step received
+    bool replied;
+    /// 0 or negative errno
+    int replyResult;
+    /// connection and service discovery time out at
+    std::chrono::steady_clock::time_point deadline;
+    BluezDeviceState();
+    bool resolved() const;
+};
+
+/**
+ * Linux backend: BlueZ over D-Bus. Advertisements come as Device1 property changes (discovery filter
+ * reports each advertisement of the devices with the label service), notifications as
+ * GattCharacteristic1 Value changes; both are handled on the bus thread without waiting.
+ * Sessions are opened and closed by the calls not waited for: replies and signals advance pollOpen() and pollClose().
+ * The bus is not owned: sd-bus connection to bluetoothd or BluezBusMock in the tests.
+ */
+class BLEHelperBluez : public BLEDiscoverer, public BluezBusListener {
+private:
+    BluezBus *bus;
+    std::mutex mutexBluez;
+    /// devices seen by address, guarded by mutexBluez
+    std::map<uint64_t, BluezDeviceState> states;
+
+    int devicePath(char *retPath, size_t size, uint64_t addr) const;
+    void deviceProperties(uint64_t addr, DBusReader &properties);
+    void characteristicProperties(const char *path, uint64_t addr, DBusReader &properties);
+    int writeValue(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size,
+        bool withResponse, bool wait);
+    void enterStep(uint64_t addr, BluezSessionStep step);
+    int abortOpen(DiscoveredDevice *device);
+public:
+    /// label GATT service
+    static const char *SERVICE_UUID;
+    /// CI_REQUEST and CI_IMAGE characteristics
+    static const char *CHARACTERISTIC_UUID[2];
+
+    /// adapter object path
+    std::string adapterPath;
+    /// wait for the connection and the GATT service discovery
+    int connectTimeoutMs;
+
+    explicit BLEHelperBluez(BluezBus *bus);
+    BLEHelperBluez(BluezBus *bus, OnDiscover *onDiscover);
+    BLEHelperBluez(BluezBus *bus, OnDiscover *onDiscover, void *discoverExtra);
+    virtual ~BLEHelperBluez();
+
+    int startDiscovery() override;
+    void stopDiscovery(int seconds = 10) override;
+    int open(DiscoveredDevice* device) override;
+    int close(DiscoveredDevice* device) override;
+    int startOpen(DiscoveredDevice *device) override;
+    int pollOpen(DiscoveredDevice *device, std::chrono::steady_clock::time_point &wakeAt) override;
+    int startClose(DiscoveredDevice *device) override;
+    int pollClose(DiscoveredDevice *device, std::chrono::steady_clock::time_point &wakeAt) override;
+    int read(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size, int milliseconds = 2000) override;
+    int write(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size) override;
+    int writeWithoutResponse(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size) override;
+    int startWrite(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size,
+        bool withResponse = true) override;
+    int pair(const DiscoveredDevice *device) override;
+    int unpair(const DiscoveredDevice *device) override;
+
+    void interfacesAdded(const char *path, DBusReader &interfaces) override;
+    void interfacesRemoved(const char *path, DBusReader &interfaces) override;
+    void propertiesChanged(const char *path, const char *interface, DBusReader &changed) override;
+    void replied(const char *path, const char *method, int result) override;
+};
+
+#ifdef ESL_BLE_SDBUS
+#include "bluez-bus-sdbus.h"
+
+/**
+ * Keeps the system bus constructed before BLEHelperBluez and destroyed after it
+ */
+class BluezSystemBus {
+protected:
+    BluezBusSdBus systemBus;
+};
+
+/**
+ * BlueZ backend on the system bus
+ */
+class BLEHelper : private BluezSystemBus, public BLEHelperBluez {
+public:
+    BLEHelper();
+    BLEHelper(OnDiscover *onDiscover);
+    BLEHelper(OnDiscover *onDiscover, void *discoverExtra);
+};
+#endif
+
+#endif
@@ -0,0 +1,548 @@
+#include <algorithm>
+#include <cstring>
+
+#include "platform.h"
+#include "srgb-pack.h"
+#include "ble-helper-sim.h"
+
+SimulatedLinkParams::SimulatedLinkParams()
+    : latencyMs(15), jitterMs(5), txMs(2), mtu(247), lossPercent(0), advIntervalMs(1000), connectMs(0), dropAtChunk(0)
+{
+
+}
+
+SimulatedLabel::SimulatedLabel()
+    : addr(0), rssi(-60), blockSize(244), processMs(0), rxQueueSize(0), compression(false), acceptsSkip(false),
+    resumes(false), hangAtChunk(0), disconnected(false), screenSize(0), compressed(false), transferring(false),
+    nextChunk(0), requestCount(0), chunkCount(0), lostCount(0), overflowCount(0), imageCount(0)
+{
+
+}
+
+SimulatedLabel::SimulatedLabel(
+    uint64_t aAddr,
+    const NEMR5053ManufacturerSpecificData &aMetadata,
+    const std::string &aName
+)
+    : addr(aAddr), metadata(aMetadata), name(aName), rssi(-60), blockSize(244), processMs(0), rxQueueSize(0),
+    compression(false), acceptsSkip(false), resumes(false), hangAtChunk(0), disconnected(false), screenSize(0),
+    compressed(false), transferring(false), nextChunk(0), requestCount(0), chunkCount(0), lostCount(0), overflowCount(0), imageCount(0)
+{
+
+}
+
+BLEHelperSim::BLEHelperSim()
+    : BLEDiscoverer(), advStopRequest(false), rnd(1), maxConnections(0), connectionCount(0),
+    peakConnectionCount(0)
+{
+
+}
+
+BLEHelperSim::BLEHelperSim(
+    OnDiscover *onDiscover
+)
+    : BLEDiscoverer(onDiscover), advStopRequest(false), rnd(1), maxConnections(0), connectionCount(0),
+    peakConnectionCount(0)
+{
+
+}
+
+BLEHelperSim::BLEHelperSim(
+    OnDiscover *onDiscover,
+    void *discoverExtra
+)
+    : BLEDiscoverer(onDiscover, discoverExtra), advStopRequest(false), rnd(1), maxConnections(0), connectionCount(0),
+    peakConnectionCount(0)
+{
+
+}
+
+BLEHelperSim::~BLEHelperSim()
+{
+    stopDiscovery(0);
+}
+
+/**
+ * Add virtual label. Label added while discovery is on starts advertising at once.
+ * @param addr MAC address
+ * @param metadata advertised manufacturer specific data
+ * @param name device name
+ * @return added label to tune link and firmware parameters, tune it before startDiscovery() or under no session
+ */
+SimulatedLabel &BLEHelperSim::addLabel(
+    uint64_t addr,
+    const NEMR5053ManufacturerSpecificData &metadata,
+    const std::string &name
+) {
+    std::unique_lock<std::mutex> lck(mutexLabels);
+    labels.emplace_back(addr, metadata, name);
+    cvLabels.notify_all();
+    return labels.back();
+}
+
+/**
+ * Set random generator seed used for jitter and packet loss
+ * @param value seed
+ */
+void BLEHelperSim::seed(
+    uint32_t value
+) {
+    std::unique_lock<std::mutex> lck(mutexLabels);
+    rnd.seed(value);
+}
+
+SimulatedLabel *BLEHelperSim::findLabel(
+    uint64_t addr
+) {
+    auto it = std::find_if(labels.begin(), labels.end(), [addr](const SimulatedLabel &label) {
+        return label.addr == addr;
+    });
+    if (it == labels.end())
+        return nullptr;
+    return &*it;
+}
+
+bool BLEHelperSim::lose(
+    const SimulatedLabel *label
+) {
+    if (label->link.lossPercent == 0)
+        return false;
+    return std::uniform_int_distribution<int>(0, 99)(rnd) < label->link.lossPercent;
+}
+
+/**
+ * Queue notification. Link layer delivers notifications in order, jitter never reorders them.
+ * @param label sender
+ * @param arriveAt time when request arrived to the label
+ * @param data notification
+ * @param size notification size
+ */
+void BLEHelperSim::notify(
+    SimulatedLabel *label,
+    std::chrono::steady_clock::time_point arriveAt,
+    const void *data,
+    uint32_t size
+) {
+    if (label->disconnected)
+        return;
+    if (lose(label)) {
+        label->lostCount++;
+        return;
+    }
+    int delay = label->link.latencyMs;
+    if (label->link.jitterMs > 0)
+        delay += std::uniform_int_distribution<int>(0, label->link.jitterMs)(rnd);
+    auto deliverAt = arriveAt + std::chrono::milliseconds(delay);
+    if (label->lastDeliverAt > deliverAt)
+        deliverAt = label->lastDeliverAt;
+    label->lastDeliverAt = deliverAt;
+    // wakes the reader of this label only
+    notificationQueue(label->addr)->push(data, size, deliverAt);
+}
+
+void BLEHelperSim::receiveRequest(
+    SimulatedLabel *label,
+    std::chrono::steady_clock::time_point arriveAt,
+    const uint8_t *data,
+    uint32_t size
+) {
+    if (size < 1)
+        return;
+    label->requestCount++;
+    if (label->hangAtChunk && label->chunkCount >= label->hangAtChunk)
+        return;
+    switch (data[0]) {
+        case 1: {
+            // get block size
+            uint8_t r[3] { 1, 0, 0 };
+            uint16_t v = label->blockSize;
+#if IS_BIG_ENDIAN
+            v = SWAP_BYTES_2(v);
+#endif
+            memmove(r + 1, &v, 2);
+            notify(label, arriveAt, r, sizeof(r));
+        }
+            break;
+        case 2: {
+            // set screen size
+            if (size < 5)
+                return;
+            uint32_t v;
+            memmove(&v, data + 1, 4);
+#if IS_BIG_ENDIAN
+            v = SWAP_BYTES_4(v);
+#endif
+            uint8_t r[2] { 2, 0 };
+            bool c = size > 5 && data[5] == 1;
+            if (c && !label->compression) {
+                r[1] = 1;
+                notify(label, arriveAt, r, sizeof(r));
+                return;
+            }
+            // interrupted transfer of the same size continues
+            bool resume = label->resumes && label->transferring && label->nextChunk > 0
+                && label->screenSize == v && label->compressed == c;
+            label->screenSize = v;
+            label->compressed = c;
+            if (!resume) {
+                label->transferring = false;
+                label->nextChunk = 0;
+                // firmware accepting skipped chunks starts from the displayed image
+                if (label->acceptsSkip && !c && label->image.size() == v)
+                    label->received = label->image;
+                else
+                    label->received.resize(v);
+            }
+            notify(label, arriveAt, r, sizeof(r));
+        }
+            break;
+        case 3: {
+            // start transfer, request chunk 0 or the chunk to resume from
+            uint8_t r[6] { 5, 0, 0, 0, 0, 0 };
+            if (label->screenSize == 0)
+                r[1] = 1;
+            else {
+                label->transferring = true;
+                uint32_t v = label->nextChunk;
+#if IS_BIG_ENDIAN
+                v = SWAP_BYTES_4(v);
+#endif
+                memmove(r + 2, &v, 4);
+            }
+            notify(label, arriveAt, r, sizeof(r));
+        }
+            break;
+        case 4: {
+            // cancel
+            label->transferring = false;
+            label->nextChunk = 0;
+            uint8_t r[2] { 4, 0 };
+            notify(label, arriveAt, r, sizeof(r));
+        }
+            break;
+        default:
+            break;
+    }
+}
+
+void BLEHelperSim::receiveChunk(
+    SimulatedLabel *label,
+    std::chrono::steady_clock::time_point arriveAt,
+    const uint8_t *data,
+    uint32_t size
+) {
+    if (size < 4 || !label->transferring)
+        return;
+    label->chunkCount++;
+    // does not fit firmware buffer
+    if (size > label->blockSize)
+        return;
+    if (label->link.dropAtChunk && label->chunkCount >= label->link.dropAtChunk) {
+        // connection lost, chunk is not received
+        label->link.dropAtChunk = 0;
+        label->disconnected = true;
+        return;
+    }
+    if (label->hangAtChunk && label->chunkCount >= label->hangAtChunk)
+        return;
+    // chunks wait while firmware stores previous ones
+    if (label->busyUntil > arriveAt) {
+        if (label->rxQueueSize
+            && label->busyUntil - arriveAt >= std::chrono::milliseconds(label->processMs * label->rxQueueSize)) {
+            label->overflowCount++;
+            return;
+        }
+        arriveAt = label->busyUntil;
+    }
+    arriveAt += std::chrono::milliseconds(label->processMs);
+    label->busyUntil = arriveAt;
+    uint32_t chunkIdx;
+    memmove(&chunkIdx, data, 4);
+#if IS_BIG_ENDIAN
+    chunkIdx = SWAP_BYTES_4(chunkIdx);
+#endif
+    uint32_t chunkSize = label->blockSize - 4;
+    uint8_t r[6] { 5, 0, 0, 0, 0, 0 };
+    uint32_t chunksCount = (label->screenSize + chunkSize - 1) / chunkSize;
+    // unchanged chunks skipped by the host keep previous content
+    if (label->acceptsSkip && chunkIdx > label->nextChunk && chunkIdx < chunksCount)
+        label->nextChunk = chunkIdx;
+    if (chunkIdx == label->nextChunk) {
+        uint32_t ofs = chunkIdx * chunkSize;
+        uint32_t sz = size - 4;
+        if (ofs + sz > label->screenSize)
+            sz = ofs < label->screenSize ? label->screenSize - ofs : 0;
+        memmove(label->received.data() + ofs, data + 4, sz);
+        label->nextChunk++;
+        if (label->nextChunk * chunkSize >= label->screenSize) {
+            // all done
+            label->transferring = false;
+            label->imageCount++;
+            if (label->compressed) {
+                label->image.resize(label->metadata.screenSize());
+                if (decompressPlanes(label->image.data(), (uint32_t) label->image.size(), label->received.data(), label->screenSize) < 0)
+                    label->image.clear();   // corrupted
+            } else
+                label->image = label->received;
+            r[1] = 8;
+            notify(label, arriveAt, r, sizeof(r));
+            return;
+        }
+    }
+    // request next chunk, or the expected one again if chunk is out of order
+    uint32_t v = label->nextChunk;
+#if IS_BIG_ENDIAN
+    v = SWAP_BYTES_4(v);
+#endif
+    memmove(r + 2, &v, 4);
+    notify(label, arriveAt, r, sizeof(r));
+}
+
+void BLEHelperSim::advertise(
+    const SimulatedLabel &label
+) {
+    pushAdvertisement(label.addr, label.rssi, label.metadata, label.name.c_str(), label.name.size());
+}
+
+void BLEHelperSim::runAdvertising()
+{
+    std::vector<std::chrono::steady_clock::time_point> nextAdv;
+    std::unique_lock<std::mutex> lck(mutexLabels);
+    auto t = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < labels.size(); i++) {
+        // spread first advertisements over 100ms
+        nextAdv.push_back(t + std::chrono::milliseconds(i * 100 / labels.size()));
+    }
+    while (!advStopRequest) {
+        auto now = std::chrono::steady_clock::now();
+        auto earliest = now + std::chrono::seconds(1);
+        // labels added while waiting advertise now
+        nextAdv.resize(labels.size(), now);
+        for (size_t i = 0; i < labels.size(); i++) {
+            if (nextAdv[i] <= now) {
+                nextAdv[i] = now + std::chrono::milliseconds(labels[i].link.advIntervalMs);
+                // callbacks run on the consumer thread, so labels can be held
+                advertise(labels[i]);
+            }
+            if (nextAdv[i] < earliest)
+                earliest = nextAdv[i];
+        }
+        size_t labelCount = labels.size();
+        cvLabels.wait_until(lck, earliest, [this, &labelCount] {
+            return advStopRequest || labels.size() != labelCount;
+        });
+    }
+}
+
+int BLEHelperSim::startDiscovery()
+{
+    if (discoveryOn)
+        return 0;
+    std::unique_lock<std::mutex> lck(mutexDiscoveryState);
+    discoveryOn = true;
+    lck.unlock();
+
+    startAdvertisementConsumer();
+    advStopRequest = false;
+    advThread = std::thread(&BLEHelperSim::runAdvertising, this);
+    return 0;
+}
+
+void BLEHelperSim::stopDiscovery(
+    int
+) {
+    std::unique_lock<std::mutex> lck(mutexLabels);
+    advStopRequest = true;
+    cvLabels.notify_all();
+    lck.unlock();
+    if (advThread.joinable()) {
+        if (advThread.get_id() == std::this_thread::get_id())
+            advThread.detach();
+        else
+            advThread.join();
+    }
+    stopAdvertisementConsumer();
+    std::unique_lock<std::mutex> lckState(mutexDiscoveryState);
+    discoveryOn = false;
+    lckState.unlock();
+    cvDiscoveryState.notify_all();
+}
+
+int BLEHelperSim::open(
+    DiscoveredDevice *device
+) {
+    return waitAsync(device, startOpen(device), true);
+}
+
+/**
+ * Take the connection slot, the link is up after SimulatedLinkParams::connectMs
+ */
+int BLEHelperSim::startOpen(
+    DiscoveredDevice *device
+) {
+    std::unique_lock<std::mutex> lck(mutexLabels);
+    SimulatedLabel *label = findLabel(device->addr);
+    if (!label)
+        return -1;
+    if (device->deviceState == DS_IDLE) {
+        if (maxConnections && connectionCount >= maxConnections)
+            return -1;
+        connectionCount++;
+        peakConnectionCount = std::max(peakConnectionCount, connectionCount);
+    }
+    int connectMs = label->link.connectMs ? label->link.connectMs : 2 * label->link.latencyMs;
+    label->disconnected = false;
+    label->lastDeliverAt = std::chrono::steady_clock::time_point();
+    notificationQueue(label->addr)->clear();
+    // firmware keeping interrupted transfer resumes it in the new session
+    if (!label->resumes)
+        label->transferring = false;
+    label->busyUntil = std::chrono::steady_clock::time_point();
+    label->txUntil = std::chrono::steady_clock::time_point();
+    label->connectedAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(connectMs);
+    // connecting, close() releases the slot
+    device->deviceState = DS_RUNNING;
+    return PENDING;
+}
+
+int BLEHelperSim::pollOpen(
+    DiscoveredDevice *device,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    std::unique_lock<std::mutex> lck(mutexLabels);
+    SimulatedLabel *label = findLabel(device->addr);
+    if (!label)
+        return -1;
+    if (std::chrono::steady_clock::now() < label->connectedAt) {
+        if (label->connectedAt < wakeAt)
+            wakeAt = label->connectedAt;
+        return PENDING;
+    }
+    device->deviceState = DS_SESSION_ON;
+    return 0;
+}
+
+int BLEHelperSim::close(
+    DiscoveredDevice *device
+) {
+    std::unique_lock<std::mutex> lck(mutexLabels);
+    if (device->deviceState != DS_IDLE)
+        connectionCount--;
+    device->deviceState = DS_IDLE;
+    return 0;
+}
+
+/**
+ * Return the first notification delivered to the host, notifications delivered meanwhile wait in the queue
+ */
+int BLEHelperSim::read(
+    const DiscoveredDevice *device,
+    CharacteristicIndex,
+    void *buffer,
+    uint32_t size,
+    int milliseconds
+) {
+    if (device->deviceState == DS_IDLE)
+        return -1;
+    std::unique_lock<std::mutex> lck(mutexLabels);
+    if (!findLabel(device->addr))
+        return -1;
+    lck.unlock();
+    return notificationQueue(device->addr)->pop(buffer, size, milliseconds);
+}
+
+/**
+ * Deliver write to the label after the writes started before.
+ * Lost write without response is not delivered to the label.
+ * @param retDoneAt returns time the write is acknowledged (with response) or sent
+ * @return size, -1 if link is dropped, -4 if the label is not found
+ */
+int BLEHelperSim::transmit(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size,
+    bool withResponse,
+    std::chrono::steady_clock::time_point &retDoneAt
+) {
+    if (device->deviceState == DS_IDLE)
+        return -1;
+    std::unique_lock<std::mutex> lck(mutexLabels);
+    SimulatedLabel *label = findLabel(device->addr);
+    if (!label)
+        return -4;
+    if (label->disconnected || size + 3 > label->link.mtu)
+        return -1;
+    auto start = std::max(std::chrono::steady_clock::now(), label->txUntil);
+    label->txUntil = start + std::chrono::milliseconds(label->link.txMs);
+    auto arriveAt = start + std::chrono::milliseconds(label->link.latencyMs);
+    // write with response waits for the acknowledge, the link layer repeats it until delivered
+    retDoneAt = withResponse ? arriveAt + std::chrono::milliseconds(label->link.latencyMs) : label->txUntil;
+    if (!withResponse && lose(label)) {
+        label->lostCount++;
+        return (int) size;
+    }
+    if (characteristic == CI_REQUEST)
+        receiveRequest(label, arriveAt, (const uint8_t *) buffer, size);
+    else
+        receiveChunk(label, arriveAt, (const uint8_t *) buffer, size);
+    // link dropped, no acknowledge
+    if (withResponse && label->disconnected)
+        return -1;
+    return (int) size;
+}
+
+int BLEHelperSim::write(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size
+) {
+    std::chrono::steady_clock::time_point doneAt;
+    int r = transmit(device, characteristic, buffer, size, true, doneAt);
+    if (r > 0)
+        std::this_thread::sleep_until(doneAt);
+    return r;
+}
+
+/**
+ * Write without response takes air time only
+ */
+int BLEHelperSim::writeWithoutResponse(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size
+) {
+    std::chrono::steady_clock::time_point doneAt;
+    int r = transmit(device, characteristic, buffer, size, false, doneAt);
+    if (r > 0)
+        std::this_thread::sleep_until(doneAt);
+    return r;
+}
+
+/**
+ * Queue write on the link and return, the label receives it as write() would deliver it
+ */
+int BLEHelperSim::startWrite(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size,
+    bool withResponse
+) {
+    std::chrono::steady_clock::time_point doneAt;
+    return transmit(device, characteristic, buffer, size, withResponse, doneAt);
+}
+
+int BLEHelperSim::pair(
+    const DiscoveredDevice *
+) {
+    return 0;
+}
+
+int BLEHelperSim::unpair(
+    const DiscoveredDevice *
+) {
+    return 0;
+}
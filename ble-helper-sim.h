@@ -0,0 +1,149 @@
+#ifndef BLE_HELPER_SIM_H
+#define BLE_HELPER_SIM_H
+
+#include <deque>
+#include <random>
+#include <thread>
+
+#include "ble-helper.h"
+
+/**
+ * Radio link model of the simulated label
+ */
+class SimulatedLinkParams {
+public:
+    /// one way delay of the packet, milliseconds
+    int latencyMs;
+    /// maximum random delay added to the notification, milliseconds
+    int jitterMs;
+    /// air time of the write without response, milliseconds
+    int txMs;
+    /// ATT MTU, longer writes are rejected
+    uint16_t mtu;
+    /// probability to lose notification or write without response, 0..100
+    uint8_t lossPercent;
+    /// advertising interval, milliseconds
+    int advIntervalMs;
+    /// time to connect, milliseconds. 0- two latencies
+    int connectMs;
+    /// link drops when the label receives this chunk, until open() reconnects. 0- never
+    uint32_t dropAtChunk;
+    SimulatedLinkParams();
+};
+
+/**
+ * Virtual NEMR label: advertising data, link model and firmware state
+ */
+class SimulatedLabel {
+public:
+    uint64_t addr;
+    NEMR5053ManufacturerSpecificData metadata;
+    std::string name;
+    int16_t rssi;
+    SimulatedLinkParams link;
+    /// block size reported by CI_REQUEST 1, including 4 bytes chunk header
+    uint16_t blockSize;
+    /// time to store received chunk, milliseconds
+    int processMs;
+    /// chunks buffered while firmware is busy, extra chunks are dropped. 0- unlimited
+    uint8_t rxQueueSize;
+    /// firmware accepts images compressed by compressPlanes()
+    bool compression;
+    /// firmware keeps displayed image and accepts chunk index ahead of the expected one
+    bool acceptsSkip;
+    /// firmware keeps interrupted transfer and requests the next chunk on CI_REQUEST 3 if the size is the same
+    bool resumes;
+    /// firmware hangs when it receives this chunk, the link stays up but nothing is answered. 0- never
+    uint32_t hangAtChunk;
+
+    /// link dropped, writes fail and notifications are lost until open()
+    bool disconnected;
+    /// connection started by startOpen() is established at
+    std::chrono::steady_clock::time_point connectedAt;
+
+    // firmware state
+    /// transfer size set by CI_REQUEST 2
+    uint32_t screenSize;
+    /// CI_REQUEST 2 announced compressed image
+    bool compressed;
+    /// CI_REQUEST 3 received, waiting for chunks
+    bool transferring;
+    /// chunk expected by the firmware
+    uint32_t nextChunk;
+    /// received data
+    std::vector<uint8_t> received;
+    /// displayed image
+    std::vector<uint8_t> image;
+    /// firmware is busy with previous chunks until
+    std::chrono::steady_clock::time_point busyUntil;
+    /// link sends writes started before until
+    std::chrono::steady_clock::time_point txUntil;
+    /// last notification reaches the host, next one is not delivered before
+    std::chrono::steady_clock::time_point lastDeliverAt;
+
+    // statistics
+    uint32_t requestCount;
+    uint32_t chunkCount;
+    uint32_t lostCount;
+    uint32_t overflowCount;
+    uint32_t imageCount;
+
+    SimulatedLabel();
+    SimulatedLabel(uint64_t addr, const NEMR5053ManufacturerSpecificData &metadata, const std::string &name = "");
+};
+
+/**
+ * In-process backend emulating NEMR labels without radio.
+ * Labels answer CI_REQUEST opcodes 1..4 and accept CI_IMAGE chunks as the firmware does.
+ */
+class BLEHelperSim : public BLEDiscoverer {
+private:
+    std::mutex mutexLabels;
+    std::condition_variable cvLabels;
+    std::thread advThread;
+    bool advStopRequest;
+    std::mt19937 rnd;
+
+    SimulatedLabel *findLabel(uint64_t addr);
+    bool lose(const SimulatedLabel *label);
+    void notify(SimulatedLabel *label, std::chrono::steady_clock::time_point arriveAt, const void *data, uint32_t size);
+    void receiveRequest(SimulatedLabel *label, std::chrono::steady_clock::time_point arriveAt, const uint8_t *data, uint32_t size);
+    void receiveChunk(SimulatedLabel *label, std::chrono::steady_clock::time_point arriveAt, const uint8_t *data, uint32_t size);
+    int transmit(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size,
+        bool withResponse, std::chrono::steady_clock::time_point &retDoneAt);
+    void advertise(const SimulatedLabel &label);
+    void runAdvertising();
+public:
+    /// labels are never moved, references returned by addLabel() stay valid while labels are added
+    std::deque<SimulatedLabel> labels;
+    /// connections the adapter can keep, open() fails above. 0- unlimited
+    int maxConnections;
+    /// sessions open now
+    int connectionCount;
+    /// highest connectionCount seen
+    int peakConnectionCount;
+
+    BLEHelperSim();
+    BLEHelperSim(OnDiscover *onDiscover);
+    BLEHelperSim(OnDiscover *onDiscover, void *discoverExtra);
+    virtual ~BLEHelperSim();
+
+    SimulatedLabel &addLabel(uint64_t addr, const NEMR5053ManufacturerSpecificData &metadata, const std::string &name = "");
+    void seed(uint32_t value);
+
+    int startDiscovery() override;
+    void stopDiscovery(int seconds = 10) override;
+    int open(DiscoveredDevice* device) override;
+    int close(DiscoveredDevice* device) override;
+    int startOpen(DiscoveredDevice *device) override;
+    int pollOpen(DiscoveredDevice *device, std::chrono::steady_clock::time_point &wakeAt) override;
+    int read(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size, int milliseconds = 2000) override;
+    int write(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size) override;
+    int writeWithoutResponse(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size) override;
+    int startWrite(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size,
+        bool withResponse = true) override;
+    int pair(const DiscoveredDevice *device) override;
+    int unpair(const DiscoveredDevice *device) override;
+};
+
+#endif
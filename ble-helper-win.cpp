@@ -58,12 +58,49 @@ static const winrt::guid BLEPropertyUUID[] {
     { 0x0000fef2, 0x000000, 0x1000, { 0x80, 0x00, 0x00, 0x80, 0x5f, 0x9b, 0x34, 0xfb }}
 };
 
+BLEWriteRingWin::BLEWriteRingWin()
+    : buffers(SIZE, winrt::Windows::Storage::Streams::Buffer(nullptr)), next(0), error(0)
+{
+    for (auto &b : busy)
+        b = false;
+}
+
 BLEDeviceImplWin::BLEDeviceImplWin()
-    : dev(nullptr), service(nullptr), characteristic { nullptr, nullptr }
+    : dev(nullptr), service(nullptr), characteristic { nullptr, nullptr }, writeBuffer(nullptr),
+    writes(std::make_shared<BLEWriteRingWin>())
+{
+
+}
+
+/**
+ * Close the device and the service
+ */
+static void releaseDevice(
+    BLEDeviceImplWin *wimpl
+) {
+    try {
+        if (wimpl->service)
+            wimpl->service.Close();
+        if (wimpl->dev)
+            wimpl->dev.Close();
+    } catch (winrt::hresult_error const &ex) {
+    }
+    delete wimpl;
+}
+
+BLEOpeningWin::BLEOpeningWin()
+    : result(BLEDiscoverer::PENDING), impl(new BLEDeviceImplWin()), call(nullptr)
 {
 
 }
 
+BLEOpeningWin::~BLEOpeningWin()
+{
+    // not taken by pollOpen()
+    if (impl)
+        releaseDevice(impl);
+}
+
 static void winInit()
 {
     winrt::init_apartment();
@@ -74,13 +111,13 @@ static void winInit()
 }
 
 BLEHelper::BLEHelper()
-    : BLEDiscoverer()
+    : BLEDiscoverer(), connectTimeoutMs(10000)
 {
     winInit();
 }
 
 BLEHelper::BLEHelper(OnDiscover *onDiscover)
-    : BLEDiscoverer(onDiscover)
+    : BLEDiscoverer(onDiscover), connectTimeoutMs(10000)
 {
     winInit();
 }
@@ -89,12 +126,13 @@ BLEHelper::BLEHelper(
     OnDiscover *onDiscover,
     void *discoverExtra
 )
-    : BLEDiscoverer(onDiscover, discoverExtra)
+    : BLEDiscoverer(onDiscover, discoverExtra), connectTimeoutMs(10000)
 {
     winInit();
 }
 
 BLEHelper::~BLEHelper() {
+    stopAdvertisementConsumer();
     winrt::uninit_apartment();
 }
 
@@ -150,15 +188,17 @@ int BLEHelper::startDiscovery() {
     discoveryOn = true;
     lck.unlock();
 
+    startAdvertisementConsumer();
     discoveryToken = advWatcher.Received([this](
         const winrt::Windows::Devices::Bluetooth::Advertisement::BluetoothLEAdvertisementWatcher &watcher,
         const winrt::Windows::Devices::Bluetooth::Advertisement::BluetoothLEAdvertisementReceivedEventArgs &eventArgs
     ) {
         uint64_t addr = eventArgs.BluetoothAddress();
 
-        // Bluetooth Base UUID
-        std::vector<winrt::guid> serviceUuids;
-        std::string deviceName;
+        // parsed on the radio thread without allocations, applied to devices by the consumer thread
+        bool found = false;
+        char deviceName[AdvertisementRecord::MAX_NAME];
+        size_t deviceNameSize = 0;
         auto rssi = eventArgs.RawSignalStrengthInDBm();
         NEMR5053ManufacturerSpecificData manufacturerSpecificData;
         for (winrt::Windows::Devices::Bluetooth::Advertisement::BluetoothLEAdvertisementDataSection dataSection : eventArgs.Advertisement().DataSections()) {
@@ -170,7 +210,7 @@ int BLEHelper::startDiscovery() {
                 for (int i = 0; i < sz; i++) {
                     winrt::guid g;
                     setUUID(g, c, 16);
-                    serviceUuids.push_back(g);
+                    found = found || g == serviceUUID;
                     c += 16;
                 }
             }
@@ -180,7 +220,7 @@ int BLEHelper::startDiscovery() {
                 for (int i = 0; i < sz; i++) {
                     winrt::guid g;
                     setUUID(g, c, 4);
-                    serviceUuids.push_back(g);
+                    found = found || g == serviceUUID;
                     c += 4;
                 }
             }
@@ -190,7 +230,7 @@ int BLEHelper::startDiscovery() {
                 for (int i = 0; i < sz; i++) {
                     winrt::guid g;
                     setUUID(g, c, 2);
-                    serviceUuids.push_back(g);
+                    found = found || g == serviceUUID;
                     c += 2;
                 }
             }
@@ -199,7 +239,8 @@ int BLEHelper::startDiscovery() {
                 len = dataSection.Data().Length();
                 if (!len)
                     return 0;
-                deviceName = std::string((const char *) c, len);
+                deviceNameSize = len < sizeof(deviceName) ? len : sizeof(deviceName);
+                memmove(deviceName, c, deviceNameSize);
             }
             if (dataSection.DataType() == winrt::Windows::Devices::Bluetooth::Advertisement::BluetoothLEAdvertisementDataTypes::ManufacturerSpecificData()) {
                 c = dataSection.Data().data();
@@ -211,12 +252,6 @@ int BLEHelper::startDiscovery() {
         }
 
         // check does service published
-        bool found = false;
-        for (auto &u : serviceUuids) {
-            found = u == serviceUUID;
-            if (found)
-                break;
-        }
         if (!found)
             return 0;
 
@@ -230,20 +265,7 @@ int BLEHelper::startDiscovery() {
         if (deviceName.find(DEVICE_NAME_PREFIX) != 0)
             return 0;
         */
-        std::unique_lock<std::mutex> lck(mutexDiscoveryState);
-        DiscoveredDevice dd = DiscoveredDevice(addr, rssi, manufacturerSpecificData, deviceName);
-        auto f = find(addr);
-        if (f.addr == 0) {
-            // just discovered
-            devices.emplace_back(dd);
-            if (onDiscover)
-                onDiscover->discoverFirstTime(dd);
-        } else {
-            if (onDiscover)
-                onDiscover->discoverNextTime(dd);
-        }
-        cvDiscoveryState.notify_all();
-        lck.unlock();
+        pushAdvertisement(addr, rssi, manufacturerSpecificData, deviceName, deviceNameSize);
 
         return 0;
     });
@@ -275,6 +297,8 @@ void BLEHelper::stopDiscovery(
     cvDiscoveryState.wait_for(lock, std::chrono::seconds(seconds), [this] {
         return !discoveryOn;
     });
+    lock.unlock();
+    stopAdvertisementConsumer();
 }
 
 void BLEHelper::commandCharacteristicValueChanged(
@@ -285,12 +309,8 @@ void BLEHelper::commandCharacteristicValueChanged(
     if (!len)
         return;
     uint64_t addr = sender.Service().Device().BluetoothAddress();
-    std::unique_lock<std::mutex> lck(mutexRead);
-    void *b = malloc(len);
-    memmove(b, valueChangedValue.CharacteristicValue().data(), len);
-    lastReceivedData[addr] = ReceivedData(b, len);
-    // std::cout << macAddress2string(addr) << " received " << hex(valueChangedValue.CharacteristicValue().data(), len) << std::endl;
-    cvRead.notify_all();
+    // copied into the pooled buffer, wakes the reader of this device only
+    notificationQueue(addr)->push(valueChangedValue.CharacteristicValue().data(), len);
 }
 
 void BLEHelper::pairingRequestedHandler(
@@ -361,68 +381,315 @@ int BLEHelper::unpair(
     return 0;
 }
 
+/**
+ * Connect, find the characteristics and subscribe to the command characteristic notifications
+ * @return 0- success
+ */
 int BLEHelper::open(
     DiscoveredDevice *device
 )
 {
-    BLEDeviceImplWin *wimpl = new BLEDeviceImplWin();
-    wimpl->dev = winrt::Windows::Devices::Bluetooth::BluetoothLEDevice::FromBluetoothAddressAsync(device->addr).get();
-    // session
-    winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattSession session = winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattSession::FromDeviceIdAsync(wimpl->dev.BluetoothDeviceId()).get();
-    if (session.CanMaintainConnection())
-        session.MaintainConnection(true);
-    session.SessionStatusChanged([this, device](const winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattSession &session, const winrt::Windows::Foundation::IInspectable &status) {
-        device->deviceState = session.SessionStatus() == winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattSessionStatus::Active ? DS_SESSION_ON : DS_RUNNING;
-    });
+    return waitAsync(device, startOpen(device), true);
+}
 
-    // get service
-    winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattDeviceServicesResult result = wimpl->dev.GetGattServicesForUuidAsync(serviceUUID).get();
-    if (result.Status() != winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
-        std::cerr << "Error "
-                  << gattCommunicationStatus2string(result.Status())
-                  << " getting service " << UUIDToString(serviceUUID) << std::endl;
-        return -1;
+/**
+ * Remember the call in progress, pollOpen() cancels it on timeout
+ */
+void BLEHelper::track(
+    const std::shared_ptr<BLEOpeningWin> &opening,
+    const winrt::Windows::Foundation::IAsyncInfo &call
+) {
+    std::unique_lock<std::mutex> lck(opening->mutex);
+    opening->call = call;
+}
+
+/**
+ * Check in the Completed handler the chain goes on
+ * @return false if pollOpen() gave up or the call failed
+ */
+bool BLEHelper::proceed(
+    const std::shared_ptr<BLEOpeningWin> &opening,
+    winrt::Windows::Foundation::AsyncStatus status
+) {
+    {
+        std::unique_lock<std::mutex> lck(opening->mutex);
+        if (opening->result != PENDING)
+            return false;
+    }
+    if (status == winrt::Windows::Foundation::AsyncStatus::Completed)
+        return true;
+    opened(opening, -1);
+    return false;
+}
+
+/**
+ * Chain finished, wake pollOpen()
+ */
+void BLEHelper::opened(
+    const std::shared_ptr<BLEOpeningWin> &opening,
+    int result
+) {
+    {
+        std::unique_lock<std::mutex> lck(opening->mutex);
+        if (opening->result == PENDING)
+            opening->result = result;
+    }
+    anyNotification()->notify();
+}
+
+void BLEHelper::openSession(
+    const std::shared_ptr<BLEOpeningWin> &opening,
+    DiscoveredDevice *device
+) {
+    try {
+        auto call = winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattSession::FromDeviceIdAsync(opening->impl->dev.BluetoothDeviceId());
+        track(opening, call);
+        call.Completed([this, opening, device](auto &&op, auto &&status) {
+            if (!proceed(opening, status))
+                return;
+            try {
+                winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattSession session = op.GetResults();
+                if (session.CanMaintainConnection())
+                    session.MaintainConnection(true);
+                session.SessionStatusChanged([this, device](const winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattSession &session, const winrt::Windows::Foundation::IInspectable &status) {
+                    device->deviceState = session.SessionStatus() == winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattSessionStatus::Active ? DS_SESSION_ON : DS_RUNNING;
+                });
+                openService(opening);
+            } catch (winrt::hresult_error const &ex) {
+                opened(opening, -1);
+            }
+        });
+    } catch (winrt::hresult_error const &ex) {
+        opened(opening, -1);
     }
-    wimpl->service = result.Services().GetAt(0);
+}
 
-    // get characteristics
-    winrt::Windows::Foundation::Collections::IVectorView<winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattDeviceService> services = result.Services();
-    bool success = true;
+void BLEHelper::openService(
+    const std::shared_ptr<BLEOpeningWin> &opening
+) {
     try {
-        for (int i = 0; i < 2; i++) {
-            auto characteristics = wimpl->service.GetCharacteristicsForUuidAsync(BLEPropertyUUID[i]).get();
-            if (characteristics.Status() != winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success || characteristics.Characteristics().Size() < 1)
-                success = false;
-            else
-                wimpl->characteristic[i] = characteristics.Characteristics().GetAt(0);
-        }
-        // notify
-        winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattWriteResult writeResult
-            = wimpl->characteristic[0].WriteClientCharacteristicConfigurationDescriptorWithResultAsync(
-            winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::Notify).get();
-        success = (writeResult.Status() == winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success);
-        auto notifyToken = wimpl->characteristic[0].ValueChanged({ this, &BLEHelper::commandCharacteristicValueChanged });
+        auto call = opening->impl->dev.GetGattServicesForUuidAsync(serviceUUID);
+        track(opening, call);
+        call.Completed([this, opening](auto &&op, auto &&status) {
+            if (!proceed(opening, status))
+                return;
+            try {
+                winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattDeviceServicesResult result = op.GetResults();
+                if (result.Status() != winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success
+                    || result.Services().Size() < 1) {
+                    std::cerr << "Error "
+                              << gattCommunicationStatus2string(result.Status())
+                              << " getting service " << UUIDToString(serviceUUID) << std::endl;
+                    opened(opening, -1);
+                    return;
+                }
+                opening->impl->service = result.Services().GetAt(0);
+                openCharacteristic(opening, 0);
+            } catch (winrt::hresult_error const &ex) {
+                opened(opening, -1);
+            }
+        });
+    } catch (winrt::hresult_error const &ex) {
+        opened(opening, -1);
+    }
+}
+
+/**
+ * Get the command characteristic, then the image characteristic
+ */
+void BLEHelper::openCharacteristic(
+    const std::shared_ptr<BLEOpeningWin> &opening,
+    int index
+) {
+    try {
+        auto call = opening->impl->service.GetCharacteristicsForUuidAsync(BLEPropertyUUID[index]);
+        track(opening, call);
+        call.Completed([this, opening, index](auto &&op, auto &&status) {
+            if (!proceed(opening, status))
+                return;
+            try {
+                auto characteristics = op.GetResults();
+                if (characteristics.Status() != winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success
+                    || characteristics.Characteristics().Size() < 1) {
+                    opened(opening, -1);
+                    return;
+                }
+                opening->impl->characteristic[index] = characteristics.Characteristics().GetAt(0);
+                if (index == 0)
+                    openCharacteristic(opening, 1);
+                else
+                    subscribe(opening);
+            } catch (winrt::hresult_error const &ex) {
+                opened(opening, -1);
+            }
+        });
+    } catch (winrt::hresult_error const &ex) {
+        opened(opening, -1);
+    }
+}
+
+void BLEHelper::subscribe(
+    const std::shared_ptr<BLEOpeningWin> &opening
+) {
+    try {
+        auto call = opening->impl->characteristic[0].WriteClientCharacteristicConfigurationDescriptorWithResultAsync(
+            winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::Notify);
+        track(opening, call);
+        call.Completed([this, opening](auto &&op, auto &&status) {
+            if (!proceed(opening, status))
+                return;
+            try {
+                if (op.GetResults().Status() != winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success) {
+                    opened(opening, -1);
+                    return;
+                }
+                opening->impl->characteristic[0].ValueChanged({ this, &BLEHelper::commandCharacteristicValueChanged });
+                opened(opening, 0);
+            } catch (winrt::hresult_error const &ex) {
+                opened(opening, -1);
+            }
+        });
+    } catch (winrt::hresult_error const &ex) {
+        opened(opening, -1);
+    }
+}
 
+/**
+ * Start the chain of WinRT calls: device, GATT session, service, characteristics and the notification subscription.
+ * Completed handlers run on the thread pool and notify anyNotification() when the chain finishes.
+ * @return PENDING, -1 if error
+ */
+int BLEHelper::startOpen(
+    DiscoveredDevice *device
+) {
+    // responses and write errors left from the previous session
+    notificationQueue(device->addr)->clear();
+    if (device->impl)
+        ((BLEDeviceImplWin *) device->impl)->writes->error = 0;
+    auto opening = std::make_shared<BLEOpeningWin>();
+    opening->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(connectTimeoutMs);
+    {
+        std::unique_lock<std::mutex> lck(mutexOpenings);
+        openings[device->addr] = opening;
+    }
+    try {
+        auto call = winrt::Windows::Devices::Bluetooth::BluetoothLEDevice::FromBluetoothAddressAsync(device->addr);
+        track(opening, call);
+        call.Completed([this, opening, device](auto &&op, auto &&status) {
+            if (!proceed(opening, status))
+                return;
+            try {
+                opening->impl->dev = op.GetResults();
+                if (!opening->impl->dev) {
+                    opened(opening, -1);
+                    return;
+                }
+                openSession(opening, device);
+            } catch (winrt::hresult_error const &ex) {
+                opened(opening, -1);
+            }
+        });
     } catch (winrt::hresult_error const &ex) {
-        device->deviceState = DS_IDLE;
-        success = false;
+        std::unique_lock<std::mutex> lck(mutexOpenings);
+        openings.erase(device->addr);
+        return -1;
+    }
+    return PENDING;
+}
+
+/**
+ * Stop the chain still in progress: handlers stop at the next step, the call in progress is cancelled
+ */
+void BLEHelper::giveUp(
+    const std::shared_ptr<BLEOpeningWin> &opening
+) {
+    winrt::Windows::Foundation::IAsyncInfo call = nullptr;
+    {
+        std::unique_lock<std::mutex> lck(opening->mutex);
+        if (opening->result != PENDING)
+            return;
+        opening->result = -1;
+        call = opening->call;
     }
+    if (call) {
+        try {
+            call.Cancel();
+        } catch (winrt::hresult_error const &ex) {
+        }
+    }
+}
 
-    if (success) {
-        device->impl = wimpl;
-        pair(device);
-    } else
-        delete wimpl;
+/**
+ * Take the device opened by the chain, give up after connectTimeoutMs
+ */
+int BLEHelper::pollOpen(
+    DiscoveredDevice *device,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    std::shared_ptr<BLEOpeningWin> opening;
+    {
+        std::unique_lock<std::mutex> lck(mutexOpenings);
+        auto it = openings.find(device->addr);
+        if (it == openings.end())
+            return -1;
+        opening = it->second;
+    }
+    std::unique_lock<std::mutex> lck(opening->mutex);
+    if (opening->result == PENDING && std::chrono::steady_clock::now() < opening->deadline) {
+        if (opening->deadline < wakeAt)
+            wakeAt = opening->deadline;
+        return PENDING;
+    }
+    lck.unlock();
+    giveUp(opening);
+    lck.lock();
+    int r = opening->result;
+    BLEDeviceImplWin *wimpl = nullptr;
+    if (r == 0) {
+        wimpl = opening->impl;
+        opening->impl = nullptr;
+    }
+    lck.unlock();
+    {
+        std::unique_lock<std::mutex> lckOpenings(mutexOpenings);
+        auto it = openings.find(device->addr);
+        if (it != openings.end() && it->second == opening)
+            openings.erase(it);
+    }
+    if (r < 0)
+        return r;
+    delete device->impl;
+    device->impl = wimpl;
+    pair(device);
     if (device->deviceState != DS_SESSION_ON)
         device->deviceState = DS_RUNNING;
     return 0;
 }
 
+/**
+ * Give up open() in progress, the device opened by the chain and not taken is released with its state
+ */
+void BLEHelper::dropOpening(
+    uint64_t addr
+) {
+    std::shared_ptr<BLEOpeningWin> opening;
+    {
+        std::unique_lock<std::mutex> lck(mutexOpenings);
+        auto it = openings.find(addr);
+        if (it == openings.end())
+            return;
+        opening = it->second;
+        openings.erase(it);
+    }
+    giveUp(opening);
+}
+
 int BLEHelper::close(
     DiscoveredDevice *device
 )
 {
     device->deviceState = DS_IDLE;
+    dropOpening(device->addr);
     BLEDeviceImplWin *wimpl = (BLEDeviceImplWin *) device->impl;
     if (wimpl) {
         try {
@@ -431,15 +698,52 @@ int BLEHelper::close(
                 winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::None).get();
         } catch (winrt::hresult_error const &ex) {
         }
-        wimpl->service.Close();
-        wimpl->dev.Close();
         // unpair(device);
-        delete wimpl;
+        releaseDevice(wimpl);
         device->impl = nullptr;
     }
     return 0;
 }
 
+/**
+ * Unsubscribe and release the device on the thread pool, return without waiting. Open in progress is given up.
+ * @return 0
+ */
+int BLEHelper::startClose(
+    DiscoveredDevice *device
+) {
+    device->deviceState = DS_IDLE;
+    dropOpening(device->addr);
+    BLEDeviceImplWin *wimpl = (BLEDeviceImplWin *) device->impl;
+    if (!wimpl)
+        return 0;
+    device->impl = nullptr;
+    // writes completing after the session are not reported
+    wimpl->writes->error = 0;
+    try {
+        wimpl->characteristic[0].WriteClientCharacteristicConfigurationDescriptorWithResultAsync(
+            winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattClientCharacteristicConfigurationDescriptorValue::None)
+            .Completed([wimpl](auto &&op, auto &&status) {
+                releaseDevice(wimpl);
+            });
+    } catch (winrt::hresult_error const &ex) {
+        releaseDevice(wimpl);
+    }
+    return 0;
+}
+
+/**
+ * Take the first error of the writes started by startWrite() and completed since the last call
+ */
+int BLEHelper::takeWriteError(
+    const DiscoveredDevice *device
+) {
+    BLEDeviceImplWin *wimpl = (BLEDeviceImplWin *) device->impl;
+    if (!wimpl)
+        return 0;
+    return wimpl->writes->error.exchange(0);
+}
+
 int BLEHelper::read(
     const DiscoveredDevice *device,
     CharacteristicIndex characteristicIdx,
@@ -452,25 +756,7 @@ int BLEHelper::read(
     BLEDeviceImplWin* wimpl = (BLEDeviceImplWin*) device->impl;
     if (!wimpl)
         return -1;
-    // wait
-    std::unique_lock<std::mutex> lock(mutexRead);
-    cvRead.wait_for(lock, std::chrono::milliseconds(milliseconds), [this, device] {
-        auto lrd = lastReceivedData.find(device->addr);
-        if (lrd == lastReceivedData.end())
-            return false;
-        return true;
-    });
-
-    auto lrd = lastReceivedData.find(device->addr);
-    if (lrd == lastReceivedData.end())
-        return -1;
-    auto sz = lrd->second.size;
-    if (size < sz)
-        sz = size;
-    memmove(buf, lrd->second.data, sz);
-    free(lrd->second.data);
-    lastReceivedData.erase(lrd);
-    return (int) sz;
+    return notificationQueue(device->addr)->pop(buf, size, milliseconds);
 }
 
 int BLEHelper::write(
@@ -478,6 +764,27 @@ int BLEHelper::write(
     CharacteristicIndex characteristicIdx,
     void *buf,
     uint32_t size
+) {
+    return writeValue(device, characteristicIdx, buf, size,
+        winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattWriteOption::WriteWithResponse);
+}
+
+int BLEHelper::writeWithoutResponse(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristicIdx,
+    void *buf,
+    uint32_t size
+) {
+    return writeValue(device, characteristicIdx, buf, size,
+        winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattWriteOption::WriteWithoutResponse);
+}
+
+int BLEHelper::writeValue(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristicIdx,
+    void *buf,
+    uint32_t size,
+    winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattWriteOption option
 ) {
     if (device->deviceState == DS_IDLE)
         return -1;
@@ -486,11 +793,13 @@ int BLEHelper::write(
         return -4;
     try {
         // BT_Code: Writes the value from the buffer to the characteristic.
-        winrt::Windows::Storage::Streams::Buffer buffer(size);
-        memcpy(buffer.data(), buf, size);
-        buffer.Length(size);
+        // one buffer per session, allocated on the first write
+        if (!wimpl->writeBuffer || wimpl->writeBuffer.Capacity() < size)
+            wimpl->writeBuffer = winrt::Windows::Storage::Streams::Buffer(size < 512 ? 512 : size);
+        memcpy(wimpl->writeBuffer.data(), buf, size);
+        wimpl->writeBuffer.Length(size);
         // write buffer
-        auto result = wimpl->characteristic[(int) characteristicIdx].WriteValueWithResultAsync(buffer).get();
+        auto result = wimpl->characteristic[(int) characteristicIdx].WriteValueWithResultAsync(wimpl->writeBuffer, option).get();
         // std::cout << "Write " << hex(buf, size) << std::endl;
         if (result.Status() != winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success)
             return - (int) result.Status();
@@ -500,3 +809,61 @@ int BLEHelper::write(
     }
     return size;
 }
+
+/**
+ * Start WriteValueWithResultAsync and return, the data is copied to the buffer of the write ring.
+ * A failed write is kept for takeWriteError(), the completion notifies anyNotification() as the buffer is free again.
+ * @return size, BUSY if all buffers of the ring are in flight, < 0 if error
+ */
+int BLEHelper::startWrite(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristicIdx,
+    void *buf,
+    uint32_t size,
+    bool withResponse
+) {
+    if (device->deviceState == DS_IDLE)
+        return -1;
+    BLEDeviceImplWin* wimpl = (BLEDeviceImplWin*) device->impl;
+    if (!wimpl)
+        return -4;
+    auto writes = wimpl->writes;
+    int i = writes->next;
+    if (writes->busy[i])
+        return BUSY;
+    writes->next = (i + 1) % BLEWriteRingWin::SIZE;
+    try {
+        auto &buffer = writes->buffers[i];
+        if (!buffer || buffer.Capacity() < size)
+            buffer = winrt::Windows::Storage::Streams::Buffer(size < 512 ? 512 : size);
+        memcpy(buffer.data(), buf, size);
+        buffer.Length(size);
+        writes->busy[i] = true;
+        wimpl->characteristic[(int) characteristicIdx].WriteValueWithResultAsync(buffer, withResponse
+            ? winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattWriteOption::WriteWithResponse
+            : winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattWriteOption::WriteWithoutResponse)
+            .Completed([this, writes, i](auto &&op, auto &&status) {
+                int r = 0;
+                try {
+                    if (status != winrt::Windows::Foundation::AsyncStatus::Completed)
+                        r = -5;
+                    else if (op.GetResults().Status() != winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCommunicationStatus::Success)
+                        r = - (int) op.GetResults().Status();
+                } catch (winrt::hresult_error const &ex) {
+                    r = -5;
+                }
+                if (r) {
+                    // first error is reported, the operation falls back on it
+                    int none = 0;
+                    writes->error.compare_exchange_strong(none, r);
+                }
+                writes->busy[i] = false;
+                // wakes the operation waiting for a free buffer or for the response to the failed write
+                anyNotification()->notify();
+            });
+    } catch (winrt::hresult_error const &ex) {
+        writes->busy[i] = false;
+        return -5;
+    }
+    return size;
+}
@@ -8,18 +8,60 @@
 #include <winrt/windows.devices.bluetooth.advertisement.h>
 #include <winrt/windows.devices.bluetooth.genericattributeprofile.h>
 #include <winrt/windows.storage.streams.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <vector>
 
 #include "ble-helper.h"
 #include "esl-string-helper-win.h"
 
+/**
+ * Buffers of the writes started by startWrite(): each write in flight keeps its own buffer until it completes
+ * on the thread pool. Shared with the completion handlers, the ring outlives the session.
+ */
+class BLEWriteRingWin {
+public:
+    static const int SIZE = 32;
+    std::vector<winrt::Windows::Storage::Streams::Buffer> buffers;
+    /// write of the buffer is not completed yet
+    std::atomic<bool> busy[SIZE];
+    /// buffer to use next, driver thread only
+    int next;
+    /// first error of the writes completed, taken by takeWriteError()
+    std::atomic<int> error;
+    BLEWriteRingWin();
+};
+
 class BLEDeviceImplWin : public BLEDeviceImpl {
 public:
     winrt::Windows::Devices::Bluetooth::BluetoothLEDevice dev;
     winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattDeviceService service;
     winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCharacteristic characteristic[2];
+    /// reused by write() and writeWithoutResponse(), each write completes before the next one
+    winrt::Windows::Storage::Streams::Buffer writeBuffer;
+    std::shared_ptr<BLEWriteRingWin> writes;
     BLEDeviceImplWin();
 };
 
+/**
+ * open() in progress: each WinRT call is started by the Completed handler of the previous one on the thread pool.
+ * Shared with the handlers, the state outlives pollOpen() giving up on timeout; the device not taken is released
+ * with it.
+ */
+class BLEOpeningWin {
+public:
+    std::mutex mutex;
+    /// BLEDiscoverer::PENDING until the chain finishes or pollOpen() gives up, then 0 or error
+    int result;
+    BLEDeviceImplWin *impl;
+    /// call in progress, cancelled on timeout
+    winrt::Windows::Foundation::IAsyncInfo call;
+    std::chrono::steady_clock::time_point deadline;
+    BLEOpeningWin();
+    ~BLEOpeningWin();
+};
+
 void setUUID(
     winrt::guid &uuid,
     void *buffer,
@@ -31,6 +73,9 @@ private:
     winrt::Windows::Devices::Bluetooth::Advertisement::BluetoothLEAdvertisementWatcher advWatcher;
     winrt::event_token discoveryToken;
     winrt::event_token stoppedDiscoveryToken;
+    std::mutex mutexOpenings;
+    /// open() in progress by device address
+    std::map<uint64_t, std::shared_ptr<BLEOpeningWin>> openings;
 
     std::string getDeviceName(winrt::Windows::Devices::Bluetooth::BluetoothLEDevice *device);
     std::string getDeviceName(uint64_t addr);
@@ -43,9 +88,22 @@ private:
         const winrt::Windows::Devices::Enumeration::DevicePairingRequestedEventArgs &eventArgs
     );
 
-    std::mutex mutexRead;
-    std::condition_variable cvRead;
+    int writeValue(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size,
+        winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattWriteOption option);
+
+    void track(const std::shared_ptr<BLEOpeningWin> &opening, const winrt::Windows::Foundation::IAsyncInfo &call);
+    bool proceed(const std::shared_ptr<BLEOpeningWin> &opening, winrt::Windows::Foundation::AsyncStatus status);
+    void opened(const std::shared_ptr<BLEOpeningWin> &opening, int result);
+    void giveUp(const std::shared_ptr<BLEOpeningWin> &opening);
+    void dropOpening(uint64_t addr);
+    void openSession(const std::shared_ptr<BLEOpeningWin> &opening, DiscoveredDevice *device);
+    void openService(const std::shared_ptr<BLEOpeningWin> &opening);
+    void openCharacteristic(const std::shared_ptr<BLEOpeningWin> &opening, int index);
+    void subscribe(const std::shared_ptr<BLEOpeningWin> &opening);
 public:
+    /// wait for the connection and the GATT service discovery
+    int connectTimeoutMs;
+
     BLEHelper();
     BLEHelper(OnDiscover *onDiscover);
     BLEHelper(OnDiscover *onDiscover, void *discoverExtra);
@@ -57,6 +115,13 @@ public:
     int close(DiscoveredDevice*) override;
     int read(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size, int milliseconds = 2000) override;
     int write(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size) override;
+    int writeWithoutResponse(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size) override;
+    int startWrite(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size,
+        bool withResponse = true) override;
+    int startOpen(DiscoveredDevice *device) override;
+    int pollOpen(DiscoveredDevice *device, std::chrono::steady_clock::time_point &wakeAt) override;
+    int startClose(DiscoveredDevice *device) override;
+    int takeWriteError(const DiscoveredDevice *device) override;
     int pair(const DiscoveredDevice *device) override;
     int unpair(const DiscoveredDevice *device) override;
 };
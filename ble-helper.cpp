@@ -1,80 +1,272 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <thread>
 #include "ble-helper.h"
 #include "image2srgb8.h"
+#include "send-operation.h"
 
 SendingState::SendingState()
-    : buffer(nullptr), size(0), blockSize(244), offset(0), stepRetryCount(3), stepTryCount(0)
+    : hash(0), size(0), blockSize(244), offset(0), compressed(false)
 {
 
 }
 
-SendingState::SendingState(
-    const SendingState &state
+DiscoveredDevice::DiscoveredDevice()
+    : addr(0), dt(std::chrono::system_clock::now()), rssi(0), deviceState(DS_IDLE),
+    impl(nullptr), rssiSmoothed(0), advIntervalMs(0), advCount(0), pins(0)
+{
+
+}
+
+DiscoveredDevice::DiscoveredDevice(
+    uint64_t aAddr,
+    int16_t aRssi,
+    const NEMR5053ManufacturerSpecificData &aMetadata,
+    const std::string &aName
 )
-    : buffer(state.buffer), size(state.size), blockSize(state.blockSize), offset(state.offset),
-    stepRetryCount(state.stepRetryCount), stepTryCount(state.stepRetryCount)
+    : addr(aAddr), dt(std::chrono::system_clock::now()), rssi(aRssi), metadata(aMetadata), name(aName), deviceState(DS_IDLE),
+    impl(nullptr), rssiSmoothed(aRssi), advIntervalMs(0), advCount(1), pins(0)
 {
 
 }
 
-SendingState::~SendingState()
+DiscoveredDevice::~DiscoveredDevice()
 {
-    if (buffer)
-        delete buffer;
+    if (impl) {
+        delete impl;
+        impl = nullptr;
+    }
+}
+
+// weight of the new sample in smoothed values, as TCP smooths round trip time
+static const float SMOOTHING = 1.0f / 8;
+
+/**
+ * Apply repeated advertisement: take last RSSI, time, metadata and name, update smoothed RSSI and interval
+ * @param advertised device as advertised now
+ */
+void DiscoveredDevice::update(
+    const DiscoveredDevice &advertised
+) {
+    float interval = (float) std::chrono::duration_cast<std::chrono::microseconds>(advertised.dt - dt).count() / 1000.0f;
+    if (interval < 0)
+        interval = 0;
+    advIntervalMs = advIntervalMs > 0 ? advIntervalMs + SMOOTHING * (interval - advIntervalMs) : interval;
+    rssiSmoothed += SMOOTHING * ((float) advertised.rssi - rssiSmoothed);
+    rssi = advertised.rssi;
+    dt = advertised.dt;
+    metadata = advertised.metadata;
+    // scan responses without the name do not clear it
+    if (!advertised.name.empty())
+        name = advertised.name;
+    advCount++;
 }
 
-ReceivedData::ReceivedData()
-    : size(0), data(nullptr)
+/**
+ * @return advertisements per second, 0 if advertised once
+ */
+float DiscoveredDevice::advRate() const
 {
+    return advIntervalMs > 0 ? 1000.0f / advIntervalMs : 0;
 }
 
-ReceivedData::ReceivedData(
-    void *aData,
-    uint32_t aSize
-)
-    : size(aSize), data(aData)
+// initial table of 64 slots
+static const int MIN_SLOT_BITS = 6;
+// evicted devices kept for reuse
+static const size_t MAX_SPARE = 64;
+
+DeviceRegistry::DeviceRegistry()
+    : slots((size_t) 1 << MIN_SLOT_BITS, 0), slotBits(MIN_SLOT_BITS), evictedExpired(0), evictedOverCapacity(0)
 {
 }
 
-ReceivedData::ReceivedData(
-    const ReceivedData &value
-)
-    : size(value.size), data(value.data)
+/**
+ * Fibonacci hashing: MAC addresses of one vendor differ in low bytes only
+ */
+size_t DeviceRegistry::home(
+    uint64_t addr
+) const {
+    return (size_t) ((addr * 0x9E3779B97F4A7C15ull) >> (64 - slotBits));
+}
+
+void DeviceRegistry::rehash(
+    int bits
+) {
+    slotBits = bits;
+    slots.assign((size_t) 1 << bits, 0);
+    size_t mask = slots.size() - 1;
+    for (size_t i = 0; i < items.size(); i++) {
+        size_t s = home(items[i]->addr);
+        while (slots[s])
+            s = (s + 1) & mask;
+        slots[s] = (uint32_t) (i + 1);
+    }
+}
+
+/**
+ * @param addr MAC address
+ * @return device, null if not discovered
+ */
+DiscoveredDevice *DeviceRegistry::find(
+    uint64_t addr
+) {
+    size_t mask = slots.size() - 1;
+    for (size_t s = home(addr); slots[s]; s = (s + 1) & mask) {
+        DiscoveredDevice *d = items[slots[s] - 1].get();
+        if (d->addr == addr)
+            return d;
+    }
+    return nullptr;
+}
+
+const DiscoveredDevice *DeviceRegistry::find(
+    uint64_t addr
+) const {
+    return const_cast<DeviceRegistry *>(this)->find(addr);
+}
+
+/**
+ * Add device if its address is not registered yet
+ * @param device device to copy
+ * @return registered device and true if it is just added
+ */
+std::pair<DiscoveredDevice *, bool> DeviceRegistry::insert(
+    const DiscoveredDevice &device
+) {
+    size_t mask = slots.size() - 1;
+    size_t s = home(device.addr);
+    for (; slots[s]; s = (s + 1) & mask) {
+        DiscoveredDevice *d = items[slots[s] - 1].get();
+        if (d->addr == device.addr)
+            return { d, false };
+    }
+    if (spare.empty())
+        items.emplace_back(new DiscoveredDevice(device));
+    else {
+        // name keeps its buffer
+        *spare.back() = device;
+        items.push_back(std::move(spare.back()));
+        spare.pop_back();
+    }
+    slots[s] = (uint32_t) items.size();
+    // keep load factor below 1/2, probe sequences stay short
+    if (items.size() * 2 > slots.size())
+        rehash(slotBits + 1);
+    return { items.back().get(), true };
+}
+
+/**
+ * Device is not in session and nobody holds its pointer
+ */
+bool DeviceRegistry::evictable(
+    const DiscoveredDevice &device
+) {
+    return device.pins == 0 && device.deviceState == DS_IDLE && device.impl == nullptr;
+}
+
+/**
+ * Remove idle devices not advertised since olderThan, then the oldest idle devices above capacity.
+ * Order of the rest is kept. O(n), call it from a timer, not on each advertisement.
+ * @param olderThan last advertisement time limit, DISCOVERED_TIME::min() keeps all
+ * @param capacity devices to keep, 0- unlimited
+ * @return devices evicted
+ */
+size_t DeviceRegistry::evict(
+    DISCOVERED_TIME olderThan,
+    size_t capacity
+) {
+    std::vector<bool> evicted(items.size(), false);
+    size_t count = 0;
+    std::vector<std::pair<DISCOVERED_TIME, size_t>> idle;
+    for (size_t i = 0; i < items.size(); i++) {
+        if (!evictable(*items[i]))
+            continue;
+        if (items[i]->dt < olderThan) {
+            evicted[i] = true;
+            count++;
+        } else
+            idle.emplace_back(items[i]->dt, i);
+    }
+    evictedExpired += count;
+    if (capacity && items.size() - count > capacity) {
+        size_t over = std::min(items.size() - count - capacity, idle.size());
+        std::nth_element(idle.begin(), idle.begin() + over, idle.end());
+        for (size_t i = 0; i < over; i++)
+            evicted[idle[i].second] = true;
+        evictedOverCapacity += over;
+        count += over;
+    }
+    if (!count)
+        return 0;
+    size_t n = 0;
+    for (size_t i = 0; i < items.size(); i++) {
+        if (!evicted[i])
+            items[n++] = std::move(items[i]);
+        else if (spare.size() < MAX_SPARE)
+            spare.push_back(std::move(items[i]));
+    }
+    items.resize(n);
+    // shrink the table with the registry
+    int bits = MIN_SLOT_BITS;
+    while (items.size() * 2 > ((size_t) 1 << bits))
+        bits++;
+    rehash(bits);
+    return count;
+}
+
+void DeviceRegistry::clear()
 {
+    items.clear();
+    spare.clear();
+    rehash(MIN_SLOT_BITS);
 }
 
-ReceivedData::~ReceivedData() {
+size_t DeviceRegistry::size() const
+{
+    return items.size();
 }
 
-DiscoveredDevice::DiscoveredDevice()
-    : addr(0), dt(std::chrono::system_clock::now()), rssi(0), deviceState(DS_IDLE),
-    impl(nullptr)
+bool DeviceRegistry::empty() const
 {
+    return items.empty();
+}
 
+DiscoveredDevice &DeviceRegistry::operator[](
+    size_t index
+) {
+    return *items[index];
 }
 
-DiscoveredDevice::DiscoveredDevice(
-    uint64_t aAddr,
-    int16_t aRssi,
-    const NEMR5053ManufacturerSpecificData &aMetadata,
-    const std::string &aName
-)
-    : addr(aAddr), dt(std::chrono::system_clock::now()), rssi(aRssi), metadata(aMetadata), name(aName), deviceState(DS_IDLE),
-    impl(nullptr)
+const DiscoveredDevice &DeviceRegistry::operator[](
+    size_t index
+) const {
+    return *items[index];
+}
+
+DeviceRegistry::iterator DeviceRegistry::begin()
 {
+    return iterator(items.begin());
+}
 
+DeviceRegistry::iterator DeviceRegistry::end()
+{
+    return iterator(items.end());
 }
 
-DiscoveredDevice::~DiscoveredDevice()
+DeviceRegistry::const_iterator DeviceRegistry::begin() const
 {
-    if (impl) {
-        delete impl;
-        impl = nullptr;
-    }
+    return const_iterator(items.begin());
+}
+
+DeviceRegistry::const_iterator DeviceRegistry::end() const
+{
+    return const_iterator(items.end());
 }
 
 BLEDiscoverer::BLEDiscoverer()
-    : discoveryOn(false), onDiscover(nullptr)
+    : advConsumerStopRequest(false), discoveryOn(false), deviceTtlSeconds(0), maxDevices(0), evictionIntervalMs(1000),
+    onDiscover(nullptr), refreshWaitMs(99000)
 {
 
 }
@@ -82,7 +274,8 @@ BLEDiscoverer::BLEDiscoverer()
 BLEDiscoverer::BLEDiscoverer(
     OnDiscover *aOnDiscover
 )
-    : discoveryOn(false), onDiscover(aOnDiscover)
+    : advConsumerStopRequest(false), discoveryOn(false), deviceTtlSeconds(0), maxDevices(0), evictionIntervalMs(1000),
+    onDiscover(aOnDiscover), refreshWaitMs(99000)
 {
     if (aOnDiscover) {
         aOnDiscover->discoverer = this;
@@ -94,7 +287,8 @@ BLEDiscoverer::BLEDiscoverer(
     OnDiscover *aOnDiscover,
     void *aDiscoverExtra
 )
-    : discoveryOn(false), onDiscover(aOnDiscover)
+    : advConsumerStopRequest(false), discoveryOn(false), deviceTtlSeconds(0), maxDevices(0), evictionIntervalMs(1000),
+    onDiscover(aOnDiscover), refreshWaitMs(99000)
 {
     if (aOnDiscover) {
         aOnDiscover->discoverer = this;
@@ -102,6 +296,166 @@ BLEDiscoverer::BLEDiscoverer(
     }
 }
 
+/**
+ * Derived class must stop discovery in its destructor, the consumer thread calls its methods from callbacks
+ */
+BLEDiscoverer::~BLEDiscoverer()
+{
+    stopAdvertisementConsumer();
+}
+
+/**
+ * Queue advertisement from the radio callback thread, never blocks
+ * @return false if the ring is full and the advertisement is dropped
+ */
+bool BLEDiscoverer::pushAdvertisement(
+    uint64_t addr,
+    int16_t rssi,
+    const NEMR5053ManufacturerSpecificData &metadata,
+    const char *name,
+    size_t nameSize
+) {
+    if (!advertisements.push(AdvertisementRecord(addr, rssi, metadata, name, nameSize)))
+        return false;
+    // without the lock: a missed wake up costs the consumer one poll interval
+    cvAdvConsumer.notify_one();
+    return true;
+}
+
+/**
+ * Add new device or update known one and call OnDiscover. Callbacks are called without mutexDiscoveryState held.
+ */
+void BLEDiscoverer::applyAdvertisement(
+    const AdvertisementRecord &record
+) {
+    NEMR5053ManufacturerSpecificData metadata;
+    metadata.val = record.metadata;
+    DiscoveredDevice dd = DiscoveredDevice(record.addr, record.rssi, metadata, record.nameString());
+    dd.dt = record.dt;
+    std::unique_lock<std::mutex> lck(mutexDiscoveryState);
+    auto r = devices.insert(dd);
+    if (!r.second)
+        r.first->update(dd);
+    lck.unlock();
+    cvDiscoveryState.notify_all();
+    if (!onDiscover)
+        return;
+    // only this thread adds, updates and evicts devices, the device stays as is until the callback returns
+    if (r.second)
+        onDiscover->discoverFirstTime(*r.first);
+    else
+        onDiscover->discoverNextTime(*r.first);
+}
+
+/**
+ * Evict stale devices and devices above maxDevices each evictionIntervalMs
+ */
+void BLEDiscoverer::evictDevices()
+{
+    if (deviceTtlSeconds <= 0 && maxDevices == 0)
+        return;
+    auto now = std::chrono::steady_clock::now();
+    if (now < nextEvictionAt)
+        return;
+    nextEvictionAt = now + std::chrono::milliseconds(evictionIntervalMs);
+    DISCOVERED_TIME olderThan = deviceTtlSeconds > 0
+        ? std::chrono::system_clock::now() - std::chrono::seconds(deviceTtlSeconds) : DISCOVERED_TIME::min();
+    std::unique_lock<std::mutex> lck(mutexDiscoveryState);
+    devices.evict(olderThan, maxDevices);
+}
+
+void BLEDiscoverer::runAdvertisementConsumer()
+{
+    AdvertisementRecord record;
+    while (true) {
+        while (advertisements.pop(record))
+            applyAdvertisement(record);
+        evictDevices();
+        if (advConsumerStopRequest)
+            break;
+        std::unique_lock<std::mutex> lck(mutexAdvConsumer);
+        cvAdvConsumer.wait_for(lck, std::chrono::milliseconds(10), [this] {
+            return advConsumerStopRequest || !advertisements.empty();
+        });
+    }
+}
+
+void BLEDiscoverer::startAdvertisementConsumer()
+{
+    if (advConsumerThread.joinable())
+        return;
+    advConsumerStopRequest = false;
+    advConsumerThread = std::thread(&BLEDiscoverer::runAdvertisementConsumer, this);
+}
+
+/**
+ * Apply queued advertisements and stop the consumer thread.
+ * Called from a callback, the thread is detached and stops after the callback returns.
+ */
+void BLEDiscoverer::stopAdvertisementConsumer()
+{
+    {
+        std::unique_lock<std::mutex> lck(mutexAdvConsumer);
+        advConsumerStopRequest = true;
+    }
+    cvAdvConsumer.notify_all();
+    if (advConsumerThread.joinable()) {
+        if (advConsumerThread.get_id() == std::this_thread::get_id())
+            advConsumerThread.detach();
+        else
+            advConsumerThread.join();
+    }
+}
+
+/**
+ * Queue of the device notifications, created on the first use
+ * @param addr device address
+ */
+NotificationQueue *BLEDiscoverer::notificationQueue(
+    uint64_t addr
+) {
+    std::unique_lock<std::mutex> lck(mutexNotifications);
+    auto &q = notifications[addr];
+    if (!q) {
+        q.reset(new NotificationQueue());
+        q->setSignal(&notificationSignal);
+    }
+    return q.get();
+}
+
+/**
+ * Wait until the device notification can be read without waiting
+ * @param device device
+ * @param until timeout
+ * @return false if timed out
+ */
+bool BLEDiscoverer::waitNotification(
+    const DiscoveredDevice *device,
+    std::chrono::steady_clock::time_point until
+) {
+    return notificationQueue(device->addr)->wait(until);
+}
+
+/**
+ * @param device device
+ * @param retValue returns delivery time of the first notification not read
+ * @return false if there are no notifications
+ */
+bool BLEDiscoverer::nextNotificationAt(
+    const DiscoveredDevice *device,
+    std::chrono::steady_clock::time_point &retValue
+) {
+    return notificationQueue(device->addr)->nextDeliverAt(retValue);
+}
+
+/**
+ * @return signal notified on the notification of any device
+ */
+NotificationSignal *BLEDiscoverer::anyNotification()
+{
+    return &notificationSignal;
+}
+
 bool BLEDiscoverer::waitDiscover(
     const char *addressString,
     int seconds
@@ -109,17 +463,9 @@ bool BLEDiscoverer::waitDiscover(
     // wait
     std::unique_lock<std::mutex> lock(mutexDiscoveryState);
     uint64_t a = string2macAddress(addressString);
-    cvDiscoveryState.wait_for(lock, std::chrono::seconds(seconds), [this, a] {
-        bool found = false;
-        for (auto &d : devices) {
-            if (d.addr == a) {
-                found = true;
-                break;
-            }
-        }
-        return found;
+    return cvDiscoveryState.wait_for(lock, std::chrono::seconds(seconds), [this, a] {
+        return devices.find(a) != nullptr;
     });
-    return false;
 }
 
 int BLEDiscoverer::waitDiscover(
@@ -134,60 +480,318 @@ int BLEDiscoverer::waitDiscover(
     return (int) devices.size();
 }
 
-bool BLEDiscoverer::requestGetBlockSize(
+/**
+ * @param r startWrite() result
+ * @param size bytes to write
+ * @return 0- written, BUSY- no write buffer is free, -1 if error
+ */
+static int writeResult(
+    int r,
+    uint32_t size
+) {
+    if (r == BLEDiscoverer::BUSY)
+        return r;
+    return r == (int) size ? 0 : -1;
+}
+
+/**
+ * Request block size
+ * @param device device
+ * @return 0- request sent, BUSY- write it again later, -1 if error
+ */
+int BLEDiscoverer::requestGetBlockSize(
     const DiscoveredDevice *device
 ) {
     uint8_t buffer[1] { 1 };
-    return write(device, CI_REQUEST, buffer, 1) == 1;
+    return writeResult(startWrite(device, CI_REQUEST, buffer, 1), 1);
 }
 
-bool BLEDiscoverer::requestSetScreenSize(
+/**
+ * Request to set image size
+ * @param device device
+ * @param value size in bytes to be transferred
+ * @param compressed image is compressed by compressPlanes()
+ * @return 0- request sent, BUSY- write it again later, -1 if error
+ */
+int BLEDiscoverer::requestSetScreenSize(
     const DiscoveredDevice *device,
-    uint32_t value
+    uint32_t value,
+    bool compressed
 ) {
     uint8_t buffer[8] {2, 0, 0, 0, 0, 0, 0, 0};
 #if IS_BIG_ENDIAN
     value = SWAP_BYTES_4(value);
 #endif
     memmove(buffer + 1, &value, 4);
-    return write(device, CI_REQUEST, buffer, sizeof(buffer)) == sizeof(buffer);
+    if (compressed)
+        buffer[5] = 1;
+    return writeResult(startWrite(device, CI_REQUEST, buffer, sizeof(buffer)), sizeof(buffer));
 }
 
-bool BLEDiscoverer::requestStartTransfer(
+int BLEDiscoverer::requestStartTransfer(
     const DiscoveredDevice *device
 ) {
     uint8_t buffer[1] { 3 };
-    return write(device, CI_REQUEST, buffer, 1) == 1;
+    return writeResult(startWrite(device, CI_REQUEST, buffer, 1), 1);
 }
 
-bool BLEDiscoverer::requestCancelWrite(
+int BLEDiscoverer::requestCancelWrite(
     const DiscoveredDevice *device
 ) {
     uint8_t buffer[1] { 4 };
-    return write(device, CI_REQUEST, buffer, 1) == 1;
+    return writeResult(startWrite(device, CI_REQUEST, buffer, 1), 1);
 }
 
-bool BLEDiscoverer::requestWriteChunk(
+int BLEDiscoverer::requestWriteChunk(
     const DiscoveredDevice *device,
     uint32_t chunkNum,
     void* buf,
     uint32_t ofs,
-    uint8_t size
+    uint8_t size,
+    bool withResponse
 ) {
-    void* buffer = calloc(size + 4, 1);
-    if (!buffer)
-        return false;   // out of memory
+    // chunk is up to 255 bytes, the frame fits on the stack: no allocation per chunk
+    uint8_t frame[4 + 255];
 #if IS_BIG_ENDIAN
-    uint32_t wchunkNum = SWAP_BYTES_4(ofs);
+    uint32_t wchunkNum = SWAP_BYTES_4(chunkNum);
 #else
     uint32_t wchunkNum = chunkNum;
 #endif
-    memmove(buffer, &wchunkNum, 4);
-    auto *p = (uint8_t *) buf;
-    memmove((uint8_t *) buffer + 4, p + ofs, size);
-    int c = write(device, CI_IMAGE, buffer, size + 4);
-    free(buffer);
-    return c == size + 4;
+    memcpy(frame, &wchunkNum, 4);
+    memcpy(frame + 4, (const uint8_t *) buf + ofs, size);
+    return writeResult(startWrite(device, CI_IMAGE, frame, size + 4, withResponse), size + 4);
+}
+
+/**
+ * Write without waiting for the acknowledge. Backend can override it to send several packets per connection interval.
+ * Default implementation writes with response.
+ */
+int BLEDiscoverer::writeWithoutResponse(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size
+) {
+    return write(device, characteristic, buffer, size);
+}
+
+/**
+ * Start write, return without waiting for the acknowledge. Requests and chunks are written by startWrite(),
+ * the response notification tells they are delivered.
+ * Default implementation blocks as write() or writeWithoutResponse() does; backend copies the buffer if it overrides it.
+ * @param device device
+ * @param characteristic characteristic
+ * @param buffer data, may be reused after the call
+ * @param size data size
+ * @param withResponse link layer acknowledges the write
+ * @return size, BUSY- no write buffer is free, nothing is written, < 0 if error
+ */
+int BLEDiscoverer::startWrite(
+    const DiscoveredDevice *device,
+    CharacteristicIndex characteristic,
+    void *buffer,
+    uint32_t size,
+    bool withResponse
+) {
+    return withResponse ? write(device, characteristic, buffer, size) : writeWithoutResponse(device, characteristic, buffer, size);
+}
+
+/**
+ * Start open() without waiting for the connection. Backend overrides it with pollOpen() so one thread can connect
+ * many devices, it notifies anyNotification() when the connection progresses.
+ * Default implementation blocks as open() does.
+ * @param device device
+ * @return 0- open, PENDING- call pollOpen(), < 0 if error
+ */
+int BLEDiscoverer::startOpen(
+    DiscoveredDevice *device
+) {
+    return open(device);
+}
+
+/**
+ * Continue open() started by startOpen() without waiting
+ * @param device device
+ * @param wakeAt earlier time to poll again if anyNotification() is not notified before
+ * @return 0- open, PENDING- not connected yet, < 0 if error
+ */
+int BLEDiscoverer::pollOpen(
+    DiscoveredDevice *,
+    std::chrono::steady_clock::time_point &
+) {
+    return 0;
+}
+
+/**
+ * Start close() without waiting for the disconnection, see startOpen()
+ * @param device device
+ * @return 0- closed, PENDING- call pollClose(), < 0 if error
+ */
+int BLEDiscoverer::startClose(
+    DiscoveredDevice *device
+) {
+    return close(device);
+}
+
+/**
+ * Continue close() started by startClose() without waiting
+ * @param device device
+ * @param wakeAt earlier time to poll again if anyNotification() is not notified before
+ * @return 0- closed, PENDING- not closed yet, < 0 if error
+ */
+int BLEDiscoverer::pollClose(
+    DiscoveredDevice *,
+    std::chrono::steady_clock::time_point &
+) {
+    return 0;
+}
+
+/**
+ * Take the error of a write started by startWrite() and failed after it returned.
+ * Backend completing writes on its own threads keeps the error until the operation writing to the device takes it.
+ * Default implementation completes writes in startWrite() and has none.
+ * @param device device
+ * @return 0- none, < 0 error, cleared
+ */
+int BLEDiscoverer::takeWriteError(
+    const DiscoveredDevice *
+) {
+    return 0;
+}
+
+/**
+ * Wait for startOpen() or startClose() to finish, for backends implementing open() and close() over them
+ * @param device device
+ * @param started result of startOpen() or startClose()
+ * @param opening poll pollOpen(), otherwise pollClose()
+ * @return 0- success, < 0 if error
+ */
+int BLEDiscoverer::waitAsync(
+    DiscoveredDevice *device,
+    int started,
+    bool opening
+) {
+    int r = started;
+    while (r == PENDING) {
+        uint64_t seen = notificationSignal.current();
+        auto wakeAt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        r = opening ? pollOpen(device, wakeAt) : pollClose(device, wakeAt);
+        if (r == PENDING)
+            notificationSignal.wait(seen, wakeAt);
+    }
+    return r;
+}
+
+/**
+ * Read response to the request, skipping late responses to the previous requests
+ * @param device device
+ * @param opcode response opcode
+ * @param buffer receives response
+ * @param size buffer size
+ * @param waitMs timeout
+ * @return response size, -1 if timed out
+ */
+int BLEDiscoverer::readResponse(
+    const DiscoveredDevice *device,
+    uint8_t opcode,
+    void *buffer,
+    uint32_t size,
+    int waitMs
+) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(waitMs);
+    while (true) {
+        int ms = (int) std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        auto r = read(device, CI_REQUEST, buffer, size, ms > 0 ? ms : 0);
+        if (r < 1 || *(uint8_t *) buffer == opcode)
+            return r;
+    }
+}
+
+/**
+ * Response timeout estimated by round-trip times of the device or of its type
+ * @param device device
+ * @param waitMs upper bound, used until the device type is measured
+ * @return timeout, milliseconds
+ */
+int BLEDiscoverer::responseTimeout(
+    const DiscoveredDevice *device,
+    int waitMs
+) {
+    return responseTimeout(device->addr, SessionParamsCache::key(deviceMetadata(device)), waitMs);
+}
+
+/**
+ * Response timeout estimated by round-trip times of the device or of its type
+ * @param addr device address
+ * @param type SessionParamsCache::key() of the device metadata
+ * @param waitMs upper bound, used until the device type is measured
+ * @return timeout, milliseconds
+ */
+int BLEDiscoverer::responseTimeout(
+    uint64_t addr,
+    uint32_t type,
+    int waitMs
+) {
+    return rtts.timeout(addr, type, waitMs);
+}
+
+/**
+ * Count round-trip time of the request or the timeout
+ * @param device device
+ * @param sentAt time the request was written
+ * @param responded false if the request timed out
+ * @param receivedAt time the response was received, default- now
+ */
+void BLEDiscoverer::updateRtt(
+    const DiscoveredDevice *device,
+    std::chrono::steady_clock::time_point sentAt,
+    bool responded,
+    std::chrono::steady_clock::time_point receivedAt
+) {
+    if (!responded) {
+        rtts.timedOut(device->addr);
+        return;
+    }
+    updateRtt(device->addr, SessionParamsCache::key(deviceMetadata(device)), sentAt, responded, receivedAt);
+}
+
+/**
+ * Count round-trip time of the request or the timeout
+ * @param addr device address
+ * @param type SessionParamsCache::key() of the device metadata
+ * @param sentAt time the request was written
+ * @param responded false if the request timed out
+ * @param receivedAt time the response was received, default- now
+ */
+void BLEDiscoverer::updateRtt(
+    uint64_t addr,
+    uint32_t type,
+    std::chrono::steady_clock::time_point sentAt,
+    bool responded,
+    std::chrono::steady_clock::time_point receivedAt
+) {
+    if (!responded) {
+        rtts.timedOut(addr);
+        return;
+    }
+    if (receivedAt == std::chrono::steady_clock::time_point())
+        receivedAt = std::chrono::steady_clock::now();
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(receivedAt - sentAt).count();
+    rtts.add(addr, type, (float) us / 1000);
+}
+
+/**
+ * Sleep before the retry, jittered exponential backoff
+ * @param device device
+ * @param attempt 1- first retry
+ */
+void BLEDiscoverer::waitRetry(
+    const DiscoveredDevice *device,
+    int attempt
+) {
+    int ms = rtts.retryDelay(device->addr, SessionParamsCache::key(deviceMetadata(device)), attempt);
+    if (ms > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
 }
 
 uint16_t BLEDiscoverer::getBlockSize(
@@ -195,15 +799,15 @@ uint16_t BLEDiscoverer::getBlockSize(
     int waitMs
 )
 {
-    if (!requestGetBlockSize(device))
-        return -1;
+    auto sentAt = std::chrono::steady_clock::now();
+    if (requestGetBlockSize(device) < 0)
+        return 0;
     uint8_t buffer[3];
     // read response
-    auto r = read(device, CI_REQUEST, buffer, 3, waitMs);
+    auto r = readResponse(device, 1, buffer, 3, responseTimeout(device, waitMs));
+    updateRtt(device, sentAt, r > 0);
     if (r < 3)
         return 0;
-    if (buffer[0] != 1)
-        return 0;
 #if IS_BIG_ENDIAN
     return SWAP_BYTES_2(*((uint16_t*) (buffer + 1)));
 #else
@@ -214,43 +818,84 @@ uint16_t BLEDiscoverer::getBlockSize(
 bool BLEDiscoverer::setScreenSize(
     const DiscoveredDevice *device,
     uint32_t value,
-    int waitMs
+    int waitMs,
+    bool compressed
 )
 {
-    if (!requestSetScreenSize(device, value))
+    auto sentAt = std::chrono::steady_clock::now();
+    if (requestSetScreenSize(device, value, compressed) < 0)
         return false;
+    bool r = readScreenSizeResponse(device, waitMs);
+    updateRtt(device, sentAt, r);
+    return r;
+}
+
+/**
+ * Read response to the image size request (opcode 2)
+ * @return true if the size is accepted
+ */
+bool BLEDiscoverer::readScreenSizeResponse(
+    const DiscoveredDevice *device,
+    int waitMs
+)
+{
     uint8_t buffer[2];
     // read response
-    auto r = read(device, CI_REQUEST, buffer, 2, waitMs);
+    auto r = readResponse(device, 2, buffer, 2, responseTimeout(device, waitMs));
     if (r < 2)
         return false;
-    if (buffer[0] != 2)
-        return false;
     return buffer[1] == 0;
 }
 
+/**
+ * Start transfer
+ * @param device device
+ * @param waitMs response timeout
+ * @param retChunk returns chunk the label requests first, not 0 if it resumes interrupted transfer
+ * @return true if transfer started
+ */
 bool BLEDiscoverer::startTransfer(
     const DiscoveredDevice *device,
-    int waitMs
+    int waitMs,
+    uint32_t *retChunk
 )
 {
-    if (!requestStartTransfer(device))
+    auto sentAt = std::chrono::steady_clock::now();
+    if (requestStartTransfer(device) < 0)
         return false;
+    bool r = readStartTransferResponse(device, waitMs, retChunk);
+    updateRtt(device, sentAt, r);
+    return r;
+}
+
+/**
+ * Read response to the start transfer request (opcode 3)
+ * @param device device
+ * @param waitMs response timeout
+ * @param retChunk returns chunk the label requests first
+ * @return true if transfer started
+ */
+bool BLEDiscoverer::readStartTransferResponse(
+    const DiscoveredDevice *device,
+    int waitMs,
+    uint32_t *retChunk
+)
+{
     uint8_t buffer[6];
     // read response
-    auto r = read(device, CI_REQUEST, buffer, 6, waitMs);
+    auto r = readResponse(device, 5, buffer, 6, responseTimeout(device, waitMs));
     if (r < 2)
         return false;
-    if (buffer[0] != 5)
-        return false;
     uint8_t status = buffer[1];
+    uint32_t ofs = 0;
     if (r >= 6) {
-        uint32_t ofs;
         memmove(&ofs, buffer + 2, 4);
 #if IS_BIG_ENDIAN
         ofs = SWAP_BYTES_4(ofs);
 #endif
     }
+    if (retChunk)
+        *retChunk = ofs;
     return status == 0;
 }
 
@@ -259,36 +904,80 @@ bool BLEDiscoverer::cancelWrite(
     int waitMs
 )
 {
-    if (!requestCancelWrite(device))
+    auto sentAt = std::chrono::steady_clock::now();
+    if (requestCancelWrite(device) < 0)
         return false;
     uint8_t buffer[2];
     // read response
-    auto r = read(device, CI_REQUEST, buffer, 2, waitMs);
+    auto r = readResponse(device, 4, buffer, 2, responseTimeout(device, waitMs));
+    updateRtt(device, sentAt, r > 0);
     if (r != 2)
         return false;
-    if (buffer[0] != 4)
-        return false;
     return buffer[1] == 0;
 }
 
+/**
+ * Write chunk and read the chunk the device requests next
+ * @param device device
+ * @param chunkIdx chunk index
+ * @param buf image
+ * @param ofs chunk offset in the image
+ * @param size chunk size
+ * @param waitMs response timeout upper bound
+ * @param refresh chunk may be the last one, wait for the screen refresh (refreshWaitMs) too
+ * @return next chunk index, -8 if all chunks received, -1 if error
+ */
 int BLEDiscoverer::writeChunk(
     const DiscoveredDevice *device,
     uint32_t chunkIdx,
     void *buf,
     uint32_t ofs,
     uint8_t size,
-    int waitMs
+    int waitMs,
+    bool refresh
 ) {
-    if (!requestWriteChunk(device, chunkIdx, buf, ofs, size))
+    auto sentAt = std::chrono::steady_clock::now();
+    if (requestWriteChunk(device, chunkIdx, buf, ofs, size) < 0)
         return -1;
+    int timeout = responseTimeout(device, waitMs);
+    int r = readNextChunk(device, refresh ? refreshWaitMs + timeout : timeout);
+    // response to the last chunk includes the refresh time
+    if (r != -8)
+        updateRtt(device, sentAt, r >= 0);
+    return r;
+}
+
+/**
+ * Read chunk request (opcode 5) from the device
+ * @param device device
+ * @param waitMs timeout
+ * @return next chunk index, -8 if all chunks received, -1 if error
+ */
+int BLEDiscoverer::readNextChunk(
+    const DiscoveredDevice *device,
+    int waitMs
+) {
     uint8_t buffer[6];
     // read response
-    auto r = read(device, CI_REQUEST, buffer, 6, 99000 + waitMs);
-    if (r < 2)
+    auto r = read(device, CI_REQUEST, buffer, 6, waitMs);
+    return parseNextChunk(buffer, r);
+}
+
+/**
+ * Parse chunk request (opcode 5)
+ * @param buffer notification
+ * @param size notification size
+ * @return next chunk index, -8 if all chunks received, -1 if not a chunk request
+ */
+int BLEDiscoverer::parseNextChunk(
+    const uint8_t *buffer,
+    int size
+) {
+    if (size < 2)
         return -1;
     if (buffer[0] != 5)
         return -1;
-    if (r < 6)
+    if (size < 6)
         return 0;
     if (buffer[1] == 8)
         return -8; // all done
@@ -369,77 +1058,153 @@ int BLEDiscoverer::writeChunkI(
 }
 
 /**
- *
- * @param device
- * @param buffer
- * @param size
- * @param waitMs
+ * Get block size, set image size and start transfer.
+ * Block size known for the device type by sessionParams is not requested.
+ * @param device device
+ * @param size image size in bytes
+ * @param waitMs response timeout
+ * @param compressed image is compressed by compressPlanes()
+ * @param retBlockSize returns block size
+ * @param retChunk returns chunk the label requests first
+ * @return 0- success, -1- no block size, -2- image size not accepted, -3- transfer not started
+ */
+int BLEDiscoverer::beginTransfer(
+    const DiscoveredDevice *device,
+    uint32_t size,
+    int waitMs,
+    bool compressed,
+    uint16_t *retBlockSize,
+    uint32_t *retChunk
+) {
+    SendOperation op(this, device, nullptr, size, waitMs, 1, compressed);
+    op.handshakeOnly();
+    int r = op.runBlocking();
+    if (r == 0 && retBlockSize)
+        *retBlockSize = op.blockSize;
+    if (r == 0 && retChunk)
+        *retChunk = op.firstChunk;
+    return r;
+}
+
+/**
+ * Send image to the device. Transfer interrupted by the link loss is kept and resumed
+ * from the chunk the label requests when the same image is sent again.
+ * @param device device
+ * @param buffer image
+ * @param size image size in bytes
+ * @param waitMs response timeout
+ * @param window chunks in flight. 1- wait for response to each chunk
+ * @param compressed buffer is compressed by compressPlanes()
  * @return 0- success
  */
 int BLEDiscoverer::sendBuffer(
     const DiscoveredDevice *device,
     void *buffer,
     uint32_t size,
-    int waitMs
+    int waitMs,
+    uint8_t window,
+    bool compressed
 ) {
-    uint16_t blockSize = 0;
-    int stepTryCount = 3;
-    for (int i = 0; i < stepTryCount; i++) {
-        blockSize = getBlockSize(device, waitMs);
-        if (blockSize > 0)
-            break;
-    }
-    if (blockSize == 0)
-        return -1;
+    SendOperation op(this, device, buffer, size, waitMs, window, compressed);
+    return op.runBlocking();
+}
 
-    bool r;
-    for (int i = 0; i < stepTryCount; i++) {
-        r = setScreenSize(device, size, waitMs);
-        if (r)
-            break;
-    }
-    if (!r)
-        return -2;
+/**
+ * Send chunks one by one waiting for response to each chunk
+ * @param device device
+ * @param buffer image
+ * @param size image size in bytes
+ * @param blockSize block size returned by getBlockSize()
+ * @param waitMs response timeout
+ * @param firstChunk chunk to start from
+ * @param retNextChunk returns first chunk not acknowledged if the device does not respond
+ * @return 0- success, -4- device does not respond
+ */
+int BLEDiscoverer::sendChunks(
+    const DiscoveredDevice *device,
+    void *buffer,
+    uint32_t size,
+    uint16_t blockSize,
+    int waitMs,
+    uint32_t firstChunk,
+    uint32_t *retNextChunk
+) {
+    SendOperation op(this, device, buffer, size, waitMs, 1);
+    op.chunksOnly(blockSize, firstChunk);
+    int r = op.runBlocking();
+    if (r && retNextChunk)
+        *retNextChunk = op.nextChunk;
+    return r;
+}
 
-    for (int i = 0; i < stepTryCount; i++) {
-        r = startTransfer(device, waitMs);
-        if (r)
-            break;
-    }
-    if (!r)
-        return -3;
-
-    uint32_t chunkSize = blockSize - 4;
-    int chunksCount = (int) (size / chunkSize);
-    if (size % chunkSize)
-        chunksCount++;
-    int chunkNum = 0;
-    while (chunkNum >= 0) {
-        auto chunkOfs = chunkNum * chunkSize;
-        auto nextOfs = (chunkNum + 1) * chunkSize;
-        if (nextOfs > size)
-            nextOfs = size;
-        auto sz = nextOfs - chunkOfs;
-        for (int i = 0; i < stepTryCount; i++) {
-            chunkNum = writeChunk(device, chunkNum, buffer, chunkOfs, sz, waitMs);
-            if (chunkNum >= 0 || chunkNum == -8)
-                break;
-        }
-        if (!r)
-            return -4;
-    }
-    return 0;
+/**
+ * Send only chunks changed since the last image sent to the device. If there is no previous image,
+ * send whole image and keep it.
+ * Firmware must keep previous image and accept chunk index ahead of requested one. If firmware requests
+ * chunk before sent one, chunks are sent one by one from the requested chunk.
+ * Last chunk is always sent to finish transfer.
+ * @param device device
+ * @param buffer image, not compressed
+ * @param size image size in bytes
+ * @param waitMs response timeout
+ * @return 0- success
+ */
+int BLEDiscoverer::sendBufferDelta(
+    const DiscoveredDevice *device,
+    void *buffer,
+    uint32_t size,
+    int waitMs
+) {
+    SendOperation op(this, device, buffer, size, waitMs);
+    op.deltaOnly();
+    return op.runBlocking();
+}
+
+/**
+ * Send chunks keeping up to window chunks in flight after transfer started.
+ * Device acknowledges chunks cumulatively by requesting the next chunk index. If the device
+ * requests chunk already sent, transfer continues from that chunk with the window halved;
+ * on timeout transfer falls back to stop-and-wait after a random delay.
+ * Timeout follows round-trip time of one chunk in flight at a time, measured as in TCP.
+ * @param device device
+ * @param buffer image
+ * @param size image size in bytes
+ * @param blockSize block size returned by getBlockSize()
+ * @param window maximum chunks in flight
+ * @param waitMs response timeout
+ * @param firstChunk chunk to start from
+ * @param retNextChunk returns first chunk not acknowledged if the device does not respond
+ * @return 0- success, -4- device does not respond
+ */
+int BLEDiscoverer::sendChunksWindow(
+    const DiscoveredDevice *device,
+    void *buffer,
+    uint32_t size,
+    uint16_t blockSize,
+    uint8_t window,
+    int waitMs,
+    uint32_t firstChunk,
+    uint32_t *retNextChunk
+) {
+    SendOperation op(this, device, buffer, size, waitMs, window);
+    op.chunksOnly(blockSize, firstChunk);
+    int r = op.runBlocking();
+    if (r && retNextChunk)
+        *retNextChunk = op.nextChunk;
+    return r;
 }
 
 int BLEDiscoverer::sendBufferI(
     int deviceIndex,
     void *buffer,
     uint32_t size,
-    int waitMs
+    int waitMs,
+    uint8_t window,
+    bool compressed
 ) {
     if (deviceIndex >= devices.size())
         return -1;
-    return sendBuffer(&devices[deviceIndex], buffer, size, waitMs);
+    return sendBuffer(&devices[deviceIndex], buffer, size, waitMs, window, compressed);
 }
 
 const DiscoveredDevice notFoundDevice;
@@ -447,19 +1212,43 @@ const DiscoveredDevice notFoundDevice;
 const DiscoveredDevice& BLEDiscoverer::find(
     uint64_t addr
 ) {
-    auto it = std::find_if(devices.begin(), devices.end(), [addr](const DiscoveredDevice &dev) {
-        return dev.addr == addr;
-    });
-    if (it == devices.end())
-        return notFoundDevice;
-    return *it;
+    const DiscoveredDevice *d = devices.find(addr);
+    return d ? *d : notFoundDevice;
 }
 
+/**
+ * Copy of the device metadata. The consumer thread overwrites it on each advertisement under mutexDiscoveryState,
+ * sessions take the copy when they start.
+ * @param device device
+ * @return metadata as last advertised
+ */
+NEMR5053ManufacturerSpecificData BLEDiscoverer::deviceMetadata(
+    const DiscoveredDevice *device
+) {
+    std::unique_lock<std::mutex> lck(mutexDiscoveryState);
+    return device->metadata;
+}
+
+/**
+ * Pack image and send it to the device
+ * @param device device
+ * @param img image of the device screen size
+ * @param delta send only chunks changed since the last image, see sendBufferDelta()
+ * @param rotation rotate image clockwise: 0, 90, 180 or 270 degrees, see packSRgb8()
+ * @return 0- success
+ */
 int BLEDiscoverer::writeSRgb(
     DiscoveredDevice *device,
-    Image2sRgb *img
+    Image2sRgb *img,
+    bool delta,
+    uint16_t rotation
 ) {
-    if (device->metadata.width() != img->w || device->metadata.height() != img->h)
+    // consumer thread updates device metadata on each advertisement
+    NEMR5053ManufacturerSpecificData metadata = deviceMetadata(device);
+    uint32_t width = metadata.width();
+    uint32_t height = metadata.height();
+    bool swap = rotation == 90 || rotation == 270;
+    if ((swap ? height : width) != img->w || (swap ? width : height) != img->h)
         return -1;
     int r = open(device);
     if (r < 0) {
@@ -467,23 +1256,27 @@ int BLEDiscoverer::writeSRgb(
         return r;
     }
 
-    uint32_t imgBytes = device->metadata.screenSize();
-    uint8_t *imgBuffer = (uint8_t *) malloc(imgBytes);
-    if (imgBuffer) {
-        packSRgb8(imgBuffer, img->srgb, img->w, img->h, device->metadata.hasRed(), device->metadata.hasYellow(),
-                  device->metadata.mirror(), false);
-        r = sendBuffer(device, imgBuffer, imgBytes);
+    bool compress = !delta && metadata.compression();
+    int e = -2;
+    PackedImage packed = packedImages.get(img, width, height, metadata.hasRed(), metadata.hasYellow(),
+        metadata.mirror(), compress, rotation, &e);
+    if (packed) {
+        // senders do not modify the buffer
+        auto buffer = (void *) packed->data();
+        auto sz = (uint32_t) packed->size();
+        r = delta ? sendBufferDelta(device, buffer, sz) : sendBuffer(device, buffer, sz, 1000, 1, compress);
         if (r) {
             // std::cerr << "Error send screen to device" << r << std::endl;
         }
-        free(imgBuffer);
     } else {
         // std::cerr << "Insufficient memory" << std::endl;
-        r = -2;
+        r = e;
     }
-    r = close(device);
-    if (r < 0) {
+    int c = close(device);
+    if (c < 0) {
         // std::cerr << "Error close device" << std::endl;
+        if (r == 0)
+            r = c;
     }
     return r;
 }
@@ -1,12 +1,23 @@
 #ifndef BLE_HELPER_H
 #define BLE_HELPER_H
 
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <map>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
 
 #include "nemr-5053-manufacturer-specific-data.h"
+#include "esl-string-helper.h"
+#include "sent-image-store.h"
+#include "session-params-cache.h"
+#include "rtt-estimator.h"
+#include "packed-image-cache.h"
+#include "advertisement-ring.h"
+#include "notification-queue.h"
 
 typedef std::chrono::time_point<std::chrono::system_clock> DISCOVERED_TIME;
 
@@ -16,6 +27,8 @@ enum CharacteristicIndex {
 };
 
 class BLEDeviceImpl {
+public:
+    virtual ~BLEDeviceImpl() = default;
 };
 
 enum DeviceState {
@@ -40,42 +53,115 @@ public:
     DeviceState deviceState;
     /// OS specific implementation
     BLEDeviceImpl *impl;
+    /// exponentially smoothed RSSI in dBm
+    float rssiSmoothed;
+    /// exponentially smoothed interval between advertisements in milliseconds, 0 until the second one
+    float advIntervalMs;
+    /// advertisements received
+    uint32_t advCount;
+    /// holders of the pointer outside mutexDiscoveryState, DeviceRegistry::evict() skips pinned devices
+    uint32_t pins;
 
     DiscoveredDevice();
     DiscoveredDevice(uint64_t addr, int16_t rssi, const NEMR5053ManufacturerSpecificData &metadata, const std::string &name);
     ~DiscoveredDevice();
+    void update(const DiscoveredDevice &advertised);
+    float advRate() const;
 };
 
+/**
+ * Iterator over devices owned by DeviceRegistry
+ */
+template <class Base, class T>
+class DeviceIterator {
+private:
+    Base it;
+public:
+    explicit DeviceIterator(Base aIt) : it(aIt) {}
+    T &operator*() const { return **it; }
+    T *operator->() const { return it->get(); }
+    DeviceIterator &operator++() { ++it; return *this; }
+    bool operator==(const DeviceIterator &other) const { return it == other.it; }
+    bool operator!=(const DeviceIterator &other) const { return it != other.it; }
+};
+
+/**
+ * Discovered devices in order of discovery with O(1) lookup by address.
+ * Devices are never moved: pointers and references stay valid until the device is evicted.
+ * Not thread safe, BLEDiscoverer guards it by mutexDiscoveryState.
+ */
+class DeviceRegistry {
+private:
+    typedef std::vector<std::unique_ptr<DiscoveredDevice>> Items;
+    Items items;
+    /// evicted devices kept for reuse, labels coming back are added without allocation
+    Items spare;
+    /// open addressing with linear probing: index in items + 1, 0- empty slot
+    std::vector<uint32_t> slots;
+    /// log2 of slots size
+    int slotBits;
+
+    size_t home(uint64_t addr) const;
+    void rehash(int bits);
+    static bool evictable(const DiscoveredDevice &device);
+public:
+    typedef DeviceIterator<Items::iterator, DiscoveredDevice> iterator;
+    typedef DeviceIterator<Items::const_iterator, const DiscoveredDevice> const_iterator;
+
+    /// devices evicted as not advertised for longer than TTL
+    uint64_t evictedExpired;
+    /// oldest devices evicted to stay within capacity
+    uint64_t evictedOverCapacity;
+
+    DeviceRegistry();
+    DiscoveredDevice *find(uint64_t addr);
+    const DiscoveredDevice *find(uint64_t addr) const;
+    std::pair<DiscoveredDevice *, bool> insert(const DiscoveredDevice &device);
+    size_t evict(DISCOVERED_TIME olderThan, size_t capacity);
+    void clear();
+
+    size_t size() const;
+    bool empty() const;
+    DiscoveredDevice &operator[](size_t index);
+    const DiscoveredDevice &operator[](size_t index) const;
+    iterator begin();
+    iterator end();
+    const_iterator begin() const;
+    const_iterator end() const;
+};
+
+/**
+ * Steps of SendOperation
+ */
 enum SendingStep {
     SS_STOPPED = 0,
     SS_GET_BLOCK_SIZE,
     SS_WRITE_SCREEN_SIZE,
     SS_START_TRANSFER,
     SS_TRANSFER_BLOCK,
-    SS_DISCONNECT
+    SS_DISCONNECT,
+    SS_CONNECT,
+    SS_CANCEL,
+    /// startOpen() is pending
+    SS_CONNECTING,
+    /// startClose() is pending
+    SS_DISCONNECTING
 };
 
+/**
+ * Transfer interrupted by the link loss. sendBuffer() resumes it on the next session
+ * from the chunk the label requests if the same image is sent again.
+ */
 class SendingState {
 public:
-    void *buffer;
+    /// Image2sRgb::hashBytes() of the image
+    uint64_t hash;
     uint32_t size;
     uint16_t blockSize;
+    /// first chunk not acknowledged by the label
     uint32_t offset;
-    uint8_t stepRetryCount;
-    uint8_t stepTryCount;
+    bool compressed;
     SendingState();
-    SendingState(const SendingState&);
-    ~SendingState();
-};
-
-class ReceivedData {
-public:
-    uint32_t size;
-    void *data;
-    ReceivedData();
-    ReceivedData(void *data, uint32_t count);
-    ReceivedData(const ReceivedData&);
-    ~ReceivedData();
 };
 
 class BLEDiscoverer;
@@ -94,45 +180,118 @@ public:
 class Image2sRgb;
 
 class BLEDiscoverer {
+private:
+    std::thread advConsumerThread;
+    std::mutex mutexAdvConsumer;
+    std::condition_variable cvAdvConsumer;
+    std::atomic<bool> advConsumerStopRequest;
+    std::chrono::steady_clock::time_point nextEvictionAt;
+    std::mutex mutexNotifications;
+    /// notified on notification of any device
+    NotificationSignal notificationSignal;
+    /// notifications of the devices opened, queues are kept for the next session
+    std::map<uint64_t, std::unique_ptr<NotificationQueue>> notifications;
+
+    void runAdvertisementConsumer();
+    void applyAdvertisement(const AdvertisementRecord &record);
+    void evictDevices();
+protected:
+    bool pushAdvertisement(uint64_t addr, int16_t rssi, const NEMR5053ManufacturerSpecificData &metadata,
+        const char *name, size_t nameSize);
+    void startAdvertisementConsumer();
+    void stopAdvertisementConsumer();
+    NotificationQueue *notificationQueue(uint64_t addr);
+    int waitAsync(DiscoveredDevice *device, int started, bool opening);
 public:
+    /// startOpen(), pollOpen(), startClose() and pollClose() result: not finished yet
+    static const int PENDING = 1;
+    /// startWrite() result: no write buffer is free, write again when anyNotification() is notified
+    static const int BUSY = -11;
+
     bool discoveryOn;
     std::mutex mutexDiscoveryState;
     std::condition_variable cvDiscoveryState;
 
-    std::vector<DiscoveredDevice> devices;
-    std::map<uint64_t, ReceivedData> lastReceivedData;
+    DeviceRegistry devices;
+    /// devices not advertised for longer are evicted, 0- keep forever
+    int deviceTtlSeconds;
+    /// oldest idle devices are evicted above, 0- unlimited
+    size_t maxDevices;
+    /// period of the eviction check on the consumer thread
+    int evictionIntervalMs;
     OnDiscover *onDiscover;
+    /// last images sent to the devices for delta updates
+    SentImageStore sentImages;
+    /// images packed for the devices, shared by devices of the same type
+    PackedImageCache packedImages;
+    /// block size by device type and firmware version
+    SessionParamsCache sessionParams;
+    std::mutex mutexSendingStates;
+    /// interrupted transfers by device address
+    std::map<uint64_t, SendingState> sendingStates;
+    /// round-trip time by device and device type, response timeouts and retry delays follow it
+    RttEstimators rtts;
+    /// wait for the response to the last chunk, the label answers it after the screen refresh
+    int refreshWaitMs;
+    /// advertisements received by the radio thread, not applied to devices yet
+    AdvertisementRing advertisements;
 
     BLEDiscoverer();
     BLEDiscoverer(OnDiscover *onDiscover);
     BLEDiscoverer(OnDiscover *onDiscover, void *discoverExtra);
+    virtual ~BLEDiscoverer();
     virtual int startDiscovery() = 0;
     virtual void stopDiscovery(int seconds = 10) = 0;
     virtual int open(DiscoveredDevice* device) = 0;
     virtual int close(DiscoveredDevice* device) = 0;
     virtual int read(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size, int milliseconds = 2000) = 0;
     virtual int write(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size) = 0;
+    virtual int writeWithoutResponse(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size);
+    virtual int startWrite(const DiscoveredDevice *device, CharacteristicIndex characteristic, void *buffer, uint32_t size,
+        bool withResponse = true);
+    virtual int startOpen(DiscoveredDevice *device);
+    virtual int pollOpen(DiscoveredDevice *device, std::chrono::steady_clock::time_point &wakeAt);
+    virtual int startClose(DiscoveredDevice *device);
+    virtual int pollClose(DiscoveredDevice *device, std::chrono::steady_clock::time_point &wakeAt);
+    virtual int takeWriteError(const DiscoveredDevice *device);
     virtual int pair(const DiscoveredDevice *device) = 0;
     virtual int unpair(const DiscoveredDevice *device) = 0;
 
     const DiscoveredDevice& find(uint64_t addr);
+    NEMR5053ManufacturerSpecificData deviceMetadata(const DiscoveredDevice *device);
     int waitDiscover(int deviceCount, int seconds = 20);
     bool waitDiscover(const char *addressString, int seconds = 20);
     // index versions
     int openI(int index);
     int closeI(int index);
 
-    bool requestGetBlockSize(const DiscoveredDevice *device);
-    bool requestSetScreenSize(const DiscoveredDevice *device, uint32_t value);
-    bool requestStartTransfer(const DiscoveredDevice *device);
-    bool requestCancelWrite(const DiscoveredDevice *device);
-    bool requestWriteChunk(const DiscoveredDevice *device, uint32_t chunkNum, void* buffer, uint32_t ofs, uint8_t size);
+    int requestGetBlockSize(const DiscoveredDevice *device);
+    int requestSetScreenSize(const DiscoveredDevice *device, uint32_t value, bool compressed = false);
+    int requestStartTransfer(const DiscoveredDevice *device);
+    int requestCancelWrite(const DiscoveredDevice *device);
+    int requestWriteChunk(const DiscoveredDevice *device, uint32_t chunkNum, void* buffer, uint32_t ofs, uint8_t size, bool withResponse = true);
+    int readNextChunk(const DiscoveredDevice *device, int waitMs = 1000);
+    static int parseNextChunk(const uint8_t *buffer, int size);
+    int readResponse(const DiscoveredDevice *device, uint8_t opcode, void *buffer, uint32_t size, int waitMs = 1000);
+    bool waitNotification(const DiscoveredDevice *device, std::chrono::steady_clock::time_point until);
+    bool nextNotificationAt(const DiscoveredDevice *device, std::chrono::steady_clock::time_point &retValue);
+    NotificationSignal *anyNotification();
+    int responseTimeout(const DiscoveredDevice *device, int waitMs);
+    int responseTimeout(uint64_t addr, uint32_t type, int waitMs);
+    void updateRtt(const DiscoveredDevice *device, std::chrono::steady_clock::time_point sentAt, bool responded,
+        std::chrono::steady_clock::time_point receivedAt = std::chrono::steady_clock::time_point());
+    void updateRtt(uint64_t addr, uint32_t type, std::chrono::steady_clock::time_point sentAt, bool responded,
+        std::chrono::steady_clock::time_point receivedAt = std::chrono::steady_clock::time_point());
+    void waitRetry(const DiscoveredDevice *device, int attempt);
+    bool readScreenSizeResponse(const DiscoveredDevice *device, int waitMs = 1000);
+    bool readStartTransferResponse(const DiscoveredDevice *device, int waitMs = 1000, uint32_t *retChunk = nullptr);
 
     uint16_t getBlockSize(const DiscoveredDevice *device, int waitMs = 1000);
-    bool setScreenSize(const DiscoveredDevice *device, uint32_t value, int waitMs = 1000);
-    bool startTransfer(const DiscoveredDevice *device, int waitMs = 1000);
+    bool setScreenSize(const DiscoveredDevice *device, uint32_t value, int waitMs = 1000, bool compressed = false);
+    bool startTransfer(const DiscoveredDevice *device, int waitMs = 1000, uint32_t *retChunk = nullptr);
     bool cancelWrite(const DiscoveredDevice *device, int waitMs = 1000);
-    int writeChunk(const DiscoveredDevice *device, uint32_t chunkNum, void* buffer, uint32_t ofs, uint8_t size, int waitMs = 1000);
+    int writeChunk(const DiscoveredDevice *device, uint32_t chunkNum, void* buffer, uint32_t ofs, uint8_t size, int waitMs = 1000,
+        bool refresh = true);
 
     // index versions
     uint16_t getBlockSizeI(int deviceIndex, int waitMs = 1000);
@@ -141,14 +300,26 @@ public:
     bool cancelWriteI(int deviceIndex, int waitMs = 1000);
     int writeChunkI(int deviceIndex, uint32_t chunkNum, void* buffer, uint32_t ofs, uint8_t size, int waitMs = 1000);
 
-    int sendBuffer(const DiscoveredDevice *device, void *buffer, uint32_t size, int waitMs = 1000);
-    int sendBufferI(int deviceIndex, void *buffer, uint32_t size, int waitMs = 1000);
+    int sendBuffer(const DiscoveredDevice *device, void *buffer, uint32_t size, int waitMs = 1000, uint8_t window = 1, bool compressed = false);
+    int sendBufferI(int deviceIndex, void *buffer, uint32_t size, int waitMs = 1000, uint8_t window = 1, bool compressed = false);
+    int beginTransfer(const DiscoveredDevice *device, uint32_t size, int waitMs, bool compressed, uint16_t *retBlockSize,
+        uint32_t *retChunk = nullptr);
+    int sendChunks(const DiscoveredDevice *device, void *buffer, uint32_t size, uint16_t blockSize, int waitMs = 1000,
+        uint32_t firstChunk = 0, uint32_t *retNextChunk = nullptr);
+    int sendChunksWindow(const DiscoveredDevice *device, void *buffer, uint32_t size, uint16_t blockSize, uint8_t window,
+        int waitMs = 1000, uint32_t firstChunk = 0, uint32_t *retNextChunk = nullptr);
 
-    int writeSRgb(DiscoveredDevice *device, Image2sRgb *img);
+    int sendBufferDelta(const DiscoveredDevice *device, void *buffer, uint32_t size, int waitMs = 1000);
+
+    int writeSRgb(DiscoveredDevice *device, Image2sRgb *img, bool delta = false, uint16_t rotation = 0);
 
 };
 #ifdef _MSC_VER
 #include "ble-helper-win.h"
+#else
+#ifdef ESL_BLE_SDBUS
+#include "ble-helper-bluez.h"
+#endif
 #endif
 
 #endif
@@ -0,0 +1,721 @@
+#include <cerrno>
+#include <cstring>
+
+#include "bluez-bus-mock.h"
+#include "ble-helper-bluez.h"
+
+static const char *SERVICE_PATH = "/service000c";
+/// command, image and device name characteristics of the label
+static const char *CHARACTERISTIC_PATH[3] { "/service000c/char000d", "/service000c/char0010", "/service000c/char0013" };
+static const char *DEVICE_NAME_UUID = "00002a00-0000-1000-8000-00805f9b34fb";
+
+DBusValue::DBusValue()
+    : type('y'), number(0)
+{
+}
+
+/**
+ * @param type 'y', 'b', 'n', 'q', 'i' or 'u'
+ * @param value value
+ */
+DBusValue DBusValue::basic(
+    char type,
+    int64_t value
+) {
+    DBusValue r;
+    r.type = type;
+    r.number = value;
+    return r;
+}
+
+/**
+ * @param type 's' or 'o'
+ * @param value value
+ */
+DBusValue DBusValue::string(
+    char type,
+    const std::string &value
+) {
+    DBusValue r;
+    r.type = type;
+    r.text = value;
+    return r;
+}
+
+DBusValue DBusValue::bytes(
+    const void *data,
+    size_t size
+) {
+    DBusValue r;
+    r.type = 'a';
+    r.contents = "y";
+    r.text.assign((const char *) data, size);
+    return r;
+}
+
+DBusValue DBusValue::variant(
+    const DBusValue &value
+) {
+    DBusValue r;
+    r.type = 'v';
+    r.contents = value.signature();
+    r.items.push_back(value);
+    return r;
+}
+
+DBusValue DBusValue::array(
+    const std::string &elementSignature,
+    const std::vector<DBusValue> &elements
+) {
+    DBusValue r;
+    r.type = 'a';
+    r.contents = elementSignature;
+    r.items = elements;
+    return r;
+}
+
+DBusValue DBusValue::entry(
+    const DBusValue &key,
+    const DBusValue &value
+) {
+    DBusValue r;
+    r.type = 'e';
+    r.contents = key.signature() + value.signature();
+    r.items.push_back(key);
+    r.items.push_back(value);
+    return r;
+}
+
+/**
+ * a{sv} of the properties
+ */
+DBusValue DBusValue::dictionary(
+    const std::vector<std::pair<std::string, DBusValue>> &properties
+) {
+    std::vector<DBusValue> entries;
+    for (auto &p : properties)
+        entries.push_back(entry(string('s', p.first), variant(p.second)));
+    return array("{sv}", entries);
+}
+
+std::string DBusValue::signature() const
+{
+    switch (type) {
+        case 'a':
+            return "a" + contents;
+        case 'e':
+            return "{" + contents + "}";
+        default:
+            return std::string(1, type);
+    }
+}
+
+/**
+ * @param arguments message arguments
+ */
+DBusValueReader::DBusValueReader(
+    const std::vector<DBusValue> &arguments
+) {
+    body.type = 'r';
+    body.items = arguments;
+    stack.emplace_back(&body, 0);
+}
+
+const DBusValue *DBusValueReader::next()
+{
+    auto &top = stack.back();
+    if (top.second >= top.first->items.size())
+        return nullptr;
+    return &top.first->items[top.second];
+}
+
+bool DBusValueReader::peek(
+    char &retType,
+    const char *&retContents
+) {
+    const DBusValue *v = next();
+    if (!v)
+        return false;
+    retType = v->type;
+    retContents = v->contents.empty() ? nullptr : v->contents.c_str();
+    return true;
+}
+
+bool DBusValueReader::enter(
+    char type,
+    const char *contents
+) {
+    const DBusValue *v = next();
+    if (!v || v->type != type || (contents && v->contents != contents))
+        return false;
+    stack.back().second++;
+    stack.emplace_back(v, 0);
+    return true;
+}
+
+bool DBusValueReader::exit()
+{
+    if (stack.size() < 2 || stack.back().second < stack.back().first->items.size())
+        return false;
+    stack.pop_back();
+    return true;
+}
+
+bool DBusValueReader::read(
+    char type,
+    void *retValue
+) {
+    const DBusValue *v = next();
+    if (!v || v->type != type)
+        return false;
+    switch (type) {
+        case 'y':
+            *(uint8_t *) retValue = (uint8_t) v->number;
+            break;
+        case 'b':
+            *(int *) retValue = v->number ? 1 : 0;
+            break;
+        case 'n':
+            *(int16_t *) retValue = (int16_t) v->number;
+            break;
+        case 'q':
+            *(uint16_t *) retValue = (uint16_t) v->number;
+            break;
+        case 'i':
+            *(int32_t *) retValue = (int32_t) v->number;
+            break;
+        case 'u':
+            *(uint32_t *) retValue = (uint32_t) v->number;
+            break;
+        case 's':
+        case 'o':
+            *(const char **) retValue = v->text.c_str();
+            break;
+        default:
+            return false;
+    }
+    stack.back().second++;
+    return true;
+}
+
+bool DBusValueReader::readBytes(
+    const void *&retData,
+    size_t &retSize
+) {
+    const DBusValue *v = next();
+    if (!v || v->type != 'a' || v->contents != "y")
+        return false;
+    retData = v->text.data();
+    retSize = v->text.size();
+    stack.back().second++;
+    return true;
+}
+
+bool DBusValueReader::skip()
+{
+    if (!next())
+        return false;
+    stack.back().second++;
+    return true;
+}
+
+/**
+ * @param sim simulated labels, the mock receives their advertisements
+ * @param adapterPath adapter object path
+ */
+BluezBusMock::BluezBusMock(
+    BLEHelperSim *aSim,
+    const char *aAdapterPath
+)
+    : OnDiscover(aSim), sim(aSim), adapterPath(aAdapterPath), stopRequest(false), cachedServices(false),
+    callCount(0), writeCount(0), queuedWriteCount(0)
+{
+    sim->onDiscover = this;
+}
+
+BluezBusMock::~BluezBusMock()
+{
+    sim->stopDiscovery(0);
+    sim->onDiscover = nullptr;
+    stop();
+}
+
+std::string BluezBusMock::devicePath(
+    uint64_t addr
+) const {
+    char path[128];
+    bluezDevicePath(path, sizeof(path), adapterPath.c_str(), addr);
+    return path;
+}
+
+DiscoveredDevice *BluezBusMock::simDevice(
+    uint64_t addr
+) {
+    std::unique_lock<std::mutex> lck(sim->mutexDiscoveryState);
+    return sim->devices.find(addr);
+}
+
+/**
+ * @param path characteristic object path
+ * @param retAddr receives device address
+ * @return CI_REQUEST or CI_IMAGE, -1 if other
+ */
+int BluezBusMock::characteristicIndex(
+    const char *path,
+    uint64_t &retAddr
+) const {
+    if (!bluezPathAddr(path, retAddr))
+        return -1;
+    std::string device = devicePath(retAddr);
+    for (int i = 0; i < 2; i++) {
+        if (device + CHARACTERISTIC_PATH[i] == path)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Device1 and Properties interfaces as bluetoothd announces the device
+ */
+DBusValue BluezBusMock::deviceInterfaces(
+    const DiscoveredDevice &device,
+    bool isConnected
+) const {
+    char address[18];
+    snprintf(address, sizeof(address), "%02X:%02X:%02X:%02X:%02X:%02X",
+        (unsigned) (device.addr >> 40) & 0xff, (unsigned) (device.addr >> 32) & 0xff,
+        (unsigned) (device.addr >> 24) & 0xff, (unsigned) (device.addr >> 16) & 0xff,
+        (unsigned) (device.addr >> 8) & 0xff, (unsigned) device.addr & 0xff);
+    auto properties = advertisement(device);
+    std::vector<DBusValue> more {
+        DBusValue::entry(DBusValue::string('s', "Address"), DBusValue::variant(DBusValue::string('s', address))),
+        DBusValue::entry(DBusValue::string('s', "Adapter"), DBusValue::variant(DBusValue::string('o', adapterPath))),
+        DBusValue::entry(DBusValue::string('s', "Name"), DBusValue::variant(DBusValue::string('s', device.name))),
+        DBusValue::entry(DBusValue::string('s', "UUIDs"), DBusValue::variant(
+            DBusValue::array("s", { DBusValue::string('s', BLEHelperBluez::SERVICE_UUID) }))),
+        DBusValue::entry(DBusValue::string('s', "Paired"), DBusValue::variant(DBusValue::basic('b', 0))),
+        DBusValue::entry(DBusValue::string('s', "Connected"), DBusValue::variant(DBusValue::basic('b', isConnected))),
+        DBusValue::entry(DBusValue::string('s', "ServicesResolved"), DBusValue::variant(DBusValue::basic('b', isConnected)))
+    };
+    properties.items.insert(properties.items.begin(), more.begin(), more.end());
+    return DBusValue::array("{sa{sv}}", {
+        DBusValue::entry(DBusValue::string('s', "org.freedesktop.DBus.Introspectable"), DBusValue::dictionary({})),
+        DBusValue::entry(DBusValue::string('s', "org.bluez.Device1"), properties),
+        DBusValue::entry(DBusValue::string('s', "org.freedesktop.DBus.Properties"), DBusValue::dictionary({}))
+    });
+}
+
+/**
+ * Properties changing with each advertisement: RSSI, manufacturer data and transmit power
+ */
+DBusValue BluezBusMock::advertisement(
+    const DiscoveredDevice &device
+) const {
+    // company identifier is the first two bytes of the manufacturer specific data, little endian
+    auto *msd = (const uint8_t *) &device.metadata.val;
+    uint16_t company = (uint16_t) (msd[0] | msd[1] << 8);
+    auto manufacturerData = DBusValue::array("{qv}", {
+        DBusValue::entry(DBusValue::basic('q', company),
+            DBusValue::variant(DBusValue::bytes(msd + 2, sizeof(NEMR5053_MANUFACTURER_SPECIFIC_DATA) - 2)))
+    });
+    return DBusValue::dictionary({
+        { "RSSI", DBusValue::basic('n', device.rssi) },
+        { "TxPower", DBusValue::basic('n', 0) },
+        { "ManufacturerData", manufacturerData }
+    });
+}
+
+void BluezBusMock::emitAdded(
+    const std::string &path,
+    const DBusValue &interfaces
+) {
+    DBusValueReader reader({ interfaces });
+    std::unique_lock<std::mutex> lck(mutexListener);
+    if (listener)
+        listener->interfacesAdded(path.c_str(), reader);
+}
+
+void BluezBusMock::emitRemoved(
+    const std::string &path,
+    const std::vector<std::string> &interfaces
+) {
+    std::vector<DBusValue> names;
+    for (auto &i : interfaces)
+        names.push_back(DBusValue::string('s', i));
+    DBusValueReader reader({ DBusValue::array("s", names) });
+    std::unique_lock<std::mutex> lck(mutexListener);
+    if (listener)
+        listener->interfacesRemoved(path.c_str(), reader);
+}
+
+void BluezBusMock::emitChanged(
+    const std::string &path,
+    const char *interface,
+    const DBusValue &changed
+) {
+    // invalidated properties follow the changed ones
+    DBusValueReader reader({ changed, DBusValue::array("s", {}) });
+    std::unique_lock<std::mutex> lck(mutexListener);
+    if (listener)
+        listener->propertiesChanged(path.c_str(), interface, reader);
+}
+
+/**
+ * Label GATT service with the command, image and device name characteristics
+ */
+void BluezBusMock::emitServices(
+    uint64_t addr
+) {
+    std::string device = devicePath(addr);
+    emitAdded(device + SERVICE_PATH, DBusValue::array("{sa{sv}}", {
+        DBusValue::entry(DBusValue::string('s', "org.bluez.GattService1"), DBusValue::dictionary({
+            { "UUID", DBusValue::string('s', BLEHelperBluez::SERVICE_UUID) },
+            { "Device", DBusValue::string('o', device) },
+            { "Primary", DBusValue::basic('b', 1) }
+        }))
+    }));
+    const char *uuids[3] { BLEHelperBluez::CHARACTERISTIC_UUID[0], BLEHelperBluez::CHARACTERISTIC_UUID[1], DEVICE_NAME_UUID };
+    const char *flags[3] { "notify", "write-without-response", "read" };
+    for (int i = 0; i < 3; i++) {
+        emitAdded(device + CHARACTERISTIC_PATH[i], DBusValue::array("{sa{sv}}", {
+            DBusValue::entry(DBusValue::string('s', "org.bluez.GattCharacteristic1"), DBusValue::dictionary({
+                { "Service", DBusValue::string('o', device + SERVICE_PATH) },
+                { "Flags", DBusValue::array("s", { DBusValue::string('s', "write"), DBusValue::string('s', flags[i]) }) },
+                { "UUID", DBusValue::string('s', uuids[i]) },
+                { "Notifying", DBusValue::basic('b', 0) }
+            }))
+        }));
+    }
+}
+
+void BluezBusMock::removeServices(
+    uint64_t addr
+) {
+    std::string device = devicePath(addr);
+    for (auto &c : CHARACTERISTIC_PATH)
+        emitRemoved(device + c, { "org.bluez.GattCharacteristic1", "org.freedesktop.DBus.Properties" });
+    emitRemoved(device + SERVICE_PATH, { "org.bluez.GattService1", "org.freedesktop.DBus.Properties" });
+}
+
+void BluezBusMock::discoverFirstTime(
+    DiscoveredDevice &device
+) {
+    {
+        std::unique_lock<std::mutex> lck(mutexMock);
+        if (!known.insert(device.addr).second) {
+            lck.unlock();
+            discoverNextTime(device);
+            return;
+        }
+    }
+    emitAdded(devicePath(device.addr), deviceInterfaces(device, false));
+}
+
+void BluezBusMock::discoverNextTime(
+    DiscoveredDevice &device
+) {
+    emitChanged(devicePath(device.addr), "org.bluez.Device1", advertisement(device));
+}
+
+int BluezBusMock::start()
+{
+    if (thread.joinable())
+        return 0;
+    stopRequest = false;
+    thread = std::thread(&BluezBusMock::runNotifications, this);
+    return 0;
+}
+
+void BluezBusMock::stop()
+{
+    if (!thread.joinable())
+        return;
+    stopRequest = true;
+    sim->anyNotification()->notify();
+    thread.join();
+    std::unique_lock<std::mutex> lck(mutexMock);
+    queuedCalls.clear();
+    connecting.clear();
+}
+
+/**
+ * Link of the simulated label is up: announce the connection and the GATT objects as bluetoothd does
+ */
+void BluezBusMock::linkUp(
+    const std::string &path,
+    uint64_t addr
+) {
+    {
+        std::unique_lock<std::mutex> lck(mutexMock);
+        connected.insert(addr);
+    }
+    emitChanged(path, "org.bluez.Device1", DBusValue::dictionary({ { "Connected", DBusValue::basic('b', 1) } }));
+    if (!cachedServices)
+        emitServices(addr);
+    emitChanged(path, "org.bluez.Device1", DBusValue::dictionary({ { "ServicesResolved", DBusValue::basic('b', 1) } }));
+}
+
+void BluezBusMock::emitReply(
+    const BluezMockCall &call,
+    int result
+) {
+    std::unique_lock<std::mutex> lck(mutexListener);
+    if (listener)
+        listener->replied(call.path.c_str(), call.method.c_str(), result);
+}
+
+/**
+ * Run calls queued by callAsync(). Connect waits for the simulated link without holding the other calls.
+ * @param wakeAt earlier time to run again
+ */
+void BluezBusMock::runQueuedCalls(
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    std::vector<BluezMockCall> calls;
+    {
+        std::unique_lock<std::mutex> lck(mutexMock);
+        calls.swap(queuedCalls);
+    }
+    for (auto &c : calls) {
+        uint64_t addr;
+        if (c.method == "Connect" && c.method != failMethod && bluezPathAddr(c.path.c_str(), addr)
+            && (c.connecting = simDevice(addr)) != nullptr) {
+            callCount++;
+            int r = sim->startOpen(c.connecting);
+            if (r == BLEDiscoverer::PENDING) {
+                connecting.push_back(c);
+                continue;
+            }
+            if (r == 0)
+                linkUp(c.path, addr);
+            emitReply(c, r < 0 ? -EIO : 0);
+            continue;
+        }
+        if (c.method == "Disconnect") {
+            // connection attempt is cancelled
+            for (size_t i = 0; i < connecting.size(); ) {
+                if (connecting[i].path != c.path) {
+                    i++;
+                    continue;
+                }
+                emitReply(connecting[i], -ECONNABORTED);
+                connecting.erase(connecting.begin() + (long) i);
+            }
+        }
+        emitReply(c, call(c.path.c_str(), c.interface.c_str(), c.method.c_str()));
+    }
+    for (size_t i = 0; i < connecting.size(); ) {
+        auto &c = connecting[i];
+        int r = sim->pollOpen(c.connecting, wakeAt);
+        if (r == BLEDiscoverer::PENDING) {
+            i++;
+            continue;
+        }
+        uint64_t addr = c.connecting->addr;
+        if (r == 0)
+            linkUp(c.path, addr);
+        emitReply(c, r < 0 ? -EIO : 0);
+        connecting.erase(connecting.begin() + (long) i);
+    }
+}
+
+/**
+ * Forward notifications of the simulated labels as Value changes of the command characteristic
+ */
+void BluezBusMock::runNotifications()
+{
+    auto *signal = sim->anyNotification();
+    std::vector<uint64_t> addrs;
+    while (!stopRequest) {
+        uint64_t seen = signal->current();
+        auto wakeAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+        {
+            std::unique_lock<std::mutex> lck(mutexMock);
+            addrs.assign(notifying.begin(), notifying.end());
+        }
+        runQueuedCalls(wakeAt);
+        for (auto addr : addrs) {
+            DiscoveredDevice *device = simDevice(addr);
+            if (!device)
+                continue;
+            uint8_t value[Notification::MAX_SIZE];
+            int r;
+            while ((r = sim->read(device, CI_REQUEST, value, sizeof(value), 0)) > 0) {
+                emitChanged(devicePath(addr) + CHARACTERISTIC_PATH[CI_REQUEST], "org.bluez.GattCharacteristic1",
+                    DBusValue::dictionary({ { "Value", DBusValue::bytes(value, (size_t) r) } }));
+            }
+            std::chrono::steady_clock::time_point at;
+            if (sim->nextNotificationAt(device, at) && at < wakeAt)
+                wakeAt = at;
+        }
+        signal->wait(seen, wakeAt);
+    }
+}
+
+int BluezBusMock::call(
+    const char *path,
+    const char *interface,
+    const char *method,
+    const char *objectPath,
+    int
+) {
+    callCount++;
+    if (failMethod == method)
+        return -EIO;
+    if (strcmp(method, "GetManagedObjects") == 0)
+        return getManagedObjects();
+    if (adapterPath == path && strcmp(interface, "org.bluez.Adapter1") == 0) {
+        if (strcmp(method, "StartDiscovery") == 0)
+            return sim->startDiscovery() < 0 ? -EIO : 0;
+        if (strcmp(method, "StopDiscovery") == 0) {
+            sim->stopDiscovery(0);
+            return 0;
+        }
+        uint64_t addr;
+        if (strcmp(method, "RemoveDevice") == 0 && objectPath && bluezPathAddr(objectPath, addr)) {
+            {
+                std::unique_lock<std::mutex> lck(mutexMock);
+                known.erase(addr);
+            }
+            emitRemoved(objectPath, { "org.bluez.Device1", "org.freedesktop.DBus.Properties" });
+            return 0;
+        }
+        return -EINVAL;
+    }
+    uint64_t addr;
+    if (!bluezPathAddr(path, addr))
+        return -EINVAL;
+    DiscoveredDevice *device = simDevice(addr);
+    if (!device)
+        return -ENODEV;
+    if (strcmp(interface, "org.bluez.Device1") == 0) {
+        if (strcmp(method, "Connect") == 0) {
+            if (sim->open(device) < 0)
+                return -EIO;
+            linkUp(path, addr);
+            return 0;
+        }
+        if (strcmp(method, "Disconnect") == 0) {
+            sim->close(device);
+            {
+                std::unique_lock<std::mutex> lck(mutexMock);
+                connected.erase(addr);
+                notifying.erase(addr);
+            }
+            emitChanged(path, interface, DBusValue::dictionary({ { "ServicesResolved", DBusValue::basic('b', 0) } }));
+            if (!cachedServices)
+                removeServices(addr);
+            emitChanged(path, interface, DBusValue::dictionary({ { "Connected", DBusValue::basic('b', 0) } }));
+            return 0;
+        }
+        if (strcmp(method, "Pair") == 0)
+            return 0;
+        return -EINVAL;
+    }
+    uint64_t a;
+    if (strcmp(interface, "org.bluez.GattCharacteristic1") == 0 && characteristicIndex(path, a) == CI_REQUEST) {
+        bool on = strcmp(method, "StartNotify") == 0;
+        if (!on && strcmp(method, "StopNotify") != 0)
+            return -EINVAL;
+        {
+            std::unique_lock<std::mutex> lck(mutexMock);
+            if (on && !connected.count(addr))
+                return -ENOTCONN;
+            if (on)
+                notifying.insert(addr);
+            else
+                notifying.erase(addr);
+        }
+        emitChanged(path, interface, DBusValue::dictionary({ { "Notifying", DBusValue::basic('b', on) } }));
+        sim->anyNotification()->notify();
+        return 0;
+    }
+    return -EINVAL;
+}
+
+int BluezBusMock::setDiscoveryFilter(
+    const char *aAdapterPath,
+    const char *serviceUuid
+) {
+    callCount++;
+    if (failMethod == "SetDiscoveryFilter")
+        return -EIO;
+    return adapterPath == aAdapterPath && strcmp(serviceUuid, BLEHelperBluez::SERVICE_UUID) == 0 ? 0 : -EINVAL;
+}
+
+/**
+ * Write to the simulated label: the caller waits as for the WriteValue reply, or the write is queued on the link
+ */
+int BluezBusMock::writeValue(
+    const char *characteristicPath,
+    const void *data,
+    size_t size,
+    bool withResponse,
+    bool wait
+) {
+    uint64_t addr;
+    int index = characteristicIndex(characteristicPath, addr);
+    uint8_t value[512];
+    if (index < 0 || size > sizeof(value))
+        return -EINVAL;
+    DiscoveredDevice *device = simDevice(addr);
+    if (!device)
+        return -ENODEV;
+    {
+        std::unique_lock<std::mutex> lck(mutexMock);
+        if (!connected.count(addr))
+            return -ENOTCONN;
+    }
+    writeCount++;
+    memmove(value, data, size);
+    int r;
+    if (wait)
+        r = withResponse ? sim->write(device, (CharacteristicIndex) index, value, (uint32_t) size)
+            : sim->writeWithoutResponse(device, (CharacteristicIndex) index, value, (uint32_t) size);
+    else {
+        queuedWriteCount++;
+        r = sim->startWrite(device, (CharacteristicIndex) index, value, (uint32_t) size, withResponse);
+    }
+    return r < 0 ? -EIO : 0;
+}
+
+/**
+ * Queue the call for the mock thread, the reply goes to the listener as bluetoothd replies do
+ */
+int BluezBusMock::callAsync(
+    const char *path,
+    const char *interface,
+    const char *method,
+    int
+) {
+    {
+        std::unique_lock<std::mutex> lck(mutexMock);
+        queuedCalls.push_back(BluezMockCall { path, interface, method, nullptr });
+    }
+    // wakes the mock thread
+    sim->anyNotification()->notify();
+    return 0;
+}
+
+/**
+ * Announce known devices, and the GATT objects of the connected ones
+ */
+int BluezBusMock::getManagedObjects()
+{
+    std::vector<uint64_t> addrs;
+    std::set<uint64_t> on;
+    {
+        std::unique_lock<std::mutex> lck(mutexMock);
+        addrs.assign(known.begin(), known.end());
+        on = connected;
+    }
+    for (auto addr : addrs) {
+        DiscoveredDevice *device = simDevice(addr);
+        if (!device)
+            continue;
+        emitAdded(devicePath(addr), deviceInterfaces(*device, on.count(addr) > 0));
+        if (on.count(addr))
+            emitServices(addr);
+    }
+    return 0;
+}
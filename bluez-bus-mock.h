@@ -0,0 +1,132 @@
+#ifndef BLUEZ_BUS_MOCK_H
+#define BLUEZ_BUS_MOCK_H
+
+#include <atomic>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bluez-bus.h"
+#include "ble-helper-sim.h"
+
+/**
+ * D-Bus value built by the mock: basic value, array, dictionary entry or variant
+ */
+class DBusValue {
+public:
+    char type;
+    /// signature of the array elements, of the dictionary entry key and value or of the variant value
+    std::string contents;
+    int64_t number;
+    /// string, object path or bytes of the byte array
+    std::string text;
+    std::vector<DBusValue> items;
+
+    DBusValue();
+    static DBusValue basic(char type, int64_t value);
+    static DBusValue string(char type, const std::string &value);
+    static DBusValue bytes(const void *data, size_t size);
+    static DBusValue variant(const DBusValue &value);
+    static DBusValue array(const std::string &elementSignature, const std::vector<DBusValue> &elements);
+    static DBusValue entry(const DBusValue &key, const DBusValue &value);
+    static DBusValue dictionary(const std::vector<std::pair<std::string, DBusValue>> &properties);
+    std::string signature() const;
+};
+
+/**
+ * Reads DBusValue arguments as sd-bus reads the message, containers must be read to the end before exit()
+ */
+class DBusValueReader : public DBusReader {
+private:
+    DBusValue body;
+    /// containers entered and index of the next value in each
+    std::vector<std::pair<const DBusValue *, size_t>> stack;
+
+    const DBusValue *next();
+public:
+    explicit DBusValueReader(const std::vector<DBusValue> &arguments);
+    bool peek(char &retType, const char *&retContents) override;
+    bool enter(char type, const char *contents) override;
+    bool exit() override;
+    bool read(char type, void *retValue) override;
+    bool readBytes(const void *&retData, size_t &retSize) override;
+    bool skip() override;
+};
+
+/**
+ * Method call queued by BluezBusMock::callAsync()
+ */
+class BluezMockCall {
+public:
+    std::string path;
+    std::string interface;
+    std::string method;
+    /// simulated device of Connect waiting for the link
+    DiscoveredDevice *connecting;
+};
+
+/**
+ * In-process bluetoothd for the tests: org.bluez objects of the labels simulated by BLEHelperSim.
+ * Methods run on the calling thread and send their signals before the reply as bluetoothd does, callAsync()
+ * methods run on the mock thread; advertisements are sent from the simulator discovery thread, notifications
+ * from the mock thread.
+ */
+class BluezBusMock : public BluezBus, public OnDiscover {
+private:
+    BLEHelperSim *sim;
+    std::string adapterPath;
+    std::mutex mutexMock;
+    /// devices announced by InterfacesAdded
+    std::set<uint64_t> known;
+    std::set<uint64_t> connected;
+    /// devices with command characteristic notifications on
+    std::set<uint64_t> notifying;
+    /// calls of callAsync() not run yet
+    std::vector<BluezMockCall> queuedCalls;
+    /// Connect calls waiting for the simulated link, mock thread only
+    std::vector<BluezMockCall> connecting;
+    std::thread thread;
+    std::atomic<bool> stopRequest;
+
+    std::string devicePath(uint64_t addr) const;
+    DiscoveredDevice *simDevice(uint64_t addr);
+    int characteristicIndex(const char *path, uint64_t &retAddr) const;
+    DBusValue deviceInterfaces(const DiscoveredDevice &device, bool isConnected) const;
+    DBusValue advertisement(const DiscoveredDevice &device) const;
+    void emitAdded(const std::string &path, const DBusValue &interfaces);
+    void emitRemoved(const std::string &path, const std::vector<std::string> &interfaces);
+    void emitChanged(const std::string &path, const char *interface, const DBusValue &changed);
+    void emitServices(uint64_t addr);
+    void removeServices(uint64_t addr);
+    void linkUp(const std::string &path, uint64_t addr);
+    void emitReply(const BluezMockCall &call, int result);
+    void runQueuedCalls(std::chrono::steady_clock::time_point &wakeAt);
+    int getManagedObjects();
+    void runNotifications();
+public:
+    /// GATT objects are not announced on Connect, GetManagedObjects returns them (bluetoothd cache of bonded device)
+    bool cachedServices;
+    /// method failing with -EIO, empty- none
+    std::string failMethod;
+    std::atomic<uint32_t> callCount;
+    std::atomic<uint32_t> writeCount;
+    /// writes the caller did not wait for
+    std::atomic<uint32_t> queuedWriteCount;
+
+    explicit BluezBusMock(BLEHelperSim *sim, const char *adapterPath = "/org/bluez/hci0");
+    virtual ~BluezBusMock();
+
+    void discoverFirstTime(DiscoveredDevice &device) override;
+    void discoverNextTime(DiscoveredDevice &device) override;
+
+    int start() override;
+    void stop() override;
+    int call(const char *path, const char *interface, const char *method, const char *objectPath = nullptr,
+        int timeoutMs = 25000) override;
+    int callAsync(const char *path, const char *interface, const char *method, int timeoutMs = 25000) override;
+    int setDiscoveryFilter(const char *adapterPath, const char *serviceUuid) override;
+    int writeValue(const char *characteristicPath, const void *data, size_t size, bool withResponse, bool wait) override;
+};
+
+#endif
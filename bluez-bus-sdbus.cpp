@@ -0,0 +1,426 @@
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <string>
+#include <unistd.h>
+#include <systemd/sd-bus.h>
+
+#include "bluez-bus-sdbus.h"
+
+static const char *BLUEZ = "org.bluez";
+static const char *IFACE_OBJECT_MANAGER = "org.freedesktop.DBus.ObjectManager";
+static const char *IFACE_PROPERTIES = "org.freedesktop.DBus.Properties";
+
+/**
+ * DBusReader over the sd-bus message
+ */
+class SdBusReader : public DBusReader {
+private:
+    sd_bus_message *message;
+public:
+    explicit SdBusReader(sd_bus_message *aMessage)
+        : message(aMessage)
+    {
+    }
+
+    bool peek(char &retType, const char *&retContents) override
+    {
+        return sd_bus_message_peek_type(message, &retType, &retContents) > 0;
+    }
+
+    bool enter(char type, const char *contents) override
+    {
+        return sd_bus_message_enter_container(message, type, contents) > 0;
+    }
+
+    bool exit() override
+    {
+        return sd_bus_message_exit_container(message) >= 0;
+    }
+
+    bool read(char type, void *retValue) override
+    {
+        return sd_bus_message_read_basic(message, type, retValue) > 0;
+    }
+
+    bool readBytes(const void *&retData, size_t &retSize) override
+    {
+        return sd_bus_message_read_array(message, 'y', &retData, &retSize) > 0;
+    }
+
+    bool skip() override
+    {
+        return sd_bus_message_skip(message, nullptr) > 0;
+    }
+};
+
+/**
+ * Call waiting for the reply
+ */
+class SdBusCall {
+public:
+    BluezBusSdBus *bus;
+    bool done;
+    int result;
+};
+
+/**
+ * Call of callAsync(), deleted with its slot after the reply
+ */
+class SdBusAsyncCall {
+public:
+    BluezBusSdBus *bus;
+    std::string path;
+    std::string method;
+    /// GetManagedObjects reply, objects go to the listener
+    bool objects;
+};
+
+static void deleteAsyncCall(
+    void *userdata
+) {
+    delete (SdBusAsyncCall *) userdata;
+}
+
+BluezBusSdBus::BluezBusSdBus()
+    : bus(nullptr), stopRequest(false), dispatching(false), wakeFd { -1, -1 }
+{
+}
+
+BluezBusSdBus::~BluezBusSdBus()
+{
+    stop();
+}
+
+/**
+ * Connect to the system bus, subscribe to bluetoothd signals and start the bus thread
+ * @return 0, negative errno if the bus is not available
+ */
+int BluezBusSdBus::start()
+{
+    std::unique_lock<std::mutex> lck(mutexBus);
+    if (bus)
+        return dispatching ? 0 : -ENOTCONN;
+    int r = sd_bus_open_system(&bus);
+    if (r < 0) {
+        bus = nullptr;
+        return r;
+    }
+    const char *signals[3][2] {
+        { IFACE_OBJECT_MANAGER, "InterfacesAdded" },
+        { IFACE_OBJECT_MANAGER, "InterfacesRemoved" },
+        { IFACE_PROPERTIES, "PropertiesChanged" }
+    };
+    for (auto &s : signals) {
+        // slot is owned by the bus
+        r = sd_bus_match_signal(bus, nullptr, BLUEZ, nullptr, s[0], s[1], onSignal, this);
+        if (r < 0)
+            break;
+    }
+    if (r >= 0 && pipe(wakeFd) < 0)
+        r = -errno;
+    if (r < 0) {
+        bus = sd_bus_flush_close_unref(bus);
+        return r;
+    }
+    for (int fd : wakeFd)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    stopRequest = false;
+    dispatching = true;
+    thread = std::thread(&BluezBusSdBus::runDispatch, this);
+    return 0;
+}
+
+void BluezBusSdBus::stop()
+{
+    {
+        std::unique_lock<std::mutex> lck(mutexBus);
+        if (!thread.joinable())
+            return;
+        stopRequest = true;
+        wake();
+    }
+    thread.join();
+    std::unique_lock<std::mutex> lck(mutexBus);
+    bus = sd_bus_flush_close_unref(bus);
+    for (int &fd : wakeFd) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+void BluezBusSdBus::wake()
+{
+    char c = 0;
+    if (::write(wakeFd[1], &c, 1) < 0) {
+        // pipe is full, the bus thread is woken already
+    }
+}
+
+/**
+ * Process messages, then poll the bus without holding it, so callers can queue their calls
+ */
+void BluezBusSdBus::runDispatch()
+{
+    std::unique_lock<std::mutex> lck(mutexBus);
+    while (!stopRequest) {
+        int r;
+        while ((r = sd_bus_process(bus, nullptr)) > 0)
+            ;
+        // connection to the bus is lost
+        if (r < 0)
+            break;
+        struct pollfd fds[2];
+        fds[0].fd = sd_bus_get_fd(bus);
+        fds[0].events = (short) sd_bus_get_events(bus);
+        fds[0].revents = 0;
+        fds[1].fd = wakeFd[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        int timeoutMs = -1;
+        uint64_t until;
+        if (sd_bus_get_timeout(bus, &until) >= 0 && until != UINT64_MAX) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t now = (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+            uint64_t ms = until > now ? (until - now + 999) / 1000 : 0;
+            timeoutMs = ms < INT_MAX ? (int) ms : INT_MAX;
+        }
+        lck.unlock();
+        poll(fds, 2, timeoutMs);
+        if (fds[1].revents & POLLIN) {
+            char buffer[64];
+            while (::read(wakeFd[0], buffer, sizeof(buffer)) > 0)
+                ;
+        }
+        lck.lock();
+    }
+    dispatching = false;
+    cvReply.notify_all();
+}
+
+int BluezBusSdBus::onSignal(
+    sd_bus_message *message,
+    void *userdata,
+    sd_bus_error *
+) {
+    ((BluezBusSdBus *) userdata)->dispatchSignal(message);
+    return 0;
+}
+
+/**
+ * Pass InterfacesAdded, InterfacesRemoved and PropertiesChanged to the listener, on the bus thread
+ */
+void BluezBusSdBus::dispatchSignal(
+    sd_bus_message *message
+) {
+    std::unique_lock<std::mutex> lck(mutexListener);
+    if (!listener)
+        return;
+    SdBusReader reader(message);
+    const char *member = sd_bus_message_get_member(message);
+    if (!member)
+        return;
+    if (strcmp(member, "PropertiesChanged") == 0) {
+        const char *interface;
+        if (sd_bus_message_read_basic(message, 's', &interface) > 0)
+            listener->propertiesChanged(sd_bus_message_get_path(message), interface, reader);
+        return;
+    }
+    const char *path;
+    if (sd_bus_message_read_basic(message, 'o', &path) <= 0)
+        return;
+    if (strcmp(member, "InterfacesAdded") == 0)
+        listener->interfacesAdded(path, reader);
+    else
+        listener->interfacesRemoved(path, reader);
+}
+
+/**
+ * Pass objects of the GetManagedObjects reply to the listener
+ */
+void BluezBusSdBus::managedObjects(
+    sd_bus_message *message
+) {
+    std::unique_lock<std::mutex> lck(mutexListener);
+    if (!listener)
+        return;
+    SdBusReader reader(message);
+    if (sd_bus_message_enter_container(message, 'a', "{oa{sa{sv}}}") <= 0)
+        return;
+    while (sd_bus_message_enter_container(message, 'e', "oa{sa{sv}}") > 0) {
+        const char *path;
+        if (sd_bus_message_read_basic(message, 'o', &path) <= 0)
+            return;
+        listener->interfacesAdded(path, reader);
+        if (sd_bus_message_exit_container(message) < 0)
+            return;
+    }
+    sd_bus_message_exit_container(message);
+}
+
+int BluezBusSdBus::onReply(
+    sd_bus_message *message,
+    void *userdata,
+    sd_bus_error *
+) {
+    auto *call = (SdBusCall *) userdata;
+    if (sd_bus_message_is_method_error(message, nullptr)) {
+        int e = sd_bus_message_get_errno(message);
+        call->result = e > 0 ? -e : -EIO;
+    }
+    call->done = true;
+    call->bus->cvReply.notify_all();
+    return 0;
+}
+
+/**
+ * Pass the reply of callAsync() to the listener, on the bus thread
+ */
+int BluezBusSdBus::onAsyncReply(
+    sd_bus_message *message,
+    void *userdata,
+    sd_bus_error *
+) {
+    auto *call = (SdBusAsyncCall *) userdata;
+    int result = 0;
+    if (sd_bus_message_is_method_error(message, nullptr)) {
+        int e = sd_bus_message_get_errno(message);
+        result = e > 0 ? -e : -EIO;
+    } else if (call->objects)
+        call->bus->managedObjects(message);
+    std::unique_lock<std::mutex> lck(call->bus->mutexListener);
+    if (call->bus->listener)
+        call->bus->listener->replied(call->path.c_str(), call->method.c_str(), result);
+    return 0;
+}
+
+/**
+ * Queue the call and wake the bus thread to send it
+ * @param message method call, released
+ * @param wait wait for the reply, otherwise the call is sent with no reply expected
+ * @param timeoutMs reply timeout
+ * @param lck lock of mutexBus, released while waiting
+ * @return 0, negative errno
+ */
+int BluezBusSdBus::send(
+    sd_bus_message *message,
+    bool wait,
+    int timeoutMs,
+    std::unique_lock<std::mutex> &lck
+) {
+    SdBusCall call { this, false, 0 };
+    sd_bus_slot *slot = nullptr;
+    int r = sd_bus_call_async(bus, wait ? &slot : nullptr, message, wait ? onReply : nullptr, &call,
+        (uint64_t) timeoutMs * 1000);
+    sd_bus_message_unref(message);
+    if (r < 0)
+        return r;
+    wake();
+    if (!wait)
+        return 0;
+    cvReply.wait(lck, [this, &call] {
+        return call.done || !dispatching;
+    });
+    // callback is not called after the slot is released
+    sd_bus_slot_unref(slot);
+    return call.done ? call.result : -ENOTCONN;
+}
+
+int BluezBusSdBus::call(
+    const char *path,
+    const char *interface,
+    const char *method,
+    const char *objectPath,
+    int timeoutMs
+) {
+    std::unique_lock<std::mutex> lck(mutexBus);
+    if (!dispatching)
+        return -ENOTCONN;
+    sd_bus_message *message = nullptr;
+    int r = sd_bus_message_new_method_call(bus, &message, BLUEZ, path, interface, method);
+    if (r >= 0 && objectPath)
+        r = sd_bus_message_append(message, "o", objectPath);
+    if (r < 0) {
+        sd_bus_message_unref(message);
+        return r;
+    }
+    return send(message, true, timeoutMs, lck);
+}
+
+int BluezBusSdBus::callAsync(
+    const char *path,
+    const char *interface,
+    const char *method,
+    int timeoutMs
+) {
+    std::unique_lock<std::mutex> lck(mutexBus);
+    if (!dispatching)
+        return -ENOTCONN;
+    sd_bus_message *message = nullptr;
+    int r = sd_bus_message_new_method_call(bus, &message, BLUEZ, path, interface, method);
+    if (r < 0) {
+        sd_bus_message_unref(message);
+        return r;
+    }
+    auto *call = new SdBusAsyncCall { this, path, method, strcmp(method, "GetManagedObjects") == 0 };
+    sd_bus_slot *slot = nullptr;
+    r = sd_bus_call_async(bus, &slot, message, onAsyncReply, call, (uint64_t) timeoutMs * 1000);
+    sd_bus_message_unref(message);
+    if (r < 0) {
+        delete call;
+        return r;
+    }
+    // bus keeps the slot until the reply or the bus is closed, the call is deleted with the slot
+    sd_bus_slot_set_destroy_callback(slot, deleteAsyncCall);
+    sd_bus_slot_set_floating(slot, 1);
+    sd_bus_slot_unref(slot);
+    wake();
+    return 0;
+}
+
+int BluezBusSdBus::setDiscoveryFilter(
+    const char *adapterPath,
+    const char *serviceUuid
+) {
+    std::unique_lock<std::mutex> lck(mutexBus);
+    if (!dispatching)
+        return -ENOTCONN;
+    sd_bus_message *message = nullptr;
+    int r = sd_bus_message_new_method_call(bus, &message, BLUEZ, adapterPath, "org.bluez.Adapter1", "SetDiscoveryFilter");
+    if (r >= 0)
+        r = sd_bus_message_append(message, "a{sv}", 3, "Transport", "s", "le", "DuplicateData", "b", 1,
+            "UUIDs", "as", 1, serviceUuid);
+    if (r < 0) {
+        sd_bus_message_unref(message);
+        return r;
+    }
+    return send(message, true, 25000, lck);
+}
+
+int BluezBusSdBus::writeValue(
+    const char *characteristicPath,
+    const void *data,
+    size_t size,
+    bool withResponse,
+    bool wait
+) {
+    std::unique_lock<std::mutex> lck(mutexBus);
+    if (!dispatching)
+        return -ENOTCONN;
+    sd_bus_message *message = nullptr;
+    int r = sd_bus_message_new_method_call(bus, &message, BLUEZ, characteristicPath, "org.bluez.GattCharacteristic1",
+        "WriteValue");
+    if (r >= 0)
+        r = sd_bus_message_append_array(message, 'y', data, size);
+    if (r >= 0)
+        r = sd_bus_message_append(message, "a{sv}", 1, "type", "s", withResponse ? "request" : "command");
+    if (r < 0) {
+        sd_bus_message_unref(message);
+        return r;
+    }
+    return send(message, wait, 25000, lck);
+}
@@ -0,0 +1,55 @@
+#ifndef BLUEZ_BUS_SDBUS_H
+#define BLUEZ_BUS_SDBUS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "bluez-bus.h"
+
+typedef struct sd_bus sd_bus;
+typedef struct sd_bus_message sd_bus_message;
+typedef struct sd_bus_error sd_bus_error;
+
+/**
+ * BluezBus over the sd-bus system bus connection (libsystemd).
+ * sd-bus is not thread safe: the bus thread dispatches signals and replies, callers queue messages
+ * under mutexBus and wait for the reply without holding it, so notifications keep coming during
+ * the long calls. callAsync() does not wait: the reply is passed to the listener.
+ */
+class BluezBusSdBus : public BluezBus {
+private:
+    sd_bus *bus;
+    std::mutex mutexBus;
+    /// replies received
+    std::condition_variable cvReply;
+    std::thread thread;
+    std::atomic<bool> stopRequest;
+    /// bus thread is running, false after the connection is lost
+    bool dispatching;
+    /// wakes the bus thread to flush messages queued by the callers
+    int wakeFd[2];
+
+    static int onSignal(sd_bus_message *message, void *userdata, sd_bus_error *retError);
+    static int onReply(sd_bus_message *message, void *userdata, sd_bus_error *retError);
+    static int onAsyncReply(sd_bus_message *message, void *userdata, sd_bus_error *retError);
+    void dispatchSignal(sd_bus_message *message);
+    void managedObjects(sd_bus_message *message);
+    int send(sd_bus_message *message, bool wait, int timeoutMs, std::unique_lock<std::mutex> &lck);
+    void wake();
+    void runDispatch();
+public:
+    BluezBusSdBus();
+    virtual ~BluezBusSdBus();
+
+    int start() override;
+    void stop() override;
+    int call(const char *path, const char *interface, const char *method, const char *objectPath = nullptr,
+        int timeoutMs = 25000) override;
+    int callAsync(const char *path, const char *interface, const char *method, int timeoutMs = 25000) override;
+    int setDiscoveryFilter(const char *adapterPath, const char *serviceUuid) override;
+    int writeValue(const char *characteristicPath, const void *data, size_t size, bool withResponse, bool wait) override;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include <cstdio>
+#include <cstring>
+
+#include "bluez-bus.h"
+
+/**
+ * Enter variant if its value is of the type, otherwise skip it
+ * @param contents signature of the value expected
+ * @return true if entered
+ */
+bool DBusReader::enterVariant(
+    const char *contents
+) {
+    char type;
+    const char *c;
+    if (!peek(type, c))
+        return false;
+    if (type == 'v' && c && strcmp(c, contents) == 0)
+        return enter('v', contents);
+    skip();
+    return false;
+}
+
+BluezBus::BluezBus()
+    : listener(nullptr)
+{
+}
+
+BluezBus::~BluezBus()
+{
+}
+
+/**
+ * Set receiver of the signals, waits for the signal being delivered
+ * @param value listener, nullptr- drop signals
+ */
+void BluezBus::setListener(
+    BluezBusListener *value
+) {
+    std::unique_lock<std::mutex> lck(mutexListener);
+    listener = value;
+}
+
+/**
+ * Object path of the device: <adapter>/dev_XX_XX_XX_XX_XX_XX
+ * @param retPath receives path
+ * @param size buffer size
+ * @param adapterPath adapter, e.g. /org/bluez/hci0
+ * @param addr Bluetooth address
+ * @return path length, >= size if the buffer is too small
+ */
+int bluezDevicePath(
+    char *retPath,
+    size_t size,
+    const char *adapterPath,
+    uint64_t addr
+) {
+    return snprintf(retPath, size, "%s/dev_%02X_%02X_%02X_%02X_%02X_%02X", adapterPath,
+        (unsigned) (addr >> 40) & 0xff, (unsigned) (addr >> 32) & 0xff, (unsigned) (addr >> 24) & 0xff,
+        (unsigned) (addr >> 16) & 0xff, (unsigned) (addr >> 8) & 0xff, (unsigned) addr & 0xff);
+}
+
+static int hexDigit(
+    char c
+) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/**
+ * Address of the device the object belongs to: device, its service, characteristic or descriptor
+ * @param path object path
+ * @param retAddr receives Bluetooth address
+ * @return false if the path is not under a device
+ */
+bool bluezPathAddr(
+    const char *path,
+    uint64_t &retAddr
+) {
+    const char *p = strstr(path, "/dev_");
+    if (!p)
+        return false;
+    p += 5;
+    uint64_t a = 0;
+    for (int i = 0; i < 6; i++) {
+        int h = hexDigit(p[0]);
+        int l = hexDigit(p[1]);
+        if (h < 0 || l < 0)
+            return false;
+        a = (a << 8) | (uint64_t) (h << 4 | l);
+        p += 2;
+        if (i < 5 && *p++ != '_')
+            return false;
+    }
+    if (*p && *p != '/')
+        return false;
+    retAddr = a;
+    return true;
+}
@@ -0,0 +1,139 @@
+#ifndef BLUEZ_BUS_H
+#define BLUEZ_BUS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Read cursor over the body of the D-Bus message, same calls as sd_bus_message_read_*().
+ * Containers must be read or skipped to the end before exit().
+ */
+class DBusReader {
+public:
+    virtual ~DBusReader() = default;
+    /**
+     * @param retType type of the next value: 'y', 'b', 'n', 'q', 'i', 'u', 's', 'o', 'a', 'e' or 'v'
+     * @param retContents signature of the array elements, dictionary entry or variant value, nullptr for basic types
+     * @return false at the end of the container
+     */
+    virtual bool peek(char &retType, const char *&retContents) = 0;
+    /**
+     * Enter array 'a', dictionary entry 'e' or variant 'v'
+     * @param type container type
+     * @param contents signature of the contents
+     * @return false if the next value is not the container or there are no more array elements
+     */
+    virtual bool enter(char type, const char *contents) = 0;
+    virtual bool exit() = 0;
+    /**
+     * Read basic value: 'y' uint8_t, 'b' int, 'n' int16_t, 'q' uint16_t, 'i' int32_t, 'u' uint32_t,
+     * 's' and 'o' const char * valid until the message is released
+     * @param type value type
+     * @param retValue receives value
+     * @return false if the next value is of other type
+     */
+    virtual bool read(char type, void *retValue) = 0;
+    /**
+     * Read byte array 'ay' without copying
+     * @param retData bytes valid until the message is released
+     * @param retSize bytes count
+     */
+    virtual bool readBytes(const void *&retData, size_t &retSize) = 0;
+    /// skip the next value
+    virtual bool skip() = 0;
+
+    bool enterVariant(const char *contents);
+};
+
+/**
+ * Receives org.bluez signals and the replies to BluezBus::callAsync() on the bus thread, one call at a time.
+ * The listener must not call the bus.
+ */
+class BluezBusListener {
+public:
+    /**
+     * ObjectManager.InterfacesAdded or an object of GetManagedObjects()
+     * @param path object path
+     * @param interfaces a{sa{sv}} interfaces and their properties
+     */
+    virtual void interfacesAdded(const char *path, DBusReader &interfaces) = 0;
+    /**
+     * @param path object path
+     * @param interfaces as interfaces removed
+     */
+    virtual void interfacesRemoved(const char *path, DBusReader &interfaces) = 0;
+    /**
+     * Properties.PropertiesChanged
+     * @param path object path
+     * @param interface interface of the properties
+     * @param changed a{sv} changed properties
+     */
+    virtual void propertiesChanged(const char *path, const char *interface, DBusReader &changed) = 0;
+    /**
+     * Reply to BluezBus::callAsync()
+     * @param path object called
+     * @param method method called
+     * @param result 0 or negative errno
+     */
+    virtual void replied(const char *path, const char *method, int result) = 0;
+};
+
+/**
+ * Calls to bluetoothd the BlueZ backend makes and the signals it receives.
+ * Implemented over sd-bus (bluez-bus-sdbus.h) and by the mock backed by simulated labels (bluez-bus-mock.h).
+ * Methods return 0 or negative errno.
+ */
+class BluezBus {
+protected:
+    /// held while the listener is called
+    std::mutex mutexListener;
+    BluezBusListener *listener;
+public:
+    BluezBus();
+    virtual ~BluezBus();
+    void setListener(BluezBusListener *value);
+
+    /// subscribe to org.bluez signals, does nothing if started
+    virtual int start() = 0;
+    virtual void stop() = 0;
+    /**
+     * Call method without arguments or with one object path, wait for the reply
+     * @param path object
+     * @param interface interface
+     * @param method method
+     * @param objectPath argument, nullptr- none
+     * @param timeoutMs reply timeout
+     */
+    virtual int call(const char *path, const char *interface, const char *method, const char *objectPath = nullptr,
+        int timeoutMs = 25000) = 0;
+    /**
+     * Call method without arguments, return when the call is queued. The reply goes to BluezBusListener::replied(),
+     * objects of the ObjectManager.GetManagedObjects reply to interfacesAdded() before it.
+     * @param path object
+     * @param interface interface
+     * @param method method
+     * @param timeoutMs reply timeout
+     */
+    virtual int callAsync(const char *path, const char *interface, const char *method, int timeoutMs = 25000) = 0;
+    /**
+     * Adapter1.SetDiscoveryFilter: LE only, every advertisement reported, devices advertising the service only
+     * @param adapterPath adapter
+     * @param serviceUuid service UUID
+     */
+    virtual int setDiscoveryFilter(const char *adapterPath, const char *serviceUuid) = 0;
+    /**
+     * GattCharacteristic1.WriteValue
+     * @param characteristicPath characteristic
+     * @param data value, copied to the message
+     * @param size value size
+     * @param withResponse "request" write acknowledged by the device, "command" otherwise
+     * @param wait wait for the reply, otherwise return when the message is queued and ignore the reply
+     */
+    virtual int writeValue(const char *characteristicPath, const void *data, size_t size, bool withResponse, bool wait) = 0;
+};
+
+int bluezDevicePath(char *retPath, size_t size, const char *adapterPath, uint64_t addr);
+bool bluezPathAddr(const char *path, uint64_t &retAddr);
+
+#endif
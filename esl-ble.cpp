@@ -102,7 +102,7 @@ public:
 
 static void run()
 {
-    Png2sRgb png;
+    Png2sRgb png(true);
     int32_t sz = png.loadFile(fn);
     if (sz < 0) {
         std::cerr << "Error load image from the " << fn << " file" << std::endl;
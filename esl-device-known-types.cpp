@@ -1,4 +1,5 @@
 #include <sstream>
+#include <vector>
 #include "esl-device-known-types.h"
 
 static ESLDeviceKnownType eslDeviceKnownTypes1[] {
@@ -53,6 +54,12 @@ static ESLDeviceKnownType eslDeviceKnownTypes2[]{
     012B    00000001 00101(5)011   9  800x480 BWR
 */
 
+/*
+ * Firmware accepting compressed images: hardware version and minimal software version.
+ * No known devices yet, add them by addCompression()
+ */
+static std::vector<std::pair<uint8_t, uint8_t>> compressionFirmware;
+
 const ESLDeviceKnownType *ESLDeviceKnownTypes::find(
     uint8_t typ2
 ) {
@@ -66,3 +73,32 @@ std::string ESLDeviceKnownType::pixelSizeString() const {
     ss << (int) w << 'x' << (int) h;
     return ss.str();
 }
+
+/**
+ * Register firmware accepting compressed images
+ * @param hardwareVersion hardware version
+ * @param minSoftwareVersion first software version with compression
+ */
+void ESLDeviceKnownTypes::addCompression(
+    uint8_t hardwareVersion,
+    uint8_t minSoftwareVersion
+) {
+    compressionFirmware.emplace_back(hardwareVersion, minSoftwareVersion);
+}
+
+/**
+ * Check does firmware accept compressed images
+ * @param hardwareVersion hardware version
+ * @param softwareVersion software version
+ * @return true if compression registered by addCompression()
+ */
+bool ESLDeviceKnownTypes::compression(
+    uint8_t hardwareVersion,
+    uint8_t softwareVersion
+) {
+    for (auto &f : compressionFirmware) {
+        if (f.first == hardwareVersion && softwareVersion >= f.second)
+            return true;
+    }
+    return false;
+}
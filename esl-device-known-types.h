@@ -15,6 +15,8 @@ public:
 class ESLDeviceKnownTypes {
 public:
     static const ESLDeviceKnownType* find(uint8_t typ2);
+    static void addCompression(uint8_t hardwareVersion, uint8_t minSoftwareVersion);
+    static bool compression(uint8_t hardwareVersion, uint8_t softwareVersion);
 };
 
 #endif
@@ -5,7 +5,6 @@
 
 #include "esl-string-helper-win.h"
 
-const char ADDR_DELIMITER = ':';
 const char UUID_DELIMITER = '-';
 const char NUMBER_FILL = '0';
 
@@ -34,38 +33,6 @@ static const char* asyncStatusStrings[] {
     "error"
 };
 
-std::string macAddress2string(
-    uint64_t addr
-)
-{
-    std::stringstream ss;
-    ss << std::hex << std::setfill(NUMBER_FILL);
-    for (int i = 5; i > 0; i--) {
-        ss << std::setw(2) << ((addr >> (i * 8)) & 0xff) << ADDR_DELIMITER;
-    }
-    ss << std::setw(2) << (addr & 0xff);
-    return ss.str();
-}
-
-
-std::string hex(
-    const std::string &str
-) {
-    return hex((void *) str.c_str(), str.size());
-}
-
-std::string hex(
-    void *buffer,
-    size_t size
-) {
-    std::stringstream ss;
-    ss << std::hex << std::setfill(NUMBER_FILL);
-    for (size_t i = 0; i < size; i++) {
-        ss << std::setw(2) << (int) *(((unsigned char*) buffer)  + i);
-    }
-    return ss.str();
-}
-
 std::string characteristicProperties2String(
     const winrt::Windows::Devices::Bluetooth::GenericAttributeProfile::GattCharacteristic &characteristic
 )
@@ -169,77 +136,3 @@ std::string asyncStatus2string(
     return asyncStatusStrings[(int) status];
 }
 
-std::string currentTimeStamp()
-{
-    std::time_t t = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-    std::tm *tm = std::localtime(&t);
-    std::stringstream ss;
-    ss << std::put_time(tm, "%FT%T%z");
-    return ss.str();
-}
-
-uint64_t string2macAddress(
-    const std::string &str,
-    bool *retValid
-) {
-    std::string s(str);
-    s.erase(std::remove(s.begin(), s.end(), ':'), s.end());
-    if (s.size() + 5 != str.size()) {
-        // must have 5 ':' delimiters
-        if (retValid)
-            *retValid = false;
-        return ULLONG_MAX;
-    }
-
-    uint64_t r = strtoull(s.c_str(), nullptr, 16);
-    if (r == ULLONG_MAX) {
-        // check is it an error
-        if (errno == ERANGE) {
-            if (s.find_first_not_of("0123456789abcdefABCDEF") == std::string::npos) {
-                if (retValid)
-                    *retValid = false;
-            }
-        }
-    }
-    if (retValid)
-        *retValid = true;
-    return r;
-}
-
-bool isMacAddressString(
-    const std::string &str
-) {
-    bool r;
-    string2macAddress(str, &r);
-    return r;
-}
-
-bool isHex(
-        const std::string &value
-) {
-    return value.find_first_not_of("0123456789abcdefABCDEF") == std::string::npos;
-}
-
-static std::string readHex(
-    std::istream &s
-)
-{
-    std::stringstream r;
-    s >> std::noskipws;
-    char c[3] = {0, 0, 0};
-    while (s >> c[0]) {
-        if (!(s >> c[1]))
-            break;
-        auto x = (unsigned char) strtol(c, nullptr, 16);
-        r << x;
-    }
-    return r.str();
-}
-
-std::string hex2string(
-    const std::string &hex
-)
-{
-    std::stringstream ss(hex);
-    return readHex(ss);
-}
@@ -0,0 +1,17 @@
+#ifndef ESL_STRING_HELPER_H
+#define ESL_STRING_HELPER_H
+
+#include <cinttypes>
+#include <string>
+
+std::string macAddress2string(uint64_t addr);
+// check is valid MAC address e.g. 9c:13:9e:a0:b7:5d
+bool isMacAddressString(const std::string &str);
+uint64_t string2macAddress(const std::string &str, bool *retValid = nullptr);
+std::string hex(const std::string &str);
+std::string hex(void *buffer, size_t size);
+std::string currentTimeStamp();
+bool isHex(const std::string &value);
+std::string hex2string(const std::string &hex);
+
+#endif
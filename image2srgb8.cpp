@@ -1,24 +1,217 @@
-#include <filesystem>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <vector>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "image2srgb8.h"
 
+Image2sRgb::Image2sRgb()
+    : mapped(nullptr), mappedSize(0), srgb(nullptr), w(0), h(0)
+{
+}
+
+Image2sRgb::~Image2sRgb()
+{
+    releaseFile();
+}
+
+/**
+ * Read the rest of the stream, for pipes and files that can not be mapped
+ */
+static bool readAll(
+    std::istream &in,
+    std::vector<char> &buf
+) {
+    char block[65536];
+    while (in.read(block, sizeof(block)) || in.gcount() > 0)
+        buf.insert(buf.end(), block, block + in.gcount());
+    return !in.bad();
+}
+
+/**
+ * Map regular file read-only.
+ * @return mapped file, null if file can not be mapped (pipe, empty file, no memory)
+ */
+static void *mapFile(
+    const char *fileName,
+    size_t &size
+) {
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER fileSize;
+    void *r = nullptr;
+    if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) {
+            r = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            // view keeps the mapping alive
+            CloseHandle(mapping);
+            size = (size_t) fileSize.QuadPart;
+        }
+    }
+    CloseHandle(file);
+    return r;
+#else
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    void *r = nullptr;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        r = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (r == MAP_FAILED)
+            r = nullptr;
+        else {
+            size = (size_t) st.st_size;
+            // decoder reads the file once, front to back
+            madvise(r, size, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd);
+    return r;
+#endif
+}
+
+static void unmapFile(
+    void *data,
+    size_t size
+) {
+#if defined(_WIN32)
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+/**
+ * Release the file kept by loadFile()
+ */
+void Image2sRgb::releaseFile()
+{
+    if (mapped)
+        unmapFile(mapped, mappedSize);
+    mapped = nullptr;
+    mappedSize = 0;
+    std::vector<char>().swap(fileBuffer);
+}
+
+/**
+ * @return true if load() keeps a view of its source instead of decoding it, loadFile() keeps the file then
+ */
+bool Image2sRgb::refersToSource() const
+{
+    return false;
+}
+
+/**
+ * Load image from the file. Regular files are mapped to memory and passed to load() without copying,
+ * pipes and special files are read to the buffer. File name "-" means standard input.
+ * The file is kept until the next loadFile() if the image refers to it (streaming PNG).
+ * @return load() result, -1 if file can not be opened, -2 if read error
+ */
 int32_t Image2sRgb::loadFile(
     const char* fileName
 ) {
-    // Get size of file to know how much memory to allocate
-    std::uintmax_t fileSize = std::filesystem::file_size(fileName);
-    // Allocate buffer to hold file
-    char *buf = new char[fileSize];
-    if (!buf)
-        return -1;
-    // Read file
-    std::ifstream fin(fileName, std::ios::binary);
-    fin.read(buf, fileSize);
-    if (!fin) {
-        return -2;
+    releaseFile();
+    bool stdIn = strcmp(fileName, "-") == 0;
+    if (!stdIn) {
+        size_t size = 0;
+        void *m = mapFile(fileName, size);
+        if (m) {
+            int32_t r = load(m, size);
+            if (r >= 0 && refersToSource()) {
+                mapped = m;
+                mappedSize = size;
+            } else
+                unmapFile(m, size);
+            return r;
+        }
+    }
+    std::vector<char> buf;
+    if (stdIn) {
+        if (!readAll(std::cin, buf))
+            return -2;
+    } else {
+        std::ifstream fin(fileName, std::ios::binary);
+        if (!fin)
+            return -1;
+        if (!readAll(fin, buf))
+            return -2;
     }
-    fin.close();
-    int r = load(buf, fileSize);
-    free(buf);
+    int32_t r = load(buf.data(), buf.size());
+    // swap keeps the data where load() saw it
+    if (r >= 0 && refersToSource())
+        fileBuffer.swap(buf);
     return r;
 }
+
+/**
+ * Non-cryptographic 64-bit hash, 8 bytes per step
+ */
+uint64_t Image2sRgb::hashBytes(
+    const void *data,
+    size_t size,
+    uint64_t seed
+) {
+    const uint64_t k = 0x9E3779B97F4A7C15ull;
+    auto p = (const uint8_t *) data;
+    uint64_t h = seed ^ (size * k);
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v *= 0xFF51AFD7ED558CCDull;
+        v ^= v >> 32;
+        h = (h ^ v) * k;
+    }
+    uint64_t tail = 0;
+    if (size)
+        memcpy(&tail, p, size);
+    h = (h ^ tail) * k;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Hash of the loaded image, equal images have equal hashes
+ * @return hash of image size and pixels
+ */
+uint64_t Image2sRgb::contentHash()
+{
+    uint64_t size = ((uint64_t) w << 32) | h;
+    if (!srgb)
+        return hashBytes(nullptr, 0, size);
+    return hashBytes(srgb, (size_t) w * h * sizeof(SRgb8), size);
+}
+
+/**
+ * Pack loaded image to the buffer for ESL device
+ * @see packSRgb8()
+ * @return bytes written, <0 if error
+ */
+int Image2sRgb::pack(
+    void *dst,
+    uint32_t width,
+    uint32_t height,
+    bool hasRed,
+    bool hasYellow,
+    bool mirror,
+    bool compress,
+    uint16_t rotation
+) {
+    if (!srgb)
+        return -1;
+    return packSRgb8(dst, srgb, width, height, hasRed, hasYellow, mirror, compress, rotation);
+}
@@ -1,15 +1,32 @@
 #ifndef IMAGE2SRGB8_H
 #define IMAGE2SRGB8_H
 
+#include <cstddef>
+#include <vector>
 #include "srgb-pack.h"
 
 class Image2sRgb {
+private:
+    /// file mapped by loadFile(), kept while the image refers to it
+    void *mapped;
+    size_t mappedSize;
+    /// file read by loadFile() from a pipe, kept while the image refers to it
+    std::vector<char> fileBuffer;
+protected:
+    void releaseFile();
+    virtual bool refersToSource() const;
 public:
+    static uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 0);
     SRgb8 *srgb;
     uint32_t w;
     uint32_t h;
+    Image2sRgb();
+    virtual ~Image2sRgb();
     virtual int32_t load(void *src, size_t srcSize) = 0;
     int32_t loadFile(const char* fileName);
+    virtual int pack(void *dst, uint32_t width, uint32_t height, bool hasRed, bool hasYellow, bool mirror, bool compress,
+        uint16_t rotation = 0);
+    virtual uint64_t contentHash();
 };
 
 #endif
@@ -1,6 +1,6 @@
 #include <sstream>
 #include "nemr-5053-manufacturer-specific-data.h"
-#include "esl-string-helper-win.h"
+#include "esl-string-helper.h"
 
 static uint16_t PIXEL_WIDTH_0_7[8] {212, 128, 400, 640, 960, 196, 640, 250 };
 static uint16_t PIXEL_HEIGHT_0_7[8] {104, 296, 300, 384, 640, 96, 480, 122 };
@@ -8,7 +8,7 @@ static uint16_t PIXEL_HEIGHT_0_7[8] {104, 296, 300, 384, 640, 96, 480, 122 };
 NEMR5053_MANUFACTURER_SPECIFIC_DATA& NEMR5053_MANUFACTURER_SPECIFIC_DATA::operator=(
     const NEMR5053_MANUFACTURER_SPECIFIC_DATA& other
 ) {
-    memmove(&magicNumber50, &other.magicNumber50, sizeof(NEMR5053_MANUFACTURER_SPECIFIC_DATA));
+    memmove(&magicNumber53, &other.magicNumber53, sizeof(NEMR5053_MANUFACTURER_SPECIFIC_DATA));
     return *this;
 }
 
@@ -96,6 +96,13 @@ uint32_t NEMR5053ManufacturerSpecificData::screenSize() const {
     return lineBytes * width() * colorCount();
 }
 
+/**
+ * @return true if device firmware accepts compressed images
+ */
+bool NEMR5053ManufacturerSpecificData::compression() const {
+    return ESLDeviceKnownTypes::compression(hardwareVersion(), softwareVersion());
+}
+
 uint8_t NEMR5053ManufacturerSpecificData::voltage10() const
 {
     return val.volt10;;
@@ -108,6 +108,7 @@ public:
     uint8_t type2() const;
     uint16_t type12() const;
     uint32_t screenSize() const;
+    bool compression() const;
 
     void setWidth(uint16_t width);
     void setHeight(uint16_t height);
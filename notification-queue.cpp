@@ -0,0 +1,175 @@
+#include <cstring>
+
+#include "notification-queue.h"
+
+NotificationSignal::NotificationSignal()
+    : sequence(0)
+{
+}
+
+void NotificationSignal::notify()
+{
+    {
+        std::unique_lock<std::mutex> lck(mutex);
+        sequence++;
+    }
+    cv.notify_all();
+}
+
+/**
+ * @return notifications pushed so far, read before checking the queues and passed to wait()
+ */
+uint64_t NotificationSignal::current()
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    return sequence;
+}
+
+/**
+ * Wait for a notification pushed after current() returned seen
+ * @param seen current() value
+ * @param until timeout
+ * @return false if timed out
+ */
+bool NotificationSignal::wait(
+    uint64_t seen,
+    std::chrono::steady_clock::time_point until
+) {
+    std::unique_lock<std::mutex> lck(mutex);
+    return cv.wait_until(lck, until, [this, seen] {
+        return sequence != seen;
+    });
+}
+
+NotificationQueue::NotificationQueue()
+    : head(0), count(0), signal(nullptr), dropped(0)
+{
+}
+
+/**
+ * Queue notification, called by the backend callback thread
+ * @param data notification, longer than Notification::MAX_SIZE is truncated
+ * @param size notification size
+ * @param deliverAt pop() returns it not before this time
+ * @return false if the queue was full and the oldest notification is dropped
+ */
+bool NotificationQueue::push(
+    const void *data,
+    size_t size,
+    std::chrono::steady_clock::time_point deliverAt
+) {
+    bool full;
+    {
+        std::unique_lock<std::mutex> lck(mutex);
+        full = count == CAPACITY;
+        if (full) {
+            head = (head + 1) % CAPACITY;
+            count--;
+            dropped++;
+        }
+        Notification &n = items[(head + count) % CAPACITY];
+        n.deliverAt = deliverAt;
+        n.size = (uint8_t) (size < Notification::MAX_SIZE ? size : Notification::MAX_SIZE);
+        memcpy(n.data, data, n.size);
+        count++;
+    }
+    cv.notify_one();
+    NotificationSignal *s = signal;
+    if (s)
+        s->notify();
+    return !full;
+}
+
+/**
+ * Wait for the first notification and remove it
+ * @param buffer receives the notification
+ * @param size buffer size, longer notification is truncated
+ * @param milliseconds timeout
+ * @return bytes copied, -1 if timed out
+ */
+int NotificationQueue::pop(
+    void *buffer,
+    uint32_t size,
+    int milliseconds
+) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+    std::unique_lock<std::mutex> lck(mutex);
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        if (count && items[head].deliverAt <= now) {
+            const Notification &n = items[head];
+            uint32_t sz = n.size < size ? n.size : size;
+            memcpy(buffer, n.data, sz);
+            head = (head + 1) % CAPACITY;
+            count--;
+            return (int) sz;
+        }
+        if (now >= deadline)
+            return -1;
+        auto t = deadline;
+        if (count && items[head].deliverAt < t)
+            t = items[head].deliverAt;
+        cv.wait_until(lck, t);
+    }
+}
+
+/**
+ * Wait until the first notification can be read without waiting
+ * @param until timeout
+ * @return false if timed out
+ */
+bool NotificationQueue::wait(
+    std::chrono::steady_clock::time_point until
+) {
+    std::unique_lock<std::mutex> lck(mutex);
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        if (count && items[head].deliverAt <= now)
+            return true;
+        if (now >= until)
+            return false;
+        auto t = until;
+        if (count && items[head].deliverAt < t)
+            t = items[head].deliverAt;
+        cv.wait_until(lck, t);
+    }
+}
+
+/**
+ * @param retValue returns delivery time of the first notification
+ * @return false if the queue is empty
+ */
+bool NotificationQueue::nextDeliverAt(
+    std::chrono::steady_clock::time_point &retValue
+) {
+    std::unique_lock<std::mutex> lck(mutex);
+    if (!count)
+        return false;
+    retValue = items[head].deliverAt;
+    return true;
+}
+
+/**
+ * @param value signal notified by push() besides the reader of this queue, nullptr- none
+ */
+void NotificationQueue::setSignal(
+    NotificationSignal *value
+) {
+    signal = value;
+}
+
+/**
+ * Drop notifications left from the previous session
+ */
+void NotificationQueue::clear()
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    head = 0;
+    count = 0;
+}
+
+size_t NotificationQueue::size()
+{
+    std::unique_lock<std::mutex> lck(mutex);
+    return count;
+}
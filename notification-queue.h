@@ -0,0 +1,69 @@
+#ifndef NOTIFICATION_QUEUE_H
+#define NOTIFICATION_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Notification received from the device, fixed size so it can be queued without allocation
+ */
+class Notification {
+public:
+    /// default ATT MTU 23 less 3 bytes of the header, label responses are up to 6 bytes
+    static const size_t MAX_SIZE = 20;
+    /// when the host receives it, later for notifications on the simulated link
+    std::chrono::steady_clock::time_point deliverAt;
+    uint8_t size;
+    uint8_t data[MAX_SIZE];
+};
+
+/**
+ * Wakes the thread driving sessions of many devices when any of their queues receives a notification
+ */
+class NotificationSignal {
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    /// notifications pushed so far
+    uint64_t sequence;
+public:
+    NotificationSignal();
+    void notify();
+    uint64_t current();
+    bool wait(uint64_t seen, std::chrono::steady_clock::time_point until);
+};
+
+/**
+ * Bounded FIFO of notifications of one device with its own wait primitive:
+ * a notification wakes only the thread reading this device.
+ * When full, the oldest notification is dropped and counted.
+ */
+class NotificationQueue {
+private:
+    static const size_t CAPACITY = 32;
+    std::mutex mutex;
+    std::condition_variable cv;
+    Notification items[CAPACITY];
+    /// first notification
+    size_t head;
+    size_t count;
+    std::atomic<NotificationSignal *> signal;
+public:
+    /// notifications lost because the queue was full
+    std::atomic<uint32_t> dropped;
+
+    NotificationQueue();
+    bool push(const void *data, size_t size,
+        std::chrono::steady_clock::time_point deliverAt = std::chrono::steady_clock::now());
+    int pop(void *buffer, uint32_t size, int milliseconds);
+    bool wait(std::chrono::steady_clock::time_point until);
+    bool nextDeliverAt(std::chrono::steady_clock::time_point &retValue);
+    void setSignal(NotificationSignal *value);
+    void clear();
+    size_t size();
+};
+
+#endif
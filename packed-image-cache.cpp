@@ -0,0 +1,117 @@
+#include <tuple>
+
+#include "packed-image-cache.h"
+#include "image2srgb8.h"
+#include "srgb-pack.h"
+
+bool PackedImageCache::Key::operator<(
+    const Key &other
+) const {
+    return std::tie(contentHash, width, height, flags, rotation)
+        < std::tie(other.contentHash, other.width, other.height, other.flags, other.rotation);
+}
+
+PackedImageCache::PackedImageCache(
+    size_t aMaxBytes
+)
+    : totalBytes(0), maxBytes(aMaxBytes), hits(0), misses(0)
+{
+}
+
+/**
+ * Drop least recently used images until there is room for addBytes more
+ */
+void PackedImageCache::evict(
+    size_t addBytes
+) {
+    while (!lru.empty() && totalBytes + addBytes > maxBytes) {
+        totalBytes -= lru.back().second->size();
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+/**
+ * Return image packed for the device, pack it on the first request.
+ * Image is packed outside the lock, two threads asking for the same new image at once may both pack it.
+ * Image larger than the limit is packed but not kept.
+ * @param img loaded image
+ * @param retError if not null, returns pack() error or -2 if insufficient memory
+ * @return packed image, null if error
+ * @see packSRgb8()
+ */
+PackedImage PackedImageCache::get(
+    Image2sRgb *img,
+    uint32_t width,
+    uint32_t height,
+    bool hasRed,
+    bool hasYellow,
+    bool mirror,
+    bool compress,
+    uint16_t rotation,
+    int *retError
+) {
+    Key key { img->contentHash(), width, height,
+        (uint8_t) ((hasRed ? 1 : 0) | (hasYellow ? 2 : 0) | (mirror ? 4 : 0) | (compress ? 8 : 0)), rotation };
+    {
+        std::unique_lock<std::mutex> lck(mutexCache);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            hits++;
+            return it->second->second;
+        }
+        misses++;
+    }
+    std::shared_ptr<std::vector<uint8_t>> packed;
+    int sz;
+    try {
+        packed = std::make_shared<std::vector<uint8_t>>(packSRgb8Size(width, height, hasRed, hasYellow, compress));
+        sz = img->pack(packed->data(), width, height, hasRed, hasYellow, mirror, compress, rotation);
+        if (sz >= 0) {
+            packed->resize((size_t) sz);
+            packed->shrink_to_fit();
+        }
+    } catch (std::bad_alloc &) {
+        sz = -2;
+    }
+    if (sz < 0) {
+        if (retError)
+            *retError = sz;
+        return nullptr;
+    }
+    std::unique_lock<std::mutex> lck(mutexCache);
+    auto it = index.find(key);
+    if (it != index.end())
+        return it->second->second;
+    if (packed->size() <= maxBytes) {
+        evict(packed->size());
+        lru.emplace_front(key, packed);
+        index[key] = lru.begin();
+        totalBytes += packed->size();
+    }
+    return packed;
+}
+
+void PackedImageCache::clear()
+{
+    std::unique_lock<std::mutex> lck(mutexCache);
+    lru.clear();
+    index.clear();
+    totalBytes = 0;
+}
+
+size_t PackedImageCache::count()
+{
+    std::unique_lock<std::mutex> lck(mutexCache);
+    return index.size();
+}
+
+/**
+ * @return total size of cached images in bytes
+ */
+size_t PackedImageCache::bytes()
+{
+    std::unique_lock<std::mutex> lck(mutexCache);
+    return totalBytes;
+}
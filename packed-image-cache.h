@@ -0,0 +1,59 @@
+#ifndef PACKED_IMAGE_CACHE_H
+#define PACKED_IMAGE_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class Image2sRgb;
+
+/**
+ * Packed image (see packSRgb8()) shared read-only by concurrent uploads
+ */
+typedef std::shared_ptr<const std::vector<uint8_t>> PackedImage;
+
+/**
+ * Planes packed for the device, keyed by image content hash and packing parameters,
+ * so the same image sent to many identical labels is packed once.
+ * Least recently used images are evicted when total size exceeds the limit.
+ */
+class PackedImageCache {
+private:
+    class Key {
+    public:
+        uint64_t contentHash;
+        uint32_t width;
+        uint32_t height;
+        /// hasRed, hasYellow, mirror, compress bits
+        uint8_t flags;
+        uint16_t rotation;
+        bool operator<(const Key &other) const;
+    };
+    typedef std::list<std::pair<Key, PackedImage>> LruList;
+
+    std::mutex mutexCache;
+    /// most recently used first
+    LruList lru;
+    std::map<Key, LruList::iterator> index;
+    size_t totalBytes;
+
+    void evict(size_t addBytes);
+public:
+    /// total size limit in bytes
+    size_t maxBytes;
+    // statistics
+    uint32_t hits;
+    uint32_t misses;
+
+    explicit PackedImageCache(size_t maxBytes = 64 * 1024 * 1024);
+    PackedImage get(Image2sRgb *img, uint32_t width, uint32_t height, bool hasRed, bool hasYellow, bool mirror,
+        bool compress, uint16_t rotation = 0, int *retError = nullptr);
+    void clear();
+    size_t count();
+    size_t bytes();
+};
+
+#endif
@@ -2,11 +2,12 @@
 #define PLATFORM_H
 
 #include <cinttypes>
+#include <cstring>
 #include <string>
 
 // #define PACK( __Declaration__ ) __Declaration__
 #ifdef __GNUC__
-#define PACK( __Declaration__ ) __Declaration__ __attribute__((__packed__))
+#define PACK( __Declaration__ ) _Pragma("pack(push, 1)") __Declaration__ _Pragma("pack(pop)")
 #else
 #ifdef _MSC_VER
 #define PACK( __Declaration__ ) __pragma( pack(push, 1) ) __Declaration__ __pragma( pack(pop))
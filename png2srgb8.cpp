@@ -1,15 +1,50 @@
 #include "png2srgb8.h"
 #include "wpng/wpng_read.h"
 
+Png2sRgb::Png2sRgb(
+    bool aStreaming,
+    bool trusted
+)
+    : streaming(aStreaming), flags(trusted ? WPNG_READ_SKIP_IDAT_CRC : 0), png(nullptr), pngSize(0)
+{
+}
+
+Png2sRgb::~Png2sRgb()
+{
+    free(srgb);
+}
+
+/**
+ * Decode PNG image. In streaming mode, check PNG and keep the view of it, the caller keeps srcPng
+ * until the last pack() or contentHash().
+ * @return decoded image size in bytes, in streaming mode PNG size, <0 if error
+ */
 int32_t Png2sRgb::load(
     void *srcPng,
     size_t srcPngSize
 ) {
+    free(srgb);
+    srgb = nullptr;
+    png = nullptr;
+    pngSize = 0;
+    // previous file, loadFile() keeps the new one after load() returns
+    releaseFile();
     byte_buffer inBuffer = {(uint8_t *) srcPng, srcPngSize, srcPngSize, 0 };
     wpng_load_output output;
     memset(&output, 0, sizeof(wpng_load_output));
-    uint32_t flags = WPNG_READ_FORCE_8BIT;
-    wpng_load(&inBuffer, flags, &output);
+    if (streaming) {
+        wpng_chunks chunks;
+        wpng_read_chunks(&inBuffer, flags, &chunks, &output);
+        free(chunks.idat.data);
+        if (output.error)
+            return -2;
+        png = (const uint8_t *) srcPng;
+        pngSize = srcPngSize;
+        w = chunks.width;
+        h = chunks.height;
+        return (int32_t) srcPngSize;
+    }
+    wpng_load(&inBuffer, flags | WPNG_READ_FORCE_8BIT, &output);
     if (output.error)
         return -2;
     srgb = (SRgb8*) output.data;
@@ -17,3 +52,71 @@ int32_t Png2sRgb::load(
     h = output.height;
     return (int32_t) output.size;
 }
+
+static int putRow(
+    void *packer,
+    const uint8_t *rgba,
+    uint32_t
+) {
+    return ((SRgb8RowPacker *) packer)->put((const SRgb8 *) rgba) ? 1 : 0;
+}
+
+/**
+ * Pack image to the buffer for ESL device. In streaming mode decode PNG scanline by scanline,
+ * memory used is two scanlines and eight sRGB rows instead of the whole image.
+ * @see packSRgb8()
+ * @return bytes written, <0 if error
+ */
+int Png2sRgb::pack(
+    void *dst,
+    uint32_t width,
+    uint32_t height,
+    bool hasRed,
+    bool hasYellow,
+    bool mirror,
+    bool compress,
+    uint16_t rotation
+) {
+    if (!streaming)
+        return Image2sRgb::pack(dst, width, height, hasRed, hasYellow, mirror, compress, rotation);
+    uint32_t size = packSRgb8Size(width, height, hasRed, hasYellow, false);
+    void *planes = dst;
+    if (compress) {
+        planes = malloc(size);
+        if (!planes)
+            return -1;
+    }
+    SRgb8RowPacker packer;
+    int r = packer.init(planes, width, height, hasRed, hasYellow, mirror, rotation);
+    if (r == 0 && (packer.sourceWidth != w || packer.sourceHeight != h))
+        r = -1;
+    if (r == 0) {
+        byte_buffer inBuffer = {(uint8_t *) png, pngSize, pngSize, 0 };
+        wpng_load_output output;
+        memset(&output, 0, sizeof(wpng_load_output));
+        wpng_load_rows(&inBuffer, flags, putRow, &packer, &output);
+        r = output.error ? -2 : (int) size;
+    }
+    if (compress) {
+        if (r >= 0)
+            r = (int) compressPlanes(dst, planes, size);
+        free(planes);
+    }
+    return r;
+}
+
+/**
+ * In streaming mode, hash of PNG file, otherwise of decoded pixels
+ * @see Image2sRgb::contentHash()
+ */
+uint64_t Png2sRgb::contentHash()
+{
+    if (!streaming)
+        return Image2sRgb::contentHash();
+    return hashBytes(png, pngSize, ((uint64_t) w << 32) | h);
+}
+
+bool Png2sRgb::refersToSource() const
+{
+    return streaming;
+}
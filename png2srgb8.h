@@ -3,9 +3,29 @@
 
 #include "image2srgb8.h"
 
+/**
+ * PNG image.
+ * In streaming mode load() keeps a view of the compressed PNG and pack() decodes it row by row directly
+ * into color planes, srgb stays null. The PNG passed to load() must stay valid until the last pack() or
+ * contentHash(); loadFile() keeps the file itself.
+ * Image from trusted source (default) skips IDAT chunk CRC check, zlib Adler-32 still detects corrupted data.
+ */
 class Png2sRgb : public Image2sRgb {
+private:
+    bool streaming;
+    uint32_t flags;
+    /// PNG of the caller in streaming mode, not copied
+    const uint8_t *png;
+    size_t pngSize;
+protected:
+    bool refersToSource() const override;
 public:
+    explicit Png2sRgb(bool streaming = false, bool trusted = true);
+    ~Png2sRgb() override;
     int32_t load(void *srcPng, size_t srcPngSize) override;
+    int pack(void *dst, uint32_t width, uint32_t height, bool hasRed, bool hasYellow, bool mirror, bool compress,
+        uint16_t rotation = 0) override;
+    uint64_t contentHash() override;
 };
 
 #endif
@@ -0,0 +1,181 @@
+#include <cmath>
+
+#include "rtt-estimator.h"
+
+/// maximum timeout multiplier
+static const uint32_t MAX_BACKOFF = 64;
+
+RttEstimator::RttEstimator()
+    : srttMs(0), rttvarMs(0), samples(0), backoff(1)
+{
+}
+
+/**
+ * Add round-trip time of the request answered. Response after a timeout is ambiguous
+ * (it may answer the request sent before), so it only resets the backoff (Karn's algorithm).
+ * @param ms time from the request to the response
+ */
+void RttEstimator::add(
+    float ms
+) {
+    if (backoff > 1) {
+        backoff = 1;
+        return;
+    }
+    if (samples == 0) {
+        srttMs = ms;
+        rttvarMs = ms / 2;
+    } else {
+        rttvarMs += (std::fabs(srttMs - ms) - rttvarMs) / 4;
+        srttMs += (ms - srttMs) / 8;
+    }
+    samples++;
+}
+
+/**
+ * Double the timeout until the next response
+ */
+void RttEstimator::timedOut()
+{
+    if (backoff < MAX_BACKOFF)
+        backoff *= 2;
+}
+
+/**
+ * @param minMs lower bound
+ * @param maxMs upper bound, returned if there are no samples yet
+ * @return SRTT + 4 * RTTVAR multiplied by the backoff, milliseconds
+ */
+int RttEstimator::timeout(
+    int minMs,
+    int maxMs
+) const {
+    if (samples == 0)
+        return maxMs;
+    float t = srttMs + 4 * rttvarMs;
+    if (t < minMs)
+        t = (float) minMs;
+    t *= (float) backoff;
+    return t < (float) maxMs ? (int) std::ceil(t) : maxMs;
+}
+
+RttEstimators::RttEstimators()
+    : rnd(std::random_device()()), minTimeoutMs(200), maxRetryDelayMs(2000)
+{
+}
+
+/**
+ * Add round-trip time to the device and to its type
+ * @param addr device address
+ * @param type SessionParamsCache::key() of the device
+ * @param ms time from the request to the response
+ */
+void RttEstimators::add(
+    uint64_t addr,
+    uint32_t type,
+    float ms
+) {
+    std::unique_lock<std::mutex> lck(mutexRtt);
+    auto &device = devices[addr];
+    // samples after a timeout are not counted for the type either
+    if (device.backoff == 1)
+        types[type].add(ms);
+    device.add(ms);
+}
+
+void RttEstimators::timedOut(
+    uint64_t addr
+) {
+    std::unique_lock<std::mutex> lck(mutexRtt);
+    devices[addr].timedOut();
+}
+
+/**
+ * Response timeout for the device
+ * @param addr device address
+ * @param type SessionParamsCache::key() of the device
+ * @param maxMs upper bound, returned if neither the device nor its type is measured
+ * @return timeout, milliseconds
+ */
+int RttEstimators::timeout(
+    uint64_t addr,
+    uint32_t type,
+    int maxMs
+) {
+    std::unique_lock<std::mutex> lck(mutexRtt);
+    RttEstimator e;
+    auto d = devices.find(addr);
+    if (d != devices.end())
+        e = d->second;
+    if (e.samples == 0) {
+        auto t = types.find(type);
+        if (t != types.end()) {
+            e.srttMs = t->second.srttMs;
+            e.rttvarMs = t->second.rttvarMs;
+            e.samples = t->second.samples;
+        }
+    }
+    return e.timeout(minTimeoutMs, maxMs);
+}
+
+/**
+ * Delay before the retry: random up to smoothed round-trip time doubled on each attempt, so labels failing
+ * together do not retry in step
+ * @param addr device address
+ * @param type SessionParamsCache::key() of the device
+ * @param attempt 1- first retry
+ * @return delay, milliseconds, not more than maxRetryDelayMs
+ */
+int RttEstimators::retryDelay(
+    uint64_t addr,
+    uint32_t type,
+    int attempt
+) {
+    std::unique_lock<std::mutex> lck(mutexRtt);
+    float base = (float) minTimeoutMs;
+    auto d = devices.find(addr);
+    if (d != devices.end() && d->second.samples)
+        base = d->second.srttMs;
+    else {
+        auto t = types.find(type);
+        if (t != types.end() && t->second.samples)
+            base = t->second.srttMs;
+    }
+    float cap = base;
+    for (int i = 1; i < attempt && cap < (float) maxRetryDelayMs; i++)
+        cap *= 2;
+    if (cap > (float) maxRetryDelayMs)
+        cap = (float) maxRetryDelayMs;
+    return std::uniform_int_distribution<int>(0, (int) cap)(rnd);
+}
+
+/**
+ * @param addr device address
+ * @param retValue returns estimator of the device
+ * @return false if the device has no responses or timeouts yet
+ */
+bool RttEstimators::get(
+    uint64_t addr,
+    RttEstimator &retValue
+) {
+    std::unique_lock<std::mutex> lck(mutexRtt);
+    auto d = devices.find(addr);
+    if (d == devices.end())
+        return false;
+    retValue = d->second;
+    return true;
+}
+
+void RttEstimators::erase(
+    uint64_t addr
+) {
+    std::unique_lock<std::mutex> lck(mutexRtt);
+    devices.erase(addr);
+}
+
+void RttEstimators::clear()
+{
+    std::unique_lock<std::mutex> lck(mutexRtt);
+    devices.clear();
+    types.clear();
+}
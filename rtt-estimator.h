@@ -0,0 +1,53 @@
+#ifndef RTT_ESTIMATOR_H
+#define RTT_ESTIMATOR_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <random>
+
+/**
+ * Smoothed round-trip time and its variation (RFC 6298), milliseconds
+ */
+class RttEstimator {
+public:
+    float srttMs;
+    float rttvarMs;
+    /// samples taken, 0- estimate is unknown
+    uint32_t samples;
+    /// timeout multiplier, doubled on each timeout, reset by the next response
+    uint32_t backoff;
+
+    RttEstimator();
+    void add(float ms);
+    void timedOut();
+    int timeout(int minMs, int maxMs) const;
+};
+
+/**
+ * Round-trip time estimators by device address and by device type and firmware version.
+ * Device not measured yet starts with the estimate of its type, device of unknown type with the maximum timeout.
+ */
+class RttEstimators {
+private:
+    std::mutex mutexRtt;
+    std::map<uint64_t, RttEstimator> devices;
+    std::map<uint32_t, RttEstimator> types;
+    std::minstd_rand rnd;
+public:
+    /// lower bound of the response timeout, covers connection interval and firmware processing
+    int minTimeoutMs;
+    /// upper bound of the delay between retries
+    int maxRetryDelayMs;
+
+    RttEstimators();
+    void add(uint64_t addr, uint32_t type, float ms);
+    void timedOut(uint64_t addr);
+    int timeout(uint64_t addr, uint32_t type, int maxMs);
+    int retryDelay(uint64_t addr, uint32_t type, int attempt);
+    bool get(uint64_t addr, RttEstimator &retValue);
+    void erase(uint64_t addr);
+    void clear();
+};
+
+#endif
@@ -0,0 +1,780 @@
+#include <cstring>
+
+#include "platform.h"
+#include "send-operation.h"
+#include "image2srgb8.h"
+
+/// attempts of each handshake step and of each chunk
+static const int STEP_TRY_COUNT = 3;
+
+/**
+ * @param discoverer backend
+ * @param device device
+ * @param buffer image, kept by the caller until the operation finishes, nullptr for handshakeOnly()
+ * @param size image size in bytes
+ * @param waitMs upper bound of the response timeout
+ * @param window chunks in flight. 1- wait for response to each chunk
+ * @param compressed buffer is compressed by compressPlanes()
+ */
+SendOperation::SendOperation(
+    BLEDiscoverer *aDiscoverer,
+    const DiscoveredDevice *aDevice,
+    void *aBuffer,
+    uint32_t aSize,
+    int aWaitMs,
+    uint8_t aWindow,
+    bool aCompressed
+)
+    : discoverer(aDiscoverer), buffer(aBuffer), size(aSize), waitMs(aWaitMs), window(aWindow), compressed(aCompressed),
+    scope(SCOPE_IMAGE), resumable(false), restarted(false), pipelined(false), sequential(false),
+    keepImage(false), requested(false), writeBusy(false), attempt(0),
+    chunkSize(0), chunksCount(0), next(0), sentEnd(0), w(1), ackCount(0), failCount(0), resent(-1), timedChunk(-1),
+    device(aDevice), session(nullptr), step(SS_CONNECT), result(0), blockSize(0), firstChunk(0), nextChunk(0),
+    extra(nullptr)
+{
+    metadata = discoverer->deviceMetadata(device);
+    typeKey = SessionParamsCache::key(metadata);
+}
+
+/**
+ * Stop after the transfer is started, as BLEDiscoverer::beginTransfer() does
+ */
+void SendOperation::handshakeOnly()
+{
+    scope = SCOPE_HANDSHAKE;
+}
+
+/**
+ * Send chunks of the transfer already started, as BLEDiscoverer::sendChunksWindow() does
+ * @param aBlockSize block size returned by getBlockSize()
+ * @param aFirstChunk chunk to start from
+ */
+void SendOperation::chunksOnly(
+    uint16_t aBlockSize,
+    uint32_t aFirstChunk
+) {
+    scope = SCOPE_CHUNKS;
+    blockSize = aBlockSize;
+    firstChunk = aFirstChunk;
+}
+
+/**
+ * Send only chunks changed since the image sent last, one at a time, as BLEDiscoverer::sendBufferDelta() does.
+ * The whole image is sent if the image sent last is not known.
+ */
+void SendOperation::deltaOnly()
+{
+    scope = SCOPE_DELTA;
+    window = 1;
+}
+
+void SendOperation::enter(
+    SendingStep value
+) {
+    step = value;
+    requested = false;
+    attempt = 0;
+    retryAt = std::chrono::steady_clock::time_point();
+}
+
+/**
+ * Skip block size request if the block size of the device type is known
+ */
+void SendOperation::beginHandshake()
+{
+    pipelined = discoverer->sessionParams.get(metadata, params);
+    enter(pipelined ? SS_WRITE_SCREEN_SIZE : SS_GET_BLOCK_SIZE);
+}
+
+void SendOperation::beginChunks()
+{
+    chunkSize = blockSize - 4;
+    chunksCount = (size + chunkSize - 1) / chunkSize;
+    next = firstChunk;
+    sentEnd = firstChunk;
+    nextChunk = firstChunk;
+    w = window;
+    ackCount = 0;
+    failCount = 0;
+    resent = -1;
+    timedChunk = -1;
+    enter(SS_TRANSFER_BLOCK);
+}
+
+/**
+ * Write request of the current step
+ * @return 0- written, BLEDiscoverer::BUSY- write it again later, -1 if not written
+ */
+int SendOperation::request()
+{
+    switch (step) {
+        case SS_GET_BLOCK_SIZE:
+            return discoverer->requestGetBlockSize(device);
+        case SS_WRITE_SCREEN_SIZE: {
+            // responses come in order
+            int r = discoverer->requestSetScreenSize(device, size, compressed);
+            // both are written again if the start request finds no free buffer, the late response is skipped
+            return r || !pipelined ? r : discoverer->requestStartTransfer(device);
+        }
+        case SS_START_TRANSFER:
+            // written with the image size
+            return pipelined ? 0 : discoverer->requestStartTransfer(device);
+        case SS_CANCEL:
+            return discoverer->requestCancelWrite(device);
+        default:
+            return -1;
+    }
+}
+
+/**
+ * No write buffer is free: anyNotification() wakes the driver when the backend releases one
+ * @param now current time
+ * @param wakeAt earlier time to write again if the backend does not notify
+ */
+void SendOperation::waitWrite(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    writeBusy = true;
+    waitFor(now + std::chrono::milliseconds(waitMs), wakeAt);
+}
+
+void SendOperation::waitFor(
+    std::chrono::steady_clock::time_point at,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    if (at < wakeAt)
+        wakeAt = at;
+    // notification delivered later on the simulated link
+    std::chrono::steady_clock::time_point deliverAt;
+    if (discoverer->nextNotificationAt(device, deliverAt) && deliverAt < wakeAt)
+        wakeAt = deliverAt;
+}
+
+/**
+ * Read response without waiting
+ * @param response receives response
+ * @param responseSize response buffer size
+ * @param retReceivedAt returns time the response was received, round-trip time does not count the driver being late
+ * @return response size, < 0 if none
+ */
+int SendOperation::receive(
+    uint8_t *response,
+    uint32_t responseSize,
+    std::chrono::steady_clock::time_point &retReceivedAt
+) {
+    if (!discoverer->nextNotificationAt(device, retReceivedAt))
+        return -1;
+    return discoverer->read(device, CI_REQUEST, response, responseSize, 0);
+}
+
+/**
+ * Write request of the current step once and read its response without waiting, late responses to previous
+ * requests are skipped
+ * @param now current time
+ * @param wakeAt earlier time to run again if the response is not received
+ * @param opcode response opcode
+ * @param response receives response
+ * @param responseSize response buffer size
+ * @param timed count round-trip time
+ * @return response size, 0- waiting, -1- request not written, failed or timed out
+ */
+int SendOperation::exchange(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wakeAt,
+    uint8_t opcode,
+    uint8_t *response,
+    uint32_t responseSize,
+    bool timed
+) {
+    if (!requested) {
+        if (now < retryAt) {
+            waitFor(retryAt, wakeAt);
+            return 0;
+        }
+        // error of a write the label answered already
+        discoverer->takeWriteError(device);
+        // driver thread may be late by the steps of other operations
+        sentAt = std::chrono::steady_clock::now();
+        int written = request();
+        if (written == BLEDiscoverer::BUSY) {
+            waitWrite(now, wakeAt);
+            return 0;
+        }
+        writeBusy = false;
+        if (written < 0)
+            return -1;
+        requested = true;
+        deadline = sentAt + std::chrono::milliseconds(discoverer->responseTimeout(device->addr, typeKey, waitMs));
+    }
+    while (true) {
+        std::chrono::steady_clock::time_point receivedAt;
+        int r = receive(response, responseSize, receivedAt);
+        if (r < 1)
+            break;
+        if (response[0] == opcode) {
+            requested = false;
+            if (timed)
+                discoverer->updateRtt(device->addr, typeKey, sentAt, true, receivedAt);
+            return r;
+        }
+    }
+    // request failed on the link, the response does not come
+    if (discoverer->takeWriteError(device) < 0) {
+        requested = false;
+        return -1;
+    }
+    if (now >= deadline) {
+        requested = false;
+        if (timed)
+            discoverer->updateRtt(device->addr, typeKey, sentAt, false);
+        return -1;
+    }
+    waitFor(deadline, wakeAt);
+    return 0;
+}
+
+/**
+ * Repeat the step after a random delay
+ * @param now current time
+ * @param failure result if attempts are over, the transfer is kept for the next session
+ * @return true
+ */
+bool SendOperation::retry(
+    std::chrono::steady_clock::time_point now,
+    int failure
+) {
+    if (++attempt >= STEP_TRY_COUNT) {
+        if (step == SS_TRANSFER_BLOCK) {
+            nextChunk = state.offset = next;
+            finishTransfer(failure);
+        } else
+            finish(failure);
+        return true;
+    }
+    requested = false;
+    retryAt = now + std::chrono::milliseconds(discoverer->rtts.retryDelay(device->addr, typeKey, attempt));
+    return true;
+}
+
+/**
+ * Label does not follow the short handshake, negotiate again
+ */
+bool SendOperation::fallBack()
+{
+    discoverer->sessionParams.erase(metadata);
+    pipelined = false;
+    enter(SS_GET_BLOCK_SIZE);
+    return true;
+}
+
+void SendOperation::finish(
+    int value
+) {
+    result = value;
+    if (session)
+        enter(SS_DISCONNECT);
+    else
+        enter(SS_STOPPED);
+}
+
+/**
+ * Keep interrupted transfer for the next session, keep image for the delta update
+ */
+void SendOperation::finishTransfer(
+    int value
+) {
+    if (scope == SCOPE_IMAGE) {
+        {
+            std::unique_lock<std::mutex> lck(discoverer->mutexSendingStates);
+            if (value == -4)
+                discoverer->sendingStates[device->addr] = state;
+            else
+                discoverer->sendingStates.erase(device->addr);
+        }
+        // no chunk accepted: cached block size may not fit the label
+        if (value == -4 && state.offset == firstChunk)
+            discoverer->sessionParams.erase(metadata);
+        if (value || compressed)
+            discoverer->sentImages.erase(device->addr);
+        else if (keepImage || discoverer->sentImages.has(device->addr))
+            discoverer->sentImages.put(device->addr, buffer, size);
+    } else if (scope == SCOPE_DELTA) {
+        // screen state is unknown
+        if (value)
+            discoverer->sentImages.erase(device->addr);
+        else
+            discoverer->sentImages.put(device->addr, buffer, size);
+    }
+    finish(value);
+}
+
+/**
+ * @param index chunk to start from
+ * @return first chunk differing from the image sent last, the last chunk is always sent: it refreshes the screen
+ */
+uint32_t SendOperation::nextDirty(
+    uint32_t index
+) const {
+    auto *p = (const uint8_t *) buffer;
+    for (; index + 1 < chunksCount; index++) {
+        uint32_t ofs = index * chunkSize;
+        if (memcmp(previous.data() + ofs, p + ofs, chunkSize) != 0)
+            break;
+    }
+    return index;
+}
+
+bool SendOperation::connect()
+{
+    if (session) {
+        int r = discoverer->startOpen(session);
+        if (r == BLEDiscoverer::PENDING) {
+            enter(SS_CONNECTING);
+            return true;
+        }
+        if (r < 0) {
+            result = r;
+            enter(SS_STOPPED);
+            return true;
+        }
+    }
+    return opened();
+}
+
+bool SendOperation::connecting(
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    int r = discoverer->pollOpen(session, wakeAt);
+    if (r == BLEDiscoverer::PENDING)
+        return false;
+    if (r < 0) {
+        result = r;
+        enter(SS_STOPPED);
+        return true;
+    }
+    return opened();
+}
+
+/**
+ * Session is open: start the handshake, or the chunks of the transfer started already
+ */
+bool SendOperation::opened()
+{
+    if (scope == SCOPE_CHUNKS) {
+        beginChunks();
+        return true;
+    }
+    if (scope == SCOPE_DELTA) {
+        if (!discoverer->sentImages.get(device->addr, previous) || previous.size() != size) {
+            // nothing to compare with
+            scope = SCOPE_IMAGE;
+            keepImage = true;
+        } else if (memcmp(previous.data(), buffer, size) == 0) {
+            // nothing changed
+            finish(0);
+            return true;
+        }
+    }
+    if (scope == SCOPE_IMAGE) {
+        // interrupted transfer of the same image
+        state.hash = Image2sRgb::hashBytes(buffer, size);
+        state.size = size;
+        state.compressed = compressed;
+        std::unique_lock<std::mutex> lck(discoverer->mutexSendingStates);
+        auto it = discoverer->sendingStates.find(device->addr);
+        resumable = it != discoverer->sendingStates.end() && it->second.hash == state.hash && it->second.size == size
+            && it->second.compressed == compressed;
+        if (resumable)
+            state.blockSize = it->second.blockSize;
+    }
+    beginHandshake();
+    return true;
+}
+
+bool SendOperation::getBlockSize(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    uint8_t response[3];
+    int r = exchange(now, wakeAt, 1, response, sizeof(response), true);
+    if (r == 0)
+        return false;
+    uint16_t v = 0;
+    if (r >= 3) {
+        memmove(&v, response + 1, 2);
+#if IS_BIG_ENDIAN
+        v = SWAP_BYTES_2(v);
+#endif
+    }
+    if (v == 0)
+        return retry(now, -1);
+    // 4 bytes of the chunk header and at least 1 byte of data
+    if (v <= 4) {
+        finish(-1);
+        return true;
+    }
+    blockSize = v;
+    params.blockSize = v;
+    discoverer->sessionParams.put(metadata, params);
+    enter(SS_WRITE_SCREEN_SIZE);
+    return true;
+}
+
+bool SendOperation::setScreenSize(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    uint8_t response[2];
+    int r = exchange(now, wakeAt, 2, response, sizeof(response), true);
+    if (r == 0)
+        return false;
+    if (r >= 2 && response[1] == 0) {
+        enter(SS_START_TRANSFER);
+        return true;
+    }
+    if (pipelined)
+        return fallBack();
+    return retry(now, -2);
+}
+
+bool SendOperation::startTransfer(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    uint8_t response[6];
+    // start transfer written with the image size is not timed
+    int r = exchange(now, wakeAt, 5, response, sizeof(response), !pipelined);
+    if (r == 0)
+        return false;
+    if (r < 2 || response[1] != 0) {
+        if (pipelined)
+            return fallBack();
+        return retry(now, -3);
+    }
+    uint32_t ofs = 0;
+    if (r >= 6) {
+        memmove(&ofs, response + 2, 4);
+#if IS_BIG_ENDIAN
+        ofs = SWAP_BYTES_4(ofs);
+#endif
+    }
+    firstChunk = ofs;
+    if (pipelined)
+        blockSize = params.blockSize;
+    return started();
+}
+
+/**
+ * Transfer started: resume, start over or send from the first chunk
+ */
+bool SendOperation::started()
+{
+    if (scope == SCOPE_HANDSHAKE) {
+        finish(0);
+        return true;
+    }
+    if (scope == SCOPE_DELTA) {
+        // chunk the label requests is not used, the delta starts from the first chunk changed
+        beginChunks();
+        next = nextDirty(0);
+        return true;
+    }
+    if (!restarted) {
+        if (firstChunk && (!resumable || blockSize != state.blockSize
+            || (uint64_t) firstChunk * (blockSize - 4) >= size)) {
+            // label resumes transfer of another image, start over
+            restarted = true;
+            enter(SS_CANCEL);
+            return true;
+        }
+    } else if (firstChunk) {
+        finish(-3);
+        return true;
+    }
+    state.blockSize = blockSize;
+    state.offset = firstChunk;
+    beginChunks();
+    return true;
+}
+
+bool SendOperation::cancel(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    uint8_t response[2];
+    if (exchange(now, wakeAt, 4, response, sizeof(response), true) == 0)
+        return false;
+    // start over whatever the label answers
+    beginHandshake();
+    return true;
+}
+
+/**
+ * Stop-and-wait: write chunk, wait for the chunk the label requests next
+ */
+bool SendOperation::transferChunk(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    if (!requested) {
+        if (now < retryAt) {
+            waitFor(retryAt, wakeAt);
+            return false;
+        }
+        uint32_t chunkOfs = next * chunkSize;
+        uint32_t nextOfs = chunkOfs + chunkSize;
+        if (nextOfs > size)
+            nextOfs = size;
+        sentAt = std::chrono::steady_clock::now();
+        int written = discoverer->requestWriteChunk(device, next, buffer, chunkOfs, nextOfs - chunkOfs);
+        if (written == BLEDiscoverer::BUSY) {
+            waitWrite(now, wakeAt);
+            return false;
+        }
+        writeBusy = false;
+        if (written < 0)
+            return retry(now, -4);
+        requested = true;
+        int timeout = discoverer->responseTimeout(device->addr, typeKey, waitMs);
+        // label answers the last chunk after the screen refresh
+        deadline = sentAt + std::chrono::milliseconds(nextOfs == size ? discoverer->refreshWaitMs + timeout : timeout);
+    }
+    uint8_t response[6];
+    std::chrono::steady_clock::time_point receivedAt;
+    int r = receive(response, sizeof(response), receivedAt);
+    if (r < 0) {
+        // chunk failed on the link, the label does not answer it
+        if (discoverer->takeWriteError(device) < 0) {
+            requested = false;
+            return retry(now, -4);
+        }
+        if (now < deadline) {
+            waitFor(deadline, wakeAt);
+            return false;
+        }
+    }
+    requested = false;
+    int c = BLEDiscoverer::parseNextChunk(response, r);
+    if (c == -8) {
+        finishTransfer(0);
+        return true;
+    }
+    discoverer->updateRtt(device->addr, typeKey, sentAt, c >= 0, receivedAt);
+    if (c >= 0) {
+        if (scope == SCOPE_DELTA) {
+            // firmware does not accept skipped chunks
+            if ((uint32_t) c <= next)
+                sequential = true;
+            next = sequential ? (uint32_t) c : nextDirty((uint32_t) c);
+        } else
+            next = (uint32_t) c;
+        attempt = 0;
+        retryAt = std::chrono::steady_clock::time_point();
+        return true;
+    }
+    return retry(now, -4);
+}
+
+/**
+ * Keep up to window chunks in flight, see BLEDiscoverer::sendChunksWindow()
+ */
+bool SendOperation::transferWindow(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    // chunks left unsent when no write buffer was free are written as buffers are released
+    if (!requested || writeBusy) {
+        if (!requested && now < retryAt) {
+            waitFor(retryAt, wakeAt);
+            return false;
+        }
+        uint32_t sentFrom = next;
+        writeBusy = false;
+        while (next < chunksCount && next < nextChunk + w) {
+            uint32_t chunkOfs = next * chunkSize;
+            uint32_t nextOfs = chunkOfs + chunkSize;
+            if (nextOfs > size)
+                nextOfs = size;
+            int written = discoverer->requestWriteChunk(device, next, buffer, chunkOfs, nextOfs - chunkOfs, w == 1);
+            if (written == BLEDiscoverer::BUSY)
+                writeBusy = true;
+            if (written < 0)
+                break;
+            if (timedChunk < 0 && next >= sentEnd && next + 1 < chunksCount) {
+                timedChunk = (int) next;
+                timedAt = std::chrono::steady_clock::now();
+            }
+            next++;
+            if (next > sentEnd)
+                sentEnd = next;
+        }
+        // deadline follows the last chunk written, waiting for a free buffer does not extend it
+        if (!requested || next != sentFrom) {
+            requested = true;
+            int timeout = discoverer->responseTimeout(device->addr, typeKey, waitMs);
+            // device can refresh screen for a long time after last chunk
+            deadline = std::chrono::steady_clock::now()
+                + std::chrono::milliseconds(next < chunksCount ? timeout : discoverer->refreshWaitMs + timeout);
+        }
+    }
+    uint8_t response[6];
+    std::chrono::steady_clock::time_point receivedAt;
+    int r = receive(response, sizeof(response), receivedAt);
+    // chunk failed on the link: fall back as if it was lost, without counting a timeout
+    bool writeFailed = r < 0 && discoverer->takeWriteError(device) < 0;
+    if (r < 0 && !writeFailed && now < deadline) {
+        waitFor(deadline, wakeAt);
+        return false;
+    }
+    requested = false;
+    int c = BLEDiscoverer::parseNextChunk(response, r);
+    if (c == -8) {
+        finishTransfer(0);
+        return true;
+    }
+    if (c < 0) {
+        if (!writeFailed)
+            discoverer->rtts.timedOut(device->addr);
+        // lost chunk or response, fall back to stop-and-wait
+        if (++failCount >= STEP_TRY_COUNT) {
+            state.offset = nextChunk;
+            finishTransfer(-4);
+            return true;
+        }
+        retryAt = now + std::chrono::milliseconds(discoverer->rtts.retryDelay(device->addr, typeKey, failCount));
+        w = 1;
+        next = nextChunk;
+        resent = -1;
+        timedChunk = -1;
+        return true;
+    }
+    failCount = 0;
+    auto n = (uint32_t) c;
+    if (timedChunk >= 0 && n > (uint32_t) timedChunk) {
+        discoverer->updateRtt(device->addr, typeKey, timedAt, true, receivedAt);
+        timedChunk = -1;
+    }
+    if (n > nextChunk) {
+        // acknowledged
+        nextChunk = n;
+        if (next < nextChunk)
+            next = nextChunk;
+        // restore window
+        ackCount++;
+        if (w < window && ackCount >= w) {
+            w++;
+            ackCount = 0;
+        }
+        return true;
+    }
+    if (n < nextChunk || c == resent)
+        return true;   // stale request
+    // device is missing chunk n, resend from it
+    resent = c;
+    next = n;
+    w = w > 1 ? w / 2 : 1;
+    ackCount = 0;
+    timedChunk = -1;
+    return true;
+}
+
+bool SendOperation::disconnect()
+{
+    int r = discoverer->startClose(session);
+    if (r == BLEDiscoverer::PENDING)
+        enter(SS_DISCONNECTING);
+    else
+        closed(r);
+    return true;
+}
+
+bool SendOperation::disconnecting(
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    int r = discoverer->pollClose(session, wakeAt);
+    if (r == BLEDiscoverer::PENDING)
+        return false;
+    closed(r);
+    return true;
+}
+
+void SendOperation::closed(
+    int value
+) {
+    if (result == 0 && value < 0)
+        result = value;
+    enter(SS_STOPPED);
+}
+
+/**
+ * Do the steps that do not wait
+ * @param now current time
+ * @param wakeAt earlier time to run again if a notification is not received before
+ * @return true if finished, see result
+ */
+bool SendOperation::run(
+    std::chrono::steady_clock::time_point now,
+    std::chrono::steady_clock::time_point &wakeAt
+) {
+    bool progress = true;
+    while (progress) {
+        switch (step) {
+            case SS_CONNECT:
+                progress = connect();
+                break;
+            case SS_CONNECTING:
+                progress = connecting(wakeAt);
+                break;
+            case SS_GET_BLOCK_SIZE:
+                progress = getBlockSize(now, wakeAt);
+                break;
+            case SS_WRITE_SCREEN_SIZE:
+                progress = setScreenSize(now, wakeAt);
+                break;
+            case SS_START_TRANSFER:
+                progress = startTransfer(now, wakeAt);
+                break;
+            case SS_CANCEL:
+                progress = cancel(now, wakeAt);
+                break;
+            case SS_TRANSFER_BLOCK:
+                progress = window > 1 ? transferWindow(now, wakeAt) : transferChunk(now, wakeAt);
+                break;
+            case SS_DISCONNECT:
+                progress = disconnect();
+                break;
+            case SS_DISCONNECTING:
+                progress = disconnecting(wakeAt);
+                break;
+            default:
+                return true;
+        }
+    }
+    return step == SS_STOPPED;
+}
+
+bool SendOperation::finished() const
+{
+    return step == SS_STOPPED;
+}
+
+/**
+ * Run on the calling thread until finished, waiting for notifications of this device only
+ * @return result
+ */
+int SendOperation::runBlocking()
+{
+    while (true) {
+        // backend notifies all waiters when the connection progresses
+        uint64_t seen = discoverer->anyNotification()->current();
+        auto now = std::chrono::steady_clock::now();
+        auto wakeAt = now + std::chrono::hours(1);
+        if (run(now, wakeAt))
+            return result;
+        if (step == SS_CONNECTING || step == SS_DISCONNECTING || writeBusy)
+            discoverer->anyNotification()->wait(seen, wakeAt);
+        else
+            discoverer->waitNotification(device, wakeAt);
+    }
+}
@@ -0,0 +1,137 @@
+#ifndef SEND_OPERATION_H
+#define SEND_OPERATION_H
+
+#include <chrono>
+#include <vector>
+
+#include "ble-helper.h"
+
+/**
+ * Image transfer to one device as a state machine: run() does what can be done without waiting
+ * and returns when the next step waits for a notification, a timeout or a retry delay.
+ * Many operations are driven by one thread (see SessionDriver), runBlocking() drives one on the calling thread.
+ * Opening and closing the session are steps too: startOpen() and startClose() do not wait for the link.
+ * The image buffer must stay valid until the operation finishes.
+ */
+class SendOperation {
+private:
+    enum Scope {
+        /// handshake, transfer and resume bookkeeping as sendBuffer() does
+        SCOPE_IMAGE = 0,
+        /// get block size, set image size and start transfer only
+        SCOPE_HANDSHAKE,
+        /// chunks only, transfer is started already
+        SCOPE_CHUNKS,
+        /// chunks changed since the image sent last, as sendBufferDelta() does
+        SCOPE_DELTA
+    };
+
+    BLEDiscoverer *discoverer;
+    void *buffer;
+    uint32_t size;
+    int waitMs;
+    uint8_t window;
+    bool compressed;
+    Scope scope;
+    /// device metadata taken when the operation is created, the consumer thread updates the device
+    NEMR5053ManufacturerSpecificData metadata;
+    /// SessionParamsCache::key() of the metadata, round-trip times of the device type
+    uint32_t typeKey;
+
+    /// transfer to keep if the link is lost
+    SendingState state;
+    /// same image was interrupted on the previous session
+    bool resumable;
+    /// cancelled transfer the label resumed and started again
+    bool restarted;
+    /// block size known by device type, image size and start transfer requests are written together
+    bool pipelined;
+    /// image sent last, SCOPE_DELTA writes chunks that differ
+    std::vector<uint8_t> previous;
+    /// label does not accept skipped chunks, SCOPE_DELTA sends the rest in order
+    bool sequential;
+    /// SCOPE_DELTA sends the whole image: keep it for the next delta update
+    bool keepImage;
+    SessionParams params;
+
+    // request waiting for the response
+    bool requested;
+    /// no write buffer was free, the step writes again when the backend releases one
+    bool writeBusy;
+    int attempt;
+    std::chrono::steady_clock::time_point sentAt;
+    std::chrono::steady_clock::time_point deadline;
+    std::chrono::steady_clock::time_point retryAt;
+
+    // sliding window, see BLEDiscoverer::sendChunksWindow()
+    uint32_t chunkSize;
+    uint32_t chunksCount;
+    /// chunk to send next
+    uint32_t next;
+    /// highest chunk sent so far + 1, chunks below may be sent again
+    uint32_t sentEnd;
+    uint8_t w;
+    uint32_t ackCount;
+    int failCount;
+    /// chunk already re-sent on device request
+    int resent;
+    /// one chunk in flight is timed, none if it may be sent twice
+    int timedChunk;
+    std::chrono::steady_clock::time_point timedAt;
+
+    void enter(SendingStep value);
+    void beginHandshake();
+    void beginChunks();
+    int request();
+    void waitWrite(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &wakeAt);
+    int receive(uint8_t *response, uint32_t responseSize, std::chrono::steady_clock::time_point &retReceivedAt);
+    int exchange(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &wakeAt,
+        uint8_t opcode, uint8_t *response, uint32_t responseSize, bool timed);
+    void waitFor(std::chrono::steady_clock::time_point at, std::chrono::steady_clock::time_point &wakeAt);
+    bool retry(std::chrono::steady_clock::time_point now, int failure);
+    bool fallBack();
+    bool started();
+    void finish(int value);
+    void finishTransfer(int value);
+    uint32_t nextDirty(uint32_t index) const;
+
+    bool connect();
+    bool connecting(std::chrono::steady_clock::time_point &wakeAt);
+    bool opened();
+    bool getBlockSize(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &wakeAt);
+    bool setScreenSize(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &wakeAt);
+    bool startTransfer(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &wakeAt);
+    bool cancel(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &wakeAt);
+    bool transferChunk(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &wakeAt);
+    bool transferWindow(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &wakeAt);
+    bool disconnect();
+    bool disconnecting(std::chrono::steady_clock::time_point &wakeAt);
+    void closed(int value);
+public:
+    const DiscoveredDevice *device;
+    /// device to open before the transfer and close after it, nullptr- session is open by the caller
+    DiscoveredDevice *session;
+    /// current step, SS_STOPPED when finished
+    SendingStep step;
+    /// sendBuffer() result, or open() or close() error
+    int result;
+    /// block size in use
+    uint16_t blockSize;
+    /// chunk the label requested first
+    uint32_t firstChunk;
+    /// first chunk not acknowledged if the device does not respond
+    uint32_t nextChunk;
+    /// caller data
+    void *extra;
+
+    SendOperation(BLEDiscoverer *discoverer, const DiscoveredDevice *device, void *buffer, uint32_t size, int waitMs = 1000,
+        uint8_t window = 1, bool compressed = false);
+    void handshakeOnly();
+    void chunksOnly(uint16_t blockSize, uint32_t firstChunk);
+    void deltaOnly();
+    bool run(std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &wakeAt);
+    bool finished() const;
+    int runBlocking();
+};
+
+#endif
@@ -0,0 +1,59 @@
+#include "sent-image-store.h"
+
+/**
+ * Copy last image sent to the device
+ * @param addr MAC address
+ * @param retValue returns image
+ * @return false if no image
+ */
+bool SentImageStore::get(
+    uint64_t addr,
+    std::vector<uint8_t> &retValue
+) {
+    std::unique_lock<std::mutex> lck(mutexImages);
+    auto it = images.find(addr);
+    if (it == images.end())
+        return false;
+    retValue = it->second;
+    return true;
+}
+
+bool SentImageStore::has(
+    uint64_t addr
+) {
+    std::unique_lock<std::mutex> lck(mutexImages);
+    return images.find(addr) != images.end();
+}
+
+void SentImageStore::put(
+    uint64_t addr,
+    const void *buffer,
+    uint32_t size
+) {
+    std::unique_lock<std::mutex> lck(mutexImages);
+    auto &v = images[addr];
+    v.assign((const uint8_t *) buffer, (const uint8_t *) buffer + size);
+}
+
+/**
+ * Forget image when device screen state is unknown
+ * @param addr MAC address
+ */
+void SentImageStore::erase(
+    uint64_t addr
+) {
+    std::unique_lock<std::mutex> lck(mutexImages);
+    images.erase(addr);
+}
+
+void SentImageStore::clear()
+{
+    std::unique_lock<std::mutex> lck(mutexImages);
+    images.clear();
+}
+
+size_t SentImageStore::count()
+{
+    std::unique_lock<std::mutex> lck(mutexImages);
+    return images.size();
+}
@@ -0,0 +1,25 @@
+#ifndef SENT_IMAGE_STORE_H
+#define SENT_IMAGE_STORE_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+/**
+ * Last image successfully sent to each device, keyed by MAC address
+ */
+class SentImageStore {
+private:
+    std::mutex mutexImages;
+    std::map<uint64_t, std::vector<uint8_t>> images;
+public:
+    bool get(uint64_t addr, std::vector<uint8_t> &retValue);
+    bool has(uint64_t addr);
+    void put(uint64_t addr, const void *buffer, uint32_t size);
+    void erase(uint64_t addr);
+    void clear();
+    size_t count();
+};
+
+#endif
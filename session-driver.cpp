@@ -0,0 +1,196 @@
+#include "session-driver.h"
+
+/**
+ * @param discoverer backend
+ * @param onSent callback, nullptr- none
+ */
+SessionDriver::SessionDriver(
+    BLEDiscoverer *aDiscoverer,
+    OnSent *aOnSent
+)
+    : discoverer(aDiscoverer), count(0), stopRequest(false), onSent(aOnSent)
+{
+}
+
+/**
+ * Stop the thread, close sessions of the operations not finished and unpin their devices
+ */
+SessionDriver::~SessionDriver()
+{
+    stop();
+    for (auto &o : added)
+        operations.push_back(std::move(o));
+    added.clear();
+    for (auto &o : operations) {
+        if (!o->session)
+            continue;
+        // session is opening or open, startClose() of SS_DISCONNECTING finishes on its own
+        if (o->step != SS_CONNECT && o->step != SS_DISCONNECTING)
+            discoverer->close(o->session);
+        std::unique_lock<std::mutex> lck(discoverer->mutexDiscoveryState);
+        o->session->pins--;
+    }
+}
+
+/**
+ * Add operation, the driver deletes it after OnSent::sent()
+ * @param operation operation not started yet
+ */
+void SessionDriver::add(
+    SendOperation *operation
+) {
+    {
+        std::unique_lock<std::mutex> lck(mutexOperations);
+        added.emplace_back(operation);
+        count++;
+    }
+    // wake the driver waiting for notifications
+    discoverer->anyNotification()->notify();
+}
+
+/**
+ * Open session, send image and close session as UploadScheduler does, without a thread per device
+ * @param device discovered device, pinned until the operation finishes
+ * @param buffer image, kept by the caller until OnSent::sent()
+ * @param size image size in bytes
+ * @param waitMs upper bound of the response timeout
+ * @param window chunks in flight
+ * @param compressed buffer is compressed by compressPlanes()
+ * @param extra caller data passed to OnSent::sent()
+ * @return operation, valid until OnSent::sent()
+ */
+SendOperation *SessionDriver::send(
+    DiscoveredDevice *device,
+    void *buffer,
+    uint32_t size,
+    int waitMs,
+    uint8_t window,
+    bool compressed,
+    void *extra
+) {
+    return addSession(device, new SendOperation(discoverer, device, buffer, size, waitMs, window, compressed), extra);
+}
+
+/**
+ * Open session, send chunks changed since the image sent last and close session, see BLEDiscoverer::sendBufferDelta()
+ * @param device discovered device, pinned until the operation finishes
+ * @param buffer image, not compressed, kept by the caller until OnSent::sent()
+ * @param size image size in bytes
+ * @param waitMs upper bound of the response timeout
+ * @param extra caller data passed to OnSent::sent()
+ * @return operation, valid until OnSent::sent()
+ */
+SendOperation *SessionDriver::sendDelta(
+    DiscoveredDevice *device,
+    void *buffer,
+    uint32_t size,
+    int waitMs,
+    void *extra
+) {
+    auto *operation = new SendOperation(discoverer, device, buffer, size, waitMs);
+    operation->deltaOnly();
+    return addSession(device, operation, extra);
+}
+
+/**
+ * Pin the device and add the operation opening and closing its session
+ */
+SendOperation *SessionDriver::addSession(
+    DiscoveredDevice *device,
+    SendOperation *operation,
+    void *extra
+) {
+    {
+        std::unique_lock<std::mutex> lck(discoverer->mutexDiscoveryState);
+        device->pins++;
+    }
+    operation->session = device;
+    operation->extra = extra;
+    add(operation);
+    return operation;
+}
+
+/**
+ * Run steps of all operations and wait for the next notification, timeout or retry
+ * @param milliseconds maximum wait
+ * @return true if operations are not finished yet
+ */
+bool SessionDriver::poll(
+    int milliseconds
+) {
+    auto *signal = discoverer->anyNotification();
+    // notification received while operations run wakes the next wait
+    uint64_t seen = signal->current();
+    {
+        std::unique_lock<std::mutex> lck(mutexOperations);
+        for (auto &o : added)
+            operations.push_back(std::move(o));
+        added.clear();
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto wakeAt = now + std::chrono::milliseconds(milliseconds);
+    for (size_t i = 0; i < operations.size(); ) {
+        auto &o = operations[i];
+        if (!o->run(now, wakeAt)) {
+            i++;
+            continue;
+        }
+        if (o->session) {
+            std::unique_lock<std::mutex> lck(discoverer->mutexDiscoveryState);
+            o->session->pins--;
+        }
+        if (onSent)
+            onSent->sent(*o);
+        o = std::move(operations.back());
+        operations.pop_back();
+        count--;
+    }
+    if (count == 0)
+        return false;
+    signal->wait(seen, wakeAt);
+    return true;
+}
+
+/**
+ * @return operations added and not finished
+ */
+size_t SessionDriver::pending()
+{
+    return count;
+}
+
+/**
+ * Drive operations on the own thread instead of poll()
+ */
+void SessionDriver::start()
+{
+    if (thread.joinable())
+        return;
+    stopRequest = false;
+    thread = std::thread(&SessionDriver::runThread, this);
+}
+
+/**
+ * Stop the thread, operations not finished are kept
+ */
+void SessionDriver::stop()
+{
+    if (!thread.joinable())
+        return;
+    stopRequest = true;
+    discoverer->anyNotification()->notify();
+    thread.join();
+}
+
+void SessionDriver::runThread()
+{
+    while (!stopRequest) {
+        if (!poll(1000)) {
+            // idle until add()
+            auto *signal = discoverer->anyNotification();
+            uint64_t seen = signal->current();
+            if (count == 0 && !stopRequest)
+                signal->wait(seen, std::chrono::steady_clock::now() + std::chrono::seconds(1));
+        }
+    }
+}
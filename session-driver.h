@@ -0,0 +1,60 @@
+#ifndef SESSION_DRIVER_H
+#define SESSION_DRIVER_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "send-operation.h"
+
+/**
+ * Called by the driver thread when the operation finishes
+ */
+class OnSent {
+public:
+    /**
+     * @param operation finished operation, see result; deleted after the call
+     */
+    virtual void sent(const SendOperation &operation) = 0;
+};
+
+/**
+ * Drives many SendOperation on one thread: steps of all operations run as their notifications arrive,
+ * so sessions do not need a thread each. Sessions are opened and closed by startOpen() and startClose(),
+ * requests and chunks are written by startWrite(): a slow or absent device does not hold the others.
+ */
+class SessionDriver {
+private:
+    BLEDiscoverer *discoverer;
+    std::mutex mutexOperations;
+    /// operations added, not taken by the driver yet
+    std::vector<std::unique_ptr<SendOperation>> added;
+    /// operations in progress, driver thread only
+    std::vector<std::unique_ptr<SendOperation>> operations;
+    /// operations added and not finished
+    std::atomic<size_t> count;
+    std::thread thread;
+    std::atomic<bool> stopRequest;
+
+    void runThread();
+    SendOperation *addSession(DiscoveredDevice *device, SendOperation *operation, void *extra);
+public:
+    OnSent *onSent;
+
+    explicit SessionDriver(BLEDiscoverer *discoverer, OnSent *onSent = nullptr);
+    virtual ~SessionDriver();
+
+    void add(SendOperation *operation);
+    SendOperation *send(DiscoveredDevice *device, void *buffer, uint32_t size, int waitMs = 1000, uint8_t window = 1,
+        bool compressed = false, void *extra = nullptr);
+    SendOperation *sendDelta(DiscoveredDevice *device, void *buffer, uint32_t size, int waitMs = 1000,
+        void *extra = nullptr);
+    bool poll(int milliseconds);
+    size_t pending();
+    void start();
+    void stop();
+};
+
+#endif
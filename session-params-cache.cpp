@@ -0,0 +1,116 @@
+#include <fstream>
+
+#include "session-params-cache.h"
+
+SessionParams::SessionParams()
+    : blockSize(0)
+{
+}
+
+SessionParamsCache::SessionParamsCache()
+    : hits(0), misses(0)
+{
+}
+
+/**
+ * @return hardware version, software version and type12() packed in 32 bits
+ */
+uint32_t SessionParamsCache::key(
+    const NEMR5053ManufacturerSpecificData &metadata
+) {
+    return ((uint32_t) metadata.hardwareVersion() << 24) | ((uint32_t) metadata.softwareVersion() << 16)
+        | metadata.type12();
+}
+
+/**
+ * Find parameters of the device type, count hit or miss
+ * @param metadata advertised device spec
+ * @param retValue returns parameters
+ * @return false if parameters are not known yet
+ */
+bool SessionParamsCache::get(
+    const NEMR5053ManufacturerSpecificData &metadata,
+    SessionParams &retValue
+) {
+    std::unique_lock<std::mutex> lck(mutexParams);
+    auto it = params.find(key(metadata));
+    if (it == params.end()) {
+        misses++;
+        return false;
+    }
+    hits++;
+    retValue = it->second;
+    return true;
+}
+
+void SessionParamsCache::put(
+    const NEMR5053ManufacturerSpecificData &metadata,
+    const SessionParams &value
+) {
+    std::unique_lock<std::mutex> lck(mutexParams);
+    params[key(metadata)] = value;
+}
+
+/**
+ * Forget parameters the device does not accept
+ */
+void SessionParamsCache::erase(
+    const NEMR5053ManufacturerSpecificData &metadata
+) {
+    std::unique_lock<std::mutex> lck(mutexParams);
+    params.erase(key(metadata));
+}
+
+void SessionParamsCache::clear()
+{
+    std::unique_lock<std::mutex> lck(mutexParams);
+    params.clear();
+}
+
+size_t SessionParamsCache::count()
+{
+    std::unique_lock<std::mutex> lck(mutexParams);
+    return params.size();
+}
+
+/**
+ * Add parameters saved by save()
+ * @param fileName text file, line per device type: key in hex, block size
+ * @return parameters loaded, -1 if file not found
+ */
+int SessionParamsCache::load(
+    const char *fileName
+) {
+    std::ifstream f(fileName);
+    if (!f.is_open())
+        return -1;
+    std::unique_lock<std::mutex> lck(mutexParams);
+    int r = 0;
+    uint32_t k;
+    SessionParams p;
+    while (f >> std::hex >> k >> std::dec >> p.blockSize) {
+        // 4 bytes chunk header and at least 1 byte of data
+        if (p.blockSize <= 4)
+            continue;
+        params[k] = p;
+        r++;
+    }
+    return r;
+}
+
+/**
+ * @param fileName text file
+ * @return parameters saved, -1 if file can not be written
+ */
+int SessionParamsCache::save(
+    const char *fileName
+) {
+    std::ofstream f(fileName);
+    if (!f.is_open())
+        return -1;
+    std::unique_lock<std::mutex> lck(mutexParams);
+    for (auto &p : params)
+        f << std::hex << p.first << ' ' << std::dec << p.second.blockSize << '\n';
+    f.close();
+    return f.fail() ? -1 : (int) params.size();
+}
@@ -0,0 +1,45 @@
+#ifndef SESSION_PARAMS_CACHE_H
+#define SESSION_PARAMS_CACHE_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+#include "nemr-5053-manufacturer-specific-data.h"
+
+/**
+ * Parameters negotiated with the label firmware
+ */
+class SessionParams {
+public:
+    /// block size reported by CI_REQUEST 1, including 4 bytes chunk header
+    uint16_t blockSize;
+    SessionParams();
+};
+
+/**
+ * Negotiated parameters by device type and firmware version: hardware version, software version, type12().
+ * Labels of a known type skip the block size request.
+ */
+class SessionParamsCache {
+private:
+    std::mutex mutexParams;
+    std::map<uint32_t, SessionParams> params;
+public:
+    /// sessions started with known parameters
+    uint32_t hits;
+    /// sessions negotiated parameters
+    uint32_t misses;
+
+    SessionParamsCache();
+    static uint32_t key(const NEMR5053ManufacturerSpecificData &metadata);
+    bool get(const NEMR5053ManufacturerSpecificData &metadata, SessionParams &retValue);
+    void put(const NEMR5053ManufacturerSpecificData &metadata, const SessionParams &value);
+    void erase(const NEMR5053ManufacturerSpecificData &metadata);
+    void clear();
+    size_t count();
+    int load(const char *fileName);
+    int save(const char *fileName);
+};
+
+#endif
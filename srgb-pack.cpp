@@ -1,16 +1,191 @@
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
 #include "srgb-pack.h"
 
-inline void setBitOn(
-    uint8_t *colorPlane,
-    uint32_t heightInBytes,
-    int x,
-    int y
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PACK_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PACK_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PACK_NEON
+#endif
+
+/*
+ * Pixel classes, in order of priority:
+ *   red     r > 150 and r > g + b
+ *   yellow  r > 150, g > 150 and b < 50
+ *   white   r + g + b >= 150
+ *   black   otherwise
+ * Red or yellow pixel is black in the B/W plane even if device has no such color.
+ */
+
+/**
+ * Classify up to 8 pixels one by one
+ * @param src pixels
+ * @param count pixels count, 1..8
+ * @param retRed returns bit i set if pixel i is red
+ * @param retYellow returns bit i set if pixel i is yellow
+ * @param retWhite returns bit i set if pixel i is white
+ */
+static void classifyScalar(
+    const SRgb8 *src,
+    int count,
+    uint8_t *retRed,
+    uint8_t *retYellow,
+    uint8_t *retWhite
+) {
+    uint8_t red = 0, yellow = 0, white = 0;
+    for (int i = 0; i < count; i++) {
+        const SRgb8 *color = src + i;
+        // no branches, compiler may vectorize
+        unsigned r150 = color->r > 150;
+        unsigned isRed = r150 & (color->r > (color->g + color->b));
+        unsigned isYellow = r150 & (color->g > 150) & (color->b < 50) & ~isRed;
+        unsigned isWhite = ((color->r + color->g + color->b) >= 150) & ~(isRed | isYellow);
+        red |= isRed << i;
+        yellow |= (isYellow & 1) << i;
+        white |= (isWhite & 1) << i;
+    }
+    *retRed = red;
+    *retYellow = yellow;
+    *retWhite = white;
+}
+
+#if defined(PACK_AVX2)
+/**
+ * Classify 8 pixels, 32-bit lane per pixel
+ */
+static void classify8(
+    const SRgb8 *src,
+    uint8_t *retRed,
+    uint8_t *retYellow,
+    uint8_t *retWhite
+) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) src);
+    __m256i m = _mm256_set1_epi32(0xff);
+    __m256i r = _mm256_and_si256(v, m);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), m);
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 16), m);
+    __m256i r150 = _mm256_cmpgt_epi32(r, _mm256_set1_epi32(150));
+    __m256i red = _mm256_and_si256(r150, _mm256_cmpgt_epi32(r, _mm256_add_epi32(g, b)));
+    __m256i yellow = _mm256_and_si256(r150, _mm256_and_si256(_mm256_cmpgt_epi32(g, _mm256_set1_epi32(150)),
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(50), b)));
+    yellow = _mm256_andnot_si256(red, yellow);
+    __m256i white = _mm256_cmpgt_epi32(_mm256_add_epi32(_mm256_add_epi32(r, g), b), _mm256_set1_epi32(149));
+    white = _mm256_andnot_si256(_mm256_or_si256(red, yellow), white);
+    *retRed = (uint8_t) _mm256_movemask_ps(_mm256_castsi256_ps(red));
+    *retYellow = (uint8_t) _mm256_movemask_ps(_mm256_castsi256_ps(yellow));
+    *retWhite = (uint8_t) _mm256_movemask_ps(_mm256_castsi256_ps(white));
+}
+#elif defined(PACK_SSE2)
+/**
+ * Classify 4 pixels, 32-bit lane per pixel
+ */
+static void classify4(
+    const SRgb8 *src,
+    int *retRed,
+    int *retYellow,
+    int *retWhite
+) {
+    __m128i v = _mm_loadu_si128((const __m128i *) src);
+    __m128i m = _mm_set1_epi32(0xff);
+    __m128i r = _mm_and_si128(v, m);
+    __m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), m);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), m);
+    __m128i r150 = _mm_cmpgt_epi32(r, _mm_set1_epi32(150));
+    __m128i red = _mm_and_si128(r150, _mm_cmpgt_epi32(r, _mm_add_epi32(g, b)));
+    __m128i yellow = _mm_and_si128(r150, _mm_and_si128(_mm_cmpgt_epi32(g, _mm_set1_epi32(150)),
+        _mm_cmplt_epi32(b, _mm_set1_epi32(50))));
+    yellow = _mm_andnot_si128(red, yellow);
+    __m128i white = _mm_cmpgt_epi32(_mm_add_epi32(_mm_add_epi32(r, g), b), _mm_set1_epi32(149));
+    white = _mm_andnot_si128(_mm_or_si128(red, yellow), white);
+    *retRed = _mm_movemask_ps(_mm_castsi128_ps(red));
+    *retYellow = _mm_movemask_ps(_mm_castsi128_ps(yellow));
+    *retWhite = _mm_movemask_ps(_mm_castsi128_ps(white));
+}
+
+static void classify8(
+    const SRgb8 *src,
+    uint8_t *retRed,
+    uint8_t *retYellow,
+    uint8_t *retWhite
+) {
+    int red0, yellow0, white0, red1, yellow1, white1;
+    classify4(src, &red0, &yellow0, &white0);
+    classify4(src + 4, &red1, &yellow1, &white1);
+    *retRed = (uint8_t) (red0 | (red1 << 4));
+    *retYellow = (uint8_t) (yellow0 | (yellow1 << 4));
+    *retWhite = (uint8_t) (white0 | (white1 << 4));
+}
+#elif defined(PACK_NEON)
+/**
+ * Return bit i set if 16-bit lane i is set
+ */
+static uint8_t movemaskU16(
+    uint16x8_t v
+) {
+    static const uint16_t bits[8] { 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint16x8_t t = vandq_u16(v, vld1q_u16(bits));
+#if defined(__aarch64__)
+    return (uint8_t) vaddvq_u16(t);
+#else
+    uint64x2_t s = vpaddlq_u32(vpaddlq_u16(t));
+    return (uint8_t) (vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1));
+#endif
+}
+
+/**
+ * Classify 8 pixels, 16-bit lane per pixel
+ */
+static void classify8(
+    const SRgb8 *src,
+    uint8_t *retRed,
+    uint8_t *retYellow,
+    uint8_t *retWhite
+) {
+    uint8x8x4_t v = vld4_u8((const uint8_t *) src);
+    uint16x8_t r = vmovl_u8(v.val[0]);
+    uint16x8_t g = vmovl_u8(v.val[1]);
+    uint16x8_t b = vmovl_u8(v.val[2]);
+    uint16x8_t r150 = vcgtq_u16(r, vdupq_n_u16(150));
+    uint16x8_t red = vandq_u16(r150, vcgtq_u16(r, vaddq_u16(g, b)));
+    uint16x8_t yellow = vandq_u16(r150, vandq_u16(vcgtq_u16(g, vdupq_n_u16(150)), vcltq_u16(b, vdupq_n_u16(50))));
+    yellow = vbicq_u16(yellow, red);
+    uint16x8_t white = vcgtq_u16(vaddq_u16(vaddq_u16(r, g), b), vdupq_n_u16(149));
+    white = vbicq_u16(white, vorrq_u16(red, yellow));
+    *retRed = movemaskU16(red);
+    *retYellow = movemaskU16(yellow);
+    *retWhite = movemaskU16(white);
+}
+#else
+static void classify8(
+    const SRgb8 *src,
+    uint8_t *retRed,
+    uint8_t *retYellow,
+    uint8_t *retWhite
+) {
+    classifyScalar(src, 8, retRed, retYellow, retWhite);
+}
+#endif
+
+/**
+ * Transpose 8x8 bit matrix, bit 8 * i + j becomes bit 8 * j + i
+ */
+static inline uint64_t transpose8x8(
+    uint64_t x
 ) {
-    if (!colorPlane)
-        return;
-    int ofs = (x * heightInBytes) + (y / 8);
-    *(colorPlane + ofs) |= 1 << (7 - (y % 8));
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
 }
 
 /*
@@ -28,63 +203,387 @@ inline void setBitOn(
  *                         1- red, 0- none
  *       Second (red) color overlaps white and black colors
  */
+static int planeCount(
+    bool hasRed,
+    bool hasYellow
+) {
+    int planes = 1; // b/w
+    if (hasRed)
+        planes++;
+    if (hasYellow)
+        planes++;
+    return planes;
+}
+
 /**
- * Convert sRGB 8-bit per color buffer to the buffer for ESL device
- * @param dst destination ESL device buffer
- * @param src sRGB buffer
+ * Return buffer size required by packSRgb8
  * @param width device screen width
  * @param height device screen height
  * @param hasRed red color
  * @param hasYellow yellow color
- * @param mirror false- double mirror, true- single mirror
  * @param compress compression on
- * @return
+ * @return size in bytes. If compression is on, worst case size
  */
-int packSRgb8(
-    void *dst,
-    SRgb8 *src,
+uint32_t packSRgb8Size(
     uint32_t width,
     uint32_t height,
     bool hasRed,
     bool hasYellow,
-    bool mirror,
     bool compress
+) {
+    uint32_t heightInBytes = height / 8;
+    if (height % 8)
+        heightInBytes++;
+    uint32_t r = heightInBytes * width * planeCount(hasRed, hasYellow);
+    if (compress)
+        r += (r + 127) / 128 + 4;
+    return r;
+}
+
+/**
+ * Pack 8 rows x 8 columns blocks of the screen rectangle: columns x0..x1 - 1, 8-pixel bands yb0..yb1 - 1.
+ * Row masks are collected in reverse order, so after the transposition byte i holds column i with the top row
+ * in the most significant bit.
+ * Screen pixel (x, y) is read from origin + (x - x0) * dx + (y - 8 * yb0) * dy, so rotation and mirroring cost no copy.
+ */
+static void packPlanes(
+    void *dst,
+    const SRgb8 *origin,
+    ptrdiff_t dx,
+    ptrdiff_t dy,
+    uint32_t width,
+    uint32_t height,
+    uint32_t x0,
+    uint32_t x1,
+    uint32_t yb0,
+    uint32_t yb1,
+    bool hasRed,
+    bool hasYellow
 )
 {
-    int planes = 1; // b/w
-    if (hasRed)
-        planes++;
-    if (hasYellow)
-        planes++;
-    int heightInBytes = height / 8;
+    uint32_t heightInBytes = height / 8;
     if (height % 8)
         heightInBytes++;
-    // clear all (set black/none)
-    int planeBytes = heightInBytes * width;
-    memset(dst, 0, planeBytes * planes);
+    uint32_t planeBytes = heightInBytes * width;
 
     uint8_t *dstBW = (uint8_t *) dst;
     uint8_t *dstRed = hasRed ? ((uint8_t *) dst) + planeBytes : nullptr;
     uint8_t *dstYellow = hasYellow ? (hasRed ? ((uint8_t *) dst) + 2 * planeBytes : ((uint8_t *) dst) + planeBytes) : nullptr;
 
-    SRgb8* color = src;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            bool red = (color->r > 150) && (color->r > (color->g + color->b));
-            if (red)
-                setBitOn(dstRed, heightInBytes, x, y);
-            else {
-                bool yellow = (color->r > 150) && (color->g > 150) && (color->b < 50);
-                if (yellow)
-                    setBitOn(dstYellow, heightInBytes, x, y);
-                else {
-                    bool black = (color->r + color->g + color->b) < 150;
-                    if (!black)
-                        setBitOn(dstBW, heightInBytes, x, y);;
+    for (uint32_t yb = yb0; yb < yb1; yb++) {
+        uint32_t y0 = yb * 8;
+        uint32_t rows = height - y0 < 8 ? height - y0 : 8;
+        for (uint32_t xs = x0; xs < x1; xs += 8) {
+            uint32_t cols = x1 - xs < 8 ? x1 - xs : 8;
+            uint64_t red = 0, yellow = 0, white = 0;
+            for (uint32_t k = 0; k < rows; k++) {
+                const SRgb8 *row = origin + (ptrdiff_t) (y0 + k - 8 * yb0) * dy + (ptrdiff_t) (xs - x0) * dx;
+                SRgb8 gathered[8];
+                if (dx != 1) {
+                    for (uint32_t i = 0; i < cols; i++)
+                        gathered[i] = row[(ptrdiff_t) i * dx];
+                    row = gathered;
                 }
+                uint8_t r, y, w;
+                if (cols == 8)
+                    classify8(row, &r, &y, &w);
+                else
+                    classifyScalar(row, (int) cols, &r, &y, &w);
+                int shift = 8 * (7 - k);
+                red |= (uint64_t) r << shift;
+                yellow |= (uint64_t) y << shift;
+                white |= (uint64_t) w << shift;
+            }
+            red = transpose8x8(red);
+            yellow = transpose8x8(yellow);
+            white = transpose8x8(white);
+            uint32_t ofs = xs * heightInBytes + yb;
+            for (uint32_t i = 0; i < cols; i++) {
+                dstBW[ofs] = (uint8_t) (white >> (8 * i));
+                if (dstRed)
+                    dstRed[ofs] = (uint8_t) (red >> (8 * i));
+                if (dstYellow)
+                    dstYellow[ofs] = (uint8_t) (yellow >> (8 * i));
+                ofs += heightInBytes;
             }
-            color++;
         }
     }
+}
+
+/**
+ * Map screen pixel (x, y) to the source pixel sy * sourceWidth + sx = origin + x * dx + y * dy
+ * @param retOrigin offset of the screen pixel (0, 0) in the source image
+ * @return false if rotation is not 0, 90, 180 or 270
+ */
+static bool sourceMapping(
+    uint32_t width,
+    uint32_t height,
+    bool mirror,
+    uint16_t rotation,
+    ptrdiff_t *retOrigin,
+    ptrdiff_t *retDx,
+    ptrdiff_t *retDy
+) {
+    // source image width
+    ptrdiff_t sw = (rotation == 90 || rotation == 270) ? height : width;
+    ptrdiff_t sh = (rotation == 90 || rotation == 270) ? width : height;
+    ptrdiff_t origin, dx, dy;
+    switch (rotation) {
+        case 0:
+            origin = 0;
+            dx = 1;
+            dy = sw;
+            break;
+        case 90:
+            origin = (sh - 1) * sw;
+            dx = -sw;
+            dy = 1;
+            break;
+        case 180:
+            origin = sh * sw - 1;
+            dx = -1;
+            dy = -sw;
+            break;
+        case 270:
+            origin = sw - 1;
+            dx = sw;
+            dy = -1;
+            break;
+        default:
+            return false;
+    }
+    if (!mirror) {
+        origin += (ptrdiff_t) (width - 1) * dx;
+        dx = -dx;
+    }
+    *retOrigin = origin;
+    *retDx = dx;
+    *retDy = dy;
+    return true;
+}
+
+/**
+ * Convert sRGB 8-bit per color buffer to the buffer for ESL device
+ * @param dst destination ESL device buffer, at least packSRgb8Size() bytes
+ * @param src sRGB buffer, width x height, or height x width if rotation is 90 or 270
+ * @param width device screen width
+ * @param height device screen height
+ * @param hasRed red color
+ * @param hasYellow yellow color
+ * @param mirror true- single mirror, image as is, false- double mirror, columns are reversed
+ * @param compress compression on
+ * @param rotation rotate source image clockwise: 0, 90, 180 or 270 degrees
+ * @return bytes written, <0 if error
+ */
+int packSRgb8(
+    void *dst,
+    SRgb8 *src,
+    uint32_t width,
+    uint32_t height,
+    bool hasRed,
+    bool hasYellow,
+    bool mirror,
+    bool compress,
+    uint16_t rotation
+)
+{
+    ptrdiff_t origin, dx, dy;
+    if (!sourceMapping(width, height, mirror, rotation, &origin, &dx, &dy))
+        return -1;
+    uint32_t heightInBytes = (height + 7) / 8;
+    uint32_t size = packSRgb8Size(width, height, hasRed, hasYellow, false);
+    if (!compress) {
+        packPlanes(dst, src + origin, dx, dy, width, height, 0, width, 0, heightInBytes, hasRed, hasYellow);
+        return (int) size;
+    }
+    void *planes = malloc(size);
+    if (!planes)
+        return -1;
+    packPlanes(planes, src + origin, dx, dy, width, height, 0, width, 0, heightInBytes, hasRed, hasYellow);
+    int r = (int) compressPlanes(dst, planes, size);
+    free(planes);
+    return r;
+}
+
+SRgb8RowPacker::SRgb8RowPacker()
+    : dst(nullptr), width(0), height(0), hasRed(false), hasYellow(false), origin(0), dx(0), dy(0),
+      rowsAreColumns(false), first(0), next(0), sourceWidth(0), sourceHeight(0)
+{
+}
+
+/**
+ * Start packing, see packSRgb8()
+ * @param dst destination ESL device buffer, at least packSRgb8Size() bytes, uncompressed
+ * @return 0- success, -1- invalid rotation
+ */
+int SRgb8RowPacker::init(
+    void *aDst,
+    uint32_t aWidth,
+    uint32_t aHeight,
+    bool aHasRed,
+    bool aHasYellow,
+    bool mirror,
+    uint16_t rotation
+) {
+    if (!sourceMapping(aWidth, aHeight, mirror, rotation, &origin, &dx, &dy))
+        return -1;
+    dst = aDst;
+    width = aWidth;
+    height = aHeight;
+    hasRed = aHasRed;
+    hasYellow = aHasYellow;
+    rowsAreColumns = rotation == 90 || rotation == 270;
+    sourceWidth = rowsAreColumns ? height : width;
+    sourceHeight = rowsAreColumns ? width : height;
+    rows.resize((size_t) sourceWidth * 8);
+    first = 0;
+    next = 0;
     return 0;
 }
+
+/**
+ * Pack next source row, rows go from the top to the bottom
+ * @param row sourceWidth pixels
+ * @return 0- success, -1- all rows are already packed
+ */
+int SRgb8RowPacker::put(
+    const SRgb8 *row
+) {
+    if (next >= sourceHeight)
+        return -1;
+    memmove(&rows[(size_t) (next - first) * sourceWidth], row, sourceWidth * sizeof(SRgb8));
+    next++;
+    // source row is a screen row if not rotated by 90 or 270 degrees, otherwise it is a screen column
+    ptrdiff_t sw = sourceWidth;
+    ptrdiff_t step = (rowsAreColumns ? dx : dy) / sw;
+    ptrdiff_t originRow = origin / sw;
+    // screen row or column of the first and the last buffered rows
+    ptrdiff_t a = ((ptrdiff_t) first - originRow) * step;
+    ptrdiff_t b = ((ptrdiff_t) next - 1 - originRow) * step;
+    ptrdiff_t lo = a < b ? a : b;
+    ptrdiff_t hi = a < b ? b : a;
+    bool last = next == sourceHeight;
+    if (!rowsAreColumns) {
+        // wait for the whole 8-pixel band
+        bool bandDone = step > 0 ? (hi % 8 == 7) : (lo % 8 == 0);
+        if (!bandDone && !last)
+            return 0;
+        ptrdiff_t ofs = origin + lo * dy - (ptrdiff_t) first * sw;
+        packPlanes(dst, rows.data() + ofs, dx, dy, width, height, 0, width, (uint32_t) lo / 8, (uint32_t) lo / 8 + 1,
+            hasRed, hasYellow);
+    } else {
+        // columns are independent, 8 at once to classify 8 pixels
+        if (next - first < 8 && !last)
+            return 0;
+        ptrdiff_t ofs = origin + lo * dx - (ptrdiff_t) first * sw;
+        packPlanes(dst, rows.data() + ofs, dx, dy, width, height, (uint32_t) lo, (uint32_t) hi + 1, 0, (height + 7) / 8,
+            hasRed, hasYellow);
+    }
+    first = next;
+    return 0;
+}
+
+/*
+ * Compressed planes format
+ *
+ *   4 bytes    uncompressed size, little endian
+ *   packets:
+ *   0..127     n + 1 literal bytes follow
+ *   128..255   next byte repeats n - 125 times (3..130)
+ *
+ * White background and black text give long runs of 0xff and 0 bytes.
+ */
+static const uint32_t MIN_RUN = 3;
+static const uint32_t MAX_RUN = 130;
+static const uint32_t MAX_LITERALS = 128;
+
+/**
+ * Compress color planes
+ * @param dst destination buffer, at least size + (size + 127) / 128 + 4 bytes
+ * @param src planes
+ * @param size planes size in bytes
+ * @return compressed size
+ */
+uint32_t compressPlanes(
+    void *dst,
+    const void *src,
+    uint32_t size
+) {
+    auto *d = (uint8_t *) dst;
+    auto *s = (const uint8_t *) src;
+    d[0] = size & 0xff;
+    d[1] = (size >> 8) & 0xff;
+    d[2] = (size >> 16) & 0xff;
+    d[3] = (size >> 24) & 0xff;
+    uint32_t o = 4;
+    uint32_t i = 0;
+    while (i < size) {
+        uint32_t run = 1;
+        while (i + run < size && run < MAX_RUN && s[i + run] == s[i])
+            run++;
+        if (run >= MIN_RUN) {
+            d[o++] = (uint8_t) (run + 125);
+            d[o++] = s[i];
+            i += run;
+            continue;
+        }
+        // literals until next run
+        uint32_t start = i;
+        uint32_t n = 0;
+        while (i < size && n < MAX_LITERALS) {
+            if (i + 2 < size && s[i] == s[i + 1] && s[i] == s[i + 2])
+                break;
+            i++;
+            n++;
+        }
+        d[o++] = (uint8_t) (n - 1);
+        memmove(d + o, s + start, n);
+        o += n;
+    }
+    return o;
+}
+
+/**
+ * Decompress color planes compressed by compressPlanes()
+ * @param dst destination buffer
+ * @param dstSize destination buffer size
+ * @param src compressed planes
+ * @param srcSize compressed size
+ * @return uncompressed size, -1 if data is corrupted or does not fit
+ */
+int32_t decompressPlanes(
+    void *dst,
+    uint32_t dstSize,
+    const void *src,
+    uint32_t srcSize
+) {
+    auto *d = (uint8_t *) dst;
+    auto *s = (const uint8_t *) src;
+    if (srcSize < 4)
+        return -1;
+    uint32_t size = s[0] | (s[1] << 8) | (s[2] << 16) | ((uint32_t) s[3] << 24);
+    if (size > dstSize)
+        return -1;
+    uint32_t i = 4;
+    uint32_t o = 0;
+    while (i < srcSize) {
+        uint8_t c = s[i++];
+        if (c < 128) {
+            uint32_t n = c + 1;
+            if (i + n > srcSize || o + n > size)
+                return -1;
+            memmove(d + o, s + i, n);
+            i += n;
+            o += n;
+        } else {
+            uint32_t n = c - 125;
+            if (i >= srcSize || o + n > size)
+                return -1;
+            memset(d + o, s[i++], n);
+            o += n;
+        }
+    }
+    if (o != size)
+        return -1;
+    return (int32_t) size;
+}
@@ -1,13 +1,50 @@
 #ifndef SRGB_PACK_H
 #define SRGB_PACK_H
 
+#include <cstddef>
 #include <cstdint>
+#include <vector>
 
 class SRgb8 {
 public:
     uint8_t r, g, b, s;
 };
 
-int packSRgb8(void *dst, SRgb8* src, uint32_t width, uint32_t height, bool hasRed, bool hasYellow, bool mirror, bool compress);
+uint32_t packSRgb8Size(uint32_t width, uint32_t height, bool hasRed, bool hasYellow, bool compress);
+int packSRgb8(void *dst, SRgb8* src, uint32_t width, uint32_t height, bool hasRed, bool hasYellow, bool mirror, bool compress,
+    uint16_t rotation = 0);
+
+/**
+ * Pack image row by row as it is decoded, so the whole sRGB image is never kept in memory.
+ * Buffers up to 8 source rows.
+ */
+class SRgb8RowPacker {
+private:
+    void *dst;
+    uint32_t width;
+    uint32_t height;
+    bool hasRed;
+    bool hasYellow;
+    // source pixel of the screen pixel (x, y) is origin + x * dx + y * dy
+    ptrdiff_t origin;
+    ptrdiff_t dx;
+    ptrdiff_t dy;
+    // rotated by 90 or 270 degrees
+    bool rowsAreColumns;
+    std::vector<SRgb8> rows;
+    // first buffered source row
+    uint32_t first;
+    // next source row
+    uint32_t next;
+public:
+    uint32_t sourceWidth;
+    uint32_t sourceHeight;
+    SRgb8RowPacker();
+    int init(void *dst, uint32_t width, uint32_t height, bool hasRed, bool hasYellow, bool mirror, uint16_t rotation = 0);
+    int put(const SRgb8 *row);
+};
+
+uint32_t compressPlanes(void *dst, const void *src, uint32_t size);
+int32_t decompressPlanes(void *dst, uint32_t dstSize, const void *src, uint32_t srcSize);
 
 #endif
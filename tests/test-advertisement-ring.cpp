@@ -0,0 +1,114 @@
+/**
+ *  ./test-advertisement-ring
+ *  Pass advertisements from the radio thread to the consumer thread through the lock-free ring
+ */
+
+#include <iostream>
+#include <thread>
+#include "ble-helper-sim.h"
+
+/**
+ * Producer and consumer threads, records arrive in order and intact.
+ * Producer retries when the ring is full, so every record is received.
+ */
+static int checkRing() {
+    AdvertisementRing ring(1024);
+    const uint64_t count = 2000000;
+    NEMR5053ManufacturerSpecificData metadata;
+    std::thread producer([&ring, &metadata, count] {
+        for (uint64_t i = 1; i <= count; i++) {
+            while (!ring.push(AdvertisementRecord(i, (int16_t) -(i % 100), metadata, "NEMR", 4)))
+                std::this_thread::yield();
+        }
+    });
+    uint64_t received = 0, last = 0;
+    AdvertisementRecord record;
+    bool ordered = true;
+    while (received < count) {
+        if (!ring.pop(record)) {
+            std::this_thread::yield();
+            continue;
+        }
+        ordered = ordered && record.addr == last + 1 && record.rssi == (int16_t) -(record.addr % 100)
+            && record.nameString() == "NEMR";
+        last = record.addr;
+        received++;
+    }
+    producer.join();
+    std::cout << received << " advertisements received, ring was full " << ring.dropped << " times" << std::endl;
+    if (!ordered || !ring.empty()) {
+        std::cerr << "Advertisements out of order or corrupted" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * First discovery blocks for a long upload
+ */
+class SlowOnDiscover : public OnDiscover {
+public:
+    std::mutex mutexCount;
+    int firstTime;
+    int nextTime;
+    SlowOnDiscover()
+        : firstTime(0), nextTime(0)
+    {
+
+    }
+
+    void discoverFirstTime(DiscoveredDevice &device) override
+    {
+        {
+            std::unique_lock<std::mutex> lck(mutexCount);
+            firstTime++;
+        }
+        if (device.addr == 0xffff92130000)
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+
+    void discoverNextTime(DiscoveredDevice &device) override
+    {
+        std::unique_lock<std::mutex> lck(mutexCount);
+        nextTime++;
+    }
+};
+
+/**
+ * Labels keep advertising while a callback blocks the consumer, no advertisement is lost
+ */
+static int checkSlowCallback() {
+    SlowOnDiscover counter;
+    BLEHelperSim b(&counter);
+    // 250x128 BWR EPA
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    const int labelCount = 50;
+    for (int i = 0; i < labelCount; i++) {
+        auto &label = b.addLabel(0xffff92130000 + i, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+        label.link.advIntervalMs = 20;
+    }
+    b.startDiscovery();
+    auto devicesFound = b.waitDiscover(labelCount, 5);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    b.stopDiscovery(10);
+    std::cout << devicesFound << " labels discovered, " << counter.firstTime << " first time, " << counter.nextTime
+        << " next time, " << b.advertisements.dropped << " dropped" << std::endl;
+    if (devicesFound != labelCount || counter.firstTime != labelCount || b.advertisements.dropped != 0) {
+        std::cerr << "Advertisements lost while callback is running" << std::endl;
+        return 1;
+    }
+    // 500ms blocked at 50 advertisements per 20ms
+    if (counter.nextTime < labelCount * 10) {
+        std::cerr << "Advertisements not queued while callback is running" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main() {
+    int r = checkRing();
+    r |= checkSlowCallback();
+    if (r == 0)
+        std::cout << "advertisement ring works" << std::endl;
+    return r;
+}
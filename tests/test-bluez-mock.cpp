@@ -0,0 +1,210 @@
+/**
+ *  ./test-bluez-mock
+ *  BlueZ backend against the mock bus backed by simulated labels: object paths, discovery by
+ *  advertisement signals, sessions, image transfer by each write mode and by SessionDriver, failures
+ */
+
+#include <iostream>
+#include <cstring>
+#include "nemr-5053-manufacturer-specific-data.h"
+#include "ble-helper-bluez.h"
+#include "bluez-bus-mock.h"
+#include "session-driver.h"
+
+static const int LABEL_COUNT = 3;
+
+static int checkPaths() {
+    char path[128];
+    bluezDevicePath(path, sizeof(path), "/org/bluez/hci0", 0xffff92130a0b);
+    if (strcmp(path, "/org/bluez/hci0/dev_FF_FF_92_13_0A_0B") != 0) {
+        std::cerr << "Device path " << path << std::endl;
+        return 1;
+    }
+    uint64_t addr = 0;
+    if (!bluezPathAddr("/org/bluez/hci0/dev_FF_FF_92_13_0A_0B/service000c/char000d", addr) || addr != 0xffff92130a0b) {
+        std::cerr << "Address of the characteristic path" << std::endl;
+        return 1;
+    }
+    if (bluezPathAddr("/org/bluez/hci0", addr) || bluezPathAddr("/org/bluez/hci0/dev_FF_FF_92_13_0A", addr)
+        || bluezPathAddr("/org/bluez/hci0/dev_FF_FF_92_13_0A_0B0", addr)) {
+        std::cerr << "Address of the path not under a device" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Reader fails on the value of other type and on exit from the container not read to the end
+ */
+static int checkReader() {
+    DBusValueReader r({ DBusValue::dictionary({ { "RSSI", DBusValue::basic('n', -70) } }) });
+    int16_t rssi = 0;
+    const char *key = nullptr;
+    if (r.enter('a', "{qv}") || !r.enter('a', "{sv}") || !r.enter('e', "sv") || r.read('n', &rssi)
+        || !r.read('s', &key) || strcmp(key, "RSSI") != 0 || r.exit() || r.enterVariant("s") || !r.exit()
+        || r.enter('e', "sv") || !r.exit()) {
+        std::cerr << "Reader does not follow sd-bus" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+class CountSent : public OnSent {
+public:
+    int count;
+    int failed;
+    CountSent()
+        : count(0), failed(0)
+    {
+
+    }
+
+    void sent(const SendOperation &operation) override
+    {
+        count++;
+        if (operation.result)
+            failed++;
+    }
+};
+
+static int checkImage(
+    const SimulatedLabel &label,
+    const std::vector<uint8_t> &buffer,
+    uint32_t imageCount
+) {
+    if (label.imageCount != imageCount || label.image != buffer) {
+        std::cerr << "Received image differs" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static int sendThroughMockBus() {
+    BLEHelperSim sim;
+    // 250x128 BWR EPA
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    for (int i = 0; i < LABEL_COUNT; i++) {
+        auto &label = sim.addLabel(0xffff92130000 + i, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)),
+            "NEMR" + std::to_string(i));
+        label.rssi = (int16_t) (-50 - i);
+        label.link.latencyMs = 5;
+        label.link.jitterMs = 2;
+        label.link.advIntervalMs = 50;
+    }
+    BluezBusMock bus(&sim);
+    BLEHelperBluez b(&bus);
+
+    if (b.startDiscovery()) {
+        std::cerr << "Discovery not started" << std::endl;
+        return 1;
+    }
+    auto devicesFound = b.waitDiscover(LABEL_COUNT, 5);
+    b.stopDiscovery(10);
+    if (devicesFound != LABEL_COUNT) {
+        std::cerr << "Labels not discovered by advertisement signals" << std::endl;
+        return 1;
+    }
+    for (auto &label : sim.labels) {
+        auto &d = b.find(label.addr);
+        if (memcmp(&d.metadata.val, &label.metadata.val, sizeof(d.metadata.val)) != 0 || d.name != label.name
+            || d.rssi != label.rssi || d.advCount < 1) {
+            std::cerr << "Device " << d.name << " differs from the advertised label" << std::endl;
+            return 1;
+        }
+    }
+
+    uint32_t sz = b.devices[0].metadata.screenSize();
+    std::vector<uint8_t> buffer(sz);
+    for (uint32_t i = 0; i < sz; i++)
+        buffer[i] = (uint8_t) (i * 7);
+
+    // stop-and-wait, then window of chunks without response
+    uint8_t windows[LABEL_COUNT] { 1, 8, 8 };
+    for (int i = 0; i < LABEL_COUNT; i++) {
+        auto &d = b.devices[i];
+        if (b.open(&d) || d.deviceState != DS_SESSION_ON || !d.impl) {
+            std::cerr << "Session not open" << std::endl;
+            return 1;
+        }
+        int r = b.sendBuffer(&d, buffer.data(), sz, 1000, windows[i]);
+        b.close(&d);
+        if (r) {
+            std::cerr << "Image not sent, window " << (int) windows[i] << ": " << r << std::endl;
+            return 1;
+        }
+        if (checkImage(sim.labels[i], buffer, 1))
+            return 1;
+    }
+    if (bus.queuedWriteCount == 0 || bus.queuedWriteCount != bus.writeCount) {
+        std::cerr << "Requests and chunks are not queued without waiting for the reply" << std::endl;
+        return 1;
+    }
+    if (sim.connectionCount != 0) {
+        std::cerr << "Session not closed" << std::endl;
+        return 1;
+    }
+    uint8_t request[1] { 1 };
+    if (b.write(&b.devices[0], CI_REQUEST, request, 1) >= 0) {
+        std::cerr << "Write after close succeeded" << std::endl;
+        return 1;
+    }
+
+    // characteristics kept by bluetoothd are found by GetManagedObjects
+    bus.cachedServices = true;
+    auto &cached = b.devices[0];
+    for (int session = 0; session < 2; session++) {
+        if (b.open(&cached)) {
+            std::cerr << "Session with cached services not open" << std::endl;
+            return 1;
+        }
+        uint16_t blockSize = b.getBlockSize(&cached);
+        b.close(&cached);
+        if (blockSize != sim.labels[0].blockSize) {
+            std::cerr << "Block size " << blockSize << " in the session " << session << std::endl;
+            return 1;
+        }
+    }
+    bus.cachedServices = false;
+
+    bus.failMethod = "Connect";
+    if (b.open(&b.devices[1]) == 0 || b.devices[1].deviceState != DS_IDLE) {
+        std::cerr << "Failed connect opened the session" << std::endl;
+        return 1;
+    }
+    bus.failMethod.clear();
+
+    // sessions of all labels driven from one thread
+    for (auto &label : sim.labels)
+        label.imageCount = 0;
+    CountSent counter;
+    SessionDriver driver(&b, &counter);
+    for (auto &d : b.devices)
+        driver.send(&d, buffer.data(), sz, 1000, 8);
+    while (driver.poll(1000))
+        ;
+    if (counter.count != LABEL_COUNT || counter.failed) {
+        std::cerr << counter.failed << " of " << counter.count << " driver sessions failed" << std::endl;
+        return 1;
+    }
+    for (auto &label : sim.labels) {
+        if (checkImage(label, buffer, 1))
+            return 1;
+    }
+    if (sim.connectionCount != 0) {
+        std::cerr << "Driver session not closed" << std::endl;
+        return 1;
+    }
+    std::cout << LABEL_COUNT << " labels over the mock bus, " << bus.callCount << " calls, "
+        << bus.writeCount << " writes" << std::endl;
+    return 0;
+}
+
+int main() {
+    if (checkPaths())
+        return -1;
+    if (checkReader())
+        return -1;
+    if (sendThroughMockBus())
+        return -1;
+    return 0;
+}
@@ -0,0 +1,107 @@
+/**
+ *  ./test-checksum
+ *  Compare CRC-32 and Adler-32 with byte by byte reference implementations, print MB/s
+ */
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+
+#include "wpng/checksum.h"
+
+static const int REPEAT = 200;
+
+static uint32_t referenceCrc32(
+    const uint8_t *data,
+    size_t size,
+    uint32_t init
+) {
+    uint32_t c = init ^ 0xffffffff;
+    for (size_t i = 0; i < size; i++) {
+        c ^= data[i];
+        for (int k = 0; k < 8; k++)
+            c = (c >> 1) ^ ((c & 1) ? 0xEDB88320 : 0);
+    }
+    return c ^ 0xffffffff;
+}
+
+static uint32_t referenceAdler32(
+    uint32_t adler,
+    const uint8_t *data,
+    size_t size
+) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    for (size_t i = 0; i < size; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * Random lengths and alignments, incremental updates, all 0xff (maximum sums for Adler-32)
+ */
+static int check() {
+    std::vector<uint8_t> data(70000);
+    srand(1);
+    for (auto &c : data)
+        c = (uint8_t) rand();
+    // "123456789" check values
+    const uint8_t check9[] = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+    if (infl_compute_crc32(check9, 9, 0) != 0xCBF43926 || infl_compute_adler32(check9, 9) != 0x091E01DE) {
+        std::cerr << "check value mismatch" << std::endl;
+        return 1;
+    }
+    for (int i = 0; i < 2000; i++) {
+        size_t offset = rand() % 64;
+        size_t size = i < 300 ? i : rand() % (data.size() - offset);
+        const uint8_t *p = &data[offset];
+        uint32_t crcInit = i % 2 ? (uint32_t) rand() : 0;
+        uint32_t adlerInit = i % 3 ? 1 : (uint32_t) (rand() % 65521) << 16 | (rand() % 65521);
+        if (infl_compute_crc32(p, size, crcInit) != referenceCrc32(p, size, crcInit)) {
+            std::cerr << "CRC-32 differs, offset " << offset << " size " << size << std::endl;
+            return 1;
+        }
+        if (infl_update_adler32(adlerInit, p, size) != referenceAdler32(adlerInit, p, size)) {
+            std::cerr << "Adler-32 differs, offset " << offset << " size " << size << std::endl;
+            return 1;
+        }
+    }
+    std::vector<uint8_t> ones(data.size(), 0xff);
+    for (size_t size : { (size_t) 5552, (size_t) 5553, (size_t) 32 * 174, ones.size() }) {
+        uint32_t adler = (65520u << 16) | 65520;
+        if (infl_update_adler32(adler, ones.data(), size) != referenceAdler32(adler, ones.data(), size)) {
+            std::cerr << "Adler-32 overflow, size " << size << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void benchmark() {
+    std::vector<uint8_t> data(1 << 20);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (uint8_t) (i * 2654435761u >> 24);
+    uint32_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < REPEAT; i++)
+        sum += infl_compute_crc32(data.data(), data.size(), 0);
+    auto middle = std::chrono::steady_clock::now();
+    for (int i = 0; i < REPEAT; i++)
+        sum += infl_compute_adler32(data.data(), data.size());
+    auto end = std::chrono::steady_clock::now();
+    double mb = (double) data.size() * REPEAT / (1 << 20);
+    std::cout << "CRC-32 " << mb / std::chrono::duration<double>(middle - start).count() << " MB/s, "
+        << "Adler-32 " << mb / std::chrono::duration<double>(end - middle).count() << " MB/s "
+        << "(features 0x" << std::hex << checksum_cpu_features() << ", " << sum << std::dec << ")" << std::endl;
+}
+
+int main() {
+    int r = check();
+    if (r == 0) {
+        std::cout << "checksums match" << std::endl;
+        benchmark();
+    }
+    return r;
+}
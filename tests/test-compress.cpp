@@ -0,0 +1,82 @@
+/**
+ *  ./test-compress [file.png ...]
+ *  Check compressed planes and print compression ratio and speed
+ */
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+
+#include "srgb-pack.h"
+#include "png2srgb8.h"
+
+static const int REPEAT = 20;
+
+static int compressFile(
+    const char *fn
+) {
+    Png2sRgb png;
+    int32_t sz = png.loadFile(fn);
+    if (sz < 0) {
+        std::cerr << "Error parse file " << fn << std::endl;
+        return sz;
+    }
+    // pack as BWR label
+    uint32_t rawSize = packSRgb8Size(png.w, png.h, true, false, false);
+    std::vector<uint8_t> raw(rawSize);
+    std::vector<uint8_t> compressed(packSRgb8Size(png.w, png.h, true, false, true));
+    std::vector<uint8_t> decompressed(rawSize);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < REPEAT; i++)
+        packSRgb8(raw.data(), png.srgb, png.w, png.h, true, false, true, false);
+    auto packUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / REPEAT;
+
+    int compressedSize = 0;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < REPEAT; i++)
+        compressedSize = packSRgb8(compressed.data(), png.srgb, png.w, png.h, true, false, true, true);
+    auto compressUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / REPEAT;
+    if (compressedSize <= 0) {
+        std::cerr << "Error compress " << fn << std::endl;
+        return -1;
+    }
+
+    int32_t r = decompressPlanes(decompressed.data(), rawSize, compressed.data(), compressedSize);
+    if (r < 0 || (uint32_t) r != rawSize || decompressed != raw) {
+        std::cerr << "Decompressed planes differ " << fn << std::endl;
+        return -1;
+    }
+    std::cout << fn << ' ' << png.w << 'x' << png.h << ": "
+        << rawSize << " -> " << compressedSize << " bytes ("
+        << (compressedSize * 100 / rawSize) << "%), pack " << packUs << "us, pack and compress " << compressUs << "us"
+        << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // runs of all lengths and literals
+    std::vector<uint8_t> src(1000);
+    for (size_t i = 0; i < src.size(); i++)
+        src[i] = (i % 300 < 150) ? 0xff : (uint8_t) (i * 7);
+    std::vector<uint8_t> c(src.size() + (src.size() + 127) / 128 + 4);
+    std::vector<uint8_t> d(src.size());
+    uint32_t csz = compressPlanes(c.data(), src.data(), (uint32_t) src.size());
+    if (decompressPlanes(d.data(), (uint32_t) d.size(), c.data(), csz) != (int32_t) src.size() || d != src) {
+        std::cerr << "Decompressed data differs" << std::endl;
+        return -1;
+    }
+    if (decompressPlanes(d.data(), (uint32_t) d.size(), c.data(), csz - 1) >= 0) {
+        std::cerr << "Truncated data accepted" << std::endl;
+        return -1;
+    }
+
+    if (argc < 2)
+        return compressFile("../../tests/250x128.png");
+    for (int i = 1; i < argc; i++) {
+        int r = compressFile(argv[i]);
+        if (r)
+            return r;
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ *  ./test-defilter
+ *  Compare SIMD PNG defilter kernels with the scalar code on random scanlines, print MB/s of both
+ */
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+
+#include "wpng/defilter.h"
+
+static const int REPEAT = 200;
+
+static const char *filterNames[] = { "none", "sub", "up", "average", "paeth", "unknown" };
+
+/**
+ * Random rows of every filter type and pixel size, random lengths and alignments
+ */
+static int fuzz() {
+    std::vector<uint8_t> cur(8100), prev(8100), want(8100);
+    srand(1);
+    for (int i = 0; i < 20000; i++) {
+        uint8_t filter = i % 6;
+        size_t bpp = 1 + (i / 6) % 8;
+        size_t pixels = i < 600 ? i % 17 : rand() % 1000;
+        size_t len = pixels * bpp;
+        size_t offset = rand() % 16;
+        // mostly random bytes, sometimes smooth runs where Paeth ties are frequent
+        bool smooth = rand() % 3 == 0;
+        for (size_t x = 0; x < len; x++) {
+            cur[offset + x] = smooth ? (uint8_t) (rand() % 3) : (uint8_t) rand();
+            prev[offset + x] = smooth ? (uint8_t) (x / bpp + rand() % 2) : (uint8_t) rand();
+        }
+        memcpy(&want[offset], &cur[offset], len);
+        defilter_row_scalar(&want[offset], &prev[offset], len, filter, bpp);
+        defilter_row(&cur[offset], &prev[offset], len, filter, bpp);
+        if (memcmp(&want[offset], &cur[offset], len) != 0) {
+            std::cerr << filterNames[filter] << " differs, bytes per pixel " << bpp << " length " << len << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static double megabytesPerSecond(
+    void (*defilter)(uint8_t *, const uint8_t *, size_t, uint8_t, size_t),
+    uint8_t filter,
+    size_t bpp
+) {
+    size_t len = 1200 * bpp;
+    std::vector<uint8_t> cur(len), prev(len);
+    for (size_t x = 0; x < len; x++) {
+        cur[x] = (uint8_t) (x * 7);
+        prev[x] = (uint8_t) (x * 13);
+    }
+    int rows = REPEAT * 100;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rows; i++)
+        defilter(cur.data(), prev.data(), len, filter, bpp);
+    auto end = std::chrono::steady_clock::now();
+    return (double) len * rows / (1 << 20) / std::chrono::duration<double>(end - start).count();
+}
+
+static void benchmark() {
+    for (size_t bpp : { 3, 4 }) {
+        for (uint8_t filter = 1; filter <= 4; filter++) {
+            std::cout << filterNames[filter] << " " << bpp << " bytes per pixel: scalar "
+                << megabytesPerSecond(defilter_row_scalar, filter, bpp) << " MB/s, dispatched "
+                << megabytesPerSecond(defilter_row, filter, bpp) << " MB/s" << std::endl;
+        }
+    }
+}
+
+int main() {
+    int r = fuzz();
+    if (r == 0) {
+        std::cout << "defilter kernels match" << std::endl;
+        benchmark();
+    }
+    return r;
+}
@@ -0,0 +1,248 @@
+/**
+ *  ./test-device-registry [labels [advertisements-per-label]]
+ *  Feed synthetic advertisement stream to the device registry, compare with linear search, print advertisements/s.
+ *  Check devices are updated in place on repeated advertisements and stale devices are evicted.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+#include <thread>
+#include "ble-helper-sim.h"
+
+/**
+ * Registry lookups and insertions agree with linear search, handles survive growth
+ */
+static int check() {
+    DeviceRegistry registry;
+    std::vector<DiscoveredDevice *> handles;
+    std::vector<uint64_t> addrs;
+    srand(1);
+    for (int i = 0; i < 5000; i++) {
+        // half of the addresses share all bytes but the lowest one
+        uint64_t addr = i % 2 ? 0xffff92130000ull + i : 0xffff00000000ull | (((uint64_t) rand() << 16) ^ rand());
+        if (std::find(addrs.begin(), addrs.end(), addr) != addrs.end())
+            continue;
+        auto r = registry.insert(DiscoveredDevice(addr, -60, NEMR5053ManufacturerSpecificData(), ""));
+        if (!r.second || r.first->addr != addr) {
+            std::cerr << "Device not added" << std::endl;
+            return 1;
+        }
+        addrs.push_back(addr);
+        handles.push_back(r.first);
+    }
+    for (size_t i = 0; i < addrs.size(); i++) {
+        if (registry.find(addrs[i]) != handles[i] || &registry[i] != handles[i]) {
+            std::cerr << "Device moved or lost" << std::endl;
+            return 1;
+        }
+        if (registry.insert(DiscoveredDevice(addrs[i], -70, NEMR5053ManufacturerSpecificData(), "")).second) {
+            std::cerr << "Device added twice" << std::endl;
+            return 1;
+        }
+    }
+    if (registry.size() != addrs.size() || registry.find(0xffff92130000ull + 1000000) || registry.find(0)) {
+        std::cerr << "Unknown device found" << std::endl;
+        return 1;
+    }
+    registry.clear();
+    if (!registry.empty() || registry.find(addrs[0])) {
+        std::cerr << "Registry not cleared" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Repeated advertisement updates RSSI, time, metadata and name, smooths RSSI and interval
+ */
+static int checkUpdate() {
+    NEMR5053ManufacturerSpecificData metadata("53500b1c810141");
+    DiscoveredDevice d(0xffff92130000, -80, metadata, "NEMR1");
+    DiscoveredDevice next(d.addr, -40, metadata, "");
+    next.metadata.setVoltage10(27);
+    for (int i = 1; i <= 3; i++) {
+        next.dt = d.dt + std::chrono::milliseconds(100);
+        d.update(next);
+    }
+    // -80 moves 1/8 of the way to -40 three times
+    float rssi = -80;
+    for (int i = 0; i < 3; i++)
+        rssi += (-40 - rssi) / 8;
+    if (d.rssi != -40 || d.rssiSmoothed < rssi - 0.01f || d.rssiSmoothed > rssi + 0.01f
+        || d.advIntervalMs < 99.9f || d.advIntervalMs > 100.1f || d.advRate() < 9.9f || d.advRate() > 10.1f
+        || d.advCount != 4 || d.dt != next.dt || d.metadata.voltage10() != 27 || d.name != "NEMR1") {
+        std::cerr << "Device not updated: RSSI " << d.rssiSmoothed << " interval " << d.advIntervalMs << "ms" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Simulated labels advertising every 20ms, registry keeps the last voltage and the advertising rate
+ */
+static int checkSimulatedUpdate() {
+    BLEHelperSim b;
+    NEMR5053ManufacturerSpecificData metadata("53500b1c810141");
+    for (int i = 0; i < 4; i++)
+        b.addLabel(0xffff92130000 + i, metadata).link.advIntervalMs = 20;
+    b.startDiscovery();
+    b.waitDiscover(4, 5);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    b.stopDiscovery(10);
+    // label reports new voltage in the next discovery
+    b.labels[0].metadata.setVoltage10(25);
+    b.startDiscovery();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    b.stopDiscovery(10);
+    auto d = b.devices.find(0xffff92130000);
+    if (!d || d->metadata.voltage10() != 25 || d->advCount < 10 || d->advRate() < 20 || d->advRate() > 80) {
+        std::cerr << "Simulated label not updated" << std::endl;
+        return 1;
+    }
+    std::cout << d->advCount << " advertisements, " << d->advRate() << " per second, RSSI "
+        << d->rssiSmoothed << std::endl;
+    return 0;
+}
+
+/**
+ * Expired and oldest devices are evicted unless pinned or in session, the rest keep order and handles
+ */
+static int checkEvict() {
+    DeviceRegistry registry;
+    auto start = std::chrono::system_clock::now();
+    std::vector<DiscoveredDevice *> handles;
+    for (int i = 0; i < 100; i++) {
+        DiscoveredDevice d(0xffff92130000ull + i, -60, NEMR5053ManufacturerSpecificData(), "");
+        // device i advertised i seconds after the start
+        d.dt = start + std::chrono::seconds(i);
+        handles.push_back(registry.insert(d).first);
+    }
+    handles[5]->pins = 1;
+    handles[7]->deviceState = DS_SESSION_ON;
+    // expired: 0..49 but pinned 5 and in session 7
+    size_t n = registry.evict(start + std::chrono::seconds(50), 0);
+    if (n != 48 || registry.size() != 52 || registry.evictedExpired != 48
+        || registry.find(handles[5]->addr) != handles[5] || registry.find(handles[7]->addr) != handles[7]
+        || registry.find(0xffff92130000ull + 6) || &registry[2] != handles[50] || registry.find(handles[99]->addr) != handles[99]) {
+        std::cerr << "Expired devices not evicted" << std::endl;
+        return 1;
+    }
+    // over capacity: oldest idle 50..89 go, 5 and 7 stay
+    n = registry.evict(DISCOVERED_TIME::min(), 12);
+    if (n != 40 || registry.size() != 12 || registry.evictedOverCapacity != 40
+        || &registry[0] != handles[5] || &registry[1] != handles[7] || &registry[2] != handles[90]) {
+        std::cerr << "Devices over capacity not evicted" << std::endl;
+        return 1;
+    }
+    // evicted device comes back into a reused object
+    auto r = registry.insert(DiscoveredDevice(0xffff92130000ull + 1, -50, NEMR5053ManufacturerSpecificData(), "NEMR1"));
+    if (!r.second || std::find(handles.begin(), handles.end(), r.first) == handles.end()
+        || r.first->rssi != -50 || r.first->name != "NEMR1" || r.first->pins != 0 || r.first->deviceState != DS_IDLE) {
+        std::cerr << "Evicted device not added back" << std::endl;
+        return 1;
+    }
+    handles[7]->deviceState = DS_IDLE;
+    // churn: a new device each second, 60 seconds TTL keeps the registry bounded
+    for (int i = 0; i < 100000; i++) {
+        DiscoveredDevice d(0xffff00000000ull + i, -60, NEMR5053ManufacturerSpecificData(), "");
+        d.dt = start + std::chrono::seconds(200 + i);
+        registry.insert(d);
+        if (i % 10 == 0)
+            registry.evict(d.dt - std::chrono::seconds(60), 0);
+    }
+    if (registry.size() > 71 || registry.find(0xffff00000000ull) || !registry.find(0xffff00000000ull + 99999)
+        || registry.find(handles[5]->addr) != handles[5]) {
+        std::cerr << "Registry grows: " << registry.size() << " devices" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Simulated labels above maxDevices are evicted by the consumer thread
+ */
+static int checkSimulatedEviction() {
+    BLEHelperSim b;
+    b.maxDevices = 5;
+    b.evictionIntervalMs = 10;
+    NEMR5053ManufacturerSpecificData metadata("53500b1c810141");
+    for (int i = 0; i < 40; i++)
+        b.addLabel(0xffff92130000 + i, metadata).link.advIntervalMs = 20;
+    b.startDiscovery();
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    b.stopDiscovery(10);
+    std::unique_lock<std::mutex> lck(b.mutexDiscoveryState);
+    if (b.devices.evictedOverCapacity == 0 || b.devices.size() >= 40) {
+        std::cerr << "Simulated labels not evicted: " << b.devices.size() << " devices" << std::endl;
+        return 1;
+    }
+    std::cout << b.devices.evictedOverCapacity << " devices evicted over capacity, " << b.devices.size() << " kept" << std::endl;
+    return 0;
+}
+
+/**
+ * Each label advertises in turn, as labels advertising every second do.
+ * Every advertisement is looked up and the device added on the first one, under the discovery mutex.
+ */
+template<class Lookup>
+static double advertisementsPerSecond(
+    int labelCount,
+    int rounds,
+    Lookup lookup
+) {
+    std::mutex mutexDiscoveryState;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < labelCount; i++) {
+            // stride spreads the advertising order over the address range
+            uint64_t addr = 0xffff92130000ull + (uint64_t) ((i * 7919) % labelCount);
+            std::unique_lock<std::mutex> lck(mutexDiscoveryState);
+            lookup(addr);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return (double) labelCount * rounds / std::chrono::duration<double>(end - start).count();
+}
+
+static int benchmark(
+    int labelCount,
+    int rounds
+) {
+    DeviceRegistry registry;
+    double indexed = advertisementsPerSecond(labelCount, rounds, [&registry] (uint64_t addr) {
+        registry.insert(DiscoveredDevice(addr, -60, NEMR5053ManufacturerSpecificData(), ""));
+    });
+    std::vector<DiscoveredDevice> devices;
+    double linear = advertisementsPerSecond(labelCount, rounds, [&devices] (uint64_t addr) {
+        auto it = std::find_if(devices.begin(), devices.end(), [addr](const DiscoveredDevice &dev) {
+            return dev.addr == addr;
+        });
+        if (it == devices.end())
+            devices.emplace_back(addr, -60, NEMR5053ManufacturerSpecificData(), "");
+    });
+    std::cout << labelCount << " labels: registry " << (uint64_t) indexed << " advertisements/s, linear search "
+        << (uint64_t) linear << " advertisements/s" << std::endl;
+    if (registry.size() != (size_t) labelCount || devices.size() != (size_t) labelCount) {
+        std::cerr << "Labels lost" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1)
+        return benchmark(atoi(argv[1]), argc > 2 ? atoi(argv[2]) : 10);
+    int r = check();
+    r |= checkUpdate();
+    r |= checkSimulatedUpdate();
+    r |= checkEvict();
+    r |= checkSimulatedEviction();
+    if (r == 0)
+        std::cout << "device registry works" << std::endl;
+    r |= benchmark(200, 20);
+    r |= benchmark(2000, 20);
+    return r;
+}
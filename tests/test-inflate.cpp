@@ -0,0 +1,150 @@
+/**
+ *  ./test-inflate [file.png ...]
+ *  Compare table-driven inflate with the bit by bit reference decoder, print MB/s of both
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+
+#include "wpng/wpng_read.h"
+
+static const int REPEAT = 20;
+
+// "ESL label " x 40 and bytes 0..255, fixed Huffman codes
+static const uint8_t fixedStream[] {
+    0x78, 0x01, 0x73, 0x0d, 0xf6, 0x51, 0xc8, 0x49, 0x4c, 0x4a, 0xcd, 0x51, 0x70, 0x1d, 0x65, 0x0d,
+    0x02, 0x16, 0x03, 0x23, 0x13, 0x33, 0x0b, 0x2b, 0x1b, 0x3b, 0x07, 0x27, 0x17, 0x37, 0x0f, 0x2f,
+    0x1f, 0xbf, 0x80, 0xa0, 0x90, 0xb0, 0x88, 0xa8, 0x98, 0xb8, 0x84, 0xa4, 0x94, 0xb4, 0x8c, 0xac,
+    0x9c, 0xbc, 0x82, 0xa2, 0x92, 0xb2, 0x8a, 0xaa, 0x9a, 0xba, 0x86, 0xa6, 0x96, 0xb6, 0x8e, 0xae,
+    0x9e, 0xbe, 0x81, 0xa1, 0x91, 0xb1, 0x89, 0xa9, 0x99, 0xb9, 0x85, 0xa5, 0x95, 0xb5, 0x8d, 0xad,
+    0x9d, 0xbd, 0x83, 0xa3, 0x93, 0xb3, 0x8b, 0xab, 0x9b, 0xbb, 0x87, 0xa7, 0x97, 0xb7, 0x8f, 0xaf,
+    0x9f, 0x7f, 0x40, 0x60, 0x50, 0x70, 0x48, 0x68, 0x58, 0x78, 0x44, 0x64, 0x54, 0x74, 0x4c, 0x6c,
+    0x5c, 0x7c, 0x42, 0x62, 0x52, 0x72, 0x4a, 0x6a, 0x5a, 0x7a, 0x46, 0x66, 0x56, 0x76, 0x4e, 0x6e,
+    0x5e, 0x7e, 0x41, 0x61, 0x51, 0x71, 0x49, 0x69, 0x59, 0x79, 0x45, 0x65, 0x55, 0x75, 0x4d, 0x6d,
+    0x5d, 0x7d, 0x43, 0x63, 0x53, 0x73, 0x4b, 0x6b, 0x5b, 0x7b, 0x47, 0x67, 0x57, 0x77, 0x4f, 0x6f,
+    0x5f, 0xff, 0x84, 0x89, 0x93, 0x26, 0x4f, 0x99, 0x3a, 0x6d, 0xfa, 0x8c, 0x99, 0xb3, 0x66, 0xcf,
+    0x99, 0x3b, 0x6f, 0xfe, 0x82, 0x85, 0x8b, 0x16, 0x2f, 0x59, 0xba, 0x6c, 0xf9, 0x8a, 0x95, 0xab,
+    0x56, 0xaf, 0x59, 0xbb, 0x6e, 0xfd, 0x86, 0x8d, 0x9b, 0x36, 0x6f, 0xd9, 0xba, 0x6d, 0xfb, 0x8e,
+    0x9d, 0xbb, 0x76, 0xef, 0xd9, 0xbb, 0x6f, 0xff, 0x81, 0x83, 0x87, 0x0e, 0x1f, 0x39, 0x7a, 0xec,
+    0xf8, 0x89, 0x93, 0xa7, 0x4e, 0x9f, 0x39, 0x7b, 0xee, 0xfc, 0x85, 0x8b, 0x97, 0x2e, 0x5f, 0xb9,
+    0x7a, 0xed, 0xfa, 0x8d, 0x9b, 0xb7, 0x6e, 0xdf, 0xb9, 0x7b, 0xef, 0xfe, 0x83, 0x87, 0x8f, 0x1e,
+    0x3f, 0x79, 0xfa, 0xec, 0xf9, 0x8b, 0x97, 0xaf, 0x5e, 0xbf, 0x79, 0xfb, 0xee, 0xfd, 0x87, 0x8f,
+    0x9f, 0x3e, 0x7f, 0xf9, 0xfa, 0xed, 0xfb, 0x8f, 0x9f, 0xbf, 0x7e, 0xff, 0xf9, 0xfb, 0xef, 0x3f,
+    0x00, 0xb4, 0x6e, 0xfd, 0x21
+};
+
+static std::vector<uint8_t> fixedExpected()
+{
+    std::vector<uint8_t> r;
+    for (int i = 0; i < 40; i++)
+        r.insert(r.end(), "ESL label ", "ESL label " + 10);
+    for (int i = 0; i < 256; i++)
+        r.push_back((uint8_t) i);
+    return r;
+}
+
+/**
+ * @param raw skip zlib header and do not check Adler-32, to measure decoding only
+ */
+static std::vector<uint8_t> inflate(
+    const std::vector<uint8_t> &z,
+    bool bitwise,
+    int &retError,
+    bool raw = false
+) {
+    byte_buffer in = { (uint8_t *) z.data(), z.size(), z.size(), raw ? 2u : 0u };
+    uint8_t headerMode = raw ? 0 : 1;
+    retError = 0;
+    byte_buffer out = bitwise ? do_inflate_bitwise(&in, &retError, headerMode) : do_inflate(&in, &retError, headerMode);
+    std::vector<uint8_t> r(out.data, out.data + out.len);
+    free(out.data);
+    return r;
+}
+
+static int check(
+    const char *name,
+    const std::vector<uint8_t> &z,
+    const std::vector<uint8_t> *expected
+) {
+    int errTable, errBitwise;
+    auto table = inflate(z, false, errTable);
+    auto bitwise = inflate(z, true, errBitwise);
+    if (errTable || errBitwise) {
+        std::cerr << name << ": inflate error " << errTable << ", reference " << errBitwise << std::endl;
+        return 1;
+    }
+    if (table != bitwise || (expected && table != *expected)) {
+        std::cerr << name << ": output differs" << std::endl;
+        return 1;
+    }
+    // truncated stream must fail
+    std::vector<uint8_t> truncated(z.begin(), z.begin() + z.size() / 2);
+    inflate(truncated, false, errTable);
+    if (!errTable) {
+        std::cerr << name << ": truncated stream is not detected" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static void benchmark(
+    const char *name,
+    const std::vector<uint8_t> &z
+) {
+    double mbs[2];
+    size_t size = 0;
+    for (int bitwise = 0; bitwise < 2; bitwise++) {
+        int err;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < REPEAT; i++)
+            size = inflate(z, bitwise, err, true).size();
+        auto finish = std::chrono::steady_clock::now();
+        double us = (double) std::chrono::duration_cast<std::chrono::microseconds>(finish - start).count();
+        mbs[bitwise] = us > 0 ? (double) size * REPEAT / us : 0;
+    }
+    std::cout << name << ": " << z.size() << " -> " << size << " bytes, table "
+        << mbs[0] << " MB/s, bit by bit " << mbs[1] << " MB/s" << std::endl;
+}
+
+static int checkFile(
+    const char *fn
+) {
+    std::ifstream f(fn, std::ios::binary);
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    if (file.empty()) {
+        std::cerr << "Error read file " << fn << std::endl;
+        return 1;
+    }
+    byte_buffer buf = { file.data(), file.size(), file.size(), 0 };
+    wpng_chunks chunks;
+    wpng_load_output output;
+    memset(&output, 0, sizeof(wpng_load_output));
+    wpng_read_chunks(&buf, 0, &chunks, &output);
+    std::vector<uint8_t> z(chunks.idat.data, chunks.idat.data + chunks.idat.len);
+    free(chunks.idat.data);
+    if (output.error) {
+        std::cerr << "Error parse file " << fn << std::endl;
+        return 1;
+    }
+    int r = check(fn, z, nullptr);
+    if (r == 0)
+        benchmark(fn, z);
+    return r;
+}
+
+int main(int argc, char **argv) {
+    std::vector<uint8_t> fixed(fixedStream, fixedStream + sizeof(fixedStream));
+    auto expected = fixedExpected();
+    int r = check("fixed codes", fixed, &expected);
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++)
+            r |= checkFile(argv[i]);
+    } else
+        r |= checkFile("../../tests/250x128.png");
+    return r;
+}
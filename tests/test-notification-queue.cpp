@@ -0,0 +1,117 @@
+/**
+ *  ./test-notification-queue
+ *  Per-device notification queues: order, bounded size, delivery time, concurrent readers
+ */
+
+#include <iostream>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "notification-queue.h"
+
+/**
+ * Notifications are read in order, the oldest is dropped and counted when the queue is full
+ */
+static int checkOrder() {
+    NotificationQueue q;
+    uint8_t b[6];
+    for (uint8_t i = 0; i < 40; i++) {
+        uint8_t n[6] { 5, 0, i, 0, 0, 0 };
+        q.push(n, sizeof(n));
+    }
+    if (q.dropped != 8 || q.size() != 32) {
+        std::cerr << "Queue is not bounded" << std::endl;
+        return 1;
+    }
+    for (uint8_t i = 8; i < 40; i++) {
+        if (q.pop(b, sizeof(b), 0) != 6 || b[2] != i) {
+            std::cerr << "Notification lost or out of order" << std::endl;
+            return 1;
+        }
+    }
+    // truncated to the buffer, then timeout
+    uint8_t n[3] { 1, 0xf0, 0 };
+    q.push(n, sizeof(n));
+    if (q.pop(b, 2, 0) != 2 || b[1] != 0xf0 || q.pop(b, sizeof(b), 10) != -1) {
+        std::cerr << "Notification not truncated or timeout not detected" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Notification is not read before it is delivered
+ */
+static int checkDeliverAt() {
+    NotificationQueue q;
+    uint8_t n[2] { 2, 0 }, b[2];
+    auto start = std::chrono::steady_clock::now();
+    q.push(n, sizeof(n), start + std::chrono::milliseconds(30));
+    if (q.pop(b, sizeof(b), 10) != -1) {
+        std::cerr << "Notification read before delivered" << std::endl;
+        return 1;
+    }
+    int r = q.pop(b, sizeof(b), 1000);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if (r != 2 || ms < 30 || ms > 500) {
+        std::cerr << "Notification delivered in " << ms << "ms" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Reader per device as concurrent uploads do, each receives its own notifications in order
+ */
+static int checkConcurrent() {
+    const int deviceCount = 16;
+    const uint32_t count = 20000;
+    std::vector<NotificationQueue> queues(deviceCount);
+    std::vector<uint32_t> received(deviceCount, 0);
+    std::vector<std::thread> readers;
+    auto start = std::chrono::steady_clock::now();
+    for (int d = 0; d < deviceCount; d++) {
+        readers.emplace_back([&queues, &received, d, count] {
+            uint8_t b[6];
+            for (uint32_t i = 0; i < count; i++) {
+                if (queues[d].pop(b, sizeof(b), 1000) != 6)
+                    return;
+                uint32_t v;
+                memcpy(&v, b + 2, 4);
+                if (b[0] != 5 || b[1] != d || v != i)
+                    return;
+                received[d]++;
+            }
+        });
+    }
+    // the radio thread delivers notifications of all devices, readers keep up
+    for (uint32_t i = 0; i < count; i++) {
+        for (int d = 0; d < deviceCount; d++) {
+            uint8_t n[6] { 5, (uint8_t) d };
+            memcpy(n + 2, &i, 4);
+            while (queues[d].size() >= 16)
+                std::this_thread::yield();
+            queues[d].push(n, sizeof(n));
+        }
+    }
+    for (auto &t : readers)
+        t.join();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (int d = 0; d < deviceCount; d++) {
+        if (received[d] != count || queues[d].dropped) {
+            std::cerr << "Device " << d << " received " << received[d] << " notifications of " << count << std::endl;
+            return 1;
+        }
+    }
+    std::cout << deviceCount << " devices: " << (uint64_t) (deviceCount * count / s) << " notifications/s" << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int r = checkOrder();
+    r |= checkDeliverAt();
+    r |= checkConcurrent();
+    if (r == 0)
+        std::cout << "notification queues work" << std::endl;
+    return r;
+}
@@ -0,0 +1,201 @@
+/**
+ *  ./test-pack
+ *  Compare packSRgb8 with the pixel by pixel reference packer, check rotation and mirroring, print packing time
+ */
+
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "srgb-pack.h"
+
+static void setBitOn(
+    uint8_t *colorPlane,
+    uint32_t heightInBytes,
+    int x,
+    int y
+) {
+    if (!colorPlane)
+        return;
+    int ofs = (x * heightInBytes) + (y / 8);
+    *(colorPlane + ofs) |= 1 << (7 - (y % 8));
+}
+
+/**
+ * Reference packer
+ */
+static uint32_t packReference(
+    uint8_t *dst,
+    const SRgb8 *src,
+    uint32_t width,
+    uint32_t height,
+    bool hasRed,
+    bool hasYellow
+) {
+    uint32_t size = packSRgb8Size(width, height, hasRed, hasYellow, false);
+    memset(dst, 0, size);
+    uint32_t heightInBytes = (height + 7) / 8;
+    uint32_t planeBytes = heightInBytes * width;
+    uint8_t *dstRed = hasRed ? dst + planeBytes : nullptr;
+    uint8_t *dstYellow = hasYellow ? (hasRed ? dst + 2 * planeBytes : dst + planeBytes) : nullptr;
+    const SRgb8 *color = src;
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            if ((color->r > 150) && (color->r > (color->g + color->b)))
+                setBitOn(dstRed, heightInBytes, x, y);
+            else if ((color->r > 150) && (color->g > 150) && (color->b < 50))
+                setBitOn(dstYellow, heightInBytes, x, y);
+            else if ((color->r + color->g + color->b) >= 150)
+                setBitOn(dst, heightInBytes, x, y);
+            color++;
+        }
+    }
+    return size;
+}
+
+/**
+ * Random pixels, half of them near class thresholds
+ */
+static void fillRandom(
+    std::vector<SRgb8> &img,
+    std::mt19937 &rnd
+) {
+    static const uint8_t edges[] { 0, 49, 50, 51, 75, 100, 149, 150, 151, 200, 255 };
+    for (auto &c : img) {
+        if (rnd() & 1) {
+            c.r = edges[rnd() % sizeof(edges)];
+            c.g = edges[rnd() % sizeof(edges)];
+            c.b = edges[rnd() % sizeof(edges)];
+        } else {
+            c.r = (uint8_t) rnd();
+            c.g = (uint8_t) rnd();
+            c.b = (uint8_t) rnd();
+        }
+        c.s = (uint8_t) rnd();
+    }
+}
+
+static int comparePack(
+    uint32_t width,
+    uint32_t height,
+    bool hasRed,
+    bool hasYellow,
+    std::mt19937 &rnd
+) {
+    std::vector<SRgb8> img(width * height);
+    fillRandom(img, rnd);
+    uint32_t size = packSRgb8Size(width, height, hasRed, hasYellow, false);
+    std::vector<uint8_t> expected(size);
+    std::vector<uint8_t> packed(size, 0x5a);
+    packReference(expected.data(), img.data(), width, height, hasRed, hasYellow);
+    int r = packSRgb8(packed.data(), img.data(), width, height, hasRed, hasYellow, true, false);
+    if (r != (int) size || packed != expected) {
+        std::cerr << "Packed " << width << "x" << height << (hasRed ? " red" : "") << (hasYellow ? " yellow" : "")
+            << " differs" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Compare rotated and mirrored packing with packing of the image turned pixel by pixel
+ */
+static int compareRotation(
+    uint32_t width,
+    uint32_t height,
+    uint16_t rotation,
+    bool mirror,
+    std::mt19937 &rnd
+) {
+    bool swap = rotation == 90 || rotation == 270;
+    uint32_t sw = swap ? height : width;
+    uint32_t sh = swap ? width : height;
+    std::vector<SRgb8> src(width * height);
+    fillRandom(src, rnd);
+    std::vector<SRgb8> screen(width * height);
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t sx, sy;
+            switch (rotation) {
+                case 90:
+                    sx = y;
+                    sy = sh - 1 - x;
+                    break;
+                case 180:
+                    sx = sw - 1 - x;
+                    sy = sh - 1 - y;
+                    break;
+                case 270:
+                    sx = sw - 1 - y;
+                    sy = x;
+                    break;
+                default:
+                    sx = x;
+                    sy = y;
+            }
+            uint32_t dx = mirror ? x : width - 1 - x;
+            screen[y * width + dx] = src[sy * sw + sx];
+        }
+    }
+    uint32_t size = packSRgb8Size(width, height, true, false, false);
+    std::vector<uint8_t> expected(size);
+    std::vector<uint8_t> packed(size);
+    packReference(expected.data(), screen.data(), width, height, true, false);
+    int r = packSRgb8(packed.data(), src.data(), width, height, true, false, mirror, false, rotation);
+    if (r != (int) size || packed != expected) {
+        std::cerr << "Packed " << width << "x" << height << " rotated " << rotation << (mirror ? "" : " mirrored")
+            << " differs" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+static void benchmark(
+    uint32_t width,
+    uint32_t height,
+    int count
+) {
+    std::mt19937 rnd(2);
+    std::vector<SRgb8> img(width * height);
+    fillRandom(img, rnd);
+    std::vector<uint8_t> packed(packSRgb8Size(width, height, true, false, false));
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+        packReference(packed.data(), img.data(), width, height, true, false);
+    auto mid = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+        packSRgb8(packed.data(), img.data(), width, height, true, false, true, false);
+    auto end = std::chrono::steady_clock::now();
+    std::cout << width << "x" << height << " reference "
+        << std::chrono::duration_cast<std::chrono::microseconds>(mid - start).count() / count << "us, packSRgb8 "
+        << std::chrono::duration_cast<std::chrono::microseconds>(end - mid).count() / count << "us" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    std::mt19937 rnd(1);
+    static const uint32_t sizes[][2] {
+        { 1, 1 }, { 7, 9 }, { 8, 8 }, { 13, 17 }, { 152, 152 }, { 212, 104 }, { 250, 122 }, { 250, 128 }, { 296, 152 }
+    };
+    for (auto &sz : sizes) {
+        for (int colors = 0; colors < 4; colors++) {
+            if (comparePack(sz[0], sz[1], colors & 1, colors & 2, rnd))
+                return -1;
+        }
+    }
+    static const uint16_t rotations[] { 0, 90, 180, 270 };
+    for (auto &sz : sizes) {
+        for (auto rotation : rotations) {
+            if (compareRotation(sz[0], sz[1], rotation, true, rnd) || compareRotation(sz[0], sz[1], rotation, false, rnd))
+                return -1;
+        }
+    }
+    uint8_t dst[8];
+    SRgb8 pixel {};
+    if (packSRgb8(dst, &pixel, 1, 1, false, false, true, false, 45) >= 0) {
+        std::cerr << "Invalid rotation accepted" << std::endl;
+        return -1;
+    }
+    benchmark(250, 128, 200);
+    return 0;
+}
@@ -0,0 +1,128 @@
+/**
+ *  ./test-packed-cache [file.png]
+ *  Pack image once for many labels of the same type
+ */
+
+#include <iostream>
+#include <cstring>
+#include "nemr-5053-manufacturer-specific-data.h"
+#include "ble-helper-sim.h"
+#include "upload-scheduler.h"
+#include "png2srgb8.h"
+
+static int checkCache(
+    Png2sRgb &png
+) {
+    uint32_t w = png.w, h = png.h;
+    PackedImageCache cache;
+    PackedImage first = cache.get(&png, w, h, true, false, false, false);
+    PackedImage second = cache.get(&png, w, h, true, false, false, false);
+    std::vector<uint8_t> want(packSRgb8Size(w, h, true, false, false));
+    int sz = packSRgb8(want.data(), png.srgb, w, h, true, false, false, false);
+    if (!first || first != second || *first != std::vector<uint8_t>(want.begin(), want.begin() + sz)) {
+        std::cerr << "Cached image differs" << std::endl;
+        return 1;
+    }
+    PackedImage mirrored = cache.get(&png, w, h, true, false, true, false);
+    PackedImage compressed = cache.get(&png, w, h, true, false, false, true);
+    if (!mirrored || !compressed || mirrored == first || compressed->size() >= first->size()
+        || cache.hits != 1 || cache.misses != 3 || cache.count() != 3) {
+        std::cerr << "Packing parameters are not part of the key" << std::endl;
+        return 1;
+    }
+
+    // other image of the same size
+    Png2sRgb other;
+    other.srgb = (SRgb8 *) malloc(w * h * sizeof(SRgb8));
+    memcpy(other.srgb, png.srgb, w * h * sizeof(SRgb8));
+    other.w = w;
+    other.h = h;
+    other.srgb[w * h / 2].r ^= 0xff;
+    if (other.contentHash() == png.contentHash() || cache.get(&other, w, h, true, false, false, false) == first) {
+        std::cerr << "Different images share cache entry" << std::endl;
+        return 1;
+    }
+
+    // room for two uncompressed images only
+    cache.clear();
+    cache.maxBytes = first->size() * 2 + first->size() / 2;
+    cache.get(&png, w, h, true, false, false, false);
+    cache.get(&png, w, h, true, false, true, false);
+    cache.get(&png, w, h, true, false, false, false);
+    cache.get(&other, w, h, true, false, false, false);
+    uint32_t misses = cache.misses;
+    // mirrored image is least recently used and evicted
+    cache.get(&png, w, h, true, false, false, false);
+    cache.get(&other, w, h, true, false, false, false);
+    if (cache.count() != 2 || cache.bytes() > cache.maxBytes || cache.misses != misses) {
+        std::cerr << "Least recently used image is not evicted" << std::endl;
+        return 1;
+    }
+    cache.get(&png, w, h, true, false, true, false);
+    if (cache.misses != misses + 1) {
+        std::cerr << "Evicted image still cached" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static int uploadToSimulatedLabels(
+    Png2sRgb &png,
+    int labelCount
+) {
+    BLEHelperSim b;
+    // 250x128 BWR EPA
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    for (int i = 0; i < labelCount; i++) {
+        auto &label = b.addLabel(0xffff92130000 + i, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+        label.link.latencyMs = 1;
+        label.link.advIntervalMs = 100;
+    }
+    b.startDiscovery();
+    auto devicesFound = b.waitDiscover(labelCount, 5);
+    b.stopDiscovery(10);
+    if (devicesFound != labelCount) {
+        std::cerr << "Simulated labels not discovered" << std::endl;
+        return 1;
+    }
+    {
+        UploadScheduler scheduler(&b, 4);
+        scheduler.waitMs = 100;
+        scheduler.window = 8;
+        for (auto &d : b.devices) {
+            if (scheduler.add(d.addr, &png)) {
+                std::cerr << "Image not queued" << std::endl;
+                return 1;
+            }
+        }
+        if (!scheduler.wait(60) || scheduler.succeeded != (uint32_t) labelCount) {
+            std::cerr << "Upload failed" << std::endl;
+            return 1;
+        }
+    }
+    if (b.packedImages.misses != 1 || b.packedImages.hits != (uint32_t) labelCount - 1) {
+        std::cerr << "Image packed " << b.packedImages.misses << " times" << std::endl;
+        return 1;
+    }
+    for (auto &label : b.labels) {
+        if (label.imageCount != 1 || label.image != b.labels[0].image) {
+            std::cerr << "Received image differs" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *fn = argc > 1 ? argv[1] : "../../tests/250x128.png";
+    Png2sRgb png;
+    if (png.loadFile(fn) < 0) {
+        std::cerr << "Error parse file " << fn << std::endl;
+        return 1;
+    }
+    int r = checkCache(png);
+    r |= uploadToSimulatedLabels(png, 8);
+    if (r == 0)
+        std::cout << "packed image cache works" << std::endl;
+    return r;
+}
@@ -0,0 +1,252 @@
+/**
+ *  ./test-png-stream [file.png]
+ *  Compare planes packed by streaming PNG decoder with planes packed from the whole decoded image
+ */
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+#include "srgb-pack.h"
+#include "png2srgb8.h"
+
+static const uint16_t rotations[] = { 0, 90, 180, 270 };
+
+static void put32(
+    std::vector<uint8_t> &v,
+    uint32_t value
+) {
+    v.push_back((uint8_t) (value >> 24));
+    v.push_back((uint8_t) (value >> 16));
+    v.push_back((uint8_t) (value >> 8));
+    v.push_back((uint8_t) value);
+}
+
+static uint32_t crc32(
+    const uint8_t *data,
+    size_t size
+) {
+    uint32_t c = 0xffffffff;
+    for (size_t i = 0; i < size; i++) {
+        c ^= data[i];
+        for (int k = 0; k < 8; k++)
+            c = (c >> 1) ^ ((c & 1) ? 0xEDB88320 : 0);
+    }
+    return c ^ 0xffffffff;
+}
+
+static void putChunk(
+    std::vector<uint8_t> &png,
+    const char *name,
+    const std::vector<uint8_t> &data
+) {
+    put32(png, (uint32_t) data.size());
+    size_t start = png.size();
+    png.insert(png.end(), name, name + 4);
+    png.insert(png.end(), data.begin(), data.end());
+    put32(png, crc32(&png[start], png.size() - start));
+}
+
+static uint8_t paeth(
+    int a,
+    int b,
+    int c
+) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return (uint8_t) a;
+    if (pb <= pc)
+        return (uint8_t) b;
+    return (uint8_t) c;
+}
+
+/**
+ * Make PNG of raw scanlines, filter type of each scanline is y % 5, zlib stored blocks
+ */
+static std::vector<uint8_t> makePng(
+    uint32_t width,
+    uint32_t height,
+    uint8_t bitDepth,
+    uint8_t colorType,
+    const std::vector<uint8_t> &scanlines,
+    const std::vector<uint8_t> &palette
+) {
+    size_t stride = scanlines.size() / height;
+    size_t bpp = stride / width ? stride / width : 1;
+    std::vector<uint8_t> filtered;
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t filter = y % 5;
+        filtered.push_back(filter);
+        const uint8_t *cur = &scanlines[y * stride];
+        const uint8_t *prev = y ? &scanlines[(y - 1) * stride] : nullptr;
+        for (size_t x = 0; x < stride; x++) {
+            int left = x >= bpp ? cur[x - bpp] : 0;
+            int up = prev ? prev[x] : 0;
+            int upLeft = prev && x >= bpp ? prev[x - bpp] : 0;
+            int v = cur[x];
+            switch (filter) {
+                case 1: v -= left; break;
+                case 2: v -= up; break;
+                case 3: v -= (left + up) / 2; break;
+                case 4: v -= paeth(left, up, upLeft); break;
+                default: break;
+            }
+            filtered.push_back((uint8_t) v);
+        }
+    }
+    std::vector<uint8_t> z { 0x78, 0x01 };
+    for (size_t i = 0; i < filtered.size(); i += 65535) {
+        size_t n = filtered.size() - i < 65535 ? filtered.size() - i : 65535;
+        z.push_back(i + n == filtered.size() ? 1 : 0);
+        z.push_back((uint8_t) n);
+        z.push_back((uint8_t) (n >> 8));
+        z.push_back((uint8_t) ~n);
+        z.push_back((uint8_t) (~n >> 8));
+        z.insert(z.end(), filtered.begin() + i, filtered.begin() + i + n);
+    }
+    uint32_t a = 1, b = 0;
+    for (auto c : filtered) {
+        a = (a + c) % 65521;
+        b = (b + a) % 65521;
+    }
+    put32(z, (b << 16) | a);
+
+    std::vector<uint8_t> png { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
+    std::vector<uint8_t> ihdr;
+    put32(ihdr, width);
+    put32(ihdr, height);
+    ihdr.insert(ihdr.end(), { bitDepth, colorType, 0, 0, 0 });
+    putChunk(png, "IHDR", ihdr);
+    if (!palette.empty())
+        putChunk(png, "PLTE", palette);
+    putChunk(png, "IDAT", z);
+    putChunk(png, "IEND", {});
+    return png;
+}
+
+static int compare(
+    const char *name,
+    Png2sRgb &png,
+    const SRgb8 *expected,
+    uint32_t sourceWidth,
+    uint32_t sourceHeight
+) {
+    for (bool compress : { false, true }) {
+        for (uint16_t rotation : rotations) {
+            for (bool mirror : { true, false }) {
+                bool swap = rotation == 90 || rotation == 270;
+                uint32_t width = swap ? sourceHeight : sourceWidth;
+                uint32_t height = swap ? sourceWidth : sourceHeight;
+                uint32_t size = packSRgb8Size(width, height, true, true, compress);
+                std::vector<uint8_t> want(size), got(size);
+                int wantSize = packSRgb8(want.data(), (SRgb8 *) expected, width, height, true, true, mirror, compress, rotation);
+                int gotSize = png.pack(got.data(), width, height, true, true, mirror, compress, rotation);
+                if (gotSize != wantSize || memcmp(want.data(), got.data(), wantSize) != 0) {
+                    std::cerr << name << ": planes differ, rotation " << rotation << " mirror " << mirror
+                        << " compress " << compress << std::endl;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static int checkFile(
+    const char *fn
+) {
+    Png2sRgb full;
+    if (full.loadFile(fn) < 0) {
+        std::cerr << "Error parse file " << fn << std::endl;
+        return 1;
+    }
+    Png2sRgb streaming(true);
+    if (streaming.loadFile(fn) < 0 || streaming.srgb || streaming.w != full.w || streaming.h != full.h) {
+        std::cerr << "Error parse file " << fn << " in streaming mode" << std::endl;
+        return 1;
+    }
+    return compare(fn, streaming, full.srgb, full.w, full.h);
+}
+
+/**
+ * RGB 8 bit, larger than the inflate window
+ */
+static int checkRgb() {
+    uint32_t width = 301, height = 203;
+    std::vector<uint8_t> scanlines;
+    std::vector<SRgb8> expected;
+    srand(1);
+    for (uint32_t i = 0; i < width * height; i++) {
+        SRgb8 c { (uint8_t) (rand() % 256), (uint8_t) (rand() % 256), (uint8_t) (rand() % 256), 0xff };
+        scanlines.insert(scanlines.end(), { c.r, c.g, c.b });
+        expected.push_back(c);
+    }
+    auto file = makePng(width, height, 8, 2, scanlines, {});
+    Png2sRgb png(true);
+    if (png.load(file.data(), file.size()) < 0) {
+        std::cerr << "Error parse RGB image" << std::endl;
+        return 1;
+    }
+    return compare("RGB", png, expected.data(), width, height);
+}
+
+/**
+ * Gray 16 bit
+ */
+static int checkGray16() {
+    uint32_t width = 37, height = 29;
+    std::vector<uint8_t> scanlines;
+    std::vector<SRgb8> expected;
+    for (uint32_t i = 0; i < width * height; i++) {
+        uint16_t v = (uint16_t) (i * 977);
+        scanlines.insert(scanlines.end(), { (uint8_t) (v >> 8), (uint8_t) v });
+        // round(v / 257)
+        uint8_t g = (uint8_t) ((v + 128) / 257);
+        expected.push_back({ g, g, g, 0xff });
+    }
+    auto file = makePng(width, height, 16, 0, scanlines, {});
+    Png2sRgb png(true);
+    if (png.load(file.data(), file.size()) < 0) {
+        std::cerr << "Error parse gray image" << std::endl;
+        return 1;
+    }
+    return compare("gray 16", png, expected.data(), width, height);
+}
+
+/**
+ * Indexed 2 bit: white, black, red, yellow
+ */
+static int checkPalette() {
+    uint32_t width = 45, height = 19;
+    std::vector<uint8_t> palette { 255, 255, 255, 0, 0, 0, 255, 0, 0, 255, 255, 0 };
+    uint32_t stride = (width * 2 + 7) / 8;
+    std::vector<uint8_t> scanlines(stride * height);
+    std::vector<SRgb8> expected;
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t index = (x * 3 + y) % 4;
+            scanlines[y * stride + x / 4] |= index << (6 - 2 * (x % 4));
+            expected.push_back({ palette[index * 3], palette[index * 3 + 1], palette[index * 3 + 2], 0xff });
+        }
+    }
+    auto file = makePng(width, height, 2, 3, scanlines, palette);
+    Png2sRgb png(true);
+    if (png.load(file.data(), file.size()) < 0) {
+        std::cerr << "Error parse indexed image" << std::endl;
+        return 1;
+    }
+    return compare("indexed", png, expected.data(), width, height);
+}
+
+int main(int argc, char **argv) {
+    const char *fn = argc > 1 ? argv[1] : "../../tests/250x128.png";
+    int r = checkFile(fn);
+    r |= checkRgb();
+    r |= checkGray16();
+    r |= checkPalette();
+    if (r == 0)
+        std::cout << "streaming decode matches" << std::endl;
+    return r;
+}
@@ -0,0 +1,140 @@
+/**
+ *  ./test-rtt-estimator
+ *  Response timeouts by round-trip time: smoothing, backoff, seeding by device type, retry delays
+ */
+
+#include <iostream>
+#include "rtt-estimator.h"
+
+/**
+ * Timeout follows steady round-trip time, grows with the variation
+ */
+static int checkSmoothing() {
+    RttEstimator e;
+    if (e.timeout(10, 1000) != 1000) {
+        std::cerr << "Unknown device does not get the maximum timeout" << std::endl;
+        return 1;
+    }
+    // first sample: 40 + 4 * 20
+    e.add(40);
+    if (e.timeout(10, 1000) != 120) {
+        std::cerr << "First sample timeout " << e.timeout(10, 1000) << std::endl;
+        return 1;
+    }
+    for (int i = 0; i < 50; i++)
+        e.add(40);
+    int steady = e.timeout(10, 1000);
+    if (steady < 40 || steady > 45 || e.timeout(200, 1000) != 200) {
+        std::cerr << "Steady timeout " << steady << std::endl;
+        return 1;
+    }
+    for (int i = 0; i < 50; i++)
+        e.add(i % 2 ? 20.0f : 60.0f);
+    if (e.timeout(10, 1000) < 100 || e.timeout(10, 1000) > 150) {
+        std::cerr << "Timeout does not follow the variation " << e.timeout(10, 1000) << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Timeout doubles on each timeout up to the maximum, the response after the timeout
+ * resets the backoff and is not a sample
+ */
+static int checkBackoff() {
+    RttEstimator e;
+    for (int i = 0; i < 50; i++)
+        e.add(40);
+    int t = e.timeout(100, 1000);
+    e.timedOut();
+    e.timedOut();
+    if (e.timeout(100, 1000) != 4 * t) {
+        std::cerr << "Timeout not doubled" << std::endl;
+        return 1;
+    }
+    for (int i = 0; i < 10; i++)
+        e.timedOut();
+    if (e.timeout(100, 1000) != 1000) {
+        std::cerr << "Timeout above the maximum" << std::endl;
+        return 1;
+    }
+    float srtt = e.srttMs;
+    e.add(900);
+    if (e.srttMs != srtt || e.backoff != 1 || e.timeout(100, 1000) != t) {
+        std::cerr << "Ambiguous sample counted" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * New device starts with the estimate of its type, device of unknown type with the maximum
+ */
+static int checkTypes() {
+    RttEstimators rtts;
+    rtts.minTimeoutMs = 10;
+    for (int i = 0; i < 20; i++)
+        rtts.add(1, 0x0b1c0001, 30);
+    int known = rtts.timeout(1, 0x0b1c0001, 1000);
+    if (rtts.timeout(2, 0x0b1c0001, 1000) != known || rtts.timeout(3, 0x0b1d0001, 1000) != 1000) {
+        std::cerr << "New device not seeded by its type" << std::endl;
+        return 1;
+    }
+    // device timeouts back off from the type estimate
+    rtts.timedOut(2);
+    int backedOff = rtts.timeout(2, 0x0b1c0001, 1000);
+    if (backedOff < 2 * known - 1 || backedOff > 2 * known || rtts.timeout(1, 0x0b1c0001, 1000) != known) {
+        std::cerr << "Backoff not kept by device" << std::endl;
+        return 1;
+    }
+    RttEstimator e;
+    if (!rtts.get(2, e) || e.samples != 0 || rtts.get(3, e)) {
+        std::cerr << "Device estimators not kept" << std::endl;
+        return 1;
+    }
+    rtts.erase(2);
+    if (rtts.get(2, e)) {
+        std::cerr << "Device estimator not erased" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Retry delays are random up to the round-trip time doubled on each attempt
+ */
+static int checkRetryDelay() {
+    RttEstimators rtts;
+    rtts.maxRetryDelayMs = 100;
+    for (int i = 0; i < 20; i++)
+        rtts.add(1, 0, 20);
+    int maxDelay[4] { 0, 0, 0, 0 };
+    for (int i = 0; i < 1000; i++) {
+        for (int attempt = 1; attempt <= 4; attempt++) {
+            int d = rtts.retryDelay(1, 0, attempt);
+            if (d < 0 || d > 100) {
+                std::cerr << "Retry delay " << d << " out of range" << std::endl;
+                return 1;
+            }
+            if (d > maxDelay[attempt - 1])
+                maxDelay[attempt - 1] = d;
+        }
+    }
+    // 20, 40, 80, 100 at most
+    if (maxDelay[0] > 20 || maxDelay[0] < 15 || maxDelay[1] > 40 || maxDelay[1] < 30 || maxDelay[3] < 90) {
+        std::cerr << "Retry delays " << maxDelay[0] << " " << maxDelay[1] << " " << maxDelay[3]
+            << " not doubled" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int r = checkSmoothing();
+    r |= checkBackoff();
+    r |= checkTypes();
+    r |= checkRetryDelay();
+    if (r == 0)
+        std::cout << "round-trip time estimates match" << std::endl;
+    return r;
+}
@@ -0,0 +1,133 @@
+/**
+ *  ./test-sim-delta
+ *  Send image to the simulated label, change a few pixels and send changed chunks only,
+ *  on the open session and on the sessions SessionDriver opens
+ */
+
+#include <iostream>
+#include <cstring>
+#include "nemr-5053-manufacturer-specific-data.h"
+#include "ble-helper-sim.h"
+#include "session-driver.h"
+
+class LastResult : public OnSent {
+public:
+    int result;
+    LastResult()
+        : result(0)
+    {
+
+    }
+
+    void sent(const SendOperation &operation) override
+    {
+        result = operation.result;
+    }
+};
+
+/**
+ * Delta update on the open session, or on the session the driver opens and closes
+ */
+static int send(
+    BLEHelperSim &b,
+    DiscoveredDevice &d,
+    std::vector<uint8_t> &buffer,
+    bool driven
+) {
+    if (!driven)
+        return b.sendBufferDelta(&d, buffer.data(), (uint32_t) buffer.size(), 200);
+    LastResult last;
+    SessionDriver driver(&b, &last);
+    driver.sendDelta(&d, buffer.data(), (uint32_t) buffer.size(), 200);
+    while (driver.poll(1000))
+        ;
+    return last.result;
+}
+
+/**
+ * Send image twice, second time with delta update
+ * @param acceptsSkip firmware accepts skipped chunks
+ * @param maxChunks maximum chunks expected in the delta update
+ * @param driven send by SessionDriver
+ * @return 0- success
+ */
+static int sendDelta(
+    bool acceptsSkip,
+    uint32_t maxChunks,
+    bool driven
+) {
+    BLEHelperSim b;
+    // 250x128 BWR EPA
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    auto &label = b.addLabel(0xffff92137614, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+    label.link.latencyMs = 2;
+    label.link.jitterMs = 1;
+    label.acceptsSkip = acceptsSkip;
+
+    b.startDiscovery();
+    auto devicesFound = b.waitDiscover(1, 5);
+    b.stopDiscovery(10);
+    if (devicesFound != 1) {
+        std::cerr << "Simulated label not discovered" << std::endl;
+        return -1;
+    }
+    auto &d = b.devices[0];
+
+    uint32_t sz = d.metadata.screenSize();
+    std::vector<uint8_t> buffer(sz, 0xff);
+    if (!driven && b.openI(0) < 0) {
+        std::cerr << "Error open device" << std::endl;
+        return -1;
+    }
+    // first image is sent in full
+    auto r = send(b, d, buffer, driven);
+    if (r || b.labels[0].image != buffer) {
+        std::cerr << "Error send first image " << r << std::endl;
+        return -1;
+    }
+    uint32_t fullChunks = b.labels[0].chunkCount;
+
+    // the same image is not sent at all
+    r = send(b, d, buffer, driven);
+    if (r || b.labels[0].chunkCount != fullChunks || b.labels[0].imageCount != 1) {
+        std::cerr << "Unchanged image sent" << std::endl;
+        return -1;
+    }
+
+    // change bytes in the middle of the black/white plane
+    buffer[sz / 4] = 0;
+    buffer[sz / 4 + 1] = 0x0f;
+    r = send(b, d, buffer, driven);
+    if (!driven)
+        b.closeI(0);
+    if (r) {
+        std::cerr << "Error send delta " << r << std::endl;
+        return -1;
+    }
+    uint32_t deltaChunks = b.labels[0].chunkCount - fullChunks;
+    if (b.labels[0].imageCount != 2 || b.labels[0].image != buffer) {
+        std::cerr << "Received image differs" << std::endl;
+        return -1;
+    }
+    std::cout << (acceptsSkip ? "skip" : "no skip") << (driven ? ", driver" : "") << ": full image " << fullChunks << " chunks, delta "
+        << deltaChunks << " chunks" << std::endl;
+    if (deltaChunks > maxChunks) {
+        std::cerr << "Too many chunks sent" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // changed chunk and the last chunk
+    if (sendDelta(true, 2, false))
+        return -1;
+    // firmware requests all chunks
+    if (sendDelta(false, 100, false))
+        return -1;
+    if (sendDelta(true, 2, true))
+        return -1;
+    if (sendDelta(false, 100, true))
+        return -1;
+    return 0;
+}
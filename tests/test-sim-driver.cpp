@@ -0,0 +1,363 @@
+/**
+ *  ./test-sim-driver [labels [latency-ms [window]]]
+ *  Send images to many simulated labels from one thread, compare with sending one by one;
+ *  a label slow to connect does not hold the others, writes wait for a free buffer,
+ *  a driver destroyed early closes its sessions
+ */
+
+#include <iostream>
+#include <cstring>
+#include <map>
+#include "nemr-5053-manufacturer-specific-data.h"
+#include "ble-helper-sim.h"
+#include "session-driver.h"
+
+class CountSent : public OnSent {
+public:
+    int count;
+    int failed;
+    int lastResult;
+    CountSent()
+        : count(0), failed(0), lastResult(0)
+    {
+
+    }
+
+    void sent(const SendOperation &operation) override
+    {
+        count++;
+        if (operation.result)
+            failed++;
+        // the hung label finishes last
+        lastResult = operation.result;
+    }
+};
+
+/**
+ * Backend with a small write ring: every third write finds no free buffer,
+ * some chunks fail on the link after startWrite() returns
+ */
+class RingSim : public BLEHelperSim {
+public:
+    int writeCount;
+    int busyCount;
+    int errorCount;
+    std::map<uint64_t, int> errors;
+    RingSim()
+        : writeCount(0), busyCount(0), errorCount(0)
+    {
+
+    }
+
+    int startWrite(
+        const DiscoveredDevice *device,
+        CharacteristicIndex characteristic,
+        void *buffer,
+        uint32_t size,
+        bool withResponse
+    ) override {
+        writeCount++;
+        if (writeCount % 3 == 0) {
+            busyCount++;
+            // buffer released at once
+            anyNotification()->notify();
+            return BUSY;
+        }
+        if (characteristic == CI_IMAGE && writeCount % 50 == 1) {
+            // not delivered, the error comes after the call
+            errorCount++;
+            errors[device->addr] = -5;
+            return (int) size;
+        }
+        return BLEHelperSim::startWrite(device, characteristic, buffer, size, withResponse);
+    }
+
+    int takeWriteError(
+        const DiscoveredDevice *device
+    ) override {
+        auto it = errors.find(device->addr);
+        if (it == errors.end())
+            return 0;
+        int r = it->second;
+        errors.erase(it);
+        return r;
+    }
+};
+
+/**
+ * Labels of the same type, last one hangs in the middle of the image
+ */
+static int addLabels(
+    BLEHelperSim &b,
+    int labelCount,
+    int latencyMs
+) {
+    // 250x128 BWR EPA
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    for (int i = 0; i < labelCount; i++) {
+        auto &label = b.addLabel(0xffff92130000 + i, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+        label.link.latencyMs = latencyMs;
+        label.link.jitterMs = latencyMs / 2;
+        label.link.advIntervalMs = 100;
+    }
+    b.labels.back().hangAtChunk = 10;
+    b.startDiscovery();
+    auto devicesFound = b.waitDiscover(labelCount, 5);
+    b.stopDiscovery(10);
+    if (devicesFound != labelCount) {
+        std::cerr << "Simulated labels not discovered" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+static int checkImages(
+    BLEHelperSim &b,
+    const std::vector<uint8_t> &buffer
+) {
+    for (size_t i = 0; i + 1 < b.labels.size(); i++) {
+        if (b.labels[i].imageCount != 1 || b.labels[i].image != buffer) {
+            std::cerr << "Received image differs" << std::endl;
+            return -1;
+        }
+    }
+    if (b.connectionCount != 0) {
+        std::cerr << "Session not closed" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send image to the labels one by one, then from one driver thread
+ * @param labelCount labels
+ * @param latencyMs link latency
+ * @param window chunks in flight
+ * @param poll drive by poll() on this thread instead of the driver thread
+ * @return 0- success
+ */
+static int sendToSimulatedLabels(
+    int labelCount,
+    int latencyMs,
+    uint8_t window,
+    bool poll
+) {
+    BLEHelperSim sequential;
+    if (addLabels(sequential, labelCount, latencyMs))
+        return -1;
+    uint32_t sz = sequential.devices[0].metadata.screenSize();
+    std::vector<uint8_t> buffer(sz);
+    for (uint32_t i = 0; i < sz; i++)
+        buffer[i] = (uint8_t) i;
+
+    auto start = std::chrono::steady_clock::now();
+    int failed = 0;
+    // time the hung label takes to give up, the driver can not finish earlier
+    long long hungMs = 0;
+    for (auto &d : sequential.devices) {
+        auto labelStart = std::chrono::steady_clock::now();
+        sequential.open(&d);
+        if (sequential.sendBuffer(&d, buffer.data(), sz, 1000, window))
+            failed++;
+        sequential.close(&d);
+        hungMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - labelStart).count();
+    }
+    auto sequentialMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if (failed != 1 || checkImages(sequential, buffer))
+        return -1;
+
+    BLEHelperSim b;
+    if (addLabels(b, labelCount, latencyMs))
+        return -1;
+    CountSent counter;
+    SessionDriver driver(&b, &counter);
+    start = std::chrono::steady_clock::now();
+    for (auto &d : b.devices)
+        driver.send(&d, buffer.data(), sz, 1000, window);
+    if (poll) {
+        while (driver.poll(1000))
+            ;
+    } else {
+        driver.start();
+        while (driver.pending())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        driver.stop();
+    }
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << labelCount << " labels, latency " << latencyMs << "ms, window " << (int) window
+        << (poll ? ", poll: " : ", driver thread: ") << counter.count - counter.failed << " sent, "
+        << counter.failed << " failed in " << ms << "ms, one by one in " << sequentialMs << "ms, hung label "
+        << hungMs << "ms" << std::endl;
+    if (counter.count != labelCount || counter.failed != 1 || counter.lastResult != -4 || checkImages(b, buffer))
+        return -1;
+    for (auto &d : b.devices) {
+        if (d.pins) {
+            std::cerr << "Device left pinned" << std::endl;
+            return -1;
+        }
+    }
+    // other labels are served while the hung one waits
+    if (ms - hungMs > (sequentialMs - hungMs) / 2) {
+        std::cerr << "Sessions do not overlap" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * First label takes seconds to connect, the driver serves the others meanwhile
+ * @return 0- success
+ */
+static int slowConnect() {
+    const int labelCount = 6;
+    const int connectMs = 2000;
+    BLEHelperSim b;
+    if (addLabels(b, labelCount, 5))
+        return -1;
+    b.labels.back().hangAtChunk = 0;
+    b.labels.front().link.connectMs = connectMs;
+    uint32_t sz = b.devices[0].metadata.screenSize();
+    std::vector<uint8_t> buffer(sz);
+    for (uint32_t i = 0; i < sz; i++)
+        buffer[i] = (uint8_t) (i * 5);
+
+    CountSent counter;
+    SessionDriver driver(&b, &counter);
+    auto start = std::chrono::steady_clock::now();
+    for (auto &d : b.devices)
+        driver.send(&d, buffer.data(), sz, 1000, 8);
+    // short polls: poll() waits for the slow label after the last of the others finishes
+    while (counter.count < labelCount - 1 && driver.poll(10))
+        ;
+    auto othersMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    bool slowPending = b.labels.front().imageCount == 0;
+    while (driver.poll(1000))
+        ;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << labelCount - 1 << " labels sent in " << othersMs << "ms while the label connecting "
+        << connectMs << "ms waits, all in " << ms << "ms" << std::endl;
+    if (counter.count != labelCount || counter.failed) {
+        std::cerr << counter.failed << " of " << counter.count << " sessions failed" << std::endl;
+        return -1;
+    }
+    if (!slowPending || othersMs >= connectMs) {
+        std::cerr << "Label connecting holds the other sessions" << std::endl;
+        return -1;
+    }
+    for (auto &label : b.labels) {
+        if (label.imageCount != 1 || label.image != buffer) {
+            std::cerr << "Received image differs" << std::endl;
+            return -1;
+        }
+    }
+    return b.connectionCount == 0 ? 0 : -1;
+}
+
+/**
+ * Full write ring holds the writes back instead of failing them, failed writes are sent again
+ * @return 0- success
+ */
+static int busyWrites() {
+    const int labelCount = 4;
+    RingSim b;
+    if (addLabels(b, labelCount, 5))
+        return -1;
+    b.labels.back().hangAtChunk = 0;
+    uint32_t sz = b.devices[0].metadata.screenSize();
+    std::vector<uint8_t> buffer(sz);
+    for (uint32_t i = 0; i < sz; i++)
+        buffer[i] = (uint8_t) (i * 7);
+
+    CountSent counter;
+    SessionDriver driver(&b, &counter);
+    auto start = std::chrono::steady_clock::now();
+    int i = 0;
+    // stop-and-wait and sliding window
+    for (auto &d : b.devices)
+        driver.send(&d, buffer.data(), sz, 1000, i++ % 2 ? 8 : 1);
+    while (driver.poll(1000))
+        ;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::cout << labelCount << " labels sent in " << ms << "ms, " << b.busyCount << " of " << b.writeCount
+        << " writes found no free buffer, " << b.errorCount << " failed" << std::endl;
+    if (counter.count != labelCount || counter.failed) {
+        std::cerr << counter.failed << " of " << counter.count << " sessions failed" << std::endl;
+        return -1;
+    }
+    if (b.busyCount == 0 || b.errorCount == 0) {
+        std::cerr << "Write ring not exercised" << std::endl;
+        return -1;
+    }
+    for (auto &label : b.labels) {
+        if (label.imageCount != 1 || label.image != buffer) {
+            std::cerr << "Received image differs" << std::endl;
+            return -1;
+        }
+    }
+    return b.connectionCount == 0 ? 0 : -1;
+}
+
+/**
+ * Driver destroyed while sessions connect and transfer: the sessions are closed, the devices unpinned
+ * @return 0- success
+ */
+static int destroyUnfinished() {
+    const int labelCount = 4;
+    BLEHelperSim b;
+    if (addLabels(b, labelCount, 5))
+        return -1;
+    b.labels.back().hangAtChunk = 0;
+    b.labels.front().link.connectMs = 2000;
+    uint32_t sz = b.devices[0].metadata.screenSize();
+    std::vector<uint8_t> buffer(sz);
+    size_t pending;
+    {
+        SessionDriver driver(&b);
+        for (auto &d : b.devices)
+            driver.send(&d, buffer.data(), sz, 1000, 8);
+        auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(30);
+        while (std::chrono::steady_clock::now() < until)
+            driver.poll(5);
+        // added, never started
+        driver.send(&b.devices[1], buffer.data(), sz);
+        pending = driver.pending();
+    }
+    std::cout << "driver destroyed with " << pending << " sessions not finished" << std::endl;
+    if (pending < 2) {
+        std::cerr << "Sessions finished before the driver is destroyed" << std::endl;
+        return -1;
+    }
+    for (auto &d : b.devices) {
+        if (d.pins) {
+            std::cerr << "Device left pinned" << std::endl;
+            return -1;
+        }
+    }
+    if (b.connectionCount != 0) {
+        std::cerr << "Session not closed" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        int labelCount = atoi(argv[1]);
+        int latencyMs = argc > 2 ? atoi(argv[2]) : 15;
+        int window = argc > 3 ? atoi(argv[3]) : 8;
+        return sendToSimulatedLabels(labelCount, latencyMs, (uint8_t) window, false);
+    }
+    if (sendToSimulatedLabels(16, 10, 1, false))
+        return -1;
+    if (sendToSimulatedLabels(16, 10, 8, false))
+        return -1;
+    if (sendToSimulatedLabels(8, 10, 8, true))
+        return -1;
+    if (slowConnect())
+        return -1;
+    if (busyWrites())
+        return -1;
+    if (destroyUnfinished())
+        return -1;
+    return 0;
+}
@@ -0,0 +1,191 @@
+/**
+ *  ./test-sim-scheduler [labels [slots [latency-ms]]]
+ *  Upload images to many simulated labels in parallel, with discovery stopped and running
+ */
+
+#include <iostream>
+#include <cstring>
+#include "nemr-5053-manufacturer-specific-data.h"
+#include "ble-helper-sim.h"
+#include "upload-scheduler.h"
+
+class CountUploads : public OnUpload {
+public:
+    std::mutex mutexCount;
+    int count;
+    int failedAttempts;
+    CountUploads()
+        : count(0), failedAttempts(0)
+    {
+
+    }
+
+    void uploaded(const UploadJob &job) override
+    {
+        std::unique_lock<std::mutex> lck(mutexCount);
+        count++;
+        if (job.result)
+            failedAttempts = job.attempts;
+    }
+};
+
+/**
+ * Upload image to the labels, last label does not respond
+ * @param labelCount labels
+ * @param slots connections in parallel
+ * @param latencyMs link latency
+ * @return 0- success
+ */
+static int uploadToSimulatedLabels(
+    int labelCount,
+    int slots,
+    int latencyMs
+) {
+    BLEHelperSim b;
+    b.maxConnections = slots;
+    // 250x128 BWR EPA
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    for (int i = 0; i < labelCount; i++) {
+        auto &label = b.addLabel(0xffff92130000 + i, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+        label.link.latencyMs = latencyMs;
+        label.link.jitterMs = latencyMs / 2;
+        label.link.advIntervalMs = 100;
+    }
+    // all notifications are lost
+    b.labels.back().link.lossPercent = 100;
+
+    b.startDiscovery();
+    auto devicesFound = b.waitDiscover(labelCount, 5);
+    b.stopDiscovery(10);
+    if (devicesFound != labelCount) {
+        std::cerr << "Simulated labels not discovered" << std::endl;
+        return -1;
+    }
+
+    uint32_t sz = b.devices[0].metadata.screenSize();
+    std::vector<uint8_t> buffer(sz);
+    for (uint32_t i = 0; i < sz; i++)
+        buffer[i] = (uint8_t) i;
+
+    CountUploads counter;
+    auto start = std::chrono::steady_clock::now();
+    {
+        UploadScheduler scheduler(&b, slots);
+        scheduler.onUpload = &counter;
+        scheduler.waitMs = 100;
+        scheduler.window = 8;
+        scheduler.backoffMs = 10;
+        for (auto &d : b.devices)
+            scheduler.add(d.addr, buffer.data(), sz);
+        if (!scheduler.wait(60)) {
+            std::cerr << "Timeout" << std::endl;
+            return -1;
+        }
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << labelCount << " labels, " << slots << " slots, latency " << latencyMs << "ms: "
+            << scheduler.succeeded << " succeeded, " << scheduler.failed << " failed, "
+            << scheduler.retried << " retried in " << ms << "ms, peak connections " << b.peakConnectionCount << std::endl;
+        if (scheduler.succeeded != labelCount - 1 || scheduler.failed != 1 || scheduler.retried != scheduler.maxAttempts - 1) {
+            std::cerr << "Unexpected upload result" << std::endl;
+            return -1;
+        }
+        if (counter.count != labelCount || counter.failedAttempts != scheduler.maxAttempts) {
+            std::cerr << "Uploads not reported" << std::endl;
+            return -1;
+        }
+    }
+    if (b.peakConnectionCount > slots || b.connectionCount != 0) {
+        std::cerr << "Connection slots exceeded" << std::endl;
+        return -1;
+    }
+    for (int i = 0; i < labelCount - 1; i++) {
+        if (b.labels[i].imageCount != 1 || b.labels[i].image != buffer) {
+            std::cerr << "Received image differs" << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Labels keep advertising during the upload: sessions must not read metadata updated by the consumer thread
+ * @return 0- success
+ */
+static int uploadWhileDiscovering() {
+    const int labelCount = 4;
+    BLEHelperSim b;
+    // 250x128 BWR EPA
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    for (int i = 0; i < labelCount; i++) {
+        auto &label = b.addLabel(0xffff92140000 + i, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+        label.link.latencyMs = 2;
+        label.link.jitterMs = 1;
+        label.link.advIntervalMs = 2;
+    }
+    b.startDiscovery();
+    if (b.waitDiscover(labelCount, 5) != labelCount) {
+        b.stopDiscovery(10);
+        std::cerr << "Simulated labels not discovered" << std::endl;
+        return -1;
+    }
+    uint32_t sz;
+    uint32_t advBefore = 0;
+    {
+        std::unique_lock<std::mutex> lck(b.mutexDiscoveryState);
+        sz = b.devices[0].metadata.screenSize();
+        for (auto &d : b.devices)
+            advBefore += d.advCount;
+    }
+    std::vector<uint8_t> buffer(sz);
+    for (uint32_t i = 0; i < sz; i++)
+        buffer[i] = (uint8_t) (i * 3);
+    bool done;
+    {
+        UploadScheduler scheduler(&b, labelCount);
+        scheduler.waitMs = 100;
+        scheduler.window = 8;
+        for (int i = 0; i < labelCount; i++)
+            scheduler.add(0xffff92140000 + i, buffer.data(), sz);
+        done = scheduler.wait(60) && scheduler.succeeded == labelCount;
+    }
+    uint32_t advAfter = 0;
+    {
+        std::unique_lock<std::mutex> lck(b.mutexDiscoveryState);
+        for (auto &d : b.devices)
+            advAfter += d.advCount;
+    }
+    b.stopDiscovery(10);
+    if (!done) {
+        std::cerr << "Upload during discovery failed" << std::endl;
+        return -1;
+    }
+    if (advAfter <= advBefore) {
+        std::cerr << "Advertisements not applied during the upload" << std::endl;
+        return -1;
+    }
+    for (auto &label : b.labels) {
+        if (label.imageCount != 1 || label.image != buffer) {
+            std::cerr << "Received image differs" << std::endl;
+            return -1;
+        }
+    }
+    std::cout << labelCount << " labels uploaded during discovery, " << advAfter - advBefore << " advertisements applied"
+        << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        int labelCount = atoi(argv[1]);
+        int slots = argc > 2 ? atoi(argv[2]) : 4;
+        int latencyMs = argc > 3 ? atoi(argv[3]) : 15;
+        return uploadToSimulatedLabels(labelCount, slots, latencyMs);
+    }
+    if (uploadToSimulatedLabels(12, 1, 2))
+        return -1;
+    if (uploadToSimulatedLabels(12, 4, 2))
+        return -1;
+    if (uploadWhileDiscovering())
+        return -1;
+    return 0;
+}
@@ -0,0 +1,430 @@
+/**
+ *  ./test-sim-send [window [latency-ms [loss-percent]]]
+ *  Send image to the simulated label, check received image and print throughput.
+ *  Count allocations made by the transfer, resume transfer interrupted by the link loss,
+ *  skip block size request for labels of a known type, give up on a hung label by measured round-trip time,
+ *  discover labels added while discovery is on.
+ */
+
+#include <atomic>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "nemr-5053-manufacturer-specific-data.h"
+#include "ble-helper-sim.h"
+#include "srgb-pack.h"
+
+static std::atomic<uint64_t> allocationCount(0);
+
+#ifdef __GLIBC__
+// operator new calls malloc too
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+
+extern "C" void *malloc(size_t size) {
+    allocationCount++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    allocationCount++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *p, size_t size) {
+    allocationCount++;
+    return __libc_realloc(p, size);
+}
+#else
+void *operator new(size_t size) {
+    allocationCount++;
+    void *p = std::malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+#endif
+
+/*
+ *           B/W width
+ *       +----------------+  red
+ *       |^  ^            |-------+
+ * height||\ |\           |       |
+ *       || \|            |       |
+ *       +----------------+       |
+ *       1- white, 0- black   ----+
+ *                         1- red, 0- none
+ *       Second (red) color overlaps white and black colors
+ */
+void drawWhiteBlackRedRectangles(
+    void *buffer,
+    uint32_t size,
+    uint8_t colorCount
+) {
+    // black & none
+    memset(buffer, 0, size);
+    // white
+    memset(buffer, 0xff, size / 4);
+    if (colorCount > 1) {
+        // red
+        auto *p = (uint8_t *) buffer;
+        memset(p + (size / 2) + size / 8, 0xff, size / 4);
+    }
+}
+
+/**
+ * Send image to the simulated label
+ * @param window chunks in flight
+ * @param latencyMs link latency
+ * @param lossPercent packet loss
+ * @param processMs firmware chunk processing time
+ * @param rxQueueSize firmware chunk queue size
+ * @param compress send compressed image
+ * @param blockSize block size of the label firmware
+ * @param retAllocations returns allocations made while sending
+ * @return 0- success
+ */
+static int sendToSimulatedLabel(
+    uint8_t window,
+    int latencyMs,
+    int lossPercent,
+    int processMs = 0,
+    uint8_t rxQueueSize = 0,
+    bool compress = false,
+    uint16_t blockSize = 244,
+    uint64_t *retAllocations = nullptr
+) {
+    BLEHelperSim b;
+    // 250x128 BWR EPA
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    auto &label = b.addLabel(0xffff92137614, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+    label.link.latencyMs = latencyMs;
+    label.link.jitterMs = latencyMs / 2;
+    label.link.lossPercent = lossPercent;
+    label.processMs = processMs;
+    label.rxQueueSize = rxQueueSize;
+    label.compression = compress;
+    label.blockSize = blockSize;
+
+    b.startDiscovery();
+    auto devicesFound = b.waitDiscover(1, 5);
+    b.stopDiscovery(10);
+    if (devicesFound != 1) {
+        std::cerr << "Simulated label not discovered" << std::endl;
+        return -1;
+    }
+    auto &d = b.devices[0];
+
+    uint32_t sz = d.metadata.screenSize();
+    std::vector<uint8_t> buffer(sz);
+    drawWhiteBlackRedRectangles(buffer.data(), sz, d.metadata.colorCount());
+    std::vector<uint8_t> compressed(sz + (sz + 127) / 128 + 4);
+    uint32_t sendSize = sz;
+    void *sendBuffer = buffer.data();
+    if (compress) {
+        sendSize = compressPlanes(compressed.data(), buffer.data(), sz);
+        sendBuffer = compressed.data();
+    }
+
+    auto r = b.openI(0);
+    if (r < 0) {
+        std::cerr << "Error open device" << std::endl;
+        return -1;
+    }
+    auto start = std::chrono::steady_clock::now();
+    uint64_t allocations = allocationCount;
+    r = b.sendBufferI(0, sendBuffer, sendSize, 200, window, compress);
+    allocations = allocationCount - allocations;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    if (retAllocations)
+        *retAllocations = allocations;
+    b.closeI(0);
+    if (r) {
+        std::cerr << "Error send buffer " << r << std::endl;
+        return -1;
+    }
+    if (b.labels[0].imageCount != 1 || b.labels[0].image != buffer) {
+        std::cerr << "Received image differs" << std::endl;
+        return -1;
+    }
+    std::cout << "window " << (int) window << ", latency " << latencyMs << "ms, loss " << lossPercent << "%: "
+        << sendSize << " bytes in " << ms << "ms, "
+        << b.labels[0].chunkCount << " chunks, "
+        << b.labels[0].requestCount << " requests, "
+        << b.labels[0].lostCount << " lost, "
+        << b.labels[0].overflowCount << " overflow, "
+        << allocations << " allocations, "
+        << (ms ? sz * 1000 / ms : 0) << " bytes/s" << std::endl;
+    return 0;
+}
+
+/**
+ * Chunks are framed without allocation: 12 times more chunks take as many allocations
+ */
+static int checkAllocations() {
+    uint64_t large, small;
+    if (sendToSimulatedLabel(1, 0, 0, 0, 0, false, 244, &large)
+        || sendToSimulatedLabel(1, 0, 0, 0, 0, false, 24, &small))
+        return -1;
+    if (small != large) {
+        std::cerr << "Allocations depend on chunk count: " << large << " and " << small << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Link drops at 90% of the image, the next session continues from the chunk the label requests
+ * @param window chunks in flight
+ * @param resumes label keeps interrupted transfer
+ * @return 0- success
+ */
+static int resumeTransfer(
+    uint8_t window,
+    bool resumes
+) {
+    BLEHelperSim b;
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    auto &label = b.addLabel(0xffff92137614, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+    label.link.latencyMs = 0;
+    label.link.jitterMs = 0;
+    label.link.txMs = 0;
+    // 400 chunks, the link drops on the chunk 360
+    label.blockSize = 24;
+    label.link.dropAtChunk = 361;
+    label.resumes = resumes;
+    b.startDiscovery();
+    b.waitDiscover(1, 5);
+    b.stopDiscovery(10);
+    auto &d = b.devices[0];
+    std::vector<uint8_t> buffer(d.metadata.screenSize());
+    drawWhiteBlackRedRectangles(buffer.data(), (uint32_t) buffer.size(), d.metadata.colorCount());
+
+    b.open(&d);
+    int r = b.sendBuffer(&d, buffer.data(), (uint32_t) buffer.size(), 50, window);
+    b.close(&d);
+    if (r != -4 || b.sendingStates.count(d.addr) != 1 || b.sendingStates[d.addr].offset != 360) {
+        std::cerr << "Interrupted transfer not kept" << std::endl;
+        return -1;
+    }
+    uint32_t firstChunks = b.labels[0].chunkCount;
+    b.open(&d);
+    r = b.sendBuffer(&d, buffer.data(), (uint32_t) buffer.size(), 50, window);
+    b.close(&d);
+    uint32_t chunks = b.labels[0].chunkCount - firstChunks;
+    if (r || b.labels[0].imageCount != 1 || b.labels[0].image != buffer || !b.sendingStates.empty()) {
+        std::cerr << "Transfer not finished after reconnect" << std::endl;
+        return -1;
+    }
+    std::cout << "window " << (int) window << (resumes ? ", resumed: " : ", started over: ")
+        << chunks << " chunks sent after reconnect" << std::endl;
+    if (resumes ? chunks > 40 + window : chunks < 400) {
+        std::cerr << "Transfer " << (resumes ? "not resumed" : "resumed by the label not keeping it") << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send image to the label and return requests made by the handshake
+ * @param b helper
+ * @param window chunks in flight
+ * @param retRequests returns requests made
+ * @return sendBuffer() result
+ */
+static int sendCountRequests(
+    BLEHelperSim &b,
+    uint8_t window,
+    uint32_t &retRequests
+) {
+    auto &d = b.devices[0];
+    std::vector<uint8_t> buffer(d.metadata.screenSize());
+    drawWhiteBlackRedRectangles(buffer.data(), (uint32_t) buffer.size(), d.metadata.colorCount());
+    uint32_t requests = b.labels[0].requestCount;
+    b.open(&d);
+    int r = b.sendBuffer(&d, buffer.data(), (uint32_t) buffer.size(), 50, window);
+    b.close(&d);
+    retRequests = b.labels[0].requestCount - requests;
+    if (r == 0 && b.labels[0].image != buffer)
+        r = -1;
+    return r;
+}
+
+static void addDiscoveredLabel(
+    BLEHelperSim &b,
+    uint16_t blockSize
+) {
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    auto &label = b.addLabel(0xffff92137614, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+    label.link.latencyMs = 0;
+    label.link.jitterMs = 0;
+    label.link.txMs = 0;
+    label.blockSize = blockSize;
+    b.startDiscovery();
+    b.waitDiscover(1, 5);
+    b.stopDiscovery(10);
+}
+
+/**
+ * Block size negotiated once is reused by the next session and by the saved cache,
+ * wrong cached block size is dropped
+ * @return 0- success
+ */
+static int reuseSessionParams() {
+    const char *fn = "test-sim-send-params.txt";
+    uint32_t first, second, loaded;
+    {
+        BLEHelperSim b;
+        addDiscoveredLabel(b, 24);
+        if (sendCountRequests(b, 1, first) || sendCountRequests(b, 1, second)) {
+            std::cerr << "Error send buffer" << std::endl;
+            return -1;
+        }
+        if (b.sessionParams.save(fn) != 1) {
+            std::cerr << "Session parameters not saved" << std::endl;
+            return -1;
+        }
+    }
+    {
+        BLEHelperSim b;
+        addDiscoveredLabel(b, 24);
+        if (b.sessionParams.load(fn) != 1 || sendCountRequests(b, 1, loaded)) {
+            std::cerr << "Error send buffer with loaded session parameters" << std::endl;
+            return -1;
+        }
+    }
+    remove(fn);
+    std::cout << "handshake requests: " << first << " negotiated, " << second << " cached, "
+        << loaded << " loaded" << std::endl;
+    if (first != 3 || second != 2 || loaded != 2) {
+        std::cerr << "Block size request not skipped" << std::endl;
+        return -1;
+    }
+
+    // firmware update changed block size, version in advertisement does not
+    BLEHelperSim b;
+    addDiscoveredLabel(b, 24);
+    SessionParams wrong;
+    wrong.blockSize = 244;
+    b.sessionParams.put(b.devices[0].metadata, wrong);
+    uint32_t requests;
+    if (sendCountRequests(b, 8, requests) != -4 || b.sessionParams.count() != 0) {
+        std::cerr << "Wrong block size kept" << std::endl;
+        return -1;
+    }
+    if (sendCountRequests(b, 8, requests) || requests != 3) {
+        std::cerr << "Block size not negotiated again" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Firmware hangs in the middle of the image: timeouts follow the measured round-trip time
+ * instead of the wait for the screen refresh
+ * @param window chunks in flight
+ * @return 0- success
+ */
+static int giveUpOnHungLabel(
+    uint8_t window
+) {
+    BLEHelperSim b;
+    addDiscoveredLabel(b, 24);
+    b.labels[0].hangAtChunk = 100;
+    auto &d = b.devices[0];
+    std::vector<uint8_t> buffer(d.metadata.screenSize());
+    drawWhiteBlackRedRectangles(buffer.data(), (uint32_t) buffer.size(), d.metadata.colorCount());
+    b.open(&d);
+    auto start = std::chrono::steady_clock::now();
+    int r = b.sendBuffer(&d, buffer.data(), (uint32_t) buffer.size(), 1000, window);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    b.close(&d);
+    RttEstimator e;
+    b.rtts.get(d.addr, e);
+    std::cout << "window " << (int) window << ", hung label: gave up in " << ms << "ms, timeout "
+        << b.responseTimeout(&d, 1000) << "ms" << std::endl;
+    if (r != -4 || ms > 3000 || e.samples < 10 || e.backoff < 4) {
+        std::cerr << "Hung label not detected by round-trip time" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Labels added while discovery is on are discovered, labels added before keep their references
+ * @return 0- success
+ */
+static int addLabelsWhileDiscovering() {
+    const int labelCount = 64;
+    BLEHelperSim b;
+    // 250x128 BWR EPA
+    uint8_t msd[7] { 0x53, 0x50, 0x0b, 0x1c, 0x81, 0x01, 0x41 };
+    auto &first = b.addLabel(0xffff92150000, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd)));
+    first.link.latencyMs = 2;
+    first.link.jitterMs = 1;
+    first.link.advIntervalMs = 5;
+    b.startDiscovery();
+    for (int i = 1; i < labelCount; i++) {
+        b.addLabel(0xffff92150000 + i, NEMR5053ManufacturerSpecificData(&msd, sizeof(msd))).link.advIntervalMs = 5;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto devicesFound = b.waitDiscover(labelCount, 5);
+    b.stopDiscovery(10);
+    if (devicesFound != labelCount) {
+        std::cerr << "Labels added during discovery not discovered: " << devicesFound << std::endl;
+        return -1;
+    }
+    auto &d = b.devices[0];
+    std::vector<uint8_t> buffer(d.metadata.screenSize());
+    drawWhiteBlackRedRectangles(buffer.data(), (uint32_t) buffer.size(), d.metadata.colorCount());
+    b.open(&d);
+    int r = b.sendBuffer(&d, buffer.data(), (uint32_t) buffer.size(), 1000, 8);
+    b.close(&d);
+    // reference taken before the other labels were added
+    if (r || &first != &b.labels[0] || first.imageCount != 1 || first.image != buffer) {
+        std::cerr << "Label added first moved" << std::endl;
+        return -1;
+    }
+    std::cout << labelCount << " labels added during discovery" << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        int window = atoi(argv[1]);
+        int latencyMs = argc > 2 ? atoi(argv[2]) : 15;
+        int lossPercent = argc > 3 ? atoi(argv[3]) : 0;
+        return sendToSimulatedLabel(window, latencyMs, lossPercent);
+    }
+    // stop-and-wait
+    if (sendToSimulatedLabel(1, 2, 0))
+        return -1;
+    // sliding window
+    if (sendToSimulatedLabel(8, 2, 0))
+        return -1;
+    // lost chunks and responses
+    if (sendToSimulatedLabel(8, 2, 5))
+        return -1;
+    // firmware can not keep up
+    if (sendToSimulatedLabel(16, 2, 0, 3, 2))
+        return -1;
+    // compressed
+    if (sendToSimulatedLabel(1, 2, 0, 0, 0, true))
+        return -1;
+    // link loss
+    if (resumeTransfer(1, true) || resumeTransfer(8, true) || resumeTransfer(1, false))
+        return -1;
+    if (reuseSessionParams())
+        return -1;
+    if (giveUpOnHungLabel(1) || giveUpOnHungLabel(8))
+        return -1;
+    if (addLabelsWhileDiscovering())
+        return -1;
+    return checkAllocations();
+}
@@ -0,0 +1,183 @@
+#ifndef INCL_DEFILTER
+#define INCL_DEFILTER
+
+// you probably want:
+// void defilter_row(uint8_t * cur, const uint8_t * prev, size_t len, uint8_t filter_type, size_t filter_bpp)
+
+// Sub, Average and Paeth filters of 3 and 4 byte pixels (8-bit RGB and RGBA) run one pixel per step in SSE2
+// registers, Up runs 16 bytes per step for any pixel size; SSE2 is checked at runtime. Other cases are scalar.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "wpng_common.h"
+
+// filter_bpp: bytes per complete pixel, at least 1; unknown filter types leave the scanline as is
+static void defilter_row_scalar(uint8_t * cur, const uint8_t * prev, size_t len, uint8_t filter_type, size_t filter_bpp)
+{
+    for (size_t x = 0; x < len; x += 1)
+    {
+        int16_t left   = x >= filter_bpp ? cur[x - filter_bpp] : 0;
+        int16_t up     = prev[x];
+        int16_t upleft = x >= filter_bpp ? prev[x - filter_bpp] : 0;
+        
+        if (filter_type == 1)
+            cur[x] += left;
+        if (filter_type == 2)
+            cur[x] += up;
+        if (filter_type == 3)
+            cur[x] += (up + left) / 2;
+        if (filter_type == 4)
+            cur[x] += paeth_get_ref_raw(left, up, upleft);
+    }
+}
+
+#if defined(CHECKSUM_X86)
+// kernels are inlined into defilter_pixels_sse2 so that the pixel size is a constant
+#if defined(_MSC_VER) && !defined(__clang__)
+#define DEFILTER_INLINE static __forceinline
+#else
+#define DEFILTER_INLINE static inline __attribute__((always_inline))
+#endif
+
+CHECKSUM_TARGET("sse2")
+DEFILTER_INLINE __m128i defilter_load(const uint8_t * p, size_t bpp)
+{
+    uint32_t v;
+    if (bpp == 4)
+        memcpy(&v, p, 4);
+    else
+    {
+        // assembled in a register, a 3 byte memcpy goes through the stack and stalls store forwarding
+        uint16_t low;
+        memcpy(&low, p, 2);
+        v = low | ((uint32_t)p[2] << 16);
+    }
+    return _mm_cvtsi32_si128((int)v);
+}
+
+CHECKSUM_TARGET("sse2")
+DEFILTER_INLINE void defilter_store(uint8_t * p, __m128i v, size_t bpp)
+{
+    uint32_t x = (uint32_t)_mm_cvtsi128_si32(v);
+    memcpy(p, &x, bpp);
+}
+
+CHECKSUM_TARGET("sse2")
+static void defilter_up_sse2(uint8_t * cur, const uint8_t * prev, size_t len)
+{
+    size_t x = 0;
+    for (; x + 16 <= len; x += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)&cur[x]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&prev[x]);
+        _mm_storeu_si128((__m128i *)&cur[x], _mm_add_epi8(a, b));
+    }
+    for (; x < len; x += 1)
+        cur[x] += prev[x];
+}
+
+CHECKSUM_TARGET("sse2")
+DEFILTER_INLINE void defilter_sub_sse2(uint8_t * cur, size_t len, size_t bpp)
+{
+    __m128i a = _mm_setzero_si128();
+    for (size_t x = 0; x < len; x += bpp)
+    {
+        a = _mm_add_epi8(a, defilter_load(&cur[x], bpp));
+        defilter_store(&cur[x], a, bpp);
+    }
+}
+
+// floor((a + b) / 2) is the rounded up average minus the lost low bit
+CHECKSUM_TARGET("sse2")
+DEFILTER_INLINE void defilter_avg_sse2(uint8_t * cur, const uint8_t * prev, size_t len, size_t bpp)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+    for (size_t x = 0; x < len; x += bpp)
+    {
+        __m128i b = defilter_load(&prev[x], bpp);
+        __m128i avg = _mm_avg_epu8(a, b);
+        avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(defilter_load(&cur[x], bpp), avg);
+        defilter_store(&cur[x], a, bpp);
+    }
+}
+
+// predictor in 16-bit lanes: pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|, ties go to a, then b
+CHECKSUM_TARGET("sse2")
+DEFILTER_INLINE void defilter_paeth_sse2(uint8_t * cur, const uint8_t * prev, size_t len, size_t bpp)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+    for (size_t x = 0; x < len; x += bpp)
+    {
+        __m128i b = _mm_unpacklo_epi8(defilter_load(&prev[x], bpp), zero);
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = _mm_add_epi16(pa, pb);
+        pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+        pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+        pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        __m128i use_a = _mm_cmpeq_epi16(smallest, pa);
+        __m128i use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb));
+        __m128i use_c = _mm_andnot_si128(_mm_or_si128(use_a, use_b), _mm_set1_epi16(-1));
+        __m128i nearest = _mm_or_si128(_mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)),
+            _mm_and_si128(use_c, c));
+        __m128i d = _mm_add_epi8(defilter_load(&cur[x], bpp), _mm_packus_epi16(nearest, nearest));
+        defilter_store(&cur[x], d, bpp);
+        a = _mm_unpacklo_epi8(d, zero);
+        c = b;
+    }
+}
+
+// filter_type is 1, 3 or 4, len is a multiple of bpp, bpp is 3 or 4
+CHECKSUM_TARGET("sse2")
+static void defilter_pixels_sse2(uint8_t * cur, const uint8_t * prev, size_t len, uint8_t filter_type, size_t bpp)
+{
+    if (bpp == 3)
+    {
+        if (filter_type == 1)
+            defilter_sub_sse2(cur, len, 3);
+        else if (filter_type == 3)
+            defilter_avg_sse2(cur, prev, len, 3);
+        else
+            defilter_paeth_sse2(cur, prev, len, 3);
+    }
+    else
+    {
+        if (filter_type == 1)
+            defilter_sub_sse2(cur, len, 4);
+        else if (filter_type == 3)
+            defilter_avg_sse2(cur, prev, len, 4);
+        else
+            defilter_paeth_sse2(cur, prev, len, 4);
+    }
+}
+#endif
+
+static void defilter_row(uint8_t * cur, const uint8_t * prev, size_t len, uint8_t filter_type, size_t filter_bpp)
+{
+#if defined(CHECKSUM_X86)
+    if (filter_type >= 1 && filter_type <= 4 && (checksum_cpu_features() & CHECKSUM_CPU_SSE2))
+    {
+        if (filter_type == 2)
+        {
+            defilter_up_sse2(cur, prev, len);
+            return;
+        }
+        if ((filter_bpp == 3 || filter_bpp == 4) && len % filter_bpp == 0)
+        {
+            defilter_pixels_sse2(cur, prev, len, filter_type, filter_bpp);
+            return;
+        }
+    }
+#endif
+    defilter_row_scalar(cur, prev, len, filter_type, filter_bpp);
+}
+
+#endif // INCL_DEFILTER
@@ -3,45 +3,59 @@
 
 // you probably want:
 // byte_buffer do_inflate(byte_buffer * input_bytes, int * error, uint8_t header_mode)
+// or, to get the output piece by piece with a bounded buffer:
+// byte_buffer do_inflate_stream(byte_buffer * input_bytes, int * error, uint8_t header_mode, infl_stream * stream)
 
 #include <stdint.h> // basic types
 #include <stdlib.h> // size_t
 #include <stdio.h> // printf
 
 #include "buffers.h"
+#include "checksum.h"
 
 #define ASSERT_OR_BROKEN_FILE(expr,ret) { if (!(expr)) { *error = -1; printf("assert failed on line %d\n", __LINE__); return ret; } }
 #define ASSERT_OR_BROKEN_DECODER(expr,ret) { if (!(expr)) { *error = 1; printf("assert failed on line %d\n", __LINE__); return ret; } }
 
-static uint32_t infl_compute_adler32(const uint8_t * data, size_t size)
+// streaming output
+// decompressed data is handed to the sink as it is produced; only the last 32k (the maximum
+// LZ77 distance) are kept in the output buffer, so memory does not depend on the output size
+// the sink returns nonzero to stop decompression
+
+#define INFL_WINDOW_SIZE 32768
+
+typedef int (*infl_sink)(void * user, const uint8_t * data, size_t len);
+
+typedef struct {
+    infl_sink sink;
+    void * user;
+    size_t delivered; // bytes of the output buffer already given to the sink
+    size_t total;     // bytes given to the sink in total
+    uint32_t adler;
+    uint32_t crc;
+    uint8_t header_mode;
+    uint8_t aborted;
+} infl_stream;
+
+static void infl_stream_flush(infl_stream * stream, byte_buffer * ret, uint8_t keep_window)
 {
-    uint32_t a = 1;
-    uint32_t b = 0;
-    for (size_t i = 0; i < size; i += 1)
+    if (ret->len > stream->delivered && !stream->aborted)
     {
-        a = (a + data[i]) % 65521;
-        b = (b + a) % 65521;
+        const uint8_t * data = &ret->data[stream->delivered];
+        size_t len = ret->len - stream->delivered;
+        if (stream->header_mode == 1)
+            stream->adler = infl_update_adler32(stream->adler, data, len);
+        else if (stream->header_mode == 2)
+            stream->crc = infl_compute_crc32(data, len, stream->crc);
+        stream->total += len;
+        if (stream->sink(stream->user, data, len))
+            stream->aborted = 1;
     }
-    return (b << 16) | a;
-}
-
-static uint32_t infl_compute_crc32(const uint8_t * data, size_t size, uint32_t init)
-{
-    uint32_t crc_table[256] = {0};
-
-    for (size_t i = 0; i < 256; i += 1)
+    if (keep_window && ret->len > INFL_WINDOW_SIZE)
     {
-        uint32_t c = i;
-        for (size_t j = 0; j < 8; j += 1)
-            c = (c >> 1) ^ ((c & 1) ? 0xEDB88320 : 0);
-        crc_table[i] = c;
+        memmove(ret->data, &ret->data[ret->len - INFL_WINDOW_SIZE], INFL_WINDOW_SIZE);
+        ret->len = INFL_WINDOW_SIZE;
     }
-    
-    init ^= 0xFFFFFFFF;
-    for (size_t i = 0; i < size; i += 1)
-        init = crc_table[(init ^ data[i]) & 0xFF] ^ (init >> 8);
-    
-    return init ^ 0xFFFFFFFF;
+    stream->delivered = ret->len;
 }
 
 static void build_code(uint8_t * code_lens, uint16_t * code_lits, uint16_t * code_by_len, size_t total_count, int * error)
@@ -92,7 +106,7 @@ static uint16_t read_huff_code(bit_buffer * input, uint16_t * code_by_len, int *
     return code;
 }
 
-static void do_lz77(bit_buffer * input, byte_buffer * ret, uint16_t * code_lits, uint16_t * code_by_len, uint16_t * dist_code_lits, uint16_t * dist_code_by_len, int * error)
+static void do_lz77(bit_buffer * input, byte_buffer * ret, uint16_t * code_lits, uint16_t * code_by_len, uint16_t * dist_code_lits, uint16_t * dist_code_by_len, infl_stream * stream, int * error)
 {
     int huff_error = 0;
     uint16_t literal = 256;
@@ -141,19 +155,275 @@ static void do_lz77(bit_buffer * input, byte_buffer * ret, uint16_t * code_lits,
         
         if (input->byte_index == input->buffer.len && input->bit_index != 0)
             ASSERT_OR_BROKEN_FILE(0,)
+        
+        if (stream && ret->len >= 2 * INFL_WINDOW_SIZE)
+        {
+            infl_stream_flush(stream, ret, 1);
+            if (stream->aborted)
+            {
+                *error = 2;
+                return;
+            }
+        }
     } while (literal != 256);
     //puts("block ended!");
 }
 
+// table-driven decoding
+// a symbol is looked up with the next INFL_LIT_BITS/INFL_DIST_BITS bits of the input in the primary table;
+// longer codes continue in a subtable linked from the primary entry
+// bits are taken from a 64-bit reservoir refilled up to 8 bytes at a time
+
+#define INFL_LIT_BITS 10
+#define INFL_DIST_BITS 8
+// primary table and at most one 2^(15 - bits) entries subtable per symbol
+#define INFL_LIT_TABLE_SIZE ((1 << INFL_LIT_BITS) + 288 * (1 << (15 - INFL_LIT_BITS)))
+#define INFL_DIST_TABLE_SIZE ((1 << INFL_DIST_BITS) + 32 * (1 << (15 - INFL_DIST_BITS)))
+
+// entry: bits 0..15 symbol or subtable offset, bits 16..23 code length or subtable index bits (0: no code)
+#define INFL_ENTRY_LINK 0x1000000
+
+static uint16_t infl_reverse_bits(uint16_t code, uint8_t len)
+{
+    uint16_t ret = 0;
+    for (uint8_t i = 0; i < len; i += 1)
+    {
+        ret = (ret << 1) | (code & 1);
+        code >>= 1;
+    }
+    return ret;
+}
+
+// same checks as build_code: over-subscribed codes are an error, incomplete codes are allowed
+static void build_table(const uint8_t * code_lens, size_t total_count, uint8_t primary_bits, uint32_t * table, int * error)
+{
+    uint16_t len_count[16] = {0};
+    for (size_t val = 0; val < total_count; val += 1)
+        len_count[code_lens[val]]++;
+    len_count[0] = 0;
+    
+    int32_t left = 1;
+    uint16_t next_code[16] = {0};
+    uint16_t code = 0;
+    for (size_t len = 1; len < 16; len += 1)
+    {
+        left = (left << 1) - len_count[len];
+        ASSERT_OR_BROKEN_FILE(left >= 0,)
+        code = (code + len_count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+    
+    // longest code for each primary index, to size subtables
+    uint8_t sub_bits[1 << INFL_LIT_BITS] = {0};
+    uint16_t primary_mask = (1 << primary_bits) - 1;
+    uint16_t codes[288];
+    for (size_t val = 0; val < total_count; val += 1)
+    {
+        uint8_t len = code_lens[val];
+        if (!len)
+            continue;
+        codes[val] = infl_reverse_bits(next_code[len]++, len);
+        if (len > primary_bits && len - primary_bits > sub_bits[codes[val] & primary_mask])
+            sub_bits[codes[val] & primary_mask] = len - primary_bits;
+    }
+    
+    memset(table, 0, sizeof(uint32_t) << primary_bits);
+    uint32_t used = 1 << primary_bits;
+    for (size_t i = 0; i <= primary_mask; i += 1)
+    {
+        if (!sub_bits[i])
+            continue;
+        memset(&table[used], 0, sizeof(uint32_t) << sub_bits[i]);
+        table[i] = INFL_ENTRY_LINK | ((uint32_t)sub_bits[i] << 16) | used;
+        used += 1 << sub_bits[i];
+    }
+    
+    for (size_t val = 0; val < total_count; val += 1)
+    {
+        uint8_t len = code_lens[val];
+        if (!len)
+            continue;
+        uint32_t entry = ((uint32_t)len << 16) | val;
+        if (len <= primary_bits)
+        {
+            for (uint32_t i = codes[val]; i <= primary_mask; i += 1 << len)
+                table[i] = entry;
+        }
+        else
+        {
+            uint32_t link = table[codes[val] & primary_mask];
+            uint8_t bits = (link >> 16) & 0xFF;
+            uint32_t * sub = &table[link & 0xFFFF];
+            for (uint32_t i = codes[val] >> primary_bits; i < (1u << bits); i += 1 << (len - primary_bits))
+                sub[i] = entry;
+        }
+    }
+}
+
+typedef struct {
+    const uint8_t * data;
+    size_t len;
+    size_t pos;       // next byte to load, may pass len: zero bits are loaded past the end
+    uint64_t bits;
+    uint8_t count;
+} infl_bits;
+
+static inline void infl_bits_refill(infl_bits * in)
+{
+    if (in->pos + 8 <= in->len)
+    {
+        uint64_t v;
+        memcpy(&v, &in->data[in->pos], 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        v = __builtin_bswap64(v);
+#endif
+        in->bits |= v << in->count;
+        in->pos += (63 - in->count) >> 3;
+        in->count |= 56;
+        return;
+    }
+    while (in->count <= 56)
+    {
+        if (in->pos < in->len)
+            in->bits |= (uint64_t)in->data[in->pos] << in->count;
+        in->pos += 1;
+        in->count += 8;
+    }
+}
+
+static inline uint32_t infl_bits_take(infl_bits * in, uint8_t n)
+{
+    uint32_t ret = (uint32_t)(in->bits & ((1ULL << n) - 1));
+    in->bits >>= n;
+    in->count -= n;
+    return ret;
+}
+
+static inline uint32_t infl_decode(infl_bits * in, const uint32_t * table, uint8_t primary_bits)
+{
+    uint32_t entry = table[in->bits & ((1u << primary_bits) - 1)];
+    if (entry & INFL_ENTRY_LINK)
+    {
+        uint8_t bits = (entry >> 16) & 0xFF;
+        entry = table[(entry & 0xFFFF) + ((in->bits >> primary_bits) & ((1u << bits) - 1))];
+    }
+    uint8_t len = (entry >> 16) & 0xFF;
+    in->bits >>= len;
+    in->count -= len;
+    return entry; // length 0: no such code
+}
+
+static void do_lz77_table(bit_buffer * input, byte_buffer * ret, const uint32_t * lit_table, const uint32_t * dist_table, infl_stream * stream, int * error)
+{
+    static const uint16_t len_mins[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+    static const uint8_t len_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+    static const uint16_t dist_mins[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+    static const uint8_t dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+    
+    // bit_buffer keeps bit_index in 1..8 once reading started, byte_index is the current byte
+    size_t start = input->byte_index * 8 + input->bit_index;
+    infl_bits in = {input->buffer.data, input->buffer.len, start / 8, 0, 0};
+    infl_bits_refill(&in);
+    infl_bits_take(&in, start % 8);
+    size_t end_bits = input->buffer.len * 8;
+    
+    #define INFL_SYNC_INPUT { \
+        size_t p = in.pos * 8 - in.count; \
+        input->byte_index = p / 8; \
+        input->bit_index = p % 8; \
+        if (input->bit_index == 0 && input->byte_index > 0) \
+        { \
+            input->byte_index -= 1; \
+            input->bit_index = 8; \
+        } \
+    }
+    
+    while (1)
+    {
+        infl_bits_refill(&in);
+        if (ret->len + 258 > ret->cap)
+            bytes_reserve(ret, 258);
+        
+        uint32_t entry = infl_decode(&in, lit_table, INFL_LIT_BITS);
+        uint16_t literal = entry & 0xFFFF;
+        if (((entry >> 16) & 0xFF) == 0 || literal > 285)
+        {
+            INFL_SYNC_INPUT
+            ASSERT_OR_BROKEN_FILE(0,)
+        }
+        
+        if (literal < 256)
+            ret->data[ret->len++] = (uint8_t)literal;
+        else if (literal > 256)
+        {
+            uint16_t len = len_mins[literal - 257] + infl_bits_take(&in, len_extra[literal - 257]);
+            
+            uint32_t dist_entry = infl_decode(&in, dist_table, INFL_DIST_BITS);
+            uint16_t dist_literal = dist_entry & 0xFFFF;
+            if (((dist_entry >> 16) & 0xFF) == 0 || dist_literal > 29)
+            {
+                INFL_SYNC_INPUT
+                ASSERT_OR_BROKEN_FILE(0,)
+            }
+            uint32_t dist = dist_mins[dist_literal] + infl_bits_take(&in, dist_extra[dist_literal]);
+            if (dist > ret->len)
+            {
+                INFL_SYNC_INPUT
+                ASSERT_OR_BROKEN_FILE(0,)
+            }
+            
+            uint8_t * d = &ret->data[ret->len];
+            const uint8_t * s = d - dist;
+            if (dist >= len)
+                memcpy(d, s, len);
+            else if (dist == 1)
+                memset(d, *s, len);
+            else
+            {
+                // overlapping copy repeats the last dist bytes
+                for (size_t j = 0; j < len; j++)
+                    d[j] = s[j];
+            }
+            ret->len += len;
+        }
+        else
+            break;
+        
+        if (in.pos * 8 - in.count > end_bits)
+        {
+            INFL_SYNC_INPUT
+            ASSERT_OR_BROKEN_FILE(0,)
+        }
+        
+        if (stream && ret->len >= 2 * INFL_WINDOW_SIZE)
+        {
+            infl_stream_flush(stream, ret, 1);
+            if (stream->aborted)
+            {
+                INFL_SYNC_INPUT
+                *error = 2;
+                return;
+            }
+        }
+    }
+    INFL_SYNC_INPUT
+    
+    #undef INFL_SYNC_INPUT
+}
+
 // decompression starts at input_bytes->cur
 // on error, error is set to nonzero. otherwise error is unset
 // positive error: bug in decoder
 // negative error: broken DEFLATE data
 // returns any decompressed data even on error
 // on success, sets input_bytes->cur field to where the decompressor stopped decompressing
-static byte_buffer do_inflate(byte_buffer * input_bytes, int * error, uint8_t header_mode)
+// if stream is not null, all output goes to stream->sink and only the last window is returned
+// bitwise: decode Huffman codes bit by bit instead of with lookup tables, kept as a reference
+static byte_buffer infl_run(byte_buffer * input_bytes, int * error, uint8_t header_mode, infl_stream * stream, uint8_t bitwise)
 {
     byte_buffer ret = {0, 0, 0, 0};
+    uint32_t lit_table[INFL_LIT_TABLE_SIZE];
+    uint32_t dist_table[INFL_DIST_TABLE_SIZE];
     bit_buffer input = {*input_bytes, input_bytes->cur, 0};
     
     uint16_t static_lits[1 << 9];
@@ -249,11 +519,41 @@ static byte_buffer do_inflate(byte_buffer * input_bytes, int * error, uint8_t he
             
             bytes_push(&ret, &input.buffer.data[input.byte_index + 1], len);
             input.byte_index += len;
+            
+            if (stream && ret.len >= 2 * INFL_WINDOW_SIZE)
+            {
+                infl_stream_flush(stream, &ret, 1);
+                if (stream->aborted)
+                {
+                    *error = 2;
+                    return ret;
+                }
+            }
         }
         else if (type == 1)
         {
             int lz77_error = 0;
-            do_lz77(&input, &ret, static_lits, static_by_len, static_dists, static_dists_by_len, &lz77_error);
+            if (bitwise)
+                do_lz77(&input, &ret, static_lits, static_by_len, static_dists, static_dists_by_len, stream, &lz77_error);
+            else
+            {
+                uint8_t static_lens[288 + 32];
+                memset(static_lens, 8, 144);
+                memset(&static_lens[144], 9, 112);
+                memset(&static_lens[256], 7, 24);
+                memset(&static_lens[280], 8, 8);
+                memset(&static_lens[288], 5, 32);
+                int code_error = 0;
+                build_table(static_lens, 288, INFL_LIT_BITS, lit_table, &code_error);
+                build_table(&static_lens[288], 32, INFL_DIST_BITS, dist_table, &code_error);
+                ASSERT_OR_BROKEN_DECODER(code_error == 0, ret)
+                do_lz77_table(&input, &ret, lit_table, dist_table, stream, &lz77_error);
+            }
+            if (stream && stream->aborted)
+            {
+                *error = 2;
+                return ret;
+            }
             ASSERT_OR_BROKEN_FILE(lz77_error == 0, ret)
         }
         else if (type == 2)
@@ -312,24 +612,42 @@ static byte_buffer do_inflate(byte_buffer * input_bytes, int * error, uint8_t he
             }
             
             uint8_t code_lens[288] = {0};
-            uint16_t code_lits[1 << 15] = {0};
-            uint16_t code_by_len[16] = {0};
             memcpy(code_lens, raw_code_lens, len_count);
-            //printf("building lit code, count %d\n", len_count);
-            build_code(code_lens, code_lits, code_by_len, 288, &code_error);
-            ASSERT_OR_BROKEN_FILE(code_error == 0, ret)
-            
             uint8_t dist_code_lens[32] = {0};
-            uint16_t dist_code_lits[1 << 15] = {0};
-            uint16_t dist_code_by_len[16] = {0};
             memcpy(dist_code_lens, &raw_code_lens[len_count], dist_count);
-            build_code(dist_code_lens, dist_code_lits, dist_code_by_len, 32, &code_error);
-            ASSERT_OR_BROKEN_FILE(code_error == 0, ret)
-            
-            //printf("-- finished reading huff at %08X:%d\n", input.byte_index, input.bit_index);
             
             int lz77_error = 0;
-            do_lz77(&input, &ret, code_lits, code_by_len, dist_code_lits, dist_code_by_len, &lz77_error);
+            if (bitwise)
+            {
+                uint16_t code_lits[1 << 15] = {0};
+                uint16_t code_by_len[16] = {0};
+                //printf("building lit code, count %d\n", len_count);
+                build_code(code_lens, code_lits, code_by_len, 288, &code_error);
+                ASSERT_OR_BROKEN_FILE(code_error == 0, ret)
+                
+                uint16_t dist_code_lits[1 << 15] = {0};
+                uint16_t dist_code_by_len[16] = {0};
+                build_code(dist_code_lens, dist_code_lits, dist_code_by_len, 32, &code_error);
+                ASSERT_OR_BROKEN_FILE(code_error == 0, ret)
+                
+                //printf("-- finished reading huff at %08X:%d\n", input.byte_index, input.bit_index);
+                
+                do_lz77(&input, &ret, code_lits, code_by_len, dist_code_lits, dist_code_by_len, stream, &lz77_error);
+            }
+            else
+            {
+                build_table(code_lens, 288, INFL_LIT_BITS, lit_table, &code_error);
+                ASSERT_OR_BROKEN_FILE(code_error == 0, ret)
+                build_table(dist_code_lens, 32, INFL_DIST_BITS, dist_table, &code_error);
+                ASSERT_OR_BROKEN_FILE(code_error == 0, ret)
+                
+                do_lz77_table(&input, &ret, lit_table, dist_table, stream, &lz77_error);
+            }
+            if (stream && stream->aborted)
+            {
+                *error = 2;
+                return ret;
+            }
             ASSERT_OR_BROKEN_FILE(lz77_error == 0, ret)
         }
         else
@@ -344,21 +662,30 @@ static byte_buffer do_inflate(byte_buffer * input_bytes, int * error, uint8_t he
         if (final)
             break;
     }
+    if (stream)
+    {
+        infl_stream_flush(stream, &ret, 0);
+        if (stream->aborted)
+        {
+            *error = 2;
+            return ret;
+        }
+    }
     if (header_mode == 1)
     {
         bits_align_to_byte(&input);
         //printf("-- literal addr %08llX\n", (unsigned long long)input.byte_index);
         uint32_t expected_checksum = byteswap_int(bits_pop(&input, 32), 4);
-        uint32_t checksum = infl_compute_adler32(ret.data, ret.len);
+        uint32_t checksum = stream ? stream->adler : infl_compute_adler32(ret.data, ret.len);
         ASSERT_OR_BROKEN_FILE(expected_checksum == checksum, ret)
     }
     else if (header_mode == 2)
     {
-        uint32_t crc = infl_compute_crc32(ret.data, ret.len, 0);
+        uint32_t crc = stream ? stream->crc : infl_compute_crc32(ret.data, ret.len, 0);
         uint32_t expected_crc = bits_pop(&input, 32);
         ASSERT_OR_BROKEN_FILE(crc == expected_crc, ret)
         uint32_t expected_size = bits_pop(&input, 32);
-        uint32_t size = ret.len & 0xFFFFFFFF;
+        uint32_t size = (stream ? stream->total : ret.len) & 0xFFFFFFFF;
         ASSERT_OR_BROKEN_FILE(expected_size == size, ret)
     }
     
@@ -367,6 +694,32 @@ static byte_buffer do_inflate(byte_buffer * input_bytes, int * error, uint8_t he
     return ret;
 }
 
+static byte_buffer do_inflate_stream(byte_buffer * input_bytes, int * error, uint8_t header_mode, infl_stream * stream)
+{
+    return infl_run(input_bytes, error, header_mode, stream, 0);
+}
+
+static byte_buffer do_inflate(byte_buffer * input_bytes, int * error, uint8_t header_mode)
+{
+    return infl_run(input_bytes, error, header_mode, 0, 0);
+}
+
+// reference decoder, bit by bit
+static byte_buffer do_inflate_bitwise(byte_buffer * input_bytes, int * error, uint8_t header_mode)
+{
+    return infl_run(input_bytes, error, header_mode, 0, 1);
+}
+
+// stream must be initialized with infl_stream_init
+static void infl_stream_init(infl_stream * stream, uint8_t header_mode, infl_sink sink, void * user)
+{
+    memset(stream, 0, sizeof(infl_stream));
+    stream->sink = sink;
+    stream->user = user;
+    stream->adler = 1;
+    stream->header_mode = header_mode;
+}
+
 #undef ASSERT_OR_BROKEN_FILE
 #undef ASSERT_OR_BROKEN_DECODER
 
@@ -3,6 +3,8 @@
 
 // you probably want:
 // static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * output)
+// or, to get 8-bit RGBA rows one by one without decoding the whole image into memory:
+// static void wpng_load_rows(byte_buffer * buf, uint32_t flags, wpng_row_callback callback, void * user, wpng_load_output * output)
 
 #include <stdint.h>
 #include <stddef.h>
@@ -11,6 +13,7 @@
 #include "inflate.h"
 #include "buffers.h"
 #include "wpng_common.h"
+#include "defilter.h"
 
 #ifndef TEST_VS_LIBPNG
 static double to_srgb(double x)
@@ -45,36 +48,77 @@ static uint8_t apply_gamma_u8(uint8_t val, double gamma)
 #endif
 }
 
+// table of apply_gamma_u8 for every value, so gamma costs one lookup per sample instead of two pow calls
+static void build_gamma_table_u8(uint8_t * table, float gamma)
+{
+    for (size_t i = 0; i < 256; i += 1)
+        table[i] = apply_gamma_u8((uint8_t)i, gamma);
+}
+
+// components: 1 to 4, the last of 2 or 4 is alpha and is left unchanged
+static void apply_gamma_table_u8(const uint8_t * table, uint8_t * data, size_t pixels, uint8_t components)
+{
+    if (components == 1 || components == 3)
+    {
+        size_t count = pixels * components;
+        for (size_t i = 0; i < count; i += 1)
+            data[i] = table[data[i]];
+    }
+    else if (components == 4)
+    {
+        for (size_t i = 0; i < pixels * 4; i += 4)
+        {
+            data[i + 0] = table[data[i + 0]];
+            data[i + 1] = table[data[i + 1]];
+            data[i + 2] = table[data[i + 2]];
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < pixels * 2; i += 2)
+            data[i] = table[data[i]];
+    }
+}
+
 static void apply_gamma(uint32_t width, uint32_t height, uint8_t bpp, uint8_t is_16bit, uint8_t * image_data, size_t bytes_per_scanline, float gamma)
 {
     uint8_t components = bpp;
     if (is_16bit)
         components /= 2;
     
+    if (!is_16bit)
+    {
+        uint8_t table[256];
+        build_gamma_table_u8(table, gamma);
+        for (size_t y = 0; y < height; y += 1)
+            apply_gamma_table_u8(table, &image_data[y * bytes_per_scanline], width, components);
+        return;
+    }
+    
+    // a 16-bit table only pays off when there are more samples than table entries
+    uint16_t * table = 0;
+    if ((uint64_t)width * height * components > 65536)
+        table = (uint16_t *)malloc(65536 * sizeof(uint16_t));
+    if (table)
+    {
+        for (size_t i = 0; i < 65536; i += 1)
+            table[i] = apply_gamma_u16((uint16_t)i, gamma);
+    }
+    
     for (size_t y = 0; y < height; y += 1)
     {
+        uint8_t * row = &image_data[y * bytes_per_scanline];
         for (size_t x = 0; x < width * components; x += 1)
         {
             if ((components == 2 || components == 4) && (x % components == (uint8_t)(components - 1)))
                 continue;
-            if (is_16bit)
-            {
-                uint16_t a = image_data[y * bytes_per_scanline + x * 2 + 0];
-                uint16_t b = image_data[y * bytes_per_scanline + x * 2 + 1];
-                uint16_t val = (a << 8) | b;
-                val = apply_gamma_u16(val, gamma);
-                image_data[y * bytes_per_scanline + x * 2 + 0] = val >> 8;
-                image_data[y * bytes_per_scanline + x * 2 + 1] = val;
-            }
-            else
-            {
-                
-                uint8_t val = image_data[y * bytes_per_scanline + x];
-                val = apply_gamma_u8(val, gamma);
-                image_data[y * bytes_per_scanline + x] = val;
-            }
+            uint16_t val = (row[x * 2 + 0] << 8) | row[x * 2 + 1];
+            val = table ? table[val] : apply_gamma_u16(val, gamma);
+            row[x * 2 + 0] = val >> 8;
+            row[x * 2 + 1] = val;
         }
     }
+    free(table);
 }
 
 static void defilter(uint8_t * image_data, size_t data_size, byte_buffer * dec, uint32_t width, uint32_t height, uint8_t interlace_layer, uint8_t bit_depth, uint8_t components, uint8_t * error)
@@ -155,21 +199,20 @@ static void defilter(uint8_t * image_data, size_t data_size, byte_buffer * dec,
         //if (filter_type == 4)
         //    puts("filter mode 4");
         
+        memcpy(y_prev_next, &dec->data[dec->cur], bytes_per_scanline);
+        dec->cur += bytes_per_scanline;
+        defilter_row(y_prev_next, y_prev, bytes_per_scanline, filter_type, min_bytes * components);
+        
+        if (bit_depth >= 8 && x_gap == 1)
+        {
+            assert(y * output_bps + bytes_per_scanline <= data_size);
+            memcpy(&image_data[y * output_bps], y_prev_next, bytes_per_scanline);
+            continue;
+        }
+        
         for (size_t x = 0; x < bytes_per_scanline; x += 1)
         {
-            uint8_t byte = byte_pop(dec);
-            int16_t left = x >= min_bytes * components ? y_prev_next[x - min_bytes * components] : 0;
-            int16_t up   = y_prev[x];
-            int16_t upleft = x >= min_bytes * components ? y_prev[x - min_bytes * components] : 0;
-            
-            if (filter_type == 1)
-                byte += left;
-            if (filter_type == 2)
-                byte += up;
-            if (filter_type == 3)
-                byte += (up + left) / 2;
-            if (filter_type == 4)
-                byte += paeth_get_ref_raw(left, up, upleft);
+            uint8_t byte = y_prev_next[x];
             
             // note: bits_per_pixel can only be less than 8 if there is only one component
             if (bit_depth < 8)
@@ -199,8 +242,6 @@ static void defilter(uint8_t * image_data, size_t data_size, byte_buffer * dec,
                 assert(y * output_bps + x_out < data_size);
                 image_data[y * output_bps + x_out] = byte;
             }
-            
-            y_prev_next[x] = byte;
         }
     }
     
@@ -247,14 +288,34 @@ static inline uint8_t u16_to_u8(uint16_t val)
     return val;
 }
 
-// on error, writes nonzero to the "error" value of output and leaves the rest untouched
-// on success, writes zero to the "error" value of output and writes every other value
-static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * output)
+// chunks needed to decode image data
+typedef struct {
+    byte_buffer idat;             // concatenated IDAT chunks
+    uint32_t width;
+    uint32_t height;
+    uint8_t bit_depth;
+    uint8_t color_type;
+    uint8_t interlacing;
+    uint8_t palette[1024];        // RGBA
+    uint16_t palette_size;
+    uint8_t has_trns;
+    uint32_t transparent_r;
+    uint32_t transparent_g;
+    uint32_t transparent_b;
+    uint8_t is_srgb;
+    float gamma;                  // -1 if unset
+} wpng_chunks;
+
+// reads and checks all chunks up to IEND
+// on error, writes nonzero to the "error" value of output; chunks->idat must be freed by the caller in any case
+static void wpng_read_chunks(byte_buffer * buf, uint32_t flags, wpng_chunks * chunks, wpng_load_output * output)
 {
     assert(output);
     assert(buf);
     assert(buf->data);
     
+    memset(chunks, 0, sizeof(wpng_chunks));
+    
     #define WPNG_ASSERT(COND, ERRVAL) { if (!(COND)) { output->error = (ERRVAL); return; } }
     // 1 - chunk size error
     // 2 - buffer overflow
@@ -277,9 +338,6 @@ static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * outp
     }
     buf->cur = 8;
     
-    byte_buffer idat;
-    memset(&idat, 0, sizeof(byte_buffer));
-    
     uint32_t width = 0;
     uint32_t height = 0;
     uint8_t bit_depth = 0;
@@ -453,7 +511,7 @@ static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * outp
         else if (memcmp(name, "IDAT", 4) == 0)
         {
             WPNG_ASSERT(!has_idat || prev_was_idat, 6); // multiple idat chunks must be consecutive
-            bytes_push(&idat, &buf->data[buf->cur], size);
+            bytes_push(&chunks->idat, &buf->data[buf->cur], size);
             has_idat = 1;
         }
         else if (memcmp(name, "PLTE", 4) == 0)
@@ -534,7 +592,6 @@ static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * outp
         
         buf->cur = cur_start + size + 4;
     }
-    uint8_t was_16bit = bit_depth == 16;
     
     WPNG_ASSERT(has_idat, 8);
     WPNG_ASSERT(has_iend, 8);
@@ -547,6 +604,53 @@ static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * outp
     if (color_type == 3)
         WPNG_ASSERT(palette_size != 0, 10);
     
+    chunks->width = width;
+    chunks->height = height;
+    chunks->bit_depth = bit_depth;
+    chunks->color_type = color_type;
+    chunks->interlacing = interlacing;
+    memcpy(chunks->palette, palette, sizeof(palette));
+    chunks->palette_size = palette_size;
+    chunks->has_trns = has_trns;
+    chunks->transparent_r = transparent_r;
+    chunks->transparent_g = transparent_g;
+    chunks->transparent_b = transparent_b;
+    chunks->is_srgb = is_srgb;
+    chunks->gamma = gamma;
+    output->error = 0;
+    
+    #undef WPNG_ASSERT
+}
+
+// on error, writes nonzero to the "error" value of output and leaves the rest untouched
+// on success, writes zero to the "error" value of output and writes every other value
+static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * output)
+{
+    #define WPNG_ASSERT(COND, ERRVAL) { if (!(COND)) { output->error = (ERRVAL); return; } }
+    
+    wpng_chunks chunks;
+    wpng_read_chunks(buf, flags, &chunks, output);
+    if (output->error)
+    {
+        free(chunks.idat.data);
+        return;
+    }
+    
+    byte_buffer idat = chunks.idat;
+    uint32_t width = chunks.width;
+    uint32_t height = chunks.height;
+    uint8_t bit_depth = chunks.bit_depth;
+    uint8_t color_type = chunks.color_type;
+    uint8_t interlacing = chunks.interlacing;
+    uint8_t * palette = chunks.palette;
+    uint8_t has_trns = chunks.has_trns;
+    uint32_t transparent_r = chunks.transparent_r;
+    uint32_t transparent_g = chunks.transparent_g;
+    uint32_t transparent_b = chunks.transparent_b;
+    uint8_t is_srgb = chunks.is_srgb;
+    float gamma = chunks.gamma;
+    uint8_t was_16bit = bit_depth == 16;
+    
     uint8_t temp[] = {1, 0, 3, 1, 2, 0, 4};
     uint8_t components = temp[color_type];
     
@@ -759,6 +863,251 @@ static void wpng_load(byte_buffer * buf, uint32_t flags, wpng_load_output * outp
     output->is_16bit = bit_depth == 16;
     output->was_16bit = was_16bit;
     output->was_srgb = is_srgb;
+    
+    #undef WPNG_ASSERT
+}
+
+// row by row decoding
+
+// rgba: width pixels, 4 bytes each; y: row index, from the top
+// return nonzero to stop decoding
+typedef int (*wpng_row_callback)(void * user, const uint8_t * rgba, uint32_t y);
+
+// convert defiltered scanline of any PNG format to 8-bit RGBA, gray is expanded to RGB
+static void scanline_to_rgba(const uint8_t * scanline, uint8_t * rgba, const wpng_chunks * chunks)
+{
+    uint8_t bit_depth = chunks->bit_depth;
+    uint8_t color_type = chunks->color_type;
+    uint8_t temp[] = {1, 0, 3, 1, 2, 0, 4};
+    uint8_t components = temp[color_type];
+    
+    for (size_t x = 0; x < chunks->width; x += 1)
+    {
+        uint8_t * out = &rgba[x * 4];
+        if (bit_depth < 8)
+        {
+            // gray or indexed
+            size_t bit = x * bit_depth;
+            uint8_t val = scanline[bit / 8] >> (8 - bit_depth - bit % 8);
+            val &= (1 << bit_depth) - 1;
+            if (color_type == 3)
+            {
+                memcpy(out, &chunks->palette[val * 4], 4);
+                continue;
+            }
+            uint8_t alpha = (chunks->has_trns && val == chunks->transparent_r) ? 0 : 0xFF;
+            if (bit_depth == 1)
+                val *= 0xFF;
+            else if (bit_depth == 2)
+                val *= 0x55;
+            else
+                val *= 0x11;
+            out[0] = val;
+            out[1] = val;
+            out[2] = val;
+            out[3] = alpha;
+        }
+        else if (color_type == 3)
+            memcpy(out, &chunks->palette[scanline[x] * 4], 4);
+        else
+        {
+            uint16_t vals[4];
+            if (bit_depth == 16)
+            {
+                for (size_t i = 0; i < components; i += 1)
+                    vals[i] = ((uint16_t)scanline[(x * components + i) * 2] << 8) | scanline[(x * components + i) * 2 + 1];
+            }
+            else
+            {
+                for (size_t i = 0; i < components; i += 1)
+                    vals[i] = scanline[x * components + i];
+            }
+            uint8_t is_transparent = 0;
+            if (color_type == 0)
+                is_transparent = vals[0] == chunks->transparent_r;
+            else if (color_type == 2)
+                is_transparent = vals[0] == chunks->transparent_r && vals[1] == chunks->transparent_g && vals[2] == chunks->transparent_b;
+            uint8_t out_vals[4];
+            for (size_t i = 0; i < components; i += 1)
+                out_vals[i] = bit_depth == 16 ? u16_to_u8(vals[i]) : (uint8_t)vals[i];
+            if (components <= 2)
+            {
+                out[0] = out_vals[0];
+                out[1] = out_vals[0];
+                out[2] = out_vals[0];
+                out[3] = components == 2 ? out_vals[1] : 0xFF;
+            }
+            else
+            {
+                out[0] = out_vals[0];
+                out[1] = out_vals[1];
+                out[2] = out_vals[2];
+                out[3] = components == 4 ? out_vals[3] : 0xFF;
+            }
+            if (chunks->has_trns && is_transparent)
+                out[3] = 0;
+        }
+    }
+}
+
+typedef struct {
+    const wpng_chunks * chunks;
+    wpng_row_callback callback;
+    void * user;
+    uint8_t * cur;                // filter type and scanline being received
+    uint8_t * prev;               // previous defiltered scanline, zeros before the first one
+    uint8_t * rgba;
+    size_t bytes_per_scanline;
+    size_t filter_bpp;
+    size_t filled;
+    uint32_t y;
+    uint8_t has_gamma;
+    uint8_t gamma_table[256];
+} wpng_rows;
+
+static int wpng_rows_sink(void * user, const uint8_t * data, size_t len)
+{
+    wpng_rows * rows = (wpng_rows *)user;
+    size_t line_size = rows->bytes_per_scanline + 1;
+    while (len > 0 && rows->y < rows->chunks->height)
+    {
+        size_t n = line_size - rows->filled;
+        if (n > len)
+            n = len;
+        memcpy(&rows->cur[rows->filled], data, n);
+        rows->filled += n;
+        data += n;
+        len -= n;
+        if (rows->filled < line_size)
+            break;
+        
+        defilter_row(&rows->cur[1], &rows->prev[1], rows->bytes_per_scanline, rows->cur[0], rows->filter_bpp);
+        scanline_to_rgba(&rows->cur[1], rows->rgba, rows->chunks);
+        if (rows->has_gamma)
+            apply_gamma_table_u8(rows->gamma_table, rows->rgba, rows->chunks->width, 4);
+        if (rows->callback(rows->user, rows->rgba, rows->y))
+            return 1;
+        
+        uint8_t * temp = rows->prev;
+        rows->prev = rows->cur;
+        rows->cur = temp;
+        rows->filled = 0;
+        rows->y += 1;
+    }
+    return 0;
+}
+
+// decode image and pass it to the callback as 8-bit RGBA rows, top to bottom
+// memory used is two scanlines, one RGBA row and the 32k inflate window, besides the compressed data
+// interlaced images are decoded as a whole by wpng_load first
+// on error, writes nonzero to the "error" value of output, 12 if the callback stopped decoding
+// on success, writes zero to the "error" value of output and sets width, height and gamma; data is null
+static void wpng_load_rows(byte_buffer * buf, uint32_t flags, wpng_row_callback callback, void * user, wpng_load_output * output)
+{
+    #define WPNG_ASSERT(COND, ERRVAL) { if (!(COND)) { output->error = (ERRVAL); return; } }
+    
+    wpng_chunks chunks;
+    wpng_read_chunks(buf, flags, &chunks, output);
+    if (output->error)
+    {
+        free(chunks.idat.data);
+        return;
+    }
+    
+    float gamma = chunks.gamma;
+    if (chunks.is_srgb || (flags & WPNG_READ_SKIP_GAMMA_CORRECTION))
+        gamma = -1.0;
+    
+    uint8_t * rgba = (uint8_t *)malloc((size_t)chunks.width * 4);
+    if (!rgba)
+    {
+        free(chunks.idat.data);
+        WPNG_ASSERT(0, 100);
+    }
+    
+    if (chunks.interlacing)
+    {
+        free(chunks.idat.data);
+        wpng_load_output image;
+        memset(&image, 0, sizeof(wpng_load_output));
+        wpng_load(buf, flags | WPNG_READ_FORCE_8BIT, &image);
+        if (image.error)
+            free(rgba);
+        WPNG_ASSERT(image.error == 0, image.error);
+        
+        uint8_t bpp = image.bytes_per_pixel;
+        int stopped = 0;
+        for (uint32_t y = 0; y < image.height && !stopped; y += 1)
+        {
+            const uint8_t * src = &image.data[y * image.bytes_per_scanline];
+            for (size_t x = 0; x < image.width; x += 1)
+            {
+                const uint8_t * p = &src[x * bpp];
+                uint8_t * out = &rgba[x * 4];
+                out[0] = p[0];
+                out[1] = bpp >= 3 ? p[1] : p[0];
+                out[2] = bpp >= 3 ? p[2] : p[0];
+                out[3] = bpp == 2 ? p[1] : (bpp == 4 ? p[3] : 0xFF);
+            }
+            stopped = callback(user, rgba, y);
+        }
+        free(image.data);
+        free(rgba);
+        WPNG_ASSERT(!stopped, 12);
+    }
+    else
+    {
+        uint8_t temp[] = {1, 0, 3, 1, 2, 0, 4};
+        uint8_t components = temp[chunks.color_type];
+        
+        wpng_rows rows;
+        memset(&rows, 0, sizeof(wpng_rows));
+        rows.chunks = &chunks;
+        rows.callback = callback;
+        rows.user = user;
+        rows.rgba = rgba;
+        rows.bytes_per_scanline = ((size_t)chunks.width * chunks.bit_depth + 7) / 8 * components;
+        rows.filter_bpp = (chunks.bit_depth + 7) / 8 * components;
+        rows.has_gamma = gamma >= 0.0;
+        if (rows.has_gamma)
+            build_gamma_table_u8(rows.gamma_table, gamma);
+        rows.cur = (uint8_t *)malloc(rows.bytes_per_scanline + 1);
+        rows.prev = (uint8_t *)calloc(rows.bytes_per_scanline + 1, 1);
+        
+        int error = 0;
+        uint8_t allocated = rows.cur && rows.prev;
+        infl_stream stream;
+        infl_stream_init(&stream, 1, wpng_rows_sink, &rows);
+        if (allocated)
+        {
+            chunks.idat.cur = 0;
+            byte_buffer window = do_inflate_stream(&chunks.idat, &error, 1, &stream);
+            free(window.data);
+        }
+        free(chunks.idat.data);
+        free(rows.cur);
+        free(rows.prev);
+        free(rgba);
+        WPNG_ASSERT(allocated, 100);
+        WPNG_ASSERT(!stream.aborted, 12);
+        WPNG_ASSERT(error == 0, 11);
+        WPNG_ASSERT(rows.y == chunks.height, 2);
+    }
+    
+    output->error = 0;
+    
+    output->data = 0;
+    output->size = 0;
+    output->bytes_per_scanline = (size_t)chunks.width * 4;
+    output->width = chunks.width;
+    output->height = chunks.height;
+    output->gamma = gamma;
+    output->bytes_per_pixel = 4;
+    output->is_16bit = 0;
+    output->was_16bit = chunks.bit_depth == 16;
+    output->was_srgb = chunks.is_srgb;
+    
+    #undef WPNG_ASSERT
 }
 
 #endif // WPNG_READ_INCLUDED
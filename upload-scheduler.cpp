@@ -0,0 +1,289 @@
+#include <algorithm>
+
+#include "upload-scheduler.h"
+#include "image2srgb8.h"
+#include "srgb-pack.h"
+
+UploadJob::UploadJob()
+    : addr(0), compressed(false), attempts(0), result(0)
+{
+
+}
+
+UploadJob::UploadJob(
+    uint64_t aAddr,
+    const void *aBuffer,
+    uint32_t size,
+    bool aCompressed
+)
+    : addr(aAddr), buffer(std::make_shared<std::vector<uint8_t>>((const uint8_t *) aBuffer, (const uint8_t *) aBuffer + size)),
+    compressed(aCompressed), attempts(0), result(0)
+{
+
+}
+
+UploadJob::UploadJob(
+    uint64_t aAddr,
+    PackedImage aBuffer,
+    bool aCompressed
+)
+    : addr(aAddr), buffer(std::move(aBuffer)), compressed(aCompressed), attempts(0), result(0)
+{
+
+}
+
+UploadScheduler::UploadScheduler(
+    BLEDiscoverer *aDiscoverer,
+    int connectionSlots
+)
+    : discoverer(aDiscoverer), running(0), stopRequest(false), rnd(std::random_device()()), maxAttempts(3), backoffMs(1000), maxBackoffMs(30000),
+    waitMs(1000), window(1), onUpload(nullptr), succeeded(0), failed(0), retried(0)
+{
+    if (connectionSlots < 1)
+        connectionSlots = 1;
+    for (int i = 0; i < connectionSlots; i++)
+        workers.emplace_back(&UploadScheduler::runWorker, this);
+}
+
+UploadScheduler::~UploadScheduler()
+{
+    stop();
+}
+
+/**
+ * Queue packed image
+ * @param addr device address
+ * @param buffer packed image, copied
+ * @param size image size in bytes
+ * @param compressed buffer is compressed by compressPlanes()
+ */
+void UploadScheduler::add(
+    uint64_t addr,
+    const void *buffer,
+    uint32_t size,
+    bool compressed
+) {
+    std::unique_lock<std::mutex> lck(mutexJobs);
+    jobs.emplace_back(addr, buffer, size, compressed);
+    cvJobs.notify_all();
+}
+
+/**
+ * Queue packed image without copying it
+ * @param addr device address
+ * @param buffer packed image, shared read-only
+ * @param compressed buffer is compressed by compressPlanes()
+ */
+void UploadScheduler::add(
+    uint64_t addr,
+    PackedImage buffer,
+    bool compressed
+) {
+    std::unique_lock<std::mutex> lck(mutexJobs);
+    jobs.emplace_back(addr, std::move(buffer), compressed);
+    cvJobs.notify_all();
+}
+
+/**
+ * Pack image for the discovered device and queue it.
+ * Devices of the same type share the image packed once, see BLEDiscoverer::packedImages
+ * @param addr device address
+ * @param img image of the device screen size
+ * @param rotation rotate image clockwise: 0, 90, 180 or 270 degrees, see packSRgb8()
+ * @return 0- success, -1- device not found or image size differs, -2- insufficient memory
+ */
+int UploadScheduler::add(
+    uint64_t addr,
+    Image2sRgb *img,
+    uint16_t rotation
+) {
+    NEMR5053ManufacturerSpecificData metadata;
+    {
+        std::unique_lock<std::mutex> lck(discoverer->mutexDiscoveryState);
+        auto d = discoverer->devices.find(addr);
+        if (!d)
+            return -1;
+        metadata = d->metadata;
+    }
+    uint32_t width = metadata.width();
+    uint32_t height = metadata.height();
+    bool swap = rotation == 90 || rotation == 270;
+    if ((swap ? height : width) != img->w || (swap ? width : height) != img->h)
+        return -1;
+    bool compress = metadata.compression();
+    int e = -2;
+    PackedImage packed = discoverer->packedImages.get(img, width, height, metadata.hasRed(), metadata.hasYellow(),
+        metadata.mirror(), compress, rotation, &e);
+    if (!packed)
+        return e;
+    add(addr, std::move(packed), compress);
+    return 0;
+}
+
+/**
+ * @return jobs queued or running
+ */
+size_t UploadScheduler::pending()
+{
+    std::unique_lock<std::mutex> lck(mutexJobs);
+    return jobs.size() + running;
+}
+
+/**
+ * Wait until all jobs are done
+ * @param seconds timeout, 0- no timeout
+ * @return true- all jobs done
+ */
+bool UploadScheduler::wait(
+    int seconds
+) {
+    std::unique_lock<std::mutex> lck(mutexJobs);
+    auto done = [this] {
+        return jobs.empty() && running == 0;
+    };
+    if (seconds <= 0) {
+        cvJobs.wait(lck, done);
+        return true;
+    }
+    return cvJobs.wait_for(lck, std::chrono::seconds(seconds), done);
+}
+
+/**
+ * Stop workers. Running uploads are finished, queued jobs are discarded.
+ */
+void UploadScheduler::stop()
+{
+    {
+        std::unique_lock<std::mutex> lck(mutexJobs);
+        stopRequest = true;
+        jobs.clear();
+        cvJobs.notify_all();
+    }
+    for (auto &w : workers) {
+        if (w.joinable())
+            w.join();
+    }
+    workers.clear();
+    // failed jobs queued while stopping
+    std::unique_lock<std::mutex> lck(mutexJobs);
+    jobs.clear();
+}
+
+/**
+ * Find device and pin it so the discoverer does not evict it during the upload
+ * @return device, null if not discovered
+ */
+DiscoveredDevice *UploadScheduler::pinDevice(
+    uint64_t addr
+) {
+    std::unique_lock<std::mutex> lck(discoverer->mutexDiscoveryState);
+    DiscoveredDevice *device = discoverer->devices.find(addr);
+    if (device)
+        device->pins++;
+    return device;
+}
+
+void UploadScheduler::unpinDevice(
+    DiscoveredDevice *device
+) {
+    std::unique_lock<std::mutex> lck(discoverer->mutexDiscoveryState);
+    device->pins--;
+}
+
+/**
+ * Wait for the job which is ready and whose device is not in session
+ * @param retJob returns job
+ * @return false- stop requested
+ */
+bool UploadScheduler::takeJob(
+    UploadJob &retJob
+) {
+    std::unique_lock<std::mutex> lck(mutexJobs);
+    while (!stopRequest) {
+        auto now = std::chrono::steady_clock::now();
+        auto wakeAt = std::chrono::steady_clock::time_point::max();
+        for (auto it = jobs.begin(); it != jobs.end(); it++) {
+            if (busy.find(it->addr) != busy.end())
+                continue;
+            if (it->notBefore > now) {
+                wakeAt = std::min(wakeAt, it->notBefore);
+                continue;
+            }
+            retJob = std::move(*it);
+            jobs.erase(it);
+            busy.insert(retJob.addr);
+            running++;
+            return true;
+        }
+        if (wakeAt == std::chrono::steady_clock::time_point::max())
+            cvJobs.wait(lck);
+        else
+            cvJobs.wait_until(lck, wakeAt);
+    }
+    return false;
+}
+
+/**
+ * Queue failed job again or report result
+ */
+void UploadScheduler::finishJob(
+    UploadJob &job
+) {
+    bool done = job.result == 0 || job.attempts >= maxAttempts;
+    {
+        std::unique_lock<std::mutex> lck(mutexJobs);
+        busy.erase(job.addr);
+        if (job.result == 0)
+            succeeded++;
+        else if (done)
+            failed++;
+        else {
+            retried++;
+            int delayMs = backoffMs;
+            for (int i = 1; i < job.attempts && delayMs < maxBackoffMs; i++)
+                delayMs *= 2;
+            delayMs = std::min(delayMs, maxBackoffMs);
+            // devices failing together do not retry in step
+            delayMs -= std::uniform_int_distribution<int>(0, delayMs / 2)(rnd);
+            job.notBefore = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs);
+            jobs.push_back(std::move(job));
+        }
+    }
+    if (done && onUpload)
+        onUpload->uploaded(job);
+    // report before wait() returns
+    std::unique_lock<std::mutex> lck(mutexJobs);
+    running--;
+    cvJobs.notify_all();
+}
+
+/**
+ * Open session, send image and close session
+ * @return 0- success, -5- device not discovered, other- open() or sendBuffer() error
+ */
+int UploadScheduler::upload(
+    UploadJob &job
+) {
+    DiscoveredDevice *device = pinDevice(job.addr);
+    if (!device)
+        return -5;
+    int r = discoverer->open(device);
+    if (r >= 0) {
+        r = discoverer->sendBuffer(device, (void *) job.buffer->data(), (uint32_t) job.buffer->size(), waitMs, window, job.compressed);
+        int c = discoverer->close(device);
+        if (r == 0 && c < 0)
+            r = c;
+    }
+    unpinDevice(device);
+    return r;
+}
+
+void UploadScheduler::runWorker()
+{
+    UploadJob job;
+    while (takeJob(job)) {
+        job.attempts++;
+        job.result = upload(job);
+        finishJob(job);
+    }
+}
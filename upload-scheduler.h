@@ -0,0 +1,101 @@
+#ifndef UPLOAD_SCHEDULER_H
+#define UPLOAD_SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "ble-helper.h"
+
+/**
+ * Packed image waiting for upload to the device
+ */
+class UploadJob {
+public:
+    uint64_t addr;
+    /// packed image, see packSRgb8(), may be shared with other jobs
+    PackedImage buffer;
+    /// buffer is compressed by compressPlanes()
+    bool compressed;
+    /// attempts made
+    int attempts;
+    /// last attempt result, 0- success
+    int result;
+    /// next attempt is not started before
+    std::chrono::steady_clock::time_point notBefore;
+
+    UploadJob();
+    UploadJob(uint64_t addr, const void *buffer, uint32_t size, bool compressed);
+    UploadJob(uint64_t addr, PackedImage buffer, bool compressed);
+};
+
+class OnUpload {
+public:
+    /**
+     * Called from the worker thread when the job succeeded or all attempts failed
+     */
+    virtual void uploaded(const UploadJob &job) = 0;
+};
+
+/**
+ * Upload images to many devices in parallel.
+ * Each worker keeps at most one connection open, so number of workers is number of connection slots.
+ * Failed job is queued again after jittered exponential backoff until maxAttempts is reached.
+ * Devices must be discovered before upload, discovery may go on while jobs are running.
+ */
+class UploadScheduler {
+private:
+    BLEDiscoverer *discoverer;
+    std::mutex mutexJobs;
+    std::condition_variable cvJobs;
+    /// jobs waiting for the worker
+    std::deque<UploadJob> jobs;
+    /// devices in session
+    std::set<uint64_t> busy;
+    /// jobs taken by the workers
+    size_t running;
+    std::vector<std::thread> workers;
+    bool stopRequest;
+    /// backoff jitter, guarded by mutexJobs
+    std::minstd_rand rnd;
+
+    DiscoveredDevice *pinDevice(uint64_t addr);
+    void unpinDevice(DiscoveredDevice *device);
+    bool takeJob(UploadJob &retJob);
+    void finishJob(UploadJob &job);
+    int upload(UploadJob &job);
+    void runWorker();
+public:
+    /// attempts per job
+    int maxAttempts;
+    /// delay before the second attempt, doubled on each next attempt, random half of it is taken off
+    int backoffMs;
+    int maxBackoffMs;
+    /// response timeout passed to sendBuffer()
+    int waitMs;
+    /// chunks in flight passed to sendBuffer()
+    uint8_t window;
+    OnUpload *onUpload;
+
+    // statistics
+    uint32_t succeeded;
+    uint32_t failed;
+    uint32_t retried;
+
+    explicit UploadScheduler(BLEDiscoverer *discoverer, int connectionSlots = 4);
+    virtual ~UploadScheduler();
+
+    void add(uint64_t addr, const void *buffer, uint32_t size, bool compressed = false);
+    void add(uint64_t addr, PackedImage buffer, bool compressed = false);
+    int add(uint64_t addr, Image2sRgb *img, uint16_t rotation = 0);
+    size_t pending();
+    bool wait(int seconds = 0);
+    void stop();
+};
+
+#endif